@@ -0,0 +1,74 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "mozolm/embed/embedded_model.h"
+
+#include <utility>
+
+#include "google/protobuf/text_format.h"
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "mozolm/models/model_factory.h"
+
+namespace mozolm {
+
+absl::StatusOr<std::unique_ptr<EmbeddedModel>> EmbeddedModel::Create(
+    const ModelHubConfig& config) {
+  auto hub_status = models::MakeModelHub(config);
+  if (!hub_status.ok()) return hub_status.status();
+  return absl::make_unique<EmbeddedModel>(std::move(hub_status.value()));
+}
+
+absl::StatusOr<std::unique_ptr<EmbeddedModel>> EmbeddedModel::CreateFromText(
+    absl::string_view config_text) {
+  ModelHubConfig config;
+  if (!google::protobuf::TextFormat::ParseFromString(std::string(config_text),
+                                                     &config)) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Failed to parse the model hub configuration: ",
+                     config_text));
+  }
+  return Create(config);
+}
+
+EmbeddedModel::EmbeddedModel(std::unique_ptr<models::LanguageModelHub> hub)
+    : hub_(std::move(hub)) {}
+
+int EmbeddedModel::ContextState(const std::string& context, int init_state) {
+  return hub_->ContextState(context, init_state);
+}
+
+int EmbeddedModel::NextState(int state, int utf8_sym) {
+  return hub_->NextState(state, utf8_sym);
+}
+
+int EmbeddedModel::NumSymbols() const { return hub_->VocabularySize(); }
+
+void EmbeddedModel::AppendSymbols(int first_index,
+                                  std::vector<std::string>* symbols) const {
+  hub_->AppendVocabularySymbols(first_index, symbols);
+}
+
+int EmbeddedModel::GetProbabilities(int state, double* probs, int num_probs) {
+  return hub_->ExtractProbabilities(state, probs, num_probs);
+}
+
+bool EmbeddedModel::UpdateCounts(int state, const std::vector<int>& utf8_syms,
+                                 int64 count) {
+  return hub_->UpdateLMCounts(state, utf8_syms, count);
+}
+
+}  // namespace mozolm
@@ -0,0 +1,96 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// In-process access to the models of a hub, for the applications embedding
+// them directly, such as on-device keyboards, rather than going through the
+// gRPC service. This saves the loopback RPC, the serialization of the
+// requests and the building of the LMScores on each keystroke.
+//
+// The scores are returned as dense probabilities indexed by the vocabulary,
+// into arrays owned by the caller. The vocabulary only grows, so that the
+// index of a symbol never changes, and the caller only needs to fetch the
+// symbols added since it last did.
+
+#ifndef MOZOLM_MOZOLM_EMBED_EMBEDDED_MODEL_H_
+#define MOZOLM_MOZOLM_EMBED_EMBEDDED_MODEL_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mozolm/stubs/integral_types.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "mozolm/models/language_model_hub.h"
+#include "mozolm/models/model_config.pb.h"
+
+namespace mozolm {
+
+// Stable interface of the model hub for the in-process callers. Thread-safe,
+// as the underlying hub.
+class EmbeddedModel {
+ public:
+  // Creates the model from the hub configuration.
+  static absl::StatusOr<std::unique_ptr<EmbeddedModel>> Create(
+      const ModelHubConfig& config);
+
+  // Same as above, but the configuration is given in protocol buffer text
+  // format, e.g., by the applications which do not link protocol buffers.
+  static absl::StatusOr<std::unique_ptr<EmbeddedModel>> CreateFromText(
+      absl::string_view config_text);
+
+  explicit EmbeddedModel(std::unique_ptr<models::LanguageModelHub> hub);
+  EmbeddedModel() = delete;
+  ~EmbeddedModel() = default;
+
+  EmbeddedModel(const EmbeddedModel&) = delete;
+  EmbeddedModel& operator=(const EmbeddedModel&) = delete;
+
+  // Returns the state reached from the init_state after consuming the UTF-8
+  // context, starting from the start state if init_state is negative.
+  // Returns -1 if the init_state is invalid or has been overwritten.
+  int ContextState(const std::string& context, int init_state = -1);
+
+  // Returns the state reached from the state following the Unicode
+  // codepoint, -1 if the state is invalid or has been overwritten.
+  int NextState(int state, int utf8_sym);
+
+  // Returns the number of symbols in the vocabulary.
+  int NumSymbols() const;
+
+  // Appends the UTF-8 vocabulary symbols from first_index onwards.
+  void AppendSymbols(int first_index, std::vector<std::string>* symbols) const;
+
+  // Fills in the probabilities of the symbols at the given state, indexed by
+  // the vocabulary, into the num_probs elements of the caller-owned array.
+  // Returns the number of vocabulary symbols covered, which may exceed
+  // num_probs if the vocabulary grew, in which case the caller fetches the new
+  // symbols and calls again with a larger array. The elements beyond the
+  // symbols covered are set to zero. Returns -1 if the state is invalid.
+  int GetProbabilities(int state, double* probs, int num_probs);
+
+  // Updates the counts of the codepoints following the state, returning false
+  // if the state is invalid.
+  bool UpdateCounts(int state, const std::vector<int>& utf8_syms, int64 count);
+
+  models::LanguageModelHub* hub() { return hub_.get(); }
+
+ private:
+  const std::unique_ptr<models::LanguageModelHub> hub_;
+};
+
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_EMBED_EMBEDDED_MODEL_H_
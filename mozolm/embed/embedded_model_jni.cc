@@ -0,0 +1,177 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// JNI binding of the embedded model, for the class
+// com.google.mozolm.embed.EmbeddedModel. The Java strings are converted from
+// and to UTF-16 explicitly, since the "modified UTF-8" of JNI differs from
+// UTF-8 for the codepoints outside the Basic Multilingual Plane.
+
+#include <jni.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mozolm/stubs/integral_types.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "mozolm/embed/embedded_model.h"
+#include "mozolm/utils/utf8_util.h"
+
+namespace mozolm {
+namespace {
+
+// Surrogates of the UTF-16 encoding.
+constexpr char32 kMinHighSurrogate = 0xD800;
+constexpr char32 kMinLowSurrogate = 0xDC00;
+constexpr char32 kMaxLowSurrogate = 0xDFFF;
+constexpr char32 kMinSupplementaryCodepoint = 0x10000;
+
+EmbeddedModel* FromHandle(jlong handle) {
+  return reinterpret_cast<EmbeddedModel*>(handle);
+}
+
+// Converts the Java string to UTF-8, unpaired surrogates being taken as
+// individual codepoints.
+std::string ToUtf8(JNIEnv* env, jstring text) {
+  const jsize length = env->GetStringLength(text);
+  std::vector<jchar> chars(length);
+  env->GetStringRegion(text, 0, length, chars.data());
+  std::string utf8;
+  utf8.reserve(length);
+  for (jsize i = 0; i < length; ++i) {
+    char32 codepoint = chars[i];
+    if (codepoint >= kMinHighSurrogate && codepoint < kMinLowSurrogate &&
+        i + 1 < length && chars[i + 1] >= kMinLowSurrogate &&
+        chars[i + 1] <= kMaxLowSurrogate) {
+      codepoint = kMinSupplementaryCodepoint +
+                  ((codepoint - kMinHighSurrogate) << 10) +
+                  (chars[++i] - kMinLowSurrogate);
+    }
+    utf8 += utf8::EncodeUnicodeChar(codepoint);
+  }
+  return utf8;
+}
+
+// Converts the UTF-8 text to a Java string.
+jstring ToJavaString(JNIEnv* env, absl::string_view utf8) {
+  std::vector<jchar> chars;
+  chars.reserve(utf8.size());
+  char32 codepoint;
+  int num_bytes;
+  while ((num_bytes = utf8::DecodeLeadingUnicodeChar(utf8, &codepoint)) > 0) {
+    utf8.remove_prefix(num_bytes);
+    if (codepoint >= kMinSupplementaryCodepoint) {
+      codepoint -= kMinSupplementaryCodepoint;
+      chars.push_back(kMinHighSurrogate + (codepoint >> 10));
+      chars.push_back(kMinLowSurrogate + (codepoint & 0x3FF));
+    } else {
+      chars.push_back(codepoint);
+    }
+  }
+  return env->NewString(chars.data(), chars.size());
+}
+
+void ThrowIllegalArgument(JNIEnv* env, absl::string_view message) {
+  jclass exception_class =
+      env->FindClass("java/lang/IllegalArgumentException");
+  if (exception_class != nullptr) {
+    env->ThrowNew(exception_class, std::string(message).c_str());
+  }
+}
+
+}  // namespace
+}  // namespace mozolm
+
+extern "C" {
+
+JNIEXPORT jlong JNICALL Java_com_google_mozolm_embed_EmbeddedModel_nativeCreate(
+    JNIEnv* env, jclass clazz, jstring config_text) {
+  auto model_status =
+      mozolm::EmbeddedModel::CreateFromText(mozolm::ToUtf8(env, config_text));
+  if (!model_status.ok()) {
+    mozolm::ThrowIllegalArgument(env, model_status.status().ToString());
+    return 0;
+  }
+  return reinterpret_cast<jlong>(model_status.value().release());
+}
+
+JNIEXPORT void JNICALL Java_com_google_mozolm_embed_EmbeddedModel_nativeDestroy(
+    JNIEnv* env, jclass clazz, jlong handle) {
+  delete mozolm::FromHandle(handle);
+}
+
+JNIEXPORT jint JNICALL
+Java_com_google_mozolm_embed_EmbeddedModel_nativeContextState(
+    JNIEnv* env, jclass clazz, jlong handle, jstring context,
+    jint init_state) {
+  return mozolm::FromHandle(handle)->ContextState(
+      mozolm::ToUtf8(env, context), init_state);
+}
+
+JNIEXPORT jint JNICALL
+Java_com_google_mozolm_embed_EmbeddedModel_nativeNextState(
+    JNIEnv* env, jclass clazz, jlong handle, jint state, jint codepoint) {
+  return mozolm::FromHandle(handle)->NextState(state, codepoint);
+}
+
+JNIEXPORT jint JNICALL
+Java_com_google_mozolm_embed_EmbeddedModel_nativeNumSymbols(
+    JNIEnv* env, jclass clazz, jlong handle) {
+  return mozolm::FromHandle(handle)->NumSymbols();
+}
+
+JNIEXPORT jobjectArray JNICALL
+Java_com_google_mozolm_embed_EmbeddedModel_nativeSymbols(
+    JNIEnv* env, jclass clazz, jlong handle, jint first_index) {
+  std::vector<std::string> symbols;
+  mozolm::FromHandle(handle)->AppendSymbols(first_index, &symbols);
+  jclass string_class = env->FindClass("java/lang/String");
+  if (string_class == nullptr) return nullptr;
+  jobjectArray result =
+      env->NewObjectArray(symbols.size(), string_class, nullptr);
+  if (result == nullptr) return nullptr;
+  for (int i = 0; i < symbols.size(); ++i) {
+    jstring symbol = mozolm::ToJavaString(env, symbols[i]);
+    if (symbol == nullptr) return nullptr;
+    env->SetObjectArrayElement(result, i, symbol);
+    env->DeleteLocalRef(symbol);
+  }
+  return result;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_google_mozolm_embed_EmbeddedModel_nativeGetProbabilities(
+    JNIEnv* env, jclass clazz, jlong handle, jint state, jdoubleArray probs) {
+  // Usually pins the array rather than copying it.
+  const jsize num_probs = env->GetArrayLength(probs);
+  jdouble* elements = env->GetDoubleArrayElements(probs, nullptr);
+  if (elements == nullptr) return -1;
+  const int num_symbols = mozolm::FromHandle(handle)->GetProbabilities(
+      state, elements, num_probs);
+  env->ReleaseDoubleArrayElements(probs, elements, 0);
+  return num_symbols;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_google_mozolm_embed_EmbeddedModel_nativeUpdateCounts(
+    JNIEnv* env, jclass clazz, jlong handle, jint state, jintArray codepoints,
+    jlong count) {
+  std::vector<int> utf8_syms(env->GetArrayLength(codepoints));
+  env->GetIntArrayRegion(codepoints, 0, utf8_syms.size(), utf8_syms.data());
+  return mozolm::FromHandle(handle)->UpdateCounts(state, utf8_syms, count);
+}
+
+}  // extern "C"
@@ -0,0 +1,116 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Unit tests for the embedded model.
+
+#include "mozolm/embed/embedded_model.h"
+
+#include <algorithm>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "mozolm/models/model_config.pb.h"
+#include "mozolm/utils/utf8_util.h"
+
+namespace mozolm {
+namespace {
+
+constexpr double kFloatDelta = 0.00001;  // Delta for float comparisons.
+
+// Number of symbols of the default uniform model.
+constexpr int kNumDefaultSymbols = 28;
+
+std::unique_ptr<EmbeddedModel> MakeDefaultModel() {
+  auto model_status = EmbeddedModel::Create(ModelHubConfig());
+  EXPECT_TRUE(model_status.ok()) << model_status.status();
+  return std::move(model_status.value());
+}
+
+TEST(EmbeddedModelTest, CheckProbabilities) {
+  const std::unique_ptr<EmbeddedModel> model = MakeDefaultModel();
+  ASSERT_EQ(model->NumSymbols(), kNumDefaultSymbols);
+  std::vector<std::string> symbols;
+  model->AppendSymbols(0, &symbols);
+  ASSERT_EQ(symbols.size(), kNumDefaultSymbols);
+
+  const int state = model->ContextState("ab");
+  ASSERT_GE(state, 0);
+  std::vector<double> probs(kNumDefaultSymbols + 2, -1.0);
+  ASSERT_EQ(model->GetProbabilities(state, probs.data(), probs.size()),
+            kNumDefaultSymbols);
+  for (int i = 0; i < kNumDefaultSymbols; ++i) {
+    EXPECT_NEAR(probs[i], 1.0 / kNumDefaultSymbols, kFloatDelta);
+  }
+  // The elements beyond the vocabulary are cleared.
+  EXPECT_EQ(probs[kNumDefaultSymbols], 0.0);
+  EXPECT_EQ(probs[kNumDefaultSymbols + 1], 0.0);
+
+  // Arrays smaller than the vocabulary get the first probabilities.
+  std::vector<double> short_probs(3);
+  EXPECT_EQ(model->GetProbabilities(state, short_probs.data(), 3),
+            kNumDefaultSymbols);
+  EXPECT_NEAR(short_probs[2], 1.0 / kNumDefaultSymbols, kFloatDelta);
+
+  EXPECT_EQ(model->GetProbabilities(-5, probs.data(), probs.size()), -1);
+  EXPECT_EQ(model->ContextState("a", /* init_state= */12345), -1);
+}
+
+TEST(EmbeddedModelTest, CheckUpdateCounts) {
+  const std::unique_ptr<EmbeddedModel> model = MakeDefaultModel();
+  std::vector<std::string> symbols;
+  model->AppendSymbols(0, &symbols);
+  const int state = model->ContextState("a");
+  ASSERT_GE(state, 0);
+  const int next_state = model->NextState(state, 'b');
+  ASSERT_GE(next_state, 0);
+  EXPECT_EQ(model->ContextState("b", state), next_state);
+
+  // Observing "ab" makes "b" the most likely symbol after "a".
+  ASSERT_TRUE(model->UpdateCounts(state, {'b'}, 10));
+  const int num_symbols = model->NumSymbols();
+  std::vector<double> probs(num_symbols);
+  ASSERT_EQ(model->GetProbabilities(state, probs.data(), num_symbols),
+            num_symbols);
+  const int best = std::max_element(probs.begin(), probs.end()) -
+                   probs.begin();
+  EXPECT_EQ(symbols[best], "b");
+  EXPECT_NEAR(std::accumulate(probs.begin(), probs.end(), 0.0), 1.0,
+              kFloatDelta);
+}
+
+TEST(EmbeddedModelTest, CheckMixture) {
+  auto model_status = EmbeddedModel::CreateFromText(R"(
+      mixture_type: INTERPOLATION
+      model_config { type: SIMPLE_CHAR_BIGRAM }
+      model_config { type: SIMPLE_CHAR_BIGRAM })");
+  ASSERT_TRUE(model_status.ok()) << model_status.status();
+  const std::unique_ptr<EmbeddedModel> model = std::move(model_status.value());
+  std::vector<double> probs(model->NumSymbols());
+  ASSERT_EQ(model->GetProbabilities(model->ContextState("a"), probs.data(),
+                                    probs.size()),
+            kNumDefaultSymbols);
+  for (const double prob : probs) {
+    EXPECT_NEAR(prob, 1.0 / kNumDefaultSymbols, kFloatDelta);
+  }
+
+  EXPECT_FALSE(EmbeddedModel::CreateFromText("not a config").ok());
+}
+
+}  // namespace
+}  // namespace mozolm
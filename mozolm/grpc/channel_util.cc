@@ -0,0 +1,104 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/grpc/channel_util.h"
+
+#include "include/grpc/compression.h"
+#include "include/grpc/grpc.h"
+#include "include/grpcpp/resource_quota.h"
+
+namespace mozolm {
+namespace grpc {
+namespace {
+
+grpc_compression_algorithm CompressionAlgorithm(CompressionType compression) {
+  switch (compression) {
+    case COMPRESSION_DEFLATE:
+      return GRPC_COMPRESS_DEFLATE;
+    case COMPRESSION_GZIP:
+      return GRPC_COMPRESS_GZIP;
+    default:
+      return GRPC_COMPRESS_NONE;
+  }
+}
+
+}  // namespace
+
+void SetChannelArguments(const ChannelConfig& config,
+                         ::grpc::ChannelArguments* channel_args) {
+  if (config.max_receive_message_bytes() != 0) {
+    channel_args->SetMaxReceiveMessageSize(config.max_receive_message_bytes());
+  }
+  if (config.max_send_message_bytes() != 0) {
+    channel_args->SetMaxSendMessageSize(config.max_send_message_bytes());
+  }
+  if (config.compression() != COMPRESSION_NONE) {
+    channel_args->SetCompressionAlgorithm(
+        CompressionAlgorithm(config.compression()));
+  }
+  if (config.keepalive_time_ms() > 0) {
+    channel_args->SetInt(GRPC_ARG_KEEPALIVE_TIME_MS,
+                         config.keepalive_time_ms());
+  }
+  if (config.keepalive_timeout_ms() > 0) {
+    channel_args->SetInt(GRPC_ARG_KEEPALIVE_TIMEOUT_MS,
+                         config.keepalive_timeout_ms());
+  }
+  if (config.keepalive_permit_without_calls()) {
+    channel_args->SetInt(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+  }
+}
+
+void ConfigureServerBuilder(const ServerTransportConfig& config,
+                            ::grpc::ServerBuilder* builder) {
+  const ChannelConfig& channel = config.channel();
+  if (channel.max_receive_message_bytes() != 0) {
+    builder->SetMaxReceiveMessageSize(channel.max_receive_message_bytes());
+  }
+  if (channel.max_send_message_bytes() != 0) {
+    builder->SetMaxSendMessageSize(channel.max_send_message_bytes());
+  }
+  if (channel.compression() != COMPRESSION_NONE) {
+    builder->SetDefaultCompressionAlgorithm(
+        CompressionAlgorithm(channel.compression()));
+  }
+  if (channel.keepalive_time_ms() > 0) {
+    builder->AddChannelArgument(GRPC_ARG_KEEPALIVE_TIME_MS,
+                                channel.keepalive_time_ms());
+    // Accepts the pings of the clients configured with the same interval,
+    // which the server would otherwise take for abuse.
+    builder->AddChannelArgument(
+        GRPC_ARG_HTTP2_MIN_RECV_PING_INTERVAL_WITHOUT_DATA_MS,
+        channel.keepalive_time_ms());
+  }
+  if (channel.keepalive_timeout_ms() > 0) {
+    builder->AddChannelArgument(GRPC_ARG_KEEPALIVE_TIMEOUT_MS,
+                                channel.keepalive_timeout_ms());
+  }
+  if (channel.keepalive_permit_without_calls()) {
+    builder->AddChannelArgument(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+  }
+  if (config.max_concurrent_streams() > 0) {
+    builder->AddChannelArgument(GRPC_ARG_MAX_CONCURRENT_STREAMS,
+                                config.max_concurrent_streams());
+  }
+  if (config.max_memory_bytes() > 0) {
+    ::grpc::ResourceQuota quota("mozolm_server");
+    quota.Resize(config.max_memory_bytes());
+    builder->SetResourceQuota(quota);
+  }
+}
+
+}  // namespace grpc
+}  // namespace mozolm
@@ -0,0 +1,38 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tuning of the gRPC channels of the server and the clients.
+
+#ifndef MOZOLM_MOZOLM_GRPC_CHANNEL_UTIL_H_
+#define MOZOLM_MOZOLM_GRPC_CHANNEL_UTIL_H_
+
+#include "include/grpcpp/server_builder.h"
+#include "include/grpcpp/support/channel_arguments.h"
+#include "mozolm/grpc/server_config.pb.h"
+
+namespace mozolm {
+namespace grpc {
+
+// Sets the arguments of a client channel from the channel configuration.
+void SetChannelArguments(const ChannelConfig& config,
+                         ::grpc::ChannelArguments* channel_args);
+
+// Configures the channels accepted by the server and their resources.
+void ConfigureServerBuilder(const ServerTransportConfig& config,
+                            ::grpc::ServerBuilder* builder);
+
+}  // namespace grpc
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_GRPC_CHANNEL_UTIL_H_
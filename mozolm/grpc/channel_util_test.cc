@@ -0,0 +1,72 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/grpc/channel_util.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "include/grpc/grpc.h"
+#include "include/grpcpp/support/channel_arguments.h"
+#include "mozolm/grpc/server_config.pb.h"
+
+namespace mozolm {
+namespace grpc {
+namespace {
+
+// Returns the integer value of the channel argument, -1 if it is not set.
+int GetIntArgument(const ::grpc::ChannelArguments& channel_args,
+                   const std::string& key) {
+  const grpc_channel_args args = channel_args.c_channel_args();
+  for (size_t i = 0; i < args.num_args; ++i) {
+    if (key == args.args[i].key && args.args[i].type == GRPC_ARG_INTEGER) {
+      return args.args[i].value.integer;
+    }
+  }
+  return -1;
+}
+
+TEST(ChannelUtilTest, CheckDefaultChannelArguments) {
+  ::grpc::ChannelArguments channel_args;
+  const int num_default_args = channel_args.c_channel_args().num_args;
+  SetChannelArguments(ChannelConfig(), &channel_args);
+  EXPECT_EQ(num_default_args, channel_args.c_channel_args().num_args);
+}
+
+TEST(ChannelUtilTest, CheckChannelArguments) {
+  ChannelConfig config;
+  config.set_max_receive_message_bytes(64 << 20);
+  config.set_max_send_message_bytes(-1);
+  config.set_compression(COMPRESSION_GZIP);
+  config.set_keepalive_time_ms(30000);
+  config.set_keepalive_timeout_ms(5000);
+  config.set_keepalive_permit_without_calls(true);
+  ::grpc::ChannelArguments channel_args;
+  SetChannelArguments(config, &channel_args);
+  EXPECT_EQ(64 << 20, GetIntArgument(channel_args,
+                                     GRPC_ARG_MAX_RECEIVE_MESSAGE_LENGTH));
+  EXPECT_EQ(-1, GetIntArgument(channel_args,
+                               GRPC_ARG_MAX_SEND_MESSAGE_LENGTH));
+  EXPECT_EQ(GRPC_COMPRESS_GZIP,
+            GetIntArgument(channel_args,
+                           GRPC_COMPRESSION_CHANNEL_DEFAULT_ALGORITHM));
+  EXPECT_EQ(30000, GetIntArgument(channel_args, GRPC_ARG_KEEPALIVE_TIME_MS));
+  EXPECT_EQ(5000, GetIntArgument(channel_args, GRPC_ARG_KEEPALIVE_TIMEOUT_MS));
+  EXPECT_EQ(1, GetIntArgument(channel_args,
+                              GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS));
+}
+
+}  // namespace
+}  // namespace grpc
+}  // namespace mozolm
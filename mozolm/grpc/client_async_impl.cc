@@ -14,6 +14,8 @@
 
 #include "mozolm/grpc/client_async_impl.h"
 
+#include <cstdint>
+
 #include "include/grpcpp/client_context.h"
 #include "include/grpcpp/completion_queue.h"
 #include "include/grpcpp/grpcpp.h"  // IWYU pragma: keep
@@ -48,6 +50,13 @@ absl::Status WaitAndCheck(::grpc::CompletionQueue *cq, int expected_tag) {
   return absl::OkStatus();
 }
 
+// Converts the status of a call, keeping its code so that the callers can
+// tell the failures of the server from the invalid requests.
+absl::Status ToStatus(const ::grpc::Status& status) {
+  return absl::Status(static_cast<absl::StatusCode>(status.error_code()),
+                      status.error_message());
+}
+
 std::unique_ptr<::grpc::ClientContext> MakeClientContext(double timeout_sec) {
   std::unique_ptr<::grpc::ClientContext> context =
       absl::make_unique<::grpc::ClientContext>();
@@ -58,15 +67,105 @@ std::unique_ptr<::grpc::ClientContext> MakeClientContext(double timeout_sec) {
   return context;
 }
 
+// Tags identifying the operations on the session stream. These are passed to
+// the completion queue by value, so the tags of the operations abandoned after
+// a timeout remain harmless.
+enum SessionTag {
+  kSessionStartTag = 1,
+  kSessionWriteTag,
+  kSessionReadTag,
+  kSessionWritesDoneTag,
+  kSessionFinishTag,
+};
+
+void *ToTag(int tag) {
+  return reinterpret_cast<void *>(static_cast<intptr_t>(tag));
+}
+
+// Asynchronous call in flight, which is the tag of its completion on the
+// completion queue of the client.
+class AsyncCall {
+ public:
+  virtual ~AsyncCall() = default;
+
+  // Runs the callback with the outcome of the call.
+  virtual void Complete(bool ok) = 0;
+};
+
+// Asynchronous unary call, which owns its context and response.
+template <class Response>
+class AsyncUnaryCall : public AsyncCall {
+ public:
+  AsyncUnaryCall(double timeout_sec,
+                 std::function<void(absl::StatusOr<Response>)> callback)
+      : context_(MakeClientContext(timeout_sec)),
+        callback_(std::move(callback)) {}
+
+  ::grpc::ClientContext *context() { return context_.get(); }
+
+  // Requests the response of the started call. Returns false if the call
+  // could not be started.
+  bool Finish(
+      std::unique_ptr<::grpc::ClientAsyncResponseReaderInterface<Response>>
+          rpc) {
+    rpc_ = std::move(rpc);
+    if (!rpc_) return false;
+    rpc_->Finish(&response_, &status_, static_cast<AsyncCall *>(this));
+    return true;
+  }
+
+  void Complete(bool ok) override {
+    if (!ok) {
+      callback_(absl::InternalError("RPC call failed"));
+    } else if (!status_.ok()) {
+      callback_(ToStatus(status_));
+    } else {
+      callback_(std::move(response_));
+    }
+  }
+
+ private:
+  const std::unique_ptr<::grpc::ClientContext> context_;
+  const std::function<void(absl::StatusOr<Response>)> callback_;
+  std::unique_ptr<::grpc::ClientAsyncResponseReaderInterface<Response>> rpc_;
+  Response response_;
+  ::grpc::Status status_;
+};
+
 }  // namespace
 
 ClientAsyncImpl::ClientAsyncImpl(
-    std::unique_ptr<MozoLMService::StubInterface> stub) : stub_(
-        std::move(stub)) {}
+    std::unique_ptr<MozoLMService::StubInterface> stub)
+    : async_cq_(absl::make_unique<::grpc::CompletionQueue>()),
+      async_poller_(&ClientAsyncImpl::PollAsyncCalls, this) {
+  stubs_.push_back(std::move(stub));
+}
+
+ClientAsyncImpl::ClientAsyncImpl(
+    std::vector<std::unique_ptr<MozoLMService::StubInterface>> stubs)
+    : stubs_(std::move(stubs)),
+      async_cq_(absl::make_unique<::grpc::CompletionQueue>()),
+      async_poller_(&ClientAsyncImpl::PollAsyncCalls, this) {}
+
+MozoLMService::StubInterface* ClientAsyncImpl::NextStub() {
+  if (stubs_.size() == 1) return stubs_[0].get();
+  return stubs_[next_stub_.fetch_add(1, std::memory_order_relaxed) %
+                stubs_.size()].get();
+}
+
+ClientAsyncImpl::~ClientAsyncImpl() {
+  if (session_ != nullptr) {
+    CloseSession(/* cancel= */true).IgnoreError();
+  }
+  // The completion queue delivers the outstanding completions before its
+  // shutdown completes.
+  async_cq_->Shutdown();
+  async_poller_.join();
+}
 
 absl::Status ClientAsyncImpl::GetLMScore(
-    const std::string& context_str, int initial_state, double timeout_sec,
-    double* normalization,
+    const std::string& context_str, int initial_state, int top_k,
+    double timeout_sec, double* normalization,
     std::vector<std::pair<double, std::string>>* prob_idx_pair_vector) {
   // Sets up client context and the request.
   std::unique_ptr<::grpc::ClientContext> context = MakeClientContext(
@@ -74,11 +173,12 @@ absl::Status ClientAsyncImpl::GetLMScore(
   GetContextRequest request;
   request.set_state(initial_state);
   request.set_context(context_str);
+  request.set_top_k(top_k);
 
   // Fetches the response.
   ::grpc::CompletionQueue cq;
   std::unique_ptr<::grpc::ClientAsyncResponseReaderInterface<LMScores>> rpc(
-      stub_->AsyncGetLMScores(
+      NextStub()->AsyncGetLMScores(
           context.get(), request, &cq));  // Performs RPC call.
   ::grpc::Status status;
   LMScores response;
@@ -86,7 +186,7 @@ absl::Status ClientAsyncImpl::GetLMScore(
   rpc->Finish(&response, &status, &finish_tag);
   RETURN_IF_ERROR(WaitAndCheck(&cq, finish_tag));
   if (!status.ok()) {
-    return absl::InternalError(status.error_message());
+    return ToStatus(status);
   }
 
   // Retrieves information from response if RPC call was successful.
@@ -107,7 +207,7 @@ absl::Status ClientAsyncImpl::GetNextState(
 
   ::grpc::CompletionQueue cq;
   std::unique_ptr<::grpc::ClientAsyncResponseReaderInterface<NextState>> rpc(
-      stub_->AsyncGetNextState(
+      NextStub()->AsyncGetNextState(
           context.get(), request, &cq));  // Performs RPC call.
   if (!rpc) {  // This will fail if the test mocks are not set up correctly.
     return absl::InternalError("Got invalid response reader");
@@ -118,7 +218,7 @@ absl::Status ClientAsyncImpl::GetNextState(
   rpc->Finish(&response, &status, &finish_tag);
   RETURN_IF_ERROR(WaitAndCheck(&cq, finish_tag));
   if (!status.ok()) {
-    return absl::InternalError(status.error_message());
+    return ToStatus(status);
   }
 
   // Sets next_state if RPC call was successful.
@@ -154,14 +254,14 @@ absl::Status ClientAsyncImpl::UpdateCountGetDestStateScore(
   // Fetches the response.
   ::grpc::CompletionQueue cq;
   std::unique_ptr<::grpc::ClientAsyncResponseReaderInterface<LMScores>> rpc(
-      stub_->AsyncUpdateLMScores(context.get(), request,
-                                 &cq));  // Performs RPC call.
+      NextStub()->AsyncUpdateLMScores(context.get(), request,
+                                      &cq));  // Performs RPC call.
   ::grpc::Status status;
   LMScores response;
   int finish_tag = 1;
   rpc->Finish(&response, &status, &finish_tag);
   RETURN_IF_ERROR(WaitAndCheck(&cq, finish_tag));
-  if (!status.ok()) return absl::InternalError(status.error_message());
+  if (!status.ok()) return ToStatus(status);
 
   // Retrieves information from response if RPC call was successful.
   const auto probs_status = models::GetTopHypotheses(response);
@@ -172,5 +272,217 @@ absl::Status ClientAsyncImpl::UpdateCountGetDestStateScore(
   return probs_status.status();
 }
 
+absl::Status ClientAsyncImpl::StartSession(double timeout_sec) {
+  if (session_ != nullptr) {
+    return absl::FailedPreconditionError("Session already started");
+  }
+  session_timeout_sec_ = timeout_sec;
+  session_context_ = absl::make_unique<::grpc::ClientContext>();
+  session_cq_ = absl::make_unique<::grpc::CompletionQueue>();
+  session_ = stubs_[0]->AsyncSession(session_context_.get(),
+                                     session_cq_.get(),
+                                     ToTag(kSessionStartTag));
+  if (!session_) {  // This will fail if the test mocks are not set up correctly.
+    session_context_.reset();
+    session_cq_.reset();
+    return absl::InternalError("Got invalid session stream");
+  }
+  session_ok_ = true;
+  const absl::Status status = WaitForSession(kSessionStartTag);
+  if (!status.ok()) CloseSession(/* cancel= */true).IgnoreError();
+  return status;
+}
+
+absl::Status ClientAsyncImpl::SessionUpdate(
+    const std::string& context_str, int reset_state, int32 count,
+    double* normalization,
+    std::vector<std::pair<double, std::string>>* prob_idx_pair_vector) {
+  if (session_ == nullptr || !session_ok_) {
+    return absl::FailedPreconditionError("No active session");
+  }
+  SessionRequest request;
+  if (reset_state >= 0) {
+    request.set_state(reset_state);
+    request.set_reset_state(true);
+  }
+  const std::vector<int> utf8_syms = utf8::StrSplitByCharToUnicode(
+      context_str);
+  request.mutable_utf8_sym()->Reserve(utf8_syms.size());
+  for (auto utf8_sym : utf8_syms) {
+    request.add_utf8_sym(utf8_sym);
+  }
+  request.set_count(count);
+
+  // Sends the request and fetches the response.
+  session_->Write(request, ToTag(kSessionWriteTag));
+  absl::Status status = WaitForSession(kSessionWriteTag);
+  LMScores response;
+  if (status.ok()) {
+    session_->Read(&response, ToTag(kSessionReadTag));
+    status = WaitForSession(kSessionReadTag);
+  }
+  if (!status.ok()) {
+    // The server may have terminated the session, in which case its status
+    // is more informative.
+    const absl::Status close_status = CloseSession(
+        /* cancel= */absl::IsDeadlineExceeded(status));
+    return close_status.ok() ? status : close_status;
+  }
+
+  // Retrieves information from response if RPC call was successful.
+  ASSIGN_OR_RETURN(*prob_idx_pair_vector, models::GetTopHypotheses(response));
+  *normalization = response.normalization();
+  return absl::OkStatus();
+}
+
+absl::Status ClientAsyncImpl::EndSession() {
+  if (session_ == nullptr) {
+    return absl::FailedPreconditionError("No active session");
+  }
+  return CloseSession(/* cancel= */!session_ok_);
+}
+
+void ClientAsyncImpl::GetLMScoresAsync(const std::string& context_str,
+                                       int initial_state, int top_k,
+                                       double timeout_sec,
+                                       LMScoresCallback callback) {
+  GetContextRequest request;
+  request.set_state(initial_state);
+  request.set_context(context_str);
+  request.set_top_k(top_k);
+  BeginAsyncCall();
+  auto *call = new AsyncUnaryCall<LMScores>(timeout_sec, std::move(callback));
+  if (!call->Finish(NextStub()->AsyncGetLMScores(call->context(), request,
+                                                 async_cq_.get()))) {
+    CompleteAsyncCall(static_cast<AsyncCall *>(call), /* ok= */false);
+  }
+}
+
+void ClientAsyncImpl::GetNextStateAsync(const std::string& context_str,
+                                        int initial_state, double timeout_sec,
+                                        NextStateCallback callback) {
+  GetContextRequest request;
+  request.set_state(initial_state);
+  request.set_context(context_str);
+  BeginAsyncCall();
+  auto *call = new AsyncUnaryCall<NextState>(
+      timeout_sec,
+      [callback = std::move(callback)](absl::StatusOr<NextState> response) {
+        if (!response.ok()) {
+          callback(response.status());
+        } else {
+          callback(response->next_state());
+        }
+      });
+  if (!call->Finish(NextStub()->AsyncGetNextState(call->context(), request,
+                                                  async_cq_.get()))) {
+    CompleteAsyncCall(static_cast<AsyncCall *>(call), /* ok= */false);
+  }
+}
+
+void ClientAsyncImpl::UpdateLMScoresAsync(const std::string& context_str,
+                                          int initial_state, int32 count,
+                                          double timeout_sec,
+                                          LMScoresCallback callback) {
+  UpdateLMScoresRequest request;
+  request.set_state(initial_state);
+  for (const char32 utf8_sym : utf8::Codepoints(context_str)) {
+    request.add_utf8_sym(utf8_sym);
+  }
+  request.set_count(count);
+  BeginAsyncCall();
+  auto *call = new AsyncUnaryCall<LMScores>(timeout_sec, std::move(callback));
+  if (!call->Finish(NextStub()->AsyncUpdateLMScores(
+          call->context(), request, async_cq_.get()))) {
+    CompleteAsyncCall(static_cast<AsyncCall *>(call), /* ok= */false);
+  }
+}
+
+void ClientAsyncImpl::WaitForAsyncCalls() {
+  absl::MutexLock lock(&async_mu_);
+  async_mu_.Await(absl::Condition(
+      +[](int *num_calls) { return *num_calls == 0; }, &num_async_calls_));
+}
+
+void ClientAsyncImpl::BeginAsyncCall() {
+  absl::MutexLock lock(&async_mu_);
+  ++num_async_calls_;
+}
+
+void ClientAsyncImpl::CompleteAsyncCall(void *tag, bool ok) {
+  std::unique_ptr<AsyncCall> call(static_cast<AsyncCall *>(tag));
+  call->Complete(ok);
+  call.reset();
+  absl::MutexLock lock(&async_mu_);
+  --num_async_calls_;
+}
+
+void ClientAsyncImpl::PollAsyncCalls() {
+  void *tag;
+  bool ok;
+  while (async_cq_->Next(&tag, &ok)) {
+    CompleteAsyncCall(tag, ok);
+  }
+}
+
+absl::Status ClientAsyncImpl::WaitForSession(int expected_tag) {
+  void *got_tag;
+  bool ok = false;
+  const gpr_timespec deadline = gpr_time_add(
+      gpr_now(GPR_CLOCK_REALTIME),
+      gpr_time_from_millis(static_cast<int64>(1000.0 * session_timeout_sec_),
+                           GPR_TIMESPAN));
+  const ::grpc::CompletionQueue::NextStatus next_status =
+      session_cq_->AsyncNext(&got_tag, &ok, deadline);
+  if (next_status == ::grpc::CompletionQueue::TIMEOUT) {
+    session_ok_ = false;
+    return absl::DeadlineExceededError("Session operation timed out");
+  } else if (next_status == ::grpc::CompletionQueue::SHUTDOWN) {
+    session_ok_ = false;
+    return absl::InternalError("Completion queue next error");
+  }
+  if (got_tag != ToTag(expected_tag)) {
+    session_ok_ = false;
+    return absl::InternalError(absl::StrFormat(
+        "Completion queue tag mismatch. Expected %d, got %d", expected_tag,
+        static_cast<int>(reinterpret_cast<intptr_t>(got_tag))));
+  }
+  if (!ok) {
+    session_ok_ = false;
+    return absl::InternalError("Session stream failed");
+  }
+  return absl::OkStatus();
+}
+
+absl::Status ClientAsyncImpl::CloseSession(bool cancel) {
+  absl::Status status = absl::CancelledError("Session cancelled");
+  if (!cancel) {
+    // Half-closes the stream and fetches the final status of the session. The
+    // writes can only fail if the server already terminated the session.
+    session_->WritesDone(ToTag(kSessionWritesDoneTag));
+    WaitForSession(kSessionWritesDoneTag).IgnoreError();
+    ::grpc::Status rpc_status;
+    session_->Finish(&rpc_status, ToTag(kSessionFinishTag));
+    status = WaitForSession(kSessionFinishTag);
+    if (status.ok() && !rpc_status.ok()) {
+      status = ToStatus(rpc_status);
+    }
+  }
+
+  // Cancels any operations still pending, e.g., after a timeout, which then
+  // complete right away, and drains the completion queue before releasing the
+  // session. Cancelling a finished session has no effect.
+  session_context_->TryCancel();
+  session_cq_->Shutdown();
+  void *ignored_tag;
+  bool ignored_ok;
+  while (session_cq_->Next(&ignored_tag, &ignored_ok)) {}
+  session_.reset();
+  session_context_.reset();
+  session_cq_.reset();
+  session_ok_ = false;
+  return status;
+}
+
 }  // namespace grpc
 }  // namespace mozolm
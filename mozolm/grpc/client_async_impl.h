@@ -15,29 +15,59 @@
 #ifndef MOZOLM_MOZOLM_GRPC_CLIENT_ASYNC_IMPL_H_
 #define MOZOLM_MOZOLM_GRPC_CLIENT_ASYNC_IMPL_H_
 
+#include <atomic>
+#include <functional>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "mozolm/stubs/integral_types.h"
+#include "absl/base/thread_annotations.h"
 #include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "include/grpcpp/client_context.h"
+#include "include/grpcpp/completion_queue.h"
+#include "include/grpcpp/support/async_stream.h"
 #include "mozolm/grpc/service.grpc.pb.h"
 
 namespace mozolm {
 namespace grpc {
 
 // A completion-queue asynchronous client for the LM server.
+//
+// The blocking calls below each wait for their own call to complete. The
+// calls with the Async suffix instead return right away and run a callback
+// once the response arrives, so that many requests can be in flight at once
+// over the channel. Their completions are delivered by a single completion
+// queue, polled by a thread owned by the client.
 class ClientAsyncImpl {
  public:
+  // Callbacks of the asynchronous calls, receiving the response or the error.
+  using LMScoresCallback = std::function<void(absl::StatusOr<LMScores>)>;
+  using NextStateCallback = std::function<void(absl::StatusOr<int64>)>;
+
   // Constructs a client to use the given LM server.
   explicit ClientAsyncImpl(std::unique_ptr<MozoLMService::StubInterface> stub);
 
+  // Constructs a client spreading the unary calls over the stubs in turn,
+  // e.g., over several connections to the server. The typing sessions use the
+  // first stub. At least one stub is required.
+  explicit ClientAsyncImpl(
+      std::vector<std::unique_ptr<MozoLMService::StubInterface>> stubs);
+
+  // Waits for the asynchronous calls in flight, which are bounded by their
+  // timeouts.
+  ~ClientAsyncImpl();
+
   // Seeks the language models scores given the initial state and context
-  // string.
+  // string. If top_k is positive, only the top_k most likely symbols are
+  // retrieved.
   absl::Status GetLMScore(
-      const std::string& context_str, int initial_state, double timeout_sec,
-      double* normalization,
+      const std::string& context_str, int initial_state, int top_k,
+      double timeout_sec, double* normalization,
       std::vector<std::pair<double, std::string>>* prob_idx_pair_vector);
 
   // Seeks the next model state given the initial state and context string.
@@ -50,16 +80,95 @@ class ClientAsyncImpl {
       int32 count, int64* next_state, double* normalization,
       std::vector<std::pair<double, std::string>>* prob_idx_pair_vector);
 
+  // Starts a typing session, where the state is kept by the server between
+  // the successive calls to SessionUpdate() until EndSession() is called. Each
+  // of the session operations waits at most timeout_sec for the server.
+  absl::Status StartSession(double timeout_sec);
+
+  // Sends the symbols typed in the session and retrieves the probabilities at
+  // the new session state. If count is positive, the counts of the symbols are
+  // updated. If reset_state is non-negative, the session is moved to that
+  // state before the symbols are applied.
+  absl::Status SessionUpdate(
+      const std::string& context_str, int reset_state, int32 count,
+      double* normalization,
+      std::vector<std::pair<double, std::string>>* prob_idx_pair_vector);
+
+  // Ends the typing session, returning the final status of the stream.
+  absl::Status EndSession();
+
+  // Asynchronous version of GetLMScore(), passing the scores to the callback.
+  // The callbacks of the asynchronous calls are run on the polling thread,
+  // hence should return quickly. They may issue further asynchronous calls,
+  // but must not wait for them.
+  void GetLMScoresAsync(const std::string& context_str, int initial_state,
+                        int top_k, double timeout_sec,
+                        LMScoresCallback callback)
+      ABSL_LOCKS_EXCLUDED(async_mu_);
+
+  // Asynchronous version of GetNextState().
+  void GetNextStateAsync(const std::string& context_str, int initial_state,
+                         double timeout_sec, NextStateCallback callback)
+      ABSL_LOCKS_EXCLUDED(async_mu_);
+
+  // Updates the counts of the context symbols at the initial state, passing
+  // the scores at the destination state to the callback.
+  void UpdateLMScoresAsync(const std::string& context_str, int initial_state,
+                           int32 count, double timeout_sec,
+                           LMScoresCallback callback)
+      ABSL_LOCKS_EXCLUDED(async_mu_);
+
+  // Blocks until all the asynchronous calls issued so far have completed and
+  // their callbacks have returned. Not to be called from the callbacks.
+  void WaitForAsyncCalls() ABSL_LOCKS_EXCLUDED(async_mu_);
+
  private:
   ClientAsyncImpl() = delete;
 
+  // Registers a new asynchronous call, before it is started.
+  void BeginAsyncCall() ABSL_LOCKS_EXCLUDED(async_mu_);
+
+  // Runs the completion of the asynchronous call identified by the tag, and
+  // releases it.
+  void CompleteAsyncCall(void* tag, bool ok) ABSL_LOCKS_EXCLUDED(async_mu_);
+
+  // Delivers the completions of the asynchronous calls until the completion
+  // queue is shut down.
+  void PollAsyncCalls();
+
+  // Waits for the session operation with the given tag to complete.
+  absl::Status WaitForSession(int expected_tag);
+
+  // Finishes the session stream. If the stream is not healthy, the session is
+  // cancelled. Returns the final status of the session.
+  absl::Status CloseSession(bool cancel);
+
   // Updates counts and retrieves probabilities from destination state.
   absl::Status UpdateCountGetDestStateScore(
       const std::vector<int>& context_str, int initial_state,
       double timeout_sec, int32 count, double* normalization,
       std::vector<std::pair<double, std::string>>* prob_idx_pair_vector);
 
-  std::unique_ptr<MozoLMService::StubInterface> stub_;  // Owned elsewhere.
+  // Returns the stub of the next unary call.
+  MozoLMService::StubInterface* NextStub();
+
+  std::vector<std::unique_ptr<MozoLMService::StubInterface>> stubs_;
+  std::atomic<uint32> next_stub_{0};  // Counter of the unary calls.
+
+  // Typing session state, set while the session is active.
+  double session_timeout_sec_ = 0.0;
+  bool session_ok_ = false;  // Whether no session operation has failed.
+  std::unique_ptr<::grpc::ClientContext> session_context_;
+  std::unique_ptr<::grpc::CompletionQueue> session_cq_;
+  std::unique_ptr<
+      ::grpc::ClientAsyncReaderWriterInterface<SessionRequest, LMScores>>
+      session_;
+
+  // Asynchronous calls.
+  std::unique_ptr<::grpc::CompletionQueue> async_cq_;
+  absl::Mutex async_mu_;
+  int num_async_calls_ ABSL_GUARDED_BY(async_mu_) = 0;  // Calls in flight.
+  std::thread async_poller_;  // Polls async_cq_.
 };
 
 }  // namespace grpc
@@ -17,6 +17,7 @@
 #include "mozolm/grpc/client_async_impl.h"
 
 #include <memory>
+#include <vector>
 
 #include "mozolm/stubs/integral_types.h"
 #include "include/grpcpp/grpcpp.h"  // IWYU pragma: keep
@@ -25,6 +26,7 @@
 #include "protobuf-matchers/protocol-buffer-matchers.h"
 #include "gtest/gtest.h"
 #include "absl/memory/memory.h"
+#include "absl/synchronization/mutex.h"
 #include "include/grpc++/alarm.h"
 #include "mozolm/grpc/service.grpc.pb.h"
 #include "mozolm/grpc/service_mock.grpc.pb.h"
@@ -119,6 +121,62 @@ TEST_F(ClientAsyncImplTest, CheckGetNextStateUnaryAsync) {
   EXPECT_EQ(0, next_state);
 }
 
+TEST_F(ClientAsyncImplTest, CheckGetNextStateAsyncPipelined) {
+  // Each call gets its own reader, owned by the client, whose response is
+  // delivered to the completion queue of the client by an alarm.
+  constexpr int kNumCalls = 10;
+  std::vector<std::unique_ptr<::grpc::Alarm>> alarms;
+  EXPECT_CALL(*stub_, AsyncGetNextStateRaw(_, _, _))
+      .Times(kNumCalls)
+      .WillRepeatedly(Invoke([&alarms](Unused, const GetContextRequest &request,
+                                       ::grpc::CompletionQueue *cq)
+                         -> ::grpc::ClientAsyncResponseReaderInterface<
+                             NextState> * {
+        auto *reader = new LocalMockClientAsyncResponseReader<NextState>();
+        const int state = request.state();
+        EXPECT_CALL(*reader, Finish)
+            .WillOnce(Invoke([&alarms, cq, state](NextState *result,
+                                                 ::grpc::Status *status,
+                                                 void *tag) {
+              result->set_next_state(state + 1);
+              *status = ::grpc::Status::OK;
+              alarms.push_back(absl::make_unique<::grpc::Alarm>(
+                  cq, gpr_now(GPR_CLOCK_MONOTONIC), tag));
+            }));
+        return reader;
+      }));
+
+  // All the calls are issued before waiting for any of the responses.
+  absl::Mutex mu;
+  std::vector<int64> next_states(kNumCalls, -1);
+  for (int i = 0; i < kNumCalls; ++i) {
+    client_->GetNextStateAsync(
+        "a", /* initial_state= */i, kDefaultTimeoutSec,
+        [&mu, &next_states, i](absl::StatusOr<int64> next_state) {
+          ASSERT_OK(next_state.status());
+          absl::MutexLock lock(&mu);
+          next_states[i] = next_state.value();
+        });
+  }
+  client_->WaitForAsyncCalls();
+  for (int i = 0; i < kNumCalls; ++i) {
+    EXPECT_EQ(i + 1, next_states[i]);
+  }
+}
+
+TEST_F(ClientAsyncImplTest, CheckGetLMScoresAsyncFailsWithoutReader) {
+  EXPECT_CALL(*stub_, AsyncGetLMScoresRaw(_, _, _))
+      .WillOnce(Return(nullptr));
+  absl::Status status;
+  client_->GetLMScoresAsync("a", /* initial_state= */0, /* top_k= */0,
+                            kDefaultTimeoutSec,
+                            [&status](absl::StatusOr<LMScores> scores) {
+                              status = scores.status();
+                            });
+  client_->WaitForAsyncCalls();
+  EXPECT_FALSE(status.ok());
+}
+
 }  // namespace
 }  // namespace grpc
 }  // namespace mozolm
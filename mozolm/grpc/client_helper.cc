@@ -14,9 +14,12 @@
 
 #include "mozolm/grpc/client_helper.h"
 
+#include <algorithm>
 #include <cmath>
 #include <fstream>
+#include <functional>
 #include <string>
+#include <tuple>
 #include <utility>
 #include <vector>
 
@@ -29,10 +32,20 @@
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
 #include "absl/strings/str_join.h"
+#include "absl/strings/string_view.h"
 #include "absl/synchronization/notification.h"
+#include "mozolm/grpc/channel_util.h"
 #include "mozolm/grpc/client_async_impl.h"
+#include "mozolm/grpc/replica_router.h"
 #include "mozolm/grpc/server_config.pb.h"
 #include "mozolm/grpc/server_helper.h"
+#include "mozolm/models/language_model.h"
+#include "mozolm/models/language_model_hub.h"
+#include "mozolm/models/lm_scores.pb.h"
+#include "mozolm/models/model_config.pb.h"
+#include "mozolm/models/model_factory.h"
+#include "mozolm/models/model_storage.pb.h"
+#include "mozolm/stubs/thread_pool.h"
 #include "mozolm/utils/utf8_util.h"
 #include "mozolm/stubs/status_macros.h"
 
@@ -69,7 +82,7 @@ int GetRandomPosition(
 // find match, since this will on average be efficient.
 int FindStringIndex(
     const std::vector<std::pair<double, std::string>>& prob_idx_pair_vector,
-    const std::string& utf8_sym) {
+    absl::string_view utf8_sym) {
   for (int idx = 0; idx < prob_idx_pair_vector.size(); ++idx) {
     if (utf8_sym == prob_idx_pair_vector[idx].second) {
       return idx;
@@ -127,17 +140,227 @@ BuildChannelCredentials(const ClientConfig &config,
   return ::grpc::InsecureChannelCredentials();
 }
 
+// Totals of the bits-per-character calculation over a line of the corpus.
+struct LineTally {
+  double bits = 0.0;
+  int num_chars = 0;
+  int num_oov_chars = 0;
+};
+
+// Reads the lines of the test corpus.
+absl::StatusOr<std::vector<std::string>> ReadLines(
+    const std::string& test_file) {
+  std::ifstream infile(test_file);
+  if (!infile.is_open()) {
+    return absl::NotFoundError("Test file could not be accessed");
+  }
+  std::vector<std::string> lines;
+  std::string input_line;
+  while (std::getline(infile, input_line)) {
+    lines.push_back(std::move(input_line));
+  }
+  return lines;
+}
+
+// Adds the bits of the symbol, given the scores preceding it, to the tally.
+void TallySymbol(
+    absl::string_view utf8_sym,
+    const std::vector<std::pair<double, std::string>>& prob_idx_pair_vector,
+    LineTally* tally) {
+  const int idx = FindStringIndex(prob_idx_pair_vector, utf8_sym);
+  tally->bits += CalculateBits(idx, prob_idx_pair_vector);
+  if (idx < 0) {
+    ++tally->num_oov_chars;
+  }
+  ++tally->num_chars;
+}
+
+// Scores the lines in the [begin, end) range within a single typing session
+// of the client, which keeps the model state on the server between the
+// keystrokes. The counts of the symbols are updated by the given count.
+absl::Status ScoreLinesInSession(ClientAsyncImpl* client, double timeout_sec,
+                                 int32 count,
+                                 const std::vector<std::string>& lines,
+                                 size_t begin, size_t end,
+                                 std::vector<LineTally>* tallies) {
+  RETURN_IF_ERROR(client->StartSession(timeout_sec));
+  absl::Status status = absl::OkStatus();
+  double unused_normalization;
+  for (size_t i = begin; status.ok() && i < end; ++i) {
+    // Invalid UTF-8 lines only score the end-of-string.
+    const utf8::Codepoints input_chars(
+        utf8::IsValidUTF8(lines[i]) ? lines[i] : absl::string_view());
+    std::vector<std::pair<double, std::string>> prob_idx_pair_vector;
+    // Moves the session to the initial state of the model.
+    status = client->SessionUpdate(
+        /*context_str=*/"", /*reset_state=*/0, /*count=*/0,
+        &unused_normalization, &prob_idx_pair_vector);
+    if (!status.ok()) break;
+    for (auto pos = input_chars.begin();; ++pos) {
+      // The empty symbol stands for the end-of-string character.
+      const bool end_of_string = pos == input_chars.end();
+      const absl::string_view utf8_sym =
+          end_of_string ? absl::string_view() : pos.bytes();
+      TallySymbol(utf8_sym, prob_idx_pair_vector, &(*tallies)[i]);
+      prob_idx_pair_vector.clear();
+      status = client->SessionUpdate(
+          std::string(utf8_sym), /*reset_state=*/-1, count,
+          &unused_normalization, &prob_idx_pair_vector);
+      if (!status.ok() || end_of_string) break;
+    }
+  }
+  const absl::Status session_status = client->EndSession();
+  if (status.ok()) status = session_status;
+  return status;
+}
+
+// Scores the lines in the [begin, end) range directly with the model hub,
+// following the same steps as the typing session above.
+absl::Status ScoreLinesInHub(models::LanguageModelHub* hub, int32 count,
+                             const std::vector<std::string>& lines,
+                             size_t begin, size_t end,
+                             std::vector<LineTally>* tallies) {
+  LMScores scores;
+  for (size_t i = begin; i < end; ++i) {
+    const utf8::Codepoints input_chars(
+        utf8::IsValidUTF8(lines[i]) ? lines[i] : absl::string_view());
+    int state = 0;  // Start state of the hub.
+    for (auto pos = input_chars.begin();; ++pos) {
+      scores.Clear();
+      if (!hub->ExtractLMScores(state, &scores)) {
+        return absl::InternalError("Failed to extract scores");
+      }
+      std::vector<std::pair<double, std::string>> prob_idx_pair_vector;
+      ASSIGN_OR_RETURN(prob_idx_pair_vector, models::GetTopHypotheses(scores));
+      const bool end_of_string = pos == input_chars.end();
+      TallySymbol(end_of_string ? absl::string_view() : pos.bytes(),
+                  prob_idx_pair_vector, &(*tallies)[i]);
+      if (end_of_string) break;
+      const int next_state = hub->NextState(state, *pos);
+      if (count > 0 && !hub->UpdateLMCounts(state, {*pos}, count)) {
+        return absl::InternalError("Failed to update counts");
+      }
+      state = next_state < 0 ? 0 : next_state;
+    }
+  }
+  return absl::OkStatus();
+}
+
+// Returns whether the call failed because of the server, rather than the
+// request, in which case another replica may serve it.
+bool IsReplicaFailure(const absl::Status& status) {
+  return absl::IsUnavailable(status) || absl::IsDeadlineExceeded(status);
+}
+
+// Runs score_shard(begin, end) for each of the contiguous shards of the lines
+// in parallel, returning the first failure in the order of the shards.
+absl::Status RunShards(
+    int num_shards, size_t num_lines,
+    const std::function<absl::Status(size_t, size_t)>& score_shard) {
+  std::vector<absl::Status> statuses(num_shards);
+  {
+    ThreadPool pool(num_shards);
+    pool.StartWorkers();
+    for (int shard = 0; shard < num_shards; ++shard) {
+      const size_t begin = num_lines * shard / num_shards;
+      const size_t end = num_lines * (shard + 1) / num_shards;
+      pool.Schedule([&score_shard, &statuses, shard, begin, end] {
+        statuses[shard] = score_shard(begin, end);
+      });
+    }
+  }  // Waits for the workers.
+  for (const absl::Status& status : statuses) {
+    RETURN_IF_ERROR(status);
+  }
+  return absl::OkStatus();
+}
+
+// Scores the lines in process with the models of the hub configuration, in
+// the given number of contiguous shards. Each shard is scored by its own hub,
+// so that the states of the other shards cannot recycle its states.
+absl::Status ScoreLinesWithModels(const ModelHubConfig& hub_config,
+                                  int num_workers, int32 count,
+                                  const std::vector<std::string>& lines,
+                                  std::vector<LineTally>* tallies) {
+  return RunShards(
+      num_workers, lines.size(),
+      [&hub_config, count, &lines, tallies](size_t begin,
+                                            size_t end) -> absl::Status {
+        auto hub_status = models::MakeModelHub(hub_config);
+        if (!hub_status.ok()) return hub_status.status();
+        std::unique_ptr<models::LanguageModelHub> hub =
+            std::move(hub_status.value());
+        return ScoreLinesInHub(hub.get(), count, lines, begin, end, tallies);
+      });
+}
+
+// Returns whether any of the models of the hub configuration updates its
+// counts as the text is scored.
+bool HasDynamicModels(const ModelHubConfig& hub_config) {
+  // The hub defaults to a single character bigram model.
+  if (hub_config.model_config_size() == 0) return true;
+  for (const auto& model_config : hub_config.model_config()) {
+    switch (model_config.type()) {
+      case ModelConfig::CHAR_NGRAM_FST:
+      case ModelConfig::CHAR_NGRAM_CONST_FST:
+        break;
+      case ModelConfig::PPM_AS_FST:
+        if (!model_config.storage().ppm_options().static_model()) return true;
+        break;
+      default:
+        return true;
+    }
+  }
+  return false;
+}
+
+// Sums up the lines in order, which keeps the result independent of the
+// number of workers.
+LineTally SumTallies(const std::vector<LineTally>& tallies) {
+  LineTally total;
+  for (const LineTally& tally : tallies) {
+    total.bits += tally.bits;
+    total.num_chars += tally.num_chars;
+    total.num_oov_chars += tally.num_oov_chars;
+  }
+  return total;
+}
+
+// Clears the quantization of the models of the hub configuration, returning
+// whether any of them was quantized.
+bool ClearQuantization(ModelHubConfig* hub_config) {
+  bool quantized = false;
+  for (auto& model_config : *hub_config->mutable_model_config()) {
+    ModelStorage* storage = model_config.mutable_storage();
+    if (storage->quantization() != QUANTIZATION_NONE) {
+      storage->set_quantization(QUANTIZATION_NONE);
+      quantized = true;
+    }
+  }
+  return quantized;
+}
+
 }  // namespace
 
 absl::Status ClientHelper::GetLMScores(
-    const std::string& context_string, int initial_state, double* normalization,
+    const std::string& context_string, int initial_state, int top_k,
+    double* normalization,
     std::vector<std::pair<double, std::string>>* prob_idx_pair_vector) {
-  if (completion_client_ == nullptr) {
-    return absl::InternalError("Completion client not initialized");
+  const auto get_scores = [&](ClientAsyncImpl* client, int64 state) {
+    return client->GetLMScore(context_string, state, top_k, timeout_sec_,
+                              normalization, prob_idx_pair_vector);
+  };
+  absl::Status status;
+  if (initial_state < 0 && read_only_router_ != nullptr) {
+    status = CallReadOnlyReplica(get_scores);
+    // Falls back to the replicas of the session.
+    if (IsReplicaFailure(status)) {
+      status = CallSession(initial_state, get_scores);
+    }
+  } else {
+    status = CallSession(initial_state, get_scores);
   }
-  RETURN_IF_ERROR(completion_client_->GetLMScore(context_string, initial_state,
-                                                 timeout_sec_, normalization,
-                                                 prob_idx_pair_vector));
+  RETURN_IF_ERROR(status);
   if (*normalization <= 0) {
     return absl::InternalError(absl::StrCat(
         "Invalid normalization factor: ", *normalization));
@@ -150,14 +373,17 @@ absl::StatusOr<int64> ClientHelper::GetNextState(
     const std::string& context_string,
     int initial_state) {
   int64 next_state;
-  GOOGLE_CHECK_NE(completion_client_, nullptr);
-  const absl::Status status = completion_client_->GetNextState(
-      context_string, initial_state, timeout_sec_, &next_state);
+  const absl::Status status = CallSession(
+      initial_state, [&](ClientAsyncImpl* client, int64 state) {
+        return client->GetNextState(context_string, state, timeout_sec_,
+                                    &next_state);
+      });
   if (!status.ok()) {
     return absl::InternalError(absl::StrCat(
         "Getting next state failed for initial state ", initial_state,
         " in context \"", context_string, "\": ", status.ToString()));
   }
+  TrackSessionState(context_string, initial_state, next_state);
   return next_state;
 }
 
@@ -165,12 +391,81 @@ absl::Status ClientHelper::UpdateCountGetDestStateScore(
     const std::string& context_string, int initial_state, int32 count,
     int64* next_state, double* normalization,
     std::vector<std::pair<double, std::string>>* prob_idx_pair_vector) {
-  if (completion_client_ == nullptr) {
+  RETURN_IF_ERROR(CallSession(
+      initial_state, [&](ClientAsyncImpl* client, int64 state) {
+        return client->UpdateCountGetDestStateScore(
+            context_string, state, timeout_sec_, count, next_state,
+            normalization, prob_idx_pair_vector);
+      }));
+  TrackSessionState(context_string, initial_state, *next_state);
+  return absl::OkStatus();
+}
+
+absl::Status ClientHelper::CallSession(
+    int64 initial_state,
+    const std::function<absl::Status(ClientAsyncImpl*, int64)>& call) {
+  if (clients_.empty()) {
     return absl::InternalError("Completion client not initialized");
   }
-  return completion_client_->UpdateCountGetDestStateScore(
-      context_string, initial_state, timeout_sec_, count, next_state,
-      normalization, prob_idx_pair_vector);
+  absl::Status status;
+  for (int attempt = 0; attempt < clients_.size(); ++attempt) {
+    const int replica = router_->Route(config_.session_key());
+    if (replica < 0) break;
+    int64 state = initial_state;
+    if (replica != session_replica_ && session_replica_ >= 0 &&
+        initial_state >= 0) {
+      if (initial_state != session_state_) {
+        // The state id is only valid on the previous replica of the session.
+        return absl::FailedPreconditionError(absl::StrCat(
+            "State ", initial_state, " cannot be moved to replica ", replica,
+            ", since it was not reached by the session"));
+      }
+      // Rebuilds the state of the session on its new replica.
+      status = clients_[replica]->GetNextState(
+          session_context_, /*initial_state=*/-1, timeout_sec_, &state);
+    }
+    if (status.ok()) status = call(clients_[replica].get(), state);
+    if (clients_.size() == 1 || !IsReplicaFailure(status)) {
+      session_replica_ = replica;
+      return status;
+    }
+    GOOGLE_LOG(WARNING) << "Replica " << replica
+                        << " failed: " << status.ToString();
+    // Tried again once the retry interval has elapsed.
+    router_->MarkDown(replica);
+    status = absl::OkStatus();
+  }
+  return absl::UnavailableError("No server replica available");
+}
+
+absl::Status ClientHelper::CallReadOnlyReplica(
+    const std::function<absl::Status(ClientAsyncImpl*, int64)>& call) {
+  absl::Status status = absl::UnavailableError("No read-only replica");
+  for (int attempt = 0; attempt < read_only_clients_.size(); ++attempt) {
+    const int replica = read_only_router_->Route(config_.session_key());
+    if (replica < 0) break;
+    status = call(read_only_clients_[replica].get(), /*initial_state=*/-1);
+    if (!IsReplicaFailure(status)) return status;
+    GOOGLE_LOG(WARNING) << "Read-only replica " << replica
+                        << " failed: " << status.ToString();
+    read_only_router_->MarkDown(replica);
+  }
+  return status;
+}
+
+void ClientHelper::TrackSessionState(const std::string& context_string,
+                                     int64 initial_state, int64 next_state) {
+  if (initial_state < 0) {
+    session_context_ = context_string;
+  } else if (initial_state == session_state_) {
+    session_context_ += context_string;
+  } else {
+    // The state was not reached by this client, hence cannot be rebuilt.
+    session_context_.clear();
+    session_state_ = -1;
+    return;
+  }
+  session_state_ = next_state;
 }
 
 absl::Status ClientHelper::RandGen(const std::string& context_string,
@@ -186,8 +481,8 @@ absl::Status ClientHelper::RandGen(const std::string& context_string,
   std::string chosen;
   std::vector<std::pair<double, std::string>> prob_idx_pair_vector;
   double normalization;
-  RETURN_IF_ERROR(GetLMScores(/*context_string=*/"", state, &normalization,
-                              &prob_idx_pair_vector));
+  RETURN_IF_ERROR(GetLMScores(/*context_string=*/"", state, /*top_k=*/0,
+                              &normalization, &prob_idx_pair_vector));
   bool success = true;
   do {
     if (success) {
@@ -225,10 +520,11 @@ absl::Status ClientHelper::OneKbestSample(int k_best,
                                           std::string* result) {
   std::vector<std::pair<double, std::string>> prob_idx_pair_vector;
   double normalization;
-  RETURN_IF_ERROR(GetLMScores(context_string, /*initial_state=*/-1,
+  RETURN_IF_ERROR(GetLMScores(context_string, /*initial_state=*/-1, k_best,
                               &normalization, &prob_idx_pair_vector));
   *result = std::to_string(k_best) + "-best prob continuations:";
-  for (int i = 0; i < k_best; i++) {
+  const int num_hyps = std::min<int>(k_best, prob_idx_pair_vector.size());
+  for (int i = 0; i < num_hyps; i++) {
     *result = absl::StrFormat("%s %s(%5.3f)", *result,
                               prob_idx_pair_vector[i].second,
                               prob_idx_pair_vector[i].first);
@@ -238,61 +534,153 @@ absl::Status ClientHelper::OneKbestSample(int k_best,
 
 absl::Status ClientHelper::CalcBitsPerCharacter(const std::string& test_file,
                                                 std::string* result) {
-  std::ifstream infile(test_file);
-  if (!infile.is_open()) {
-    return absl::NotFoundError("Test file could not be accessed");
+  std::vector<std::string> lines;
+  ASSIGN_OR_RETURN(lines, ReadLines(test_file));
+  const int num_workers = std::max(
+      1, std::min<int>(config_.num_eval_workers(), lines.size()));
+  // The counts are only updated when scoring the lines in sequence, so that
+  // the result does not depend on the scheduling of the workers.
+  const int32 count = num_workers > 1 ? 0 : 1;
+  if (count == 0 && HasDynamicModels(config_.server().model_hub_config())) {
+    GOOGLE_LOG(WARNING) << "Scoring with " << num_workers << " workers does "
+                        << "not update the counts of the dynamic models, "
+                        << "hence the bits per character differ from the "
+                        << "sequential evaluation";
   }
-  absl::Status status = absl::OkStatus();
-  std::string input_line;
-  int tot_chars = 0;
-  int tot_oov_chars = 0;
-  double tot_bits = 0.0;
-  double unused_normalization;
-  while (status.ok() && std::getline(infile, input_line)) {
-    std::vector<std::string> input_chars = utf8::StrSplitByChar(input_line);
-    input_chars.push_back("");  // End-of-string character.
-    int64 state = 0;  // Will start at initial state of the model.
-    std::vector<std::pair<double, std::string>> prob_idx_pair_vector;
-    RETURN_IF_ERROR(GetLMScores(/*context_string=*/"", state,
-                                &unused_normalization, &prob_idx_pair_vector));
-    for (const auto& utf8_sym : input_chars) {
-      const int idx = FindStringIndex(prob_idx_pair_vector, utf8_sym);
-      tot_bits += CalculateBits(idx, prob_idx_pair_vector);
-      if (idx < 0) {
-         ++tot_oov_chars;
-      }
-      ++tot_chars;
-      prob_idx_pair_vector.clear();
-      status = UpdateCountGetDestStateScore(utf8_sym, state, /*count=*/1,
-                                            &state, &unused_normalization,
-                                            &prob_idx_pair_vector);
-      if (!status.ok()) break;
+  std::vector<LineTally> tallies(lines.size());
+  if (config_.in_process_eval()) {
+    RETURN_IF_ERROR(ScoreLinesWithModels(config_.server().model_hub_config(),
+                                         num_workers, count, lines, &tallies));
+  } else if (num_workers == 1) {
+    const int replica =
+        router_ == nullptr ? -1 : router_->Route(config_.session_key());
+    if (replica < 0) {
+      return absl::InternalError("Completion client not initialized");
     }
+    RETURN_IF_ERROR(ScoreLinesInSession(clients_[replica].get(), timeout_sec_,
+                                        count, lines, 0, lines.size(),
+                                        &tallies));
+  } else {
+    // Each worker has its own channel and typing session, spread over the
+    // replicas of the server, if any, by the first line of its shard.
+    RETURN_IF_ERROR(RunShards(
+        num_workers, lines.size(),
+        [this, count, &lines, &tallies](size_t begin,
+                                        size_t end) -> absl::Status {
+          std::string address_uri = config_.server().address_uri();
+          if (config_.replica_address_uris_size() > 0) {
+            const int replica = router_->Route(
+                absl::StrCat(config_.session_key(), "/", begin));
+            if (replica < 0) {
+              return absl::UnavailableError("No server replica available");
+            }
+            address_uri = config_.replica_address_uris(replica);
+          }
+          std::shared_ptr<::grpc::Channel> channel;
+          ASSIGN_OR_RETURN(channel, MakeClientChannel(config_, address_uri));
+          ClientAsyncImpl client(MozoLMService::NewStub(channel));
+          return ScoreLinesInSession(&client, timeout_sec_, count, lines,
+                                     begin, end, &tallies);
+        }));
   }
-  if (infile.is_open()) {
-    infile.close();
-  }
-  if (!status.ok()) return status;
+
+  const LineTally total = SumTallies(tallies);
+  const double bits_per_char =
+      total.bits / static_cast<double>(total.num_chars);
   *result = absl::StrJoin(
-      std::make_tuple("Total characters: ", tot_chars, " (", tot_oov_chars,
-                      " OOV); bits per character: ",
-                      tot_bits / static_cast<double>(tot_chars)), "");
+      std::make_tuple("Total characters: ", total.num_chars, " (",
+                      total.num_oov_chars, " OOV); bits per character: ",
+                      bits_per_char), "");
+
+  // Scores the corpus again with the full precision models, for the loss of
+  // the quantized ones.
+  ModelHubConfig unquantized_config =
+      config_.server().model_hub_config();
+  if (config_.in_process_eval() && config_.compare_unquantized() &&
+      ClearQuantization(&unquantized_config)) {
+    std::vector<LineTally> unquantized_tallies(lines.size());
+    RETURN_IF_ERROR(ScoreLinesWithModels(unquantized_config, num_workers,
+                                         count, lines, &unquantized_tallies));
+    const LineTally unquantized_total = SumTallies(unquantized_tallies);
+    const double unquantized_bits_per_char =
+        unquantized_total.bits /
+        static_cast<double>(unquantized_total.num_chars);
+    absl::StrAppend(result, "; unquantized bits per character: ",
+                    unquantized_bits_per_char, " (quantization delta: ",
+                    bits_per_char - unquantized_bits_per_char, ")");
+  }
   return absl::OkStatus();
 }
 
 absl::Status ClientHelper::Init(const ClientConfig& config) {
+  config_ = config;
+  channels_.clear();
+  std::vector<std::string> replicas(config.replica_address_uris().begin(),
+                                    config.replica_address_uris().end());
+  if (replicas.empty()) replicas.push_back(config.server().address_uri());
+  const std::vector<std::string> read_only_replicas(
+      config.read_only_replica_address_uris().begin(),
+      config.read_only_replica_address_uris().end());
+  clients_.clear();
+  for (const std::string& address_uri : replicas) {
+    clients_.emplace_back();
+    RETURN_IF_ERROR(MakeClient(address_uri, &clients_.back()));
+  }
+  const absl::Duration retry_interval = absl::Seconds(
+      config.replica_retry_interval_sec() > 0
+          ? config.replica_retry_interval_sec()
+          : kDefaultReplicaRetrySec);
+  router_ = absl::make_unique<ReplicaRouter>(replicas, retry_interval);
+  read_only_clients_.clear();
+  read_only_router_.reset();
+  if (!read_only_replicas.empty()) {
+    for (const std::string& address_uri : read_only_replicas) {
+      read_only_clients_.emplace_back();
+      RETURN_IF_ERROR(MakeClient(address_uri, &read_only_clients_.back()));
+    }
+    read_only_router_ = absl::make_unique<ReplicaRouter>(read_only_replicas,
+                                                         retry_interval);
+  }
+  session_replica_ = -1;
+  session_state_ = -1;
+  session_context_.clear();
+  timeout_sec_ = config.timeout_sec();
+  return absl::OkStatus();
+}
+
+absl::Status ClientHelper::MakeClient(
+    const std::string& address_uri, std::unique_ptr<ClientAsyncImpl>* client) {
+  std::vector<std::unique_ptr<MozoLMService::StubInterface>> stubs;
+  const int num_channels = std::max(config_.num_channels(), 1);
+  for (int i = 0; i < num_channels; ++i) {
+    std::shared_ptr<::grpc::Channel> channel;
+    ASSIGN_OR_RETURN(channel, MakeClientChannel(config_, address_uri));
+    stubs.push_back(MozoLMService::NewStub(channel));
+    channels_.push_back(std::move(channel));
+  }
+  *client = absl::make_unique<ClientAsyncImpl>(std::move(stubs));
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::shared_ptr<::grpc::Channel>> MakeClientChannel(
+    const ClientConfig& config) {
+  return MakeClientChannel(config, config.server().address_uri());
+}
+
+absl::StatusOr<std::shared_ptr<::grpc::Channel>> MakeClientChannel(
+    const ClientConfig& config, const std::string& address_uri) {
   ::grpc::ChannelArguments channel_args;
   std::shared_ptr<::grpc::ChannelCredentials> creds = BuildChannelCredentials(
       config, &channel_args);
   if (creds == nullptr) {
     return absl::InternalError("Failed to build channel credentials");
   }
-  channel_ = ::grpc::CreateCustomChannel(config.server().address_uri(), creds,
-                                         channel_args);
-  completion_client_ =
-      absl::make_unique<ClientAsyncImpl>(MozoLMService::NewStub(channel_));
-  timeout_sec_ = config.timeout_sec();
-  return absl::OkStatus();
+  SetChannelArguments(config.channel(), &channel_args);
+  if (config.num_channels() > 1) {
+    // Otherwise the channels with the same arguments share their connection.
+    channel_args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+  }
+  return ::grpc::CreateCustomChannel(address_uri, creds, channel_args);
 }
 
 void InitConfigDefaults(ClientConfig* config) {
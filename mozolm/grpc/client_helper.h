@@ -15,6 +15,7 @@
 #ifndef MOZOLM_MOZOLM_GRPC_CLIENT_HELPER_H_
 #define MOZOLM_MOZOLM_GRPC_CLIENT_HELPER_H_
 
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
@@ -25,6 +26,7 @@
 #include "absl/status/statusor.h"
 #include "mozolm/grpc/client_async_impl.h"
 #include "mozolm/grpc/client_config.pb.h"
+#include "mozolm/grpc/replica_router.h"
 
 namespace mozolm {
 namespace grpc {
@@ -51,14 +53,27 @@ class ClientHelper {
   // codepoints, even those assigned zero probability by the model, we
   // interpolate with a uniform model over all codepoints, using a very small
   // interpolation factor for this mixing.
+  //
+  // By default the lines are scored in a single typing session which updates
+  // the counts of the model after each character. If the configuration asks
+  // for several evaluation workers, the lines are split into contiguous
+  // shards scored in parallel, each in its own session over its own channel,
+  // without updating the counts. If in_process_eval is set, the models of the
+  // server configuration are loaded and scored directly, without any RPC, by
+  // a hub per worker. The result does not depend on the scheduling of the
+  // workers, but, for the dynamic models, the parallel evaluation differs from
+  // the sequential one, which is reported by a warning. If compare_unquantized
+  // is also set, the result includes the bits per character of the quantized
+  // models loaded at full precision.
   absl::Status CalcBitsPerCharacter(const std::string& test_file,
                                     std::string* result);
 
  private:
   // Requests LMScores from model, populates vector of prob/index pairs and
-  // updates normalization count, returning true if successful.
+  // updates normalization count, returning true if successful. If top_k is
+  // positive, only the top_k most likely symbols are requested.
   absl::Status GetLMScores(
-      const std::string& context_string, int initial_state,
+      const std::string& context_string, int initial_state, int top_k,
       double* normalization,
       std::vector<std::pair<double, std::string>>* prob_idx_pair_vector);
 
@@ -72,16 +87,72 @@ class ClientHelper {
       int64* next_state, double* normalization,
       std::vector<std::pair<double, std::string>>* prob_idx_pair_vector);
 
+  // Makes the client of the server at the address, with its channels.
+  absl::Status MakeClient(const std::string& address_uri,
+                          std::unique_ptr<ClientAsyncImpl>* client);
+
+  // Runs the call, from the given state, on the replica of the session. If
+  // the replica fails, marks it down until its retry interval elapses and
+  // moves the session to the next replica, where the state of the session is
+  // first rebuilt by replaying its context. Fails if the state is not the
+  // last one reached by the session, since it cannot then be rebuilt. The call
+  // receives the client and the state on that replica.
+  absl::Status CallSession(
+      int64 initial_state,
+      const std::function<absl::Status(ClientAsyncImpl*, int64)>& call);
+
+  // Runs the call, from the start state, on the read-only replica of the
+  // session, moving to the next read-only replica if it fails. Returns an
+  // unavailable error if all of them fail.
+  absl::Status CallReadOnlyReplica(
+      const std::function<absl::Status(ClientAsyncImpl*, int64)>& call);
+
+  // Records the state of the session reached from the initial state by the
+  // context, so that it can be rebuilt on another replica.
+  void TrackSessionState(const std::string& context_string,
+                         int64 initial_state, int64 next_state);
+
   // Timeout when waiting for server (specified in seconds).
   double timeout_sec_;
 
-  std::shared_ptr<::grpc::Channel> channel_;
-  std::unique_ptr<ClientAsyncImpl> completion_client_;
+  // Configuration given at initialization.
+  ClientConfig config_;
+
+  // Channels to the servers, each with its own connection if there are
+  // several per server.
+  std::vector<std::shared_ptr<::grpc::Channel>> channels_;
+
+  // Clients of the replicas of the server, a single one unless the deployment
+  // is replicated, and the router of the session over them.
+  std::vector<std::unique_ptr<ClientAsyncImpl>> clients_;
+  std::unique_ptr<ReplicaRouter> router_;
+
+  // Clients and router of the read-only replicas, if any.
+  std::vector<std::unique_ptr<ClientAsyncImpl>> read_only_clients_;
+  std::unique_ptr<ReplicaRouter> read_only_router_;
+
+  // Replica which last served the session, state of the session on that
+  // replica and context typed from the start state to reach it, empty if the
+  // state is not known.
+  int session_replica_ = -1;
+  int64 session_state_ = -1;
+  std::string session_context_;
 };
 
 // Sets default parameters for the client if they have not already been set.
 void InitConfigDefaults(ClientConfig* config);
 
+// Makes a channel to the server, with the credentials and the channel tuning
+// given by the client configuration. If the configuration asks for several
+// channels, each channel made has its own connection.
+absl::StatusOr<std::shared_ptr<::grpc::Channel>> MakeClientChannel(
+    const ClientConfig& config);
+
+// Makes a channel as above, to the server at the given address, e.g., one of
+// the replicas.
+absl::StatusOr<std::shared_ptr<::grpc::Channel>> MakeClientChannel(
+    const ClientConfig& config, const std::string& address_uri);
+
 // Runs client service according to given configuration.
 absl::Status RunClient(const ClientConfig& config);
 
@@ -183,6 +183,46 @@ TEST_P(ClientHelperTest, CheckCalcBitsPerCharacter) {
   EXPECT_TRUE(std::filesystem::remove(test_file));
 }
 
+TEST_P(ClientHelperTest, CheckShardedCalcBitsPerCharacter) {
+  const auto temp_text_status = file::WriteTempTextFile(
+      "test.txt", "Hello world!\nHow are you?\nFine, thanks.\nBye\n");
+  EXPECT_OK(temp_text_status.status());
+  const std::string test_file = temp_text_status.value();
+
+  // Without the updates of the counts, the parallel evaluation over the server
+  // and the evaluation in process agree.
+  constexpr int kNumWorkers = 3;
+  client_config_.set_num_eval_workers(kNumWorkers);
+  ClientHelper client;
+  EXPECT_OK(client.Init(client_config_));
+  std::string result;
+  EXPECT_OK(client.CalcBitsPerCharacter(test_file, &result));
+  EXPECT_FALSE(result.empty());
+
+  client_config_.set_in_process_eval(true);
+  ClientHelper in_process_client;
+  EXPECT_OK(in_process_client.Init(client_config_));
+  std::string in_process_result;
+  EXPECT_OK(in_process_client.CalcBitsPerCharacter(test_file,
+                                                   &in_process_result));
+  EXPECT_EQ(result, in_process_result);
+
+  // Same for the sequential evaluation, which updates the counts. Note, the
+  // server has not been updated yet.
+  client_config_.set_num_eval_workers(1);
+  ClientHelper sequential_in_process_client;
+  EXPECT_OK(sequential_in_process_client.Init(client_config_));
+  EXPECT_OK(sequential_in_process_client.CalcBitsPerCharacter(
+      test_file, &in_process_result));
+  client_config_.set_in_process_eval(false);
+  ClientHelper sequential_client;
+  EXPECT_OK(sequential_client.Init(client_config_));
+  EXPECT_OK(sequential_client.CalcBitsPerCharacter(test_file, &result));
+  EXPECT_EQ(result, in_process_result);
+
+  EXPECT_TRUE(std::filesystem::remove(test_file));
+}
+
 INSTANTIATE_TEST_SUITE_P(
     ClientServerMiniEnd2End, ClientHelperTest, ::testing::Values(
         // Static character bigram.
@@ -0,0 +1,325 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/grpc/load_generator.h"
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/random/random.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "absl/synchronization/mutex.h"
+#include "mozolm/grpc/client_async_impl.h"
+#include "mozolm/grpc/client_config.pb.h"
+#include "mozolm/grpc/client_helper.h"
+#include "mozolm/grpc/service.grpc.pb.h"
+#include "mozolm/utils/file_util.h"
+#include "mozolm/utils/utf8_util.h"
+#include "mozolm/stubs/status_macros.h"
+
+namespace mozolm {
+namespace grpc {
+namespace {
+
+// Letters of the random contexts, if no corpus is given.
+constexpr char kContextLetters[] = "abcdefghijklmnopqrstuvwxyz";
+
+// Types of the requests of the mix.
+enum RequestType {
+  kGetLMScores = 0,
+  kGetNextState,
+  kUpdateLMScores,
+  kNumRequestTypes
+};
+
+// Draws the types and the contexts of the requests. Thread-safe.
+class RequestGenerator {
+ public:
+  // Sets up the generator, reading the corpus if one is configured.
+  absl::Status Init(const LoadGeneratorConfig& config) {
+    double weights[kNumRequestTypes] = {config.get_lm_scores_weight(),
+                                        config.get_next_state_weight(),
+                                        config.update_lm_scores_weight()};
+    if (std::any_of(weights, weights + kNumRequestTypes,
+                    [](double weight) { return weight < 0.0; })) {
+      return absl::InvalidArgumentError("Negative request weight");
+    }
+    if (std::all_of(weights, weights + kNumRequestTypes,
+                    [](double weight) { return weight == 0.0; })) {
+      weights[kGetLMScores] = 1.0;
+    }
+    types_ = std::discrete_distribution<int>(weights,
+                                             weights + kNumRequestTypes);
+    min_length_ = std::max(config.min_context_length(), 0);
+    max_length_ = std::max(config.max_context_length(), min_length_);
+    if (!config.context_corpus().empty()) {
+      std::string text;
+      ASSIGN_OR_RETURN(text, file::ReadBinaryFile(config.context_corpus()));
+      for (absl::string_view line : absl::StrSplit(text, '\n',
+                                                   absl::SkipEmpty())) {
+        if (!utf8::IsValidUTF8(line)) continue;
+        lines_.push_back(utf8::StrSplitByChar(line));
+      }
+      if (lines_.empty()) {
+        return absl::InvalidArgumentError("Empty context corpus");
+      }
+    }
+    return absl::OkStatus();
+  }
+
+  // Draws the type and the context of the next request. The contexts are the
+  // prefixes of the random lines of the corpus, as sent by the clients while
+  // typing, or random strings.
+  void Next(RequestType* type, std::string* context)
+      ABSL_LOCKS_EXCLUDED(mu_) {
+    absl::MutexLock lock(&mu_);
+    *type = static_cast<RequestType>(types_(gen_));
+    const int length = absl::Uniform<int>(absl::IntervalClosed, gen_,
+                                          min_length_, max_length_);
+    context->clear();
+    if (lines_.empty()) {
+      for (int i = 0; i < length; ++i) {
+        context->push_back(kContextLetters[absl::Uniform<int>(
+            gen_, 0, sizeof(kContextLetters) - 1)]);
+      }
+      return;
+    }
+    const std::vector<std::string>& line =
+        lines_[absl::Uniform<size_t>(gen_, 0, lines_.size())];
+    const int prefix_length = std::min<int>(length, line.size());
+    for (int i = 0; i < prefix_length; ++i) *context += line[i];
+  }
+
+ private:
+  absl::Mutex mu_;
+  absl::BitGen gen_ ABSL_GUARDED_BY(mu_);
+  std::discrete_distribution<int> types_ ABSL_GUARDED_BY(mu_);
+  int min_length_ = 0;
+  int max_length_ = 0;
+  std::vector<std::vector<std::string>> lines_;  // Characters of the lines.
+};
+
+// Single run of the load over the clients.
+class LoadRun {
+ public:
+  LoadRun(const LoadGeneratorConfig& config, double timeout_sec,
+          RequestGenerator* generator,
+          std::vector<std::unique_ptr<ClientAsyncImpl>>* clients)
+      : config_(config), timeout_sec_(timeout_sec), generator_(generator),
+        clients_(clients),
+        num_total_(config.num_warmup_requests() + config.num_requests()) {}
+
+  // Issues all the requests and waits for their responses.
+  LoadReport Run() ABSL_LOCKS_EXCLUDED(mu_) {
+    if (config_.requests_per_sec() > 0.0) {
+      // Open loop: the requests are issued at the random arrival times.
+      absl::BitGen gen;
+      absl::Time next_time = absl::Now();
+      for (int64 i = 0; i < num_total_; ++i) {
+        absl::SleepFor(next_time - absl::Now());
+        Issue();
+        next_time += absl::Seconds(absl::Exponential<double>(
+            gen, config_.requests_per_sec()));
+      }
+    } else {
+      // Closed loop: the completions issue the following requests.
+      const int64 concurrency = std::min<int64>(
+          std::max(config_.concurrency(), 1), num_total_);
+      {
+        absl::MutexLock lock(&mu_);
+        num_reserved_ = concurrency;
+      }
+      for (int64 i = 0; i < concurrency; ++i) Issue();
+    }
+    {
+      absl::MutexLock lock(&mu_);
+      mu_.Await(absl::Condition(this, &LoadRun::AllCompleted));
+    }
+    for (auto& client : *clients_) client->WaitForAsyncCalls();
+    absl::MutexLock lock(&mu_);
+    report_.elapsed = end_time_ - start_time_;
+    return std::move(report_);
+  }
+
+ private:
+  // Draws and issues the next request.
+  void Issue() ABSL_LOCKS_EXCLUDED(mu_) {
+    RequestType type;
+    std::string context;
+    generator_->Next(&type, &context);
+    int64 index;
+    {
+      absl::MutexLock lock(&mu_);
+      index = num_issued_++;
+      if (index == config_.num_warmup_requests()) start_time_ = absl::Now();
+    }
+    ClientAsyncImpl* client = (*clients_)[index % clients_->size()].get();
+    const absl::Time start_time = absl::Now();
+    const auto done = [this, type, index, start_time](bool ok) {
+      OnDone(type, index, start_time, ok);
+    };
+    switch (type) {
+      case kGetLMScores:
+        client->GetLMScoresAsync(
+            context, /*initial_state=*/0, config_.top_k(), timeout_sec_,
+            [done](absl::StatusOr<LMScores> scores) { done(scores.ok()); });
+        break;
+      case kGetNextState:
+        client->GetNextStateAsync(
+            context, /*initial_state=*/0, timeout_sec_,
+            [done](absl::StatusOr<int64> state) { done(state.ok()); });
+        break;
+      default:
+        client->UpdateLMScoresAsync(
+            context, /*initial_state=*/0, /*count=*/1, timeout_sec_,
+            [done](absl::StatusOr<LMScores> scores) { done(scores.ok()); });
+        break;
+    }
+  }
+
+  // Records the completion of the request and, in the closed loop, issues
+  // the next request. Runs on the polling thread of the client.
+  void OnDone(RequestType type, int64 index, absl::Time start_time, bool ok)
+      ABSL_LOCKS_EXCLUDED(mu_) {
+    const absl::Time end_time = absl::Now();
+    bool issue_next;
+    {
+      absl::MutexLock lock(&mu_);
+      if (index >= config_.num_warmup_requests()) {
+        if (ok) {
+          const absl::Duration latency = end_time - start_time;
+          report_.all.Add(latency);
+          switch (type) {
+            case kGetLMScores:
+              report_.get_lm_scores.Add(latency);
+              break;
+            case kGetNextState:
+              report_.get_next_state.Add(latency);
+              break;
+            default:
+              report_.update_lm_scores.Add(latency);
+              break;
+          }
+        } else {
+          ++report_.num_errors;
+        }
+        end_time_ = std::max(end_time_, end_time);
+      }
+      ++num_completed_;
+      // Reserves the next request, so that the concurrent completions do not
+      // issue more requests than configured.
+      issue_next = config_.requests_per_sec() <= 0.0 &&
+                   num_reserved_ < num_total_;
+      if (issue_next) ++num_reserved_;
+    }
+    if (issue_next) Issue();
+  }
+
+  // Whether all the requests have completed.
+  bool AllCompleted() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return num_completed_ == num_total_;
+  }
+
+  const LoadGeneratorConfig& config_;
+  const double timeout_sec_;
+  RequestGenerator* const generator_;  // Not owned.
+  std::vector<std::unique_ptr<ClientAsyncImpl>>* const clients_;  // Not owned.
+  const int64 num_total_;  // Requests including the warm-up.
+
+  absl::Mutex mu_;
+  int64 num_issued_ ABSL_GUARDED_BY(mu_) = 0;
+  int64 num_reserved_ ABSL_GUARDED_BY(mu_) = 0;  // Closed loop only.
+  int64 num_completed_ ABSL_GUARDED_BY(mu_) = 0;
+  absl::Time start_time_ ABSL_GUARDED_BY(mu_) = absl::InfinitePast();
+  absl::Time end_time_ ABSL_GUARDED_BY(mu_) = absl::InfinitePast();
+  LoadReport report_ ABSL_GUARDED_BY(mu_);
+};
+
+// Formats the duration in milliseconds.
+std::string FormatMsec(absl::Duration duration) {
+  return absl::StrFormat("%.3fms", absl::ToDoubleMilliseconds(duration));
+}
+
+// Formats the summary of the latencies of one of the request types.
+std::string FormatLatencies(const char* name,
+                            const LatencyHistogram& histogram) {
+  return absl::StrCat(
+      name, ": n=", histogram.count(), " mean=", FormatMsec(histogram.Mean()),
+      " p50=", FormatMsec(histogram.Percentile(0.5)),
+      " p99=", FormatMsec(histogram.Percentile(0.99)),
+      " p999=", FormatMsec(histogram.Percentile(0.999)));
+}
+
+}  // namespace
+
+double LoadReport::Throughput() const {
+  const double seconds = absl::ToDoubleSeconds(elapsed);
+  return seconds > 0.0 ? (all.count() + num_errors) / seconds : 0.0;
+}
+
+std::string LoadReport::ToString(bool with_histogram) const {
+  std::string result = absl::StrFormat(
+      "Requests: %d (%d errors) in %.3fs; throughput: %.1f requests/s\n",
+      all.count() + num_errors, num_errors, absl::ToDoubleSeconds(elapsed),
+      Throughput());
+  absl::StrAppend(&result, FormatLatencies("All", all), "\n");
+  if (get_lm_scores.count() > 0) {
+    absl::StrAppend(&result, FormatLatencies("GetLMScores", get_lm_scores),
+                    "\n");
+  }
+  if (get_next_state.count() > 0) {
+    absl::StrAppend(&result, FormatLatencies("GetNextState", get_next_state),
+                    "\n");
+  }
+  if (update_lm_scores.count() > 0) {
+    absl::StrAppend(&result,
+                    FormatLatencies("UpdateLMScores", update_lm_scores), "\n");
+  }
+  if (with_histogram) absl::StrAppend(&result, all.ToString(), "\n");
+  return result;
+}
+
+absl::StatusOr<LoadReport> RunLoad(const LoadGeneratorConfig& config) {
+  if (config.num_requests() <= 0) {
+    return absl::InvalidArgumentError("Number of requests must be positive");
+  }
+  if (config.num_warmup_requests() < 0) {
+    return absl::InvalidArgumentError(
+        "Number of warm-up requests must be non-negative");
+  }
+  RequestGenerator generator;
+  RETURN_IF_ERROR(generator.Init(config));
+  ClientConfig client_config = config.client();
+  InitConfigDefaults(&client_config);
+  std::vector<std::unique_ptr<ClientAsyncImpl>> clients;
+  const int num_channels = std::max(config.num_channels(), 1);
+  for (int i = 0; i < num_channels; ++i) {
+    std::shared_ptr<::grpc::Channel> channel;
+    ASSIGN_OR_RETURN(channel, MakeClientChannel(client_config));
+    clients.push_back(
+        absl::make_unique<ClientAsyncImpl>(MozoLMService::NewStub(channel)));
+  }
+  LoadRun run(config, client_config.timeout_sec(), &generator, &clients);
+  return run.Run();
+}
+
+}  // namespace grpc
+}  // namespace mozolm
@@ -0,0 +1,60 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Load generator measuring the throughput and the latency of the server.
+
+#ifndef MOZOLM_MOZOLM_GRPC_LOAD_GENERATOR_H_
+#define MOZOLM_MOZOLM_GRPC_LOAD_GENERATOR_H_
+
+#include <string>
+
+#include "mozolm/stubs/integral_types.h"
+#include "absl/status/statusor.h"
+#include "absl/time/time.h"
+#include "mozolm/grpc/load_generator_config.pb.h"
+#include "mozolm/utils/latency_histogram.h"
+
+namespace mozolm {
+namespace grpc {
+
+// Measurements of a run of the load generator.
+struct LoadReport {
+  // Time from the end of the warm-up to the last response.
+  absl::Duration elapsed;
+
+  // Number of measured requests that failed.
+  int64 num_errors = 0;
+
+  // Latencies of all the measured requests and for each of the request types.
+  LatencyHistogram all;
+  LatencyHistogram get_lm_scores;
+  LatencyHistogram get_next_state;
+  LatencyHistogram update_lm_scores;
+
+  // Number of measured requests completed per second.
+  double Throughput() const;
+
+  // Summary of the throughput and p50/p99/p999 latencies, followed by the
+  // histogram of all the latencies if requested.
+  std::string ToString(bool with_histogram = false) const;
+};
+
+// Runs the load described by the configuration against the server, returning
+// the measurements.
+absl::StatusOr<LoadReport> RunLoad(const LoadGeneratorConfig& config);
+
+}  // namespace grpc
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_GRPC_LOAD_GENERATOR_H_
@@ -0,0 +1,102 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Load generator measuring the throughput and the latency of a live gRPC
+// server.
+//
+// Example usage:
+// --------------
+// - Closed loop with 16 requests in flight, mostly GetLMScores requests for the
+//   prefixes of the test corpus:
+//   DATADIR=mozolm/data
+//   TESTFILE="${DATADIR}"/en_wiki_100line_dev_sample.txt
+//   bazel-bin/mozolm/grpc/load_generator \
+//     --config="client { server { address_uri:\"localhost:50051\" } } \
+//     get_lm_scores_weight:8 get_next_state_weight:1 \
+//     update_lm_scores_weight:1 concurrency:16 num_requests:100000 \
+//     num_warmup_requests:1000 context_corpus:\"${TESTFILE}\" \
+//     min_context_length:1 max_context_length:40"
+//
+// - Open loop at 2000 requests per second over 4 channels:
+//   bazel-bin/mozolm/grpc/load_generator \
+//     --config="client { server { address_uri:\"localhost:50051\" } } \
+//     requests_per_sec:2000 num_channels:4 num_requests:100000 \
+//     max_context_length:20" --histogram
+
+#include <iostream>
+#include <string>
+
+#include "mozolm/stubs/logging.h"
+#include "google/protobuf/text_format.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/status/status.h"
+#include "mozolm/grpc/load_generator.h"
+#include "mozolm/grpc/load_generator_config.pb.h"
+#include "mozolm/utils/file_util.h"
+#include "mozolm/stubs/status_macros.h"
+
+ABSL_FLAG(std::string, config, "",
+          "Contents of protocol buffer `mozolm.grpc.LoadGeneratorConfig` in "
+          "text format.");
+
+ABSL_FLAG(std::string, config_file, "",
+          "File containing the load generator configuration protocol buffer "
+          "in text format. This flag overrides --config.");
+
+ABSL_FLAG(bool, histogram, false,
+          "Also prints the histogram of all the latencies.");
+
+namespace mozolm {
+namespace grpc {
+namespace {
+
+// Initializes configuration from command-line flags.
+absl::Status InitConfigFromFlags(LoadGeneratorConfig *config) {
+  std::string config_contents = absl::GetFlag(FLAGS_config);
+  const std::string config_file = absl::GetFlag(FLAGS_config_file);
+  if (!config_file.empty()) {
+    ASSIGN_OR_RETURN(config_contents, file::ReadBinaryFile(config_file));
+  }
+  if (!google::protobuf::TextFormat::ParseFromString(config_contents, config)) {
+    return absl::InvalidArgumentError(
+        "Failed to parse load generator configuration from contents");
+  }
+  return absl::OkStatus();
+}
+
+// Runs the load and prints the report.
+absl::Status Run() {
+  LoadGeneratorConfig config;
+  RETURN_IF_ERROR(InitConfigFromFlags(&config));
+  const auto report = RunLoad(config);
+  if (!report.ok()) return report.status();
+  std::cout << report->ToString(absl::GetFlag(FLAGS_histogram));
+  return absl::OkStatus();
+}
+
+}  // namespace
+}  // namespace grpc
+}  // namespace mozolm
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+
+  const auto status = mozolm::grpc::Run();
+  if (!status.ok()) {
+    GOOGLE_LOG(ERROR) << "Failed to run load: " << status.ToString();
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,116 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/grpc/load_generator.h"
+
+#include <string>
+
+#include "google/protobuf/text_format.h"
+#include "gmock/gmock.h"
+#include "mozolm/stubs/status-matchers.h"
+#include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+#include "mozolm/grpc/client_helper.h"
+#include "mozolm/grpc/server_config.pb.h"
+#include "mozolm/grpc/server_helper.h"
+#include "mozolm/utils/file_util.h"
+
+namespace mozolm {
+namespace grpc {
+namespace {
+
+constexpr int kNumRequests = 50;
+
+class LoadGeneratorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Initialize and start the local server with the default bigram model.
+    ServerConfig server_config;
+    ASSERT_TRUE(google::protobuf::TextFormat::ParseFromString(R"(
+        address_uri: "localhost:0"
+        auth { credential_type:CREDENTIAL_INSECURE }
+        wait_for_clients: false)", &server_config));
+    ASSERT_OK(server_.Init(server_config));
+    ASSERT_OK(server_.Run(/* wait_till_terminated= */false));
+    const int server_port = server_.server().selected_port();
+    ASSERT_LT(0, server_port) << "Invalid port: " << server_port;
+
+    ClientConfig* client_config = config_.mutable_client();
+    *client_config->mutable_server() = server_config;
+    InitConfigDefaults(client_config);
+    client_config->mutable_server()->set_address_uri(
+        absl::StrCat("localhost:", server_port));
+    config_.set_get_lm_scores_weight(2.0);
+    config_.set_get_next_state_weight(1.0);
+    config_.set_update_lm_scores_weight(1.0);
+    config_.set_num_requests(kNumRequests);
+    config_.set_num_warmup_requests(5);
+    config_.set_num_channels(2);
+    config_.set_min_context_length(1);
+    config_.set_max_context_length(10);
+  }
+
+  // Checks that all the measured requests have succeeded.
+  void CheckReport(const LoadReport& report) {
+    EXPECT_EQ(0, report.num_errors);
+    EXPECT_EQ(kNumRequests, report.all.count());
+    EXPECT_EQ(kNumRequests, report.get_lm_scores.count() +
+                                report.get_next_state.count() +
+                                report.update_lm_scores.count());
+    EXPECT_LT(0.0, report.Throughput());
+    EXPECT_LE(report.all.Percentile(0.5), report.all.Percentile(0.99));
+    EXPECT_LE(report.all.Percentile(0.99), report.all.Percentile(0.999));
+    EXPECT_FALSE(report.ToString(/* with_histogram= */true).empty());
+  }
+
+  LoadGeneratorConfig config_;
+  ServerHelper server_;
+};
+
+TEST_F(LoadGeneratorTest, CheckClosedLoop) {
+  config_.set_concurrency(4);
+  const auto report = RunLoad(config_);
+  ASSERT_OK(report.status());
+  CheckReport(report.value());
+}
+
+TEST_F(LoadGeneratorTest, CheckOpenLoop) {
+  config_.set_requests_per_sec(500.0);
+  const auto report = RunLoad(config_);
+  ASSERT_OK(report.status());
+  CheckReport(report.value());
+}
+
+TEST_F(LoadGeneratorTest, CheckContextCorpus) {
+  const auto corpus_status = file::WriteTempTextFile(
+      "corpus.txt", "Hello world!\nHow are you?\n");
+  ASSERT_OK(corpus_status.status());
+  config_.set_context_corpus(corpus_status.value());
+  config_.set_concurrency(2);
+  const auto report = RunLoad(config_);
+  ASSERT_OK(report.status());
+  CheckReport(report.value());
+}
+
+TEST_F(LoadGeneratorTest, CheckBadConfig) {
+  config_.set_num_requests(0);
+  EXPECT_FALSE(RunLoad(config_).ok());
+  config_.set_num_requests(kNumRequests);
+  config_.set_get_next_state_weight(-1.0);
+  EXPECT_FALSE(RunLoad(config_).ok());
+}
+
+}  // namespace
+}  // namespace grpc
+}  // namespace mozolm
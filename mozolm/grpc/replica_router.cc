@@ -0,0 +1,103 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/grpc/replica_router.h"
+
+#include <algorithm>
+
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+
+namespace mozolm {
+namespace grpc {
+namespace {
+
+// FNV-1a parameters.
+constexpr uint64 kFnvOffsetBasis = 0xcbf29ce484222325ULL;
+constexpr uint64 kFnvPrime = 0x100000001b3ULL;
+
+// Spreads the bits of the FNV hash, whose high bits are poorly mixed for
+// short keys differing only in their last characters.
+uint64 Mix(uint64 hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+}  // namespace
+
+uint64 ReplicaRingHash(absl::string_view key) {
+  uint64 hash = kFnvOffsetBasis;
+  for (const char c : key) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * kFnvPrime;
+  }
+  return Mix(hash);
+}
+
+ReplicaRouter::ReplicaRouter(const std::vector<std::string>& replica_names,
+                             absl::Duration retry_interval)
+    : num_replicas_(replica_names.size()),
+      retry_interval_(retry_interval),
+      down_until_(replica_names.size(), absl::InfinitePast()) {
+  ring_.reserve(num_replicas_ * kNumReplicaPoints);
+  for (int replica = 0; replica < num_replicas_; ++replica) {
+    for (int point = 0; point < kNumReplicaPoints; ++point) {
+      ring_.emplace_back(
+          ReplicaRingHash(absl::StrCat(replica_names[replica], "#", point)),
+          replica);
+    }
+  }
+  std::sort(ring_.begin(), ring_.end());
+}
+
+int ReplicaRouter::Route(absl::string_view key) const {
+  if (ring_.empty()) return -1;
+  const uint64 hash = ReplicaRingHash(key);
+  const auto first = std::lower_bound(
+      ring_.begin(), ring_.end(), hash,
+      [](const std::pair<uint64, int>& point, uint64 hash) {
+        return point.first < hash;
+      });
+  const absl::Time now = absl::Now();
+  absl::MutexLock lock(&lock_);
+  const size_t start = first - ring_.begin();
+  for (size_t i = 0; i < ring_.size(); ++i) {
+    const int replica = ring_[(start + i) % ring_.size()].second;
+    if (down_until_[replica] <= now) return replica;
+  }
+  return -1;
+}
+
+void ReplicaRouter::MarkDown(int replica) {
+  const absl::Time now = absl::Now();
+  absl::MutexLock lock(&lock_);
+  down_until_[replica] = now + retry_interval_;
+}
+
+void ReplicaRouter::MarkUp(int replica) {
+  absl::MutexLock lock(&lock_);
+  down_until_[replica] = absl::InfinitePast();
+}
+
+bool ReplicaRouter::IsUp(int replica) const {
+  const absl::Time now = absl::Now();
+  absl::MutexLock lock(&lock_);
+  return down_until_[replica] <= now;
+}
+
+}  // namespace grpc
+}  // namespace mozolm
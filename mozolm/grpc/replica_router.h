@@ -0,0 +1,95 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Routing of the typing sessions over the replicas of the server.
+//
+// The model states are only meaningful on the replica which created them, so
+// that all the requests of a session go to the same replica, picked by
+// consistent hashing of the session key: each replica is placed at many points
+// of a ring of hashes, and a key is routed to the first replica found
+// clockwise from the hash of the key. Adding or removing a replica only moves
+// the keys next to its points, and the clients configured with the same
+// replicas route the keys identically, since the hashes do not depend on the
+// process. The keys of a replica which is down move to the next replicas of
+// the ring, and back once it is up again: a replica marked down is probed
+// again by the requests of its keys once the retry interval has elapsed.
+
+#ifndef MOZOLM_MOZOLM_GRPC_REPLICA_ROUTER_H_
+#define MOZOLM_MOZOLM_GRPC_REPLICA_ROUTER_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mozolm/stubs/integral_types.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace mozolm {
+namespace grpc {
+
+// Number of points of each replica on the ring, which evens out the shares
+// of the keys of the replicas.
+constexpr int kNumReplicaPoints = 100;
+
+// Default interval after which a replica marked down is tried again.
+constexpr int kDefaultReplicaRetrySec = 5;
+
+// Consistent-hash router of the keys over the replicas. Thread-safe.
+class ReplicaRouter {
+ public:
+  // Creates the router over the replicas identified by the given names, e.g.,
+  // their addresses, all of them initially up. The replicas marked down are
+  // considered up again after the retry interval.
+  explicit ReplicaRouter(
+      const std::vector<std::string>& replica_names,
+      absl::Duration retry_interval = absl::Seconds(kDefaultReplicaRetrySec));
+  ReplicaRouter() = delete;
+  ~ReplicaRouter() = default;
+
+  ReplicaRouter(const ReplicaRouter&) = delete;
+  ReplicaRouter& operator=(const ReplicaRouter&) = delete;
+
+  // Returns the index of the replica of the key among the replicas which are
+  // up, -1 if all of them are down.
+  int Route(absl::string_view key) const ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Marks the replica as down, e.g., once a request to it has failed, until
+  // the retry interval has elapsed, or as up again.
+  void MarkDown(int replica) ABSL_LOCKS_EXCLUDED(lock_);
+  void MarkUp(int replica) ABSL_LOCKS_EXCLUDED(lock_);
+  bool IsUp(int replica) const ABSL_LOCKS_EXCLUDED(lock_);
+
+  int num_replicas() const { return num_replicas_; }
+
+ private:
+  const int num_replicas_;
+  const absl::Duration retry_interval_;
+
+  // Points of the replicas sorted by hash, immutable.
+  std::vector<std::pair<uint64, int>> ring_;
+
+  // Time until which each replica is down, in the past if it is up.
+  mutable absl::Mutex lock_;
+  std::vector<absl::Time> down_until_ ABSL_GUARDED_BY(lock_);
+};
+
+// Stable 64-bit hash of the key, which is the same in all the processes.
+uint64 ReplicaRingHash(absl::string_view key);
+
+}  // namespace grpc
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_GRPC_REPLICA_ROUTER_H_
@@ -0,0 +1,116 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/grpc/replica_router.h"
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+namespace mozolm {
+namespace grpc {
+namespace {
+
+constexpr int kNumKeys = 10000;
+
+const std::vector<std::string> kReplicas = {
+    "replica0:50051", "replica1:50051", "replica2:50051", "replica3:50051"};
+
+std::vector<int> RouteKeys(const ReplicaRouter& router) {
+  std::vector<int> replicas;
+  for (int i = 0; i < kNumKeys; ++i) {
+    replicas.push_back(router.Route(absl::StrCat("user", i)));
+  }
+  return replicas;
+}
+
+TEST(ReplicaRouterTest, CheckSpreadOverReplicas) {
+  const ReplicaRouter router(kReplicas);
+  std::vector<int> num_keys(kReplicas.size());
+  for (const int replica : RouteKeys(router)) {
+    ASSERT_GE(replica, 0);
+    ASSERT_LT(replica, kReplicas.size());
+    ++num_keys[replica];
+  }
+  // Each replica gets its share of the keys, within a loose margin.
+  for (const int n : num_keys) {
+    EXPECT_GT(n, kNumKeys / kReplicas.size() / 2);
+  }
+
+  // Routing is deterministic, also for another router of the same replicas.
+  EXPECT_EQ(RouteKeys(router), RouteKeys(ReplicaRouter(kReplicas)));
+}
+
+TEST(ReplicaRouterTest, CheckAddingReplicaOnlyMovesItsKeys) {
+  const ReplicaRouter router(kReplicas);
+  std::vector<std::string> more_replicas = kReplicas;
+  more_replicas.push_back("replica4:50051");
+  const ReplicaRouter more_router(more_replicas);
+  const std::vector<int> before = RouteKeys(router);
+  const std::vector<int> after = RouteKeys(more_router);
+  int num_moved = 0;
+  for (int i = 0; i < kNumKeys; ++i) {
+    if (before[i] != after[i]) {
+      EXPECT_EQ(4, after[i]);
+      ++num_moved;
+    }
+  }
+  EXPECT_GT(num_moved, 0);
+  EXPECT_LT(num_moved, kNumKeys / 2);
+}
+
+TEST(ReplicaRouterTest, CheckFailover) {
+  ReplicaRouter router(kReplicas);
+  const std::vector<int> before = RouteKeys(router);
+  router.MarkDown(1);
+  EXPECT_FALSE(router.IsUp(1));
+  const std::vector<int> during = RouteKeys(router);
+  for (int i = 0; i < kNumKeys; ++i) {
+    EXPECT_NE(1, during[i]);
+    // Only the keys of the replica which is down move.
+    if (before[i] != 1) {
+      EXPECT_EQ(before[i], during[i]);
+    }
+  }
+  router.MarkUp(1);
+  EXPECT_EQ(before, RouteKeys(router));
+
+  for (int replica = 0; replica < kReplicas.size(); ++replica) {
+    router.MarkDown(replica);
+  }
+  EXPECT_EQ(-1, router.Route("user0"));
+  EXPECT_EQ(-1, ReplicaRouter(std::vector<std::string>()).Route("user0"));
+}
+
+TEST(ReplicaRouterTest, CheckRetriesAfterInterval) {
+  const absl::Duration retry_interval = absl::Milliseconds(100);
+  ReplicaRouter router(kReplicas, retry_interval);
+  const std::vector<int> before = RouteKeys(router);
+  router.MarkDown(1);
+  EXPECT_FALSE(router.IsUp(1));
+  EXPECT_NE(before, RouteKeys(router));
+
+  // The keys of the replica move back to it, which is probed again.
+  absl::SleepFor(2 * retry_interval);
+  EXPECT_TRUE(router.IsUp(1));
+  EXPECT_EQ(before, RouteKeys(router));
+}
+
+}  // namespace
+}  // namespace grpc
+}  // namespace mozolm
@@ -0,0 +1,104 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/grpc/request_scheduler.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "absl/time/clock.h"
+
+namespace mozolm {
+namespace grpc {
+
+RequestScheduler::RequestScheduler(ThreadPool* pool, int max_queued_requests)
+    : pool_(pool), max_queued_requests_(max_queued_requests) {}
+
+bool RequestScheduler::PickedLater(const PendingRequest& first,
+                                   const PendingRequest& second) {
+  if (first.deadline != second.deadline) {
+    return first.deadline > second.deadline;
+  }
+  return first.arrival > second.arrival;
+}
+
+void RequestScheduler::Schedule(absl::Time deadline, Priority priority,
+                                std::function<void()> handler,
+                                RejectCallback reject) {
+  if (absl::Now() >= deadline) {
+    ++num_expired_requests_;
+    reject(absl::DeadlineExceededError("Deadline passed before handling"));
+    return;
+  }
+  if (pool_ == nullptr) {
+    ++num_active_requests_;
+    handler();
+    --num_active_requests_;
+    return;
+  }
+  {
+    absl::MutexLock lock(&queue_lock_);
+    const int num_queued = read_queue_.size() + update_queue_.size();
+    if (max_queued_requests_ <= 0 || num_queued < max_queued_requests_) {
+      std::vector<PendingRequest>* queue =
+          priority == Priority::kRead ? &read_queue_ : &update_queue_;
+      queue->push_back({deadline, num_arrivals_++, std::move(handler),
+                        std::move(reject)});
+      std::push_heap(queue->begin(), queue->end(), &PickedLater);
+      reject = nullptr;
+    }
+  }
+  if (reject != nullptr) {
+    // The request has not been queued.
+    ++num_rejected_requests_;
+    reject(absl::ResourceExhaustedError("Too many queued requests"));
+    return;
+  }
+  pool_->Schedule([this]() { RunNext(); });
+}
+
+int RequestScheduler::num_queued_requests() const {
+  absl::MutexLock lock(&queue_lock_);
+  return read_queue_.size() + update_queue_.size();
+}
+
+void RequestScheduler::RunNext() {
+  PendingRequest request;
+  {
+    absl::MutexLock lock(&queue_lock_);
+    std::vector<PendingRequest>* queue =
+        !read_queue_.empty() ? &read_queue_ : &update_queue_;
+    if (queue->empty()) return;  // Not expected: one call per request.
+    std::pop_heap(queue->begin(), queue->end(), &PickedLater);
+    request = std::move(queue->back());
+    queue->pop_back();
+  }
+  HandleOrExpire(request.deadline, request.handler, request.reject);
+}
+
+void RequestScheduler::HandleOrExpire(absl::Time deadline,
+                                      const std::function<void()>& handler,
+                                      const RejectCallback& reject) {
+  if (absl::Now() >= deadline) {
+    ++num_expired_requests_;
+    reject(absl::DeadlineExceededError("Deadline passed while queued"));
+    return;
+  }
+  ++num_active_requests_;
+  handler();
+  --num_active_requests_;
+}
+
+}  // namespace grpc
+}  // namespace mozolm
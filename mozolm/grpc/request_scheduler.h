@@ -0,0 +1,129 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Deadline-aware scheduling of the server request handlers.
+
+#ifndef MOZOLM_MOZOLM_GRPC_REQUEST_SCHEDULER_H_
+#define MOZOLM_MOZOLM_GRPC_REQUEST_SCHEDULER_H_
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+#include "mozolm/stubs/integral_types.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "mozolm/stubs/thread_pool.h"
+
+namespace mozolm {
+namespace grpc {
+
+// Runs the request handlers of the server on a thread pool. The requests
+// waiting for a pool thread are kept by the scheduler rather than by the
+// pool, so that the next request is picked when a thread becomes free: the
+// reads are picked before the count updates and, within each of these, the
+// request with the earliest deadline first, the requests without a deadline
+// being picked in order of arrival.
+//
+// The requests are shed rather than handled once their callers have given
+// up: the requests whose deadline has passed on arrival or by the time they
+// are picked fail with DEADLINE_EXCEEDED, and the requests arriving while
+// the queue is full fail with RESOURCE_EXHAUSTED.
+//
+// Thread-safe.
+class RequestScheduler {
+ public:
+  // Class of a request, the reads being picked first.
+  enum class Priority { kRead, kUpdate };
+
+  // Fails the request with the given status, without handling it.
+  using RejectCallback = std::function<void(const absl::Status& status)>;
+
+  // Creates the scheduler using the given pool, which must outlive the
+  // scheduler. If the pool is null, the requests are handled inline, only
+  // failing the requests which have already expired on arrival. At most
+  // max_queued_requests requests wait for a pool thread, without a limit if
+  // not positive.
+  RequestScheduler(ThreadPool* pool, int max_queued_requests);
+  ~RequestScheduler() = default;
+
+  RequestScheduler(const RequestScheduler&) = delete;
+  RequestScheduler& operator=(const RequestScheduler&) = delete;
+
+  // Handles the request before its deadline, which is absl::InfiniteFuture()
+  // if none, or rejects it. Exactly one of the handler and the reject
+  // callback is invoked, possibly inline.
+  void Schedule(absl::Time deadline, Priority priority,
+                std::function<void()> handler, RejectCallback reject)
+      ABSL_LOCKS_EXCLUDED(queue_lock_);
+
+  // Number of requests waiting for a pool thread.
+  int num_queued_requests() const ABSL_LOCKS_EXCLUDED(queue_lock_);
+
+  // Number of requests being handled.
+  int num_active_requests() const {
+    return num_active_requests_.load(std::memory_order_relaxed);
+  }
+
+  // Number of requests failed because of their deadline, and because the
+  // queue was full.
+  int64 num_expired_requests() const {
+    return num_expired_requests_.load(std::memory_order_relaxed);
+  }
+  int64 num_rejected_requests() const {
+    return num_rejected_requests_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  // Request waiting for a pool thread.
+  struct PendingRequest {
+    absl::Time deadline;
+    int64 arrival;  // Order of arrival, breaking the ties between deadlines.
+    std::function<void()> handler;
+    RejectCallback reject;
+  };
+
+  // Heap order of the queues: whether the first request is picked after the
+  // second one.
+  static bool PickedLater(const PendingRequest& first,
+                          const PendingRequest& second);
+
+  // Picks one of the queued requests and either handles it or, if it has
+  // expired while queued, rejects it. Each scheduled request is matched by
+  // one call on a pool thread.
+  void RunNext() ABSL_LOCKS_EXCLUDED(queue_lock_);
+
+  // Handles the request, unless its deadline has passed.
+  void HandleOrExpire(absl::Time deadline, const std::function<void()>& handler,
+                      const RejectCallback& reject);
+
+  ThreadPool* const pool_;
+  const int max_queued_requests_;
+
+  // Guards the heaps of the requests waiting for a pool thread.
+  mutable absl::Mutex queue_lock_;
+  std::vector<PendingRequest> read_queue_ ABSL_GUARDED_BY(queue_lock_);
+  std::vector<PendingRequest> update_queue_ ABSL_GUARDED_BY(queue_lock_);
+  int64 num_arrivals_ ABSL_GUARDED_BY(queue_lock_) = 0;
+
+  std::atomic<int> num_active_requests_{0};
+  std::atomic<int64> num_expired_requests_{0};
+  std::atomic<int64> num_rejected_requests_{0};
+};
+
+}  // namespace grpc
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_GRPC_REQUEST_SCHEDULER_H_
@@ -0,0 +1,149 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/grpc/request_scheduler.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "mozolm/stubs/thread_pool.h"
+
+namespace mozolm {
+namespace grpc {
+namespace {
+
+using Priority = RequestScheduler::Priority;
+
+class RequestSchedulerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    pool_ = absl::make_unique<ThreadPool>(/* num_threads= */1);
+    pool_->StartWorkers();
+  }
+
+  // Occupies the single pool thread until Release() is called.
+  void Block(RequestScheduler* scheduler) {
+    absl::Notification started;
+    scheduler->Schedule(
+        absl::InfiniteFuture(), Priority::kRead,
+        [this, &started]() {
+          started.Notify();
+          release_.WaitForNotification();
+        },
+        [](const absl::Status& status) { FAIL() << status; });
+    started.WaitForNotification();
+  }
+
+  // Lets the blocked pool thread go, then waits for all the requests to be
+  // handled or rejected.
+  void ReleaseAndWait() {
+    release_.Notify();
+    pool_.reset();
+  }
+
+  // Schedules a request which records its name when handled, or its name and
+  // the status code when rejected.
+  void Schedule(RequestScheduler* scheduler, const std::string& name,
+                absl::Time deadline, Priority priority) {
+    scheduler->Schedule(
+        deadline, priority,
+        [this, name]() {
+          absl::MutexLock lock(&events_lock_);
+          events_.push_back(name);
+        },
+        [this, name](const absl::Status& status) {
+          absl::MutexLock lock(&events_lock_);
+          events_.push_back(
+              absl::StrCat(name, ":", absl::StatusCodeToString(status.code())));
+        });
+  }
+
+  std::vector<std::string> events() {
+    absl::MutexLock lock(&events_lock_);
+    return events_;
+  }
+
+  std::unique_ptr<ThreadPool> pool_;
+  absl::Notification release_;
+  absl::Mutex events_lock_;
+  std::vector<std::string> events_ ABSL_GUARDED_BY(events_lock_);
+};
+
+TEST_F(RequestSchedulerTest, CheckInlineHandling) {
+  RequestScheduler scheduler(/* pool= */nullptr, /* max_queued_requests= */1);
+  Schedule(&scheduler, "a", absl::InfiniteFuture(), Priority::kRead);
+  Schedule(&scheduler, "b", absl::Now() + absl::Hours(1), Priority::kUpdate);
+  Schedule(&scheduler, "c", absl::Now() - absl::Seconds(1), Priority::kRead);
+  EXPECT_THAT(events(),
+              ::testing::ElementsAre("a", "b", "c:DEADLINE_EXCEEDED"));
+  EXPECT_EQ(1, scheduler.num_expired_requests());
+  EXPECT_EQ(0, scheduler.num_rejected_requests());
+}
+
+TEST_F(RequestSchedulerTest, CheckReadsFirstThenEarliestDeadline) {
+  RequestScheduler scheduler(pool_.get(), /* max_queued_requests= */0);
+  Block(&scheduler);
+  const absl::Time now = absl::Now();
+  Schedule(&scheduler, "update", absl::InfiniteFuture(), Priority::kUpdate);
+  Schedule(&scheduler, "late", now + absl::Hours(2), Priority::kRead);
+  Schedule(&scheduler, "none1", absl::InfiniteFuture(), Priority::kRead);
+  Schedule(&scheduler, "early", now + absl::Hours(1), Priority::kRead);
+  Schedule(&scheduler, "none2", absl::InfiniteFuture(), Priority::kRead);
+  EXPECT_EQ(5, scheduler.num_queued_requests());
+  EXPECT_EQ(1, scheduler.num_active_requests());
+  ReleaseAndWait();
+  EXPECT_THAT(events(), ::testing::ElementsAre("early", "late", "none1",
+                                               "none2", "update"));
+  EXPECT_EQ(0, scheduler.num_queued_requests());
+  EXPECT_EQ(0, scheduler.num_active_requests());
+}
+
+TEST_F(RequestSchedulerTest, CheckQueueLimit) {
+  RequestScheduler scheduler(pool_.get(), /* max_queued_requests= */2);
+  Block(&scheduler);
+  Schedule(&scheduler, "a", absl::InfiniteFuture(), Priority::kRead);
+  Schedule(&scheduler, "b", absl::InfiniteFuture(), Priority::kUpdate);
+  Schedule(&scheduler, "c", absl::InfiniteFuture(), Priority::kRead);
+  EXPECT_EQ(2, scheduler.num_queued_requests());
+  ReleaseAndWait();
+  EXPECT_THAT(events(),
+              ::testing::ElementsAre("c:RESOURCE_EXHAUSTED", "a", "b"));
+  EXPECT_EQ(1, scheduler.num_rejected_requests());
+}
+
+TEST_F(RequestSchedulerTest, CheckExpiresWhileQueued) {
+  RequestScheduler scheduler(pool_.get(), /* max_queued_requests= */0);
+  Block(&scheduler);
+  Schedule(&scheduler, "a", absl::Now() + absl::Milliseconds(10),
+           Priority::kRead);
+  Schedule(&scheduler, "b", absl::InfiniteFuture(), Priority::kRead);
+  absl::SleepFor(absl::Milliseconds(20));
+  ReleaseAndWait();
+  EXPECT_THAT(events(), ::testing::ElementsAre("a:DEADLINE_EXCEEDED", "b"));
+  EXPECT_EQ(1, scheduler.num_expired_requests());
+}
+
+}  // namespace
+}  // namespace grpc
+}  // namespace mozolm
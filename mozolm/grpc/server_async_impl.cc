@@ -14,14 +14,25 @@
 
 #include "mozolm/grpc/server_async_impl.h"
 
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <numeric>
+#include <string>
 #include <utility>
 #include <vector>
 
 #include "mozolm/stubs/logging.h"
 #include "include/grpcpp/server_builder.h"
-#include "absl/functional/bind_front.h"
 #include "absl/memory/memory.h"
 #include "absl/strings/match.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "google/protobuf/arena.h"
+#include "mozolm/grpc/channel_util.h"
+#include "mozolm/models/model_factory.h"
+#include "mozolm/utils/tracing.h"
 
 namespace mozolm {
 namespace grpc {
@@ -29,17 +40,96 @@ namespace grpc {
 using ::grpc::Status;
 using ::grpc::ServerContext;
 
+namespace {
+
+// Size of the initial arena block of each unary call, which holds the request
+// and the response messages of the typical calls.
+constexpr int kArenaBlockSize = 16 << 10;
+
+// Maximum number of completed calls kept for reuse by each unary method,
+// beyond which the calls finishing at the peaks of concurrency are freed.
+constexpr int kMaxFreeCallsPerMethod = 64;
+
+// Fetches the options for the returned scores from any of the requests.
+template <class Request>
+models::LMScoresOptions ScoresOptionsFromRequest(const Request& request) {
+  models::LMScoresOptions options;
+  options.format = request.format();
+  options.top_k = request.top_k();
+  options.min_probability = request.min_probability();
+  options.user = request.user_id();
+  return options;
+}
+
+// Returns the deadline of the call, absl::InfiniteFuture() if none.
+absl::Time DeadlineFromContext(const ServerContext& ctx) {
+  const auto deadline = ctx.deadline();
+  if (deadline == std::chrono::system_clock::time_point::max()) {
+    return absl::InfiniteFuture();
+  }
+  return absl::FromChrono(deadline);
+}
+
+// Returns the value of the traceparent metadata of the call, empty if none.
+absl::string_view TraceParentFromContext(const ServerContext& ctx) {
+  const auto& metadata = ctx.client_metadata();
+  const auto pos = metadata.find(kTraceParentKey);
+  if (pos == metadata.end()) return absl::string_view();
+  return absl::string_view(pos->second.data(), pos->second.size());
+}
+
+// Returns the priority of the request: the count updates, which the caller
+// is usually not waiting for, are picked after the reads.
+template <class Request>
+RequestScheduler::Priority RequestPriority(const Request& request) {
+  return RequestScheduler::Priority::kRead;
+}
+
+RequestScheduler::Priority RequestPriority(
+    const UpdateLMScoresRequest& request) {
+  return RequestScheduler::Priority::kUpdate;
+}
+
+RequestScheduler::Priority RequestPriority(const BulkUpdateRequest& request) {
+  return RequestScheduler::Priority::kUpdate;
+}
+
+RequestScheduler::Priority RequestPriority(
+    const ReloadModelsRequest& request) {
+  return RequestScheduler::Priority::kUpdate;
+}
+
+// Summarizes the histogram into the latency statistics.
+void FillLatencyStats(const LatencyHistogram& histogram,
+                      LatencyStats* stats) {
+  stats->set_count(histogram.count());
+  stats->set_mean_msec(absl::ToDoubleMilliseconds(histogram.Mean()));
+  stats->set_p50_msec(absl::ToDoubleMilliseconds(histogram.Percentile(0.5)));
+  stats->set_p99_msec(absl::ToDoubleMilliseconds(histogram.Percentile(0.99)));
+  stats->set_p999_msec(
+      absl::ToDoubleMilliseconds(histogram.Percentile(0.999)));
+}
+
+}  // namespace
+
 ServerAsyncImpl::ServerAsyncImpl(
-    std::unique_ptr<models::LanguageModelHub> model_hub) {
-  model_hub_ = std::move(model_hub);
+    std::unique_ptr<models::LanguageModelHub> model_hub)
+    : model_hub_(std::move(model_hub)) {}
+
+ServerAsyncImpl::~ServerAsyncImpl() {
+  StopModelWatch();
+  StopMemoryBudget();
+  background_pool_.reset();  // Runs the queued count updates.
+  StopSnapshots();
 }
 
 Status ServerAsyncImpl::HandleRequest(ServerContext* context,
                                       const GetContextRequest* request,
                                       LMScores* response) {
-  if (!model_hub_->ExtractLMScores(
-          model_hub_->ContextState(request->context(), request->state()),
-          response)) {
+  const auto model_hub = GetModelHub();
+  if (!model_hub->ExtractLMScores(
+          model_hub->ContextState(request->context(), request->state()),
+          ScoresOptionsFromRequest(*request), response)) {
     // Only fails if given state is invalid.
     return Status(::grpc::StatusCode::INVALID_ARGUMENT, "invalid state");
   }
@@ -49,8 +139,12 @@ Status ServerAsyncImpl::HandleRequest(ServerContext* context,
 Status ServerAsyncImpl::HandleRequest(ServerContext* context,
                                       const GetContextRequest* request,
                                       NextState* response) {
-  const int64 state = model_hub_->ContextState(request->context(),
-                                               request->state());
+  const int64 state = GetModelHub()->ContextState(request->context(),
+                                                  request->state());
+  if (state < 0) {
+    // The initial state is invalid or has been recycled by the hub.
+    return Status(::grpc::StatusCode::INVALID_ARGUMENT, "invalid state");
+  }
   response->set_next_state(state);
   return Status::OK;
 }
@@ -61,18 +155,406 @@ Status ServerAsyncImpl::HandleRequest(
   return ManageUpdateLMScores(request, response);
 }
 
+Status ServerAsyncImpl::HandleRequest(ServerContext* context,
+                                      const GetContextBatchRequest* request,
+                                      LMScoresBatch* response) {
+  const int num_requests = request->requests_size();
+  std::vector<LMScores*> scores(num_requests);
+  response->mutable_scores()->Reserve(num_requests);
+  for (int i = 0; i < num_requests; ++i) {
+    scores[i] = response->add_scores();
+  }
+  std::vector<Status> statuses(num_requests);
+  RunBatch(num_requests, [this, context, request, &scores, &statuses](int i) {
+    statuses[i] = HandleRequest(context, &request->requests(i), scores[i]);
+  });
+  for (const Status& status : statuses) {
+    if (!status.ok()) return status;
+  }
+  return Status::OK;
+}
+
+Status ServerAsyncImpl::HandleRequest(ServerContext* context,
+                                      const GetContextBatchRequest* request,
+                                      NextStateBatch* response) {
+  const int num_requests = request->requests_size();
+  std::vector<int64> next_states(num_requests);
+  const auto model_hub = GetModelHub();
+  RunBatch(num_requests, [&model_hub, request, &next_states](int i) {
+    const GetContextRequest& state_request = request->requests(i);
+    next_states[i] = model_hub->ContextState(state_request.context(),
+                                             state_request.state());
+  });
+  response->mutable_next_states()->Reserve(num_requests);
+  for (const int64 next_state : next_states) {
+    if (next_state < 0) {
+      return Status(::grpc::StatusCode::INVALID_ARGUMENT, "invalid state");
+    }
+    response->add_next_states(next_state);
+  }
+  return Status::OK;
+}
+
+Status ServerAsyncImpl::HandleRequest(ServerContext* context,
+                                      const GetVocabularyRequest* request,
+                                      Vocabulary* response) {
+  GetModelHub()->GetVocabulary(response);
+  return Status::OK;
+}
+
+Status ServerAsyncImpl::HandleRequest(ServerContext* context,
+                                      const BulkUpdateRequest* request,
+                                      BulkUpdateResponse* response) {
+  if (request->count() <= 0) {
+    return Status(::grpc::StatusCode::INVALID_ARGUMENT,
+                  "count must be positive");
+  }
+  if (request->background() && background_pool_ != nullptr) {
+    // The request is freed once responded to, hence the text is copied. The
+    // hub is the one serving when the update runs, which may follow a reload.
+    background_pool_->Schedule(
+        [this, text = request->text(), count = request->count()]() {
+          absl::ReaderMutexLock counts_lock(&counts_lock_);
+          const auto num_strings =
+              GetModelHub()->BulkUpdateLMCounts(text, count);
+          if (!num_strings.ok()) {
+            GOOGLE_LOG(ERROR) << "Background count update failed: "
+                              << num_strings.status().ToString();
+          }
+        });
+    return Status::OK;
+  }
+  absl::ReaderMutexLock counts_lock(&counts_lock_);
+  const auto num_strings =
+      GetModelHub()->BulkUpdateLMCounts(request->text(), request->count());
+  if (!num_strings.ok()) {
+    return Status(::grpc::StatusCode::INVALID_ARGUMENT,
+                  std::string(num_strings.status().message()));
+  }
+  response->set_num_strings(num_strings.value());
+  return Status::OK;
+}
+
+Status ServerAsyncImpl::HandleRequest(ServerContext* context,
+                                      const ScoreStringsRequest* request,
+                                      ScoreStringsResponse* response) {
+  const int num_texts = request->texts_size();
+  std::vector<absl::StatusOr<std::vector<double>>> costs(num_texts);
+  const auto model_hub = GetModelHub();
+  RunBatch(num_texts, [&model_hub, request, &costs](int i) {
+    costs[i] = model_hub->ScoreString(request->state(), request->texts(i),
+                                      request->score_end_of_string(),
+                                      request->return_bits());
+  });
+  response->mutable_scores()->Reserve(num_texts);
+  for (const auto& text_costs : costs) {
+    if (!text_costs.ok()) {
+      return Status(::grpc::StatusCode::INVALID_ARGUMENT,
+                    std::string(text_costs.status().message()));
+    }
+    StringScore* score = response->add_scores();
+    score->mutable_costs()->Add(text_costs->begin(), text_costs->end());
+    score->set_total_cost(
+        std::accumulate(text_costs->begin(), text_costs->end(), 0.0));
+  }
+  return Status::OK;
+}
+
+Status ServerAsyncImpl::HandleRequest(ServerContext* context,
+                                      const CompletionRequest* request,
+                                      CompletionResponse* response) {
+  models::CompletionOptions options;
+  options.num_completions = request->beam_width();
+  options.max_length = request->max_length();
+  options.stop_symbols.assign(request->stop_symbols().begin(),
+                              request->stop_symbols().end());
+  options.sample = request->sample();
+  const auto completions = GetModelHub()->CompleteContext(
+      request->state(), request->context(), options);
+  if (!completions.ok()) {
+    const auto code = absl::IsInvalidArgument(completions.status())
+                          ? ::grpc::StatusCode::INVALID_ARGUMENT
+                          : ::grpc::StatusCode::INTERNAL;
+    return Status(code, std::string(completions.status().message()));
+  }
+  response->mutable_completions()->Reserve(completions->size());
+  for (const models::ContextCompletion& completion : *completions) {
+    Completion* result = response->add_completions();
+    result->set_text(completion.text);
+    result->set_cost(completion.cost);
+    result->set_finished(completion.finished);
+  }
+  return Status::OK;
+}
+
+Status ServerAsyncImpl::HandleRequest(ServerContext* context,
+                                      const GetStatsRequest* request,
+                                      ServerStats* response) {
+  {
+    absl::ReaderMutexLock lock(&metrics_lock_);
+    std::vector<std::string> rpc_names;
+    rpc_names.reserve(rpc_metrics_.size());
+    for (const auto& name_and_metrics : rpc_metrics_) {
+      rpc_names.push_back(name_and_metrics.first);
+    }
+    std::sort(rpc_names.begin(), rpc_names.end());
+    for (const std::string& rpc_name : rpc_names) {
+      const RpcMetrics& metrics = *rpc_metrics_.at(rpc_name);
+      RpcStats* rpc_stats = response->add_rpcs();
+      rpc_stats->set_method(rpc_name);
+      FillLatencyStats(metrics.latency, rpc_stats->mutable_latency());
+      rpc_stats->set_num_errors(metrics.num_errors.load());
+    }
+  }
+  if (scheduler_ != nullptr) {
+    response->set_num_queued_requests(scheduler_->num_queued_requests());
+    response->set_num_active_requests(scheduler_->num_active_requests());
+    response->set_num_expired_requests(scheduler_->num_expired_requests());
+    response->set_num_rejected_requests(scheduler_->num_rejected_requests());
+  }
+
+  models::HubStats hub_stats;
+  GetModelHub()->GetStats(&hub_stats);
+  HubStats* hub = response->mutable_hub();
+  hub->set_num_states(hub_stats.num_states);
+  hub->set_max_states(hub_stats.max_states);
+  hub->set_num_allocated_states(hub_stats.num_allocated_states);
+  hub->set_num_overwritten_states(hub_stats.num_overwritten_states);
+  hub->set_context_cache_hits(hub_stats.context_cache_hits);
+  hub->set_context_cache_prefix_hits(hub_stats.context_cache_prefix_hits);
+  hub->set_context_cache_misses(hub_stats.context_cache_misses);
+  hub->set_num_users(hub_stats.num_users);
+  hub->set_hub_states_bytes(hub_stats.memory.hub_states_bytes);
+  hub->set_user_bytes(hub_stats.memory.user_bytes);
+  for (int idx = 0; idx < hub_stats.models.size(); ++idx) {
+    const models::HubStats::Model& model_stats = hub_stats.models[idx];
+    ModelStats* model = response->add_models();
+    FillLatencyStats(model_stats.next_state, model->mutable_next_state());
+    FillLatencyStats(model_stats.extract_scores,
+                     model->mutable_extract_scores());
+    model->set_has_cache(model_stats.has_cache);
+    model->set_cache_hits(model_stats.cache.hits);
+    model->set_cache_misses(model_stats.cache.misses);
+    model->set_cache_evictions(model_stats.cache.evictions);
+    if (idx < hub_stats.memory.models.size()) {
+      const models::ModelMemoryUsage& memory = hub_stats.memory.models[idx];
+      model->set_model_bytes(memory.model_bytes);
+      model->set_cache_bytes(memory.cache_bytes);
+    }
+  }
+  response->set_num_model_reloads(num_model_reloads_.load());
+  return Status::OK;
+}
+
+Status ServerAsyncImpl::HandleRequest(ServerContext* context,
+                                      const ReloadModelsRequest* request,
+                                      ReloadModelsResponse* response) {
+  ModelHubConfig config;
+  if (request->has_model_hub_config()) {
+    config = request->model_hub_config();
+  } else {
+    absl::MutexLock lock(&reload_lock_);
+    config = model_hub_config_;
+  }
+  const absl::Time start_time = absl::Now();
+  const absl::Status status = ReloadModelHub(config);
+  if (!status.ok()) {
+    return Status(::grpc::StatusCode::INTERNAL,
+                  std::string(status.message()));
+  }
+  response->set_num_models(std::max(config.model_config_size(), 1));
+  response->set_load_msec(
+      absl::ToDoubleMilliseconds(absl::Now() - start_time));
+  return Status::OK;
+}
+
+void ServerAsyncImpl::set_model_hub_config(const ModelHubConfig& config) {
+  absl::MutexLock lock(&reload_lock_);
+  model_hub_config_ = config;
+  model_fingerprints_ = models::ModelStorageFingerprints(config);
+}
+
+absl::Status ServerAsyncImpl::ReloadModelHub(const ModelHubConfig& config) {
+  absl::MutexLock lock(&reload_lock_);
+  GOOGLE_LOG(INFO) << "Reloading the models ...";
+  // Taken before reading the models, so that the files changed in the
+  // meantime are reloaded again by the watch.
+  const std::vector<uint64> model_fingerprints =
+      models::ModelStorageFingerprints(config);
+  // The counts are only restored once the current hub has written its final
+  // snapshot, which includes the updates received while reading the models.
+  ModelHubConfig models_config = config;
+  models_config.clear_snapshot_file();
+  auto hub_status = models::MakeModelHub(models_config);
+  if (!hub_status.ok()) return hub_status.status();
+  std::unique_ptr<models::LanguageModelHub> new_hub =
+      std::move(hub_status.value());
+  {
+    // Holds the count updates back until the new hub serves, so that none is
+    // applied to the current hub after its final snapshot.
+    absl::MutexLock counts_lock(&counts_lock_);
+    const std::shared_ptr<models::LanguageModelHub> current_hub =
+        GetModelHub();
+    if (!config.snapshot_file().empty()) {
+      const auto num_updates = current_hub->WriteSnapshot();
+      if (!num_updates.ok() &&
+          !absl::IsFailedPrecondition(num_updates.status())) {
+        return num_updates.status();
+      }
+      // The snapshot is not replayed if the models have changed.
+      const absl::Status status = new_hub->RestoreSnapshot(
+          config.snapshot_file(), model_fingerprints);
+      if (!status.ok()) return status;
+    }
+    new_hub->ReplaceHub(*current_hub);
+    absl::WriterMutexLock hub_lock(&model_hub_lock_);
+    model_hub_ = std::move(new_hub);
+  }
+  // The previous hub is freed once the last request using it completes.
+  model_hub_config_ = config;
+  model_fingerprints_ = model_fingerprints;
+  ++num_model_reloads_;
+  GOOGLE_LOG(INFO) << "Switched to the reloaded models";
+  return absl::OkStatus();
+}
+
+std::shared_ptr<models::LanguageModelHub> ServerAsyncImpl::GetModelHub()
+    const {
+  absl::ReaderMutexLock lock(&model_hub_lock_);
+  return model_hub_;
+}
+
+// State of a unary call, reused by the successive calls of its method. The
+// request and response messages are allocated on the arena of the call, whose
+// initial block is kept between the calls, so that the typical calls of a
+// busy server do not allocate their messages from the heap. The context and
+// the responder cannot be reused by another call, and are recreated in place.
+template <class Request, class Response>
+struct ServerAsyncImpl::UnaryCall : public CompletionTag {
+  // Step run once the operation in flight completes.
+  enum class Step { kProcess, kCleanup };
+
+  explicit UnaryCall(UnaryMethod<Request, Response>* method)
+      : method(method), arena(MakeArenaOptions(arena_block)) {}
+
+  // Prepares the call for the next request of its method.
+  void Start() {
+    step = Step::kProcess;
+    ctx.emplace();
+    responder.emplace(&*ctx);
+    request = google::protobuf::Arena::CreateMessage<Request>(&arena);
+    response = google::protobuf::Arena::CreateMessage<Response>(&arena);
+  }
+
+  // Finishes the call with the response, once it has been filled in.
+  void Finish(const Status& status) {
+    step = Step::kCleanup;
+    responder->Finish(*response, status, this);
+  }
+
+  // Releases the resources of the finished call, other than the initial block
+  // of the arena.
+  void Reset() {
+    request = nullptr;
+    response = nullptr;
+    responder.reset();
+    ctx.reset();
+    arena.Reset();
+  }
+
+  void Proceed(bool ok) override {
+    if (step == Step::kProcess) {
+      method->server()->ProcessUnary(this, ok);
+    } else {
+      method->server()->CleanupAfterUnary(this);
+    }
+  }
+
+  static google::protobuf::ArenaOptions MakeArenaOptions(char* initial_block) {
+    google::protobuf::ArenaOptions options;
+    options.initial_block = initial_block;
+    options.initial_block_size = kArenaBlockSize;
+    return options;
+  }
+
+  UnaryMethod<Request, Response>* const method;
+  Step step = Step::kProcess;
+  absl::optional<ServerContext> ctx;
+  absl::optional<::grpc::ServerAsyncResponseWriter<Response>> responder;
+  absl::Time start_time;  // When the request was received.
+
+  // Declared before the arena, which allocates from it.
+  alignas(8) char arena_block[kArenaBlockSize];
+  google::protobuf::Arena arena;
+  Request* request = nullptr;    // Allocated on the arena.
+  Response* response = nullptr;  // Allocated on the arena.
+};
+
+template <class Request, class Response>
+class ServerAsyncImpl::UnaryMethod : public UnaryMethodBase {
+ public:
+  UnaryMethod(ServerAsyncImpl* server,
+              RequestMethod<Request, Response> request_method,
+              const char* rpc_name, RpcMetrics* metrics)
+      : server_(server), request_method_(request_method),
+        rpc_name_(rpc_name), metrics_(metrics) {}
+
+  // Returns a call prepared for the next request, reusing one of the
+  // completed calls if any. The call is owned by the caller until released.
+  UnaryCall<Request, Response>* AcquireCall() ABSL_LOCKS_EXCLUDED(lock_) {
+    std::unique_ptr<UnaryCall<Request, Response>> call;
+    {
+      absl::MutexLock lock(&lock_);
+      if (!free_calls_.empty()) {
+        call = std::move(free_calls_.back());
+        free_calls_.pop_back();
+      }
+    }
+    if (call == nullptr) {
+      call = absl::make_unique<UnaryCall<Request, Response>>(this);
+    }
+    call->Start();
+    return call.release();
+  }
+
+  // Takes back the completed call, keeping it for reuse unless enough calls
+  // are kept already.
+  void ReleaseCall(UnaryCall<Request, Response>* call)
+      ABSL_LOCKS_EXCLUDED(lock_) {
+    std::unique_ptr<UnaryCall<Request, Response>> released(call);
+    released->Reset();
+    absl::MutexLock lock(&lock_);
+    if (free_calls_.size() < kMaxFreeCallsPerMethod) {
+      free_calls_.push_back(std::move(released));
+    }
+  }
+
+  ServerAsyncImpl* server() const { return server_; }
+  RequestMethod<Request, Response> request_method() const {
+    return request_method_;
+  }
+  const char* rpc_name() const { return rpc_name_; }
+  RpcMetrics* metrics() const { return metrics_; }
+
+ private:
+  ServerAsyncImpl* const server_;
+  const RequestMethod<Request, Response> request_method_;
+  const char* const rpc_name_;
+  RpcMetrics* const metrics_;  // Owned by the server.
+
+  absl::Mutex lock_;
+  std::vector<std::unique_ptr<UnaryCall<Request, Response>>> free_calls_
+      ABSL_GUARDED_BY(lock_);
+};
+
 void ServerAsyncImpl::DriveCQ() {
   void* tag;  // Matches the async operation started against this cq_.
   bool ok;
   // Waits for the completion of the next operation in the queue. Then, if not
-  // shutting down, it casts the tag (a pointer to the std::function
-  // implementing the next step in the execution of the RPC) to a
-  // std::function and runs it inline.
+  // shutting down, it casts the tag to the state of the call the operation was
+  // started for, and proceeds inline to the next step of the call.
   while (cq_->Next(&tag, &ok)) {
-    // Casts the tag to a std::function and runs it inline.
-    auto func_ptr = static_cast<std::function<void(bool)>*>(tag);
-    (*func_ptr)(ok);
-    delete func_ptr;
+    static_cast<CompletionTag*>(tag)->Proceed(ok);
   }
   // The completion queue is shutting down.
   GOOGLE_LOG(INFO) << "Completion queue shutdown.";
@@ -92,162 +574,255 @@ bool ServerAsyncImpl::DecrementRpcPending() {
     // If count is zero, then server is shutdown (because new RPCs are requested
     // as part of this process if possible).
     GOOGLE_LOG(INFO) << "Notifying server of RPC completion.";
-    if (!rpcs_completed_.HasBeenNotified()) rpcs_completed_.Notify();
   }
   return true;
 }
 
-void ServerAsyncImpl::RequestNextGetNextState() {
+void ServerAsyncImpl::ScheduleRequest(
+    const ServerContext& ctx, RequestScheduler::Priority priority,
+    std::function<void()> handler,
+    std::function<void(const Status&)> reject) {
+  // The handler calls Finish on the responder from the pool thread, if any,
+  // which is safe to do concurrently with the completion queue being driven.
+  scheduler_->Schedule(
+      DeadlineFromContext(ctx), priority, std::move(handler),
+      [reject = std::move(reject)](const absl::Status& status) {
+        reject(Status(static_cast<::grpc::StatusCode>(status.code()),
+                      std::string(status.message())));
+      });
+}
+
+ServerAsyncImpl::RpcMetrics* ServerAsyncImpl::GetRpcMetrics(
+    absl::string_view rpc_name) {
+  {
+    absl::ReaderMutexLock lock(&metrics_lock_);
+    const auto pos = rpc_metrics_.find(rpc_name);
+    if (pos != rpc_metrics_.end()) return pos->second.get();
+  }
+  absl::WriterMutexLock lock(&metrics_lock_);
+  std::unique_ptr<RpcMetrics>& metrics = rpc_metrics_[std::string(rpc_name)];
+  if (metrics == nullptr) metrics = absl::make_unique<RpcMetrics>();
+  return metrics.get();
+}
+
+void ServerAsyncImpl::RunBatch(int num_requests,
+                               const std::function<void(int)>& handler) {
+  if (async_pool_ == nullptr) {
+    for (int i = 0; i < num_requests; ++i) handler(i);
+    return;
+  }
+  // The calling thread also processes the requests, so the batch completes
+  // even if all the pool threads are busy, e.g., handling other batches.
+  uint64 span_id;
+  Trace* trace = ScopedTraceActivation::CurrentTrace(&span_id);
+  if (trace == nullptr) {
+    async_pool_->ParallelFor(0, num_requests, handler);
+    return;
+  }
+  // Traces the requests handled by the pool threads within the batch.
+  async_pool_->ParallelFor(0, num_requests, [trace, span_id, &handler](int i) {
+    ScopedTraceActivation activation(trace, span_id);
+    handler(i);
+  });
+}
+
+template <class Request, class Response>
+void ServerAsyncImpl::AddUnaryMethod(
+    RequestMethod<Request, Response> request_method, const char* rpc_name) {
+  auto method = absl::make_unique<UnaryMethod<Request, Response>>(
+      this, request_method, rpc_name, GetRpcMetrics(rpc_name));
+  UnaryMethod<Request, Response>* method_ptr = method.get();
+  unary_methods_.push_back(std::move(method));
+  RequestNextUnary(method_ptr);
+}
+
+template <class Request, class Response>
+void ServerAsyncImpl::RequestNextUnary(UnaryMethod<Request, Response>* method) {
   if (!IncrementRpcPending()) {
-    GOOGLE_LOG(INFO) << "Server shutdown, so not requesting GetNextState";
+    GOOGLE_LOG(INFO) << "Server shutdown, so not requesting "
+                     << method->rpc_name();
     return;
   }
-  ServerContext* ctx = new ServerContext();
-  GetContextRequest* request = new GetContextRequest();
-  ::grpc::ServerAsyncResponseWriter<NextState>* responder =
-        new ::grpc::ServerAsyncResponseWriter<NextState>(ctx);
-  auto process_get_nextstate_callback = new std::function<void(bool)>(
-      absl::bind_front(&ServerAsyncImpl::ProcessGetNextState, this, ctx,
-                       request, responder));
-  service_.RequestGetNextState(ctx, request, responder, cq_.get(), cq_.get(),
-                               process_get_nextstate_callback);
+  UnaryCall<Request, Response>* call = method->AcquireCall();
+  (service_.*method->request_method())(&*call->ctx, call->request,
+                                       &*call->responder, cq_.get(),
+                                       cq_.get(), call);
 }
 
-void ServerAsyncImpl::ProcessGetNextState(
-    ServerContext* ctx, GetContextRequest* request,
-    ::grpc::ServerAsyncResponseWriter<NextState>* responder, bool ok) {
+template <class Request, class Response>
+void ServerAsyncImpl::ProcessUnary(UnaryCall<Request, Response>* call,
+                                   bool ok) {
   if (!ok) {
     // Request for new RPC has failed, cleaning up and returning.
-    GOOGLE_LOG(INFO) << "GetNextState not ok.";
-    CleanupAfterGetNextState(ctx, request, responder, ok);
+    GOOGLE_LOG(INFO) << call->method->rpc_name() << " not ok.";
+    CleanupAfterUnary(call);
     return;
   }
-  RequestNextGetNextState();  // Starts waiting for any new requests.
-  NextState response;
-  ::grpc::Status status = HandleRequest(ctx, request, &response);
-  auto finish_get_nextstate_callback = new std::function<void(bool)>(
-      absl::bind_front(&ServerAsyncImpl::CleanupAfterGetNextState, this,
-                       ctx, request, responder));
-  responder->Finish(response, status, finish_get_nextstate_callback);
-}
-
-void ServerAsyncImpl::CleanupAfterGetNextState(
-    ServerContext* ctx, GetContextRequest* request,
-    ::grpc::ServerAsyncResponseWriter<NextState>* responder, bool ignored_ok) {
-  delete ctx;
-  delete request;
-  delete responder;
+  // The latency includes the time spent waiting for a pool thread.
+  call->start_time = absl::Now();
+  // Starts waiting for any new requests.
+  RequestNextUnary(call->method);
+  ScheduleRequest(
+      *call->ctx, RequestPriority(*call->request),
+      [this, call]() {
+        Status status;
+        {
+          ScopedRequestTrace trace(tracer_.get(),
+                                   TraceParentFromContext(*call->ctx),
+                                   call->method->rpc_name());
+          trace.AddAttribute(
+              "queued_usec",
+              absl::ToInt64Microseconds(absl::Now() - call->start_time));
+          status = HandleRequest(&*call->ctx, call->request, call->response);
+          trace.AddAttribute("status", status.error_code());
+        }
+        RpcMetrics* metrics = call->method->metrics();
+        metrics->latency.Add(absl::Now() - call->start_time);
+        if (!status.ok()) ++metrics->num_errors;
+        call->Finish(status);
+      },
+      [call](const Status& status) {
+        ++call->method->metrics()->num_errors;
+        call->Finish(status);
+      });
+}
+
+template <class Request, class Response>
+void ServerAsyncImpl::CleanupAfterUnary(UnaryCall<Request, Response>* call) {
+  call->method->ReleaseCall(call);
   DecrementRpcPending();
 }
 
-void ServerAsyncImpl::RequestNextGetLMScore() {
+void ServerAsyncImpl::RequestNextSession() {
   if (!IncrementRpcPending()) {
-    GOOGLE_LOG(INFO) << "Server shutdown, so not requesting GetLMScore";
+    GOOGLE_LOG(INFO) << "Server shutdown, so not requesting Session";
     return;
   }
-  ServerContext* ctx = new ServerContext();
-  GetContextRequest* request = new GetContextRequest();
-  ::grpc::ServerAsyncResponseWriter<LMScores>* responder =
-        new ::grpc::ServerAsyncResponseWriter<LMScores>(ctx);
-  auto process_get_lmscore_callback = new std::function<void(bool)>(
-      absl::bind_front(&ServerAsyncImpl::ProcessGetLMScore, this, ctx,
-                       request, responder));
-  service_.RequestGetLMScores(ctx, request, responder, cq_.get(), cq_.get(),
-                             process_get_lmscore_callback);
+  SessionData* session = new SessionData(this);
+  service_.RequestSession(&session->ctx, &session->stream, cq_.get(),
+                          cq_.get(), session);
 }
 
-void ServerAsyncImpl::ProcessGetLMScore(
-    ServerContext* ctx, GetContextRequest* request,
-    ::grpc::ServerAsyncResponseWriter<LMScores>* responder, bool ok) {
+void ServerAsyncImpl::SessionData::Proceed(bool ok) {
+  switch (step) {
+    case Step::kStart:
+      server->ProcessSessionStart(this, ok);
+      break;
+    case Step::kRead:
+      server->ProcessSessionRead(this, ok);
+      break;
+    case Step::kWrite:
+      server->ProcessSessionWrite(this, ok);
+      break;
+    case Step::kFinish:
+      server->CleanupAfterSession(this);
+      break;
+  }
+}
+
+void ServerAsyncImpl::ProcessSessionStart(SessionData* session, bool ok) {
   if (!ok) {
     // Request for new RPC has failed, cleaning up and returning.
-    GOOGLE_LOG(INFO) << "GetLMScore not ok.";
-    CleanupAfterGetLMScore(ctx, request, responder, ok);
+    GOOGLE_LOG(INFO) << "Session not ok.";
+    CleanupAfterSession(session);
     return;
   }
-  RequestNextGetLMScore();  // Starts waiting for any new requests.
-  LMScores response;
-  ::grpc::Status status = HandleRequest(ctx, request, &response);
-  auto finish_get_lmscore_callback = new std::function<void(bool)>(
-      absl::bind_front(&ServerAsyncImpl::CleanupAfterGetLMScore, this,
-                       ctx, request, responder));
-  responder->Finish(response, status, finish_get_lmscore_callback);
-}
-
-void ServerAsyncImpl::CleanupAfterGetLMScore(
-    ServerContext* ctx, GetContextRequest* request,
-    ::grpc::ServerAsyncResponseWriter<LMScores>* responder, bool ignored_ok) {
-  delete ctx;
-  delete request;
-  delete responder;
-  DecrementRpcPending();
+  RequestNextSession();  // Starts waiting for any new sessions.
+  ReadSessionRequest(session);
 }
 
-void ServerAsyncImpl::RequestNextUpdateLMScores() {
-  if (!IncrementRpcPending()) {
-    GOOGLE_LOG(INFO) << "Server shutdown, so not requesting GetLMScore";
+void ServerAsyncImpl::ReadSessionRequest(SessionData* session) {
+  session->step = SessionData::Step::kRead;
+  session->stream.Read(&session->request, session);
+}
+
+void ServerAsyncImpl::ProcessSessionRead(SessionData* session, bool ok) {
+  if (!ok) {
+    // The client is done sending requests or the stream is broken.
+    FinishSession(session, Status::OK);
     return;
   }
-  ServerContext* ctx = new ServerContext();
-  UpdateLMScoresRequest* request = new UpdateLMScoresRequest();
-  ::grpc::ServerAsyncResponseWriter<LMScores>* responder =
-        new ::grpc::ServerAsyncResponseWriter<LMScores>(ctx);
-  auto process_update_lmscores_callback = new std::function<void(bool)>(
-      absl::bind_front(&ServerAsyncImpl::ProcessUpdateLMScores, this,
-                       ctx, request, responder));
-  service_.RequestUpdateLMScores(ctx, request, responder, cq_.get(), cq_.get(),
-                                 process_update_lmscores_callback);
+  const absl::Time start_time = absl::Now();
+  RpcMetrics* metrics = GetRpcMetrics("Session");
+  // The keystrokes of the typing sessions are picked with the reads, even
+  // though they may also update the counts, since the user is waiting.
+  ScheduleRequest(
+      session->ctx, RequestScheduler::Priority::kRead,
+      [this, session, start_time, metrics]() {
+        Status status;
+        {
+          ScopedRequestTrace trace(tracer_.get(),
+                                   TraceParentFromContext(session->ctx),
+                                   "Session");
+          trace.AddAttribute(
+              "queued_usec",
+              absl::ToInt64Microseconds(absl::Now() - start_time));
+          status = ManageSessionRequest(session);
+          trace.AddAttribute("status", status.error_code());
+        }
+        metrics->latency.Add(absl::Now() - start_time);
+        if (!status.ok()) {
+          ++metrics->num_errors;
+          FinishSession(session, status);
+          return;
+        }
+        session->step = SessionData::Step::kWrite;
+        session->stream.Write(session->response, session);
+      },
+      [this, session, metrics](const Status& status) {
+        ++metrics->num_errors;
+        FinishSession(session, status);
+      });
 }
 
-void ServerAsyncImpl::ProcessUpdateLMScores(
-    ServerContext* ctx, UpdateLMScoresRequest* request,
-    ::grpc::ServerAsyncResponseWriter<LMScores>* responder, bool ok) {
+void ServerAsyncImpl::ProcessSessionWrite(SessionData* session, bool ok) {
   if (!ok) {
-    // Request for new RPC has failed, cleaning up and returning.
-    GOOGLE_LOG(INFO) << "UpdateLMScores not ok.";
-    CleanupAfterUpdateLMScores(ctx, request, responder, ok);
+    FinishSession(session, Status(::grpc::StatusCode::UNAVAILABLE,
+                                  "Failed to write session response."));
     return;
   }
-  RequestNextUpdateLMScores();  // Starts waiting for any new requests.
-  LMScores response;
-  ::grpc::Status status = HandleRequest(ctx, request, &response);
-  auto finish_update_lmscores_callback = new std::function<void(bool)>(
-      absl::bind_front(&ServerAsyncImpl::CleanupAfterUpdateLMScores,
-                       this, ctx, request, responder));
-  responder->Finish(response, status, finish_update_lmscores_callback);
-}
-
-void ServerAsyncImpl::CleanupAfterUpdateLMScores(
-    ServerContext* ctx, UpdateLMScoresRequest* request,
-    ::grpc::ServerAsyncResponseWriter<LMScores>* responder, bool ignored_ok) {
-  delete ctx;
-  delete request;
-  delete responder;
+  ReadSessionRequest(session);  // Waits for the next keystroke.
+}
+
+void ServerAsyncImpl::FinishSession(SessionData* session,
+                                    const Status& status) {
+  session->step = SessionData::Step::kFinish;
+  session->stream.Finish(status, session);
+}
+
+void ServerAsyncImpl::CleanupAfterSession(SessionData* session) {
+  delete session;
   DecrementRpcPending();
 }
 
 absl::Status ServerAsyncImpl::BuildAndStart(
     const std::string& address_uri,
-    std::shared_ptr<::grpc::ServerCredentials> creds,
-    int async_pool_size) {
+    std::shared_ptr<::grpc::ServerCredentials> creds, int async_pool_size,
+    int max_queued_requests, const ServerTransportConfig& transport_config) {
   absl::MutexLock lock(&shutdown_lock_);
   if (server_shutdown_) {
     return absl::InternalError("Cannot initialize in the middle of shutdown");
   }
 
   // Initialize asynchronous request handlers.
-  // TODO: Complete.
   if (async_pool_size > 0) {
+    GOOGLE_LOG(INFO) << "Handling requests using " << async_pool_size
+                     << " threads";
     async_pool_ = absl::make_unique<ThreadPool>(async_pool_size);
     async_pool_->StartWorkers();
   } else {
     async_pool_ = nullptr;
   }
+  scheduler_ = absl::make_unique<RequestScheduler>(async_pool_.get(),
+                                                   max_queued_requests);
+  background_pool_ = absl::make_unique<ThreadPool>(/*num_threads=*/1);
+  background_pool_->StartWorkers();
 
   // Initialize the server.
   ::grpc::ServerBuilder builder;
   selected_port_ = -1;
   builder.AddListeningPort(address_uri, creds, &selected_port_);
+  ConfigureServerBuilder(transport_config, &builder);
   builder.RegisterService(&service_);
 
   // Build the completion queue and start.
@@ -257,7 +832,6 @@ absl::Status ServerAsyncImpl::BuildAndStart(
     return absl::InternalError(
         "Failed to build the server. Check the log for errors");
   }
-  rpcs_completed_.Notify();  // No RPCs yet.
   GOOGLE_LOG(INFO) << "Listening on \"" << address_uri << "\"";
   if (absl::EndsWith(address_uri, ":0")) {
     GOOGLE_LOG(INFO) << "Selected port: " << selected_port_;
@@ -267,9 +841,30 @@ absl::Status ServerAsyncImpl::BuildAndStart(
 
 absl::Status ServerAsyncImpl::ProcessRequests() {
   // Requests one RPC of each type to start the queue going.
-  RequestNextGetNextState();
-  RequestNextGetLMScore();
-  RequestNextUpdateLMScores();
+  using AsyncService = MozoLMService::AsyncService;
+  AddUnaryMethod<GetContextRequest, NextState>(
+      &AsyncService::RequestGetNextState, "GetNextState");
+  AddUnaryMethod<GetContextRequest, LMScores>(
+      &AsyncService::RequestGetLMScores, "GetLMScores");
+  AddUnaryMethod<UpdateLMScoresRequest, LMScores>(
+      &AsyncService::RequestUpdateLMScores, "UpdateLMScores");
+  AddUnaryMethod<GetContextBatchRequest, LMScoresBatch>(
+      &AsyncService::RequestGetLMScoresBatch, "GetLMScoresBatch");
+  AddUnaryMethod<GetContextBatchRequest, NextStateBatch>(
+      &AsyncService::RequestGetNextStateBatch, "GetNextStateBatch");
+  AddUnaryMethod<GetVocabularyRequest, Vocabulary>(
+      &AsyncService::RequestGetVocabulary, "GetVocabulary");
+  AddUnaryMethod<BulkUpdateRequest, BulkUpdateResponse>(
+      &AsyncService::RequestBulkUpdateLMCounts, "BulkUpdateLMCounts");
+  AddUnaryMethod<ScoreStringsRequest, ScoreStringsResponse>(
+      &AsyncService::RequestScoreStrings, "ScoreStrings");
+  AddUnaryMethod<CompletionRequest, CompletionResponse>(
+      &AsyncService::RequestGetCompletions, "GetCompletions");
+  AddUnaryMethod<GetStatsRequest, ServerStats>(
+      &AsyncService::RequestGetStats, "GetStats");
+  AddUnaryMethod<ReloadModelsRequest, ReloadModelsResponse>(
+      &AsyncService::RequestReloadModels, "ReloadModels");
+  RequestNextSession();
 
   // Proceed to the server's main loop.
   DriveCQ();
@@ -301,8 +896,14 @@ void ServerAsyncImpl::Shutdown() {
   // Now wait for all RPCs to complete their processing before we try to
   // shutdown the CQ. We do this because once the CQ is shutdown, we're
   // not supposed to enqueue new operations that require a CQ response,
-  // such as the Finish operations that complete the RPC lifecycle.
-  rpcs_completed_.WaitForNotification();
+  // such as the Finish operations that complete the RPC lifecycle. This
+  // includes the requests that are still being handled by the thread pool.
+  {
+    absl::MutexLock lock(&shutdown_lock_);
+    shutdown_lock_.Await(absl::Condition(
+        +[](int* rpcs_pending) { return *rpcs_pending == 0; },
+        &rpcs_pending_));
+  }
   // Shutdown the completion queue after the server is shutdown and all
   // outstanding RPCs are complete.
   cq_->Shutdown();
@@ -310,24 +911,166 @@ void ServerAsyncImpl::Shutdown() {
   // Drain the completion queue. The remaining requests will be fetched from
   // the inactive completion queue and their arguments freed.
   DriveCQ();
+
+  // Keeps the count updates applied by the last requests, including the
+  // background ones still queued.
+  StopModelWatch();
+  StopMemoryBudget();
+  background_pool_.reset();
+  StopSnapshots();
+}
+
+absl::Status ServerAsyncImpl::StartSnapshots(absl::Duration interval) {
+  if (snapshot_thread_ != nullptr) {
+    return absl::FailedPreconditionError("Snapshots already started");
+  }
+  // Checks that the hub has a snapshot file, keeping the updates so far.
+  const auto num_updates = GetModelHub()->WriteSnapshot();
+  if (!num_updates.ok()) return num_updates.status();
+  GOOGLE_LOG(INFO) << "Writing count snapshots every "
+                   << absl::FormatDuration(interval);
+  snapshot_thread_ = absl::make_unique<std::thread>(
+      &ServerAsyncImpl::RunSnapshots, this, interval);
+  return absl::OkStatus();
+}
+
+void ServerAsyncImpl::RunSnapshots(absl::Duration interval) {
+  while (!snapshot_stop_.WaitForNotificationWithTimeout(interval)) {
+    const auto num_updates = GetModelHub()->WriteSnapshot();
+    if (!num_updates.ok()) {
+      GOOGLE_LOG(ERROR) << "Count snapshot failed: "
+                        << num_updates.status().ToString();
+    }
+  }
+}
+
+void ServerAsyncImpl::StopSnapshots() {
+  if (snapshot_thread_ != nullptr) {
+    snapshot_stop_.Notify();
+    snapshot_thread_->join();
+    snapshot_thread_.reset();
+  }
+  // Written even if the snapshots were never started, since the hub records
+  // the count updates as soon as it has a snapshot file.
+  const auto num_updates = GetModelHub()->WriteSnapshot();
+  if (num_updates.ok()) {
+    if (num_updates.value() > 0) {
+      GOOGLE_LOG(INFO) << "Wrote the last " << num_updates.value()
+                       << " count updates to the snapshot";
+    }
+  } else if (!absl::IsFailedPrecondition(num_updates.status())) {
+    // The hub has no snapshot file otherwise.
+    GOOGLE_LOG(ERROR) << "Last count snapshot failed: "
+                      << num_updates.status().ToString();
+  }
+}
+
+absl::Status ServerAsyncImpl::StartMemoryBudget(int64 budget_bytes,
+                                                absl::Duration interval) {
+  if (memory_budget_thread_ != nullptr) {
+    return absl::FailedPreconditionError("Memory budget already started");
+  }
+  if (budget_bytes <= 0) {
+    return absl::InvalidArgumentError("Memory budget must be positive");
+  }
+  memory_budget_ = absl::make_unique<models::MemoryBudget>(budget_bytes);
+  GOOGLE_LOG(INFO) << "Keeping the model hub within " << budget_bytes
+                   << " bytes, rebalanced every "
+                   << absl::FormatDuration(interval);
+  memory_budget_thread_ = absl::make_unique<std::thread>(
+      &ServerAsyncImpl::RunMemoryBudget, this, interval);
+  return absl::OkStatus();
+}
+
+void ServerAsyncImpl::RunMemoryBudget(absl::Duration interval) {
+  bool over_budget = false;
+  do {
+    const models::HubMemoryUsage usage =
+        memory_budget_->Rebalance(GetModelHub().get());
+    // Only warns once the memory goes over the budget, e.g., since the models
+    // alone exceed it.
+    const bool was_over_budget = over_budget;
+    over_budget = usage.TotalBytes() > memory_budget_->budget_bytes();
+    if (over_budget && !was_over_budget) {
+      GOOGLE_LOG(WARNING) << "Model hub holds " << usage.TotalBytes()
+                          << " bytes, over the memory budget";
+    }
+  } while (!memory_budget_stop_.WaitForNotificationWithTimeout(interval));
+}
+
+void ServerAsyncImpl::StopMemoryBudget() {
+  if (memory_budget_thread_ == nullptr) return;
+  memory_budget_stop_.Notify();
+  memory_budget_thread_->join();
+  memory_budget_thread_.reset();
+}
+
+absl::Status ServerAsyncImpl::StartModelWatch(absl::Duration interval) {
+  if (model_watch_thread_ != nullptr) {
+    return absl::FailedPreconditionError("Model watch already started");
+  }
+  GOOGLE_LOG(INFO) << "Checking the model files for changes every "
+                   << absl::FormatDuration(interval);
+  model_watch_thread_ = absl::make_unique<std::thread>(
+      &ServerAsyncImpl::RunModelWatch, this, interval);
+  return absl::OkStatus();
+}
+
+void ServerAsyncImpl::RunModelWatch(absl::Duration interval) {
+  while (!model_watch_stop_.WaitForNotificationWithTimeout(interval)) {
+    ModelHubConfig config;
+    {
+      absl::MutexLock lock(&reload_lock_);
+      if (models::ModelStorageFingerprints(model_hub_config_) ==
+          model_fingerprints_) {
+        continue;
+      }
+      config = model_hub_config_;
+    }
+    GOOGLE_LOG(INFO) << "Model files changed";
+    const absl::Status status = ReloadModelHub(config);
+    if (!status.ok()) {
+      GOOGLE_LOG(ERROR) << "Failed to reload the changed models: "
+                        << status.ToString();
+    }
+  }
+}
+
+void ServerAsyncImpl::StopModelWatch() {
+  if (model_watch_thread_ == nullptr) return;
+  model_watch_stop_.Notify();
+  model_watch_thread_->join();
+  model_watch_thread_.reset();
 }
 
 Status ServerAsyncImpl::ManageUpdateLMScores(
     const UpdateLMScoresRequest* request, LMScores* response) {
+  absl::ReaderMutexLock counts_lock(&counts_lock_);
+  const auto model_hub = GetModelHub();
   const int utf8_sym_size = request->utf8_sym_size();
   std::vector<int> utf8_syms(utf8_sym_size);
   int curr_state = request->state();
   for (int i = 0; i < utf8_sym_size; ++i) {
     // Adds each symbol to vector and finds next state.
     utf8_syms[i] = request->utf8_sym(i);
-    curr_state = model_hub_->NextState(curr_state, utf8_syms[i]);
+    curr_state = model_hub->NextState(curr_state, utf8_syms[i]);
+    if (curr_state < 0) {
+      return Status(::grpc::StatusCode::INVALID_ARGUMENT, "invalid state");
+    }
   }
-  if (!model_hub_->UpdateLMCounts(request->state(), utf8_syms,
-                                  request->count())) {
+  const bool updated =
+      request->user_id().empty()
+          ? model_hub->UpdateLMCounts(request->state(), utf8_syms,
+                                      request->count())
+          : model_hub->UpdateUserCounts(request->user_id(), request->state(),
+                                        utf8_syms, request->count());
+  if (!updated) {
     return Status(::grpc::StatusCode::INVALID_ARGUMENT,
                   "Failed to update language model counts.");
   }
-  if (model_hub_->ExtractLMScores(curr_state, response)) {
+  if (model_hub->ExtractLMScores(curr_state,
+                                 ScoresOptionsFromRequest(*request),
+                                 response)) {
     return Status::OK;
   } else {
     return Status(::grpc::StatusCode::INVALID_ARGUMENT,
@@ -335,5 +1078,49 @@ Status ServerAsyncImpl::ManageUpdateLMScores(
   }
 }
 
+Status ServerAsyncImpl::ManageSessionRequest(SessionData* session) {
+  const SessionRequest& request = session->request;
+  // Only the requests updating the counts wait for the reloads.
+  absl::optional<absl::ReaderMutexLock> counts_lock;
+  if (request.count() > 0) counts_lock.emplace(&counts_lock_);
+  const auto model_hub = GetModelHub();
+  if (!session->started || request.reset_state()) {
+    session->state = request.state();
+    session->started = true;
+  }
+  if (request.count() < 0) {
+    return Status(::grpc::StatusCode::INVALID_ARGUMENT,
+                  "Session count must be non-negative.");
+  }
+  const int utf8_sym_size = request.utf8_sym_size();
+  std::vector<int> utf8_syms(utf8_sym_size);
+  int curr_state = session->state;
+  for (int i = 0; i < utf8_sym_size; ++i) {
+    utf8_syms[i] = request.utf8_sym(i);
+    curr_state = model_hub->NextState(curr_state, utf8_syms[i]);
+    if (curr_state < 0) {
+      return Status(::grpc::StatusCode::INVALID_ARGUMENT, "invalid state");
+    }
+  }
+  if (request.count() > 0 &&
+      !(request.user_id().empty()
+            ? model_hub->UpdateLMCounts(session->state, utf8_syms,
+                                        request.count())
+            : model_hub->UpdateUserCounts(request.user_id(), session->state,
+                                          utf8_syms, request.count()))) {
+    return Status(::grpc::StatusCode::INVALID_ARGUMENT,
+                  "Failed to update language model counts.");
+  }
+  session->state = curr_state;
+  session->response.Clear();
+  if (!model_hub->ExtractLMScores(session->state,
+                                  ScoresOptionsFromRequest(request),
+                                  &session->response)) {
+    return Status(::grpc::StatusCode::INVALID_ARGUMENT,
+                  "Failed to extract scores.");
+  }
+  return Status::OK;
+}
+
 }  // namespace grpc
 }  // namespace mozolm
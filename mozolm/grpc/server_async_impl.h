@@ -15,20 +15,35 @@
 #ifndef MOZOLM_MOZOLM_GRPC_SERVER_ASYNC_IMPL_H_
 #define MOZOLM_MOZOLM_GRPC_SERVER_ASYNC_IMPL_H_
 
+#include <atomic>
+#include <functional>
 #include <memory>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "include/grpcpp/grpcpp.h"
 #include "include/grpcpp/security/server_credentials.h"
 #include "include/grpcpp/server.h"
 #include "include/grpcpp/server_context.h"
 #include "include/grpcpp/support/async_stream.h"
+#include "mozolm/stubs/integral_types.h"
+#include "absl/container/flat_hash_map.h"
 #include "absl/status/status.h"
+#include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
 #include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
+#include "mozolm/grpc/request_scheduler.h"
+#include "mozolm/grpc/server_config.pb.h"
 #include "mozolm/grpc/service.grpc.pb.h"
 #include "mozolm/grpc/service.pb.h"
 #include "mozolm/models/language_model_hub.h"
+#include "mozolm/models/memory_budget.h"
+#include "mozolm/models/model_config.pb.h"
+#include "mozolm/utils/latency_histogram.h"
+#include "mozolm/utils/tracing.h"
 #include "mozolm/stubs/thread_pool.h"
 
 namespace mozolm {
@@ -39,18 +54,24 @@ namespace grpc {
 // completion queue.
 class ServerAsyncImpl : public MozoLMService::AsyncService {
  public:
-  // Creates and initializes the server, a thread pool is created to handle
-  // requests if pool_size is > 0. An initialized instance of a language model
-  // hub is required.
+  // Creates and initializes the server. An initialized instance of a language
+  // model hub is required.
   ServerAsyncImpl(std::unique_ptr<models::LanguageModelHub> model);
   ServerAsyncImpl() = delete;
-  ~ServerAsyncImpl() override = default;
+  ~ServerAsyncImpl() override;
 
   // Initializes the server binding to the supplied port, registers the
-  // service, launches the completion queue and starts the server.
-  absl::Status BuildAndStart(const std::string& address_uri,
-                             std::shared_ptr<::grpc::ServerCredentials> creds,
-                             int async_pool_size);
+  // service, launches the completion queue and starts the server. If
+  // async_pool_size is > 0, a thread pool of that size is created and the
+  // received requests are handled on the pool threads, otherwise they are
+  // handled inline in the thread driving the completion queue. At most
+  // max_queued_requests requests wait for a pool thread, without a limit if
+  // not positive. The connections are tuned by the transport configuration.
+  absl::Status BuildAndStart(
+      const std::string& address_uri,
+      std::shared_ptr<::grpc::ServerCredentials> creds, int async_pool_size,
+      int max_queued_requests = 0,
+      const ServerTransportConfig& transport_config = ServerTransportConfig());
 
   // Runs request processing loop until the server shutdown is requested.
   absl::Status ProcessRequests();
@@ -58,6 +79,47 @@ class ServerAsyncImpl : public MozoLMService::AsyncService {
   // Shutdown the server. Mostly used by the tests.
   void Shutdown();
 
+  // Appends the count updates to the snapshot file of the model hub every
+  // interval, on a dedicated thread, so that the adapted counts survive a
+  // restart. A last snapshot is written once the server is shut down. Returns
+  // an error if the model hub has no snapshot file.
+  absl::Status StartSnapshots(absl::Duration interval);
+
+  // Keeps the model hub within the memory budget, in bytes, rebalancing the
+  // memory limits of the hub states, the user counts and the model caches
+  // every interval, on a dedicated thread. The first rebalance is immediate.
+  // A reloaded hub is rebalanced within an interval of the switch.
+  absl::Status StartMemoryBudget(int64 budget_bytes, absl::Duration interval);
+
+  // Checks the storage fingerprints of the models (see
+  // models::ModelStorageFingerprints()) every interval, on a dedicated
+  // thread, and reloads the model hub from its current configuration when
+  // they change. A failed reload is tried again at the next check.
+  absl::Status StartModelWatch(absl::Duration interval)
+      ABSL_LOCKS_EXCLUDED(reload_lock_);
+
+  // Traces the requests picked by the tracer, which needs to be set before
+  // the server is started. Not traced by default.
+  void set_tracer(std::unique_ptr<Tracer> tracer) {
+    tracer_ = std::move(tracer);
+  }
+
+  // Configuration used to reload the models when the reload requests do not
+  // provide one.
+  void set_model_hub_config(const ModelHubConfig& config)
+      ABSL_LOCKS_EXCLUDED(reload_lock_);
+
+  // Reads the models from the configuration into a new model hub, while the
+  // current hub keeps serving, and then switches to the new hub. The requests
+  // in flight keep the previous hub until they complete, and the ids of its
+  // states other than the start state are rejected by the new hub. With a
+  // snapshot file, the count updates are held back during the switch: the
+  // current hub writes its final snapshot, which the new hub restores unless
+  // its models have changed. The reloads are serialized. On failure, the
+  // current hub is kept.
+  absl::Status ReloadModelHub(const ModelHubConfig& config)
+      ABSL_LOCKS_EXCLUDED(reload_lock_, counts_lock_, model_hub_lock_);
+
   // Returns the lm_scores given the context.
   ::grpc::Status HandleRequest(::grpc::ServerContext* context,
                                const GetContextRequest* request,
@@ -74,9 +136,58 @@ class ServerAsyncImpl : public MozoLMService::AsyncService {
                                const UpdateLMScoresRequest* request,
                                LMScores* response);
 
+  // Returns the lm_scores for each of the contexts in the batch. The requests
+  // are evaluated concurrently on the thread pool, if one is configured.
+  ::grpc::Status HandleRequest(::grpc::ServerContext* context,
+                               const GetContextBatchRequest* request,
+                               LMScoresBatch* response);
+
+  // Returns the next states for each of the contexts in the batch. The
+  // requests are evaluated concurrently on the thread pool, if one is
+  // configured.
+  ::grpc::Status HandleRequest(::grpc::ServerContext* context,
+                               const GetContextBatchRequest* request,
+                               NextStateBatch* response);
+
+  // Returns the vocabulary used by the scores in compact format.
+  ::grpc::Status HandleRequest(::grpc::ServerContext* context,
+                               const GetVocabularyRequest* request,
+                               Vocabulary* response);
+
+  // Updates the counts with the lines of the text. Background updates are
+  // applied by a dedicated thread once the server is started, so that a long
+  // text does not hold up a request handler.
+  ::grpc::Status HandleRequest(::grpc::ServerContext* context,
+                               const BulkUpdateRequest* request,
+                               BulkUpdateResponse* response);
+
+  // Returns the costs of each of the strings in the batch. The strings are
+  // scored concurrently on the thread pool, if one is configured.
+  ::grpc::Status HandleRequest(::grpc::ServerContext* context,
+                               const ScoreStringsRequest* request,
+                               ScoreStringsResponse* response);
+
+  // Returns the completions of the context, found within the model hub.
+  ::grpc::Status HandleRequest(::grpc::ServerContext* context,
+                               const CompletionRequest* request,
+                               CompletionResponse* response);
+
+  // Returns the counters and the latencies of the server, of the model hub
+  // and of the component models.
+  ::grpc::Status HandleRequest(::grpc::ServerContext* context,
+                               const GetStatsRequest* request,
+                               ServerStats* response)
+      ABSL_LOCKS_EXCLUDED(metrics_lock_);
+
+  // Reloads the models, from the configuration in the request if any.
+  ::grpc::Status HandleRequest(::grpc::ServerContext* context,
+                               const ReloadModelsRequest* request,
+                               ReloadModelsResponse* response)
+      ABSL_LOCKS_EXCLUDED(reload_lock_);
+
   // Returns the model symbol index associated with a state.
   int ModelStateSym(int state) {
-    return model_hub_->StateSym(state);
+    return GetModelHub()->StateSym(state);
   }
 
   int selected_port() const { return selected_port_; }
@@ -86,53 +197,166 @@ class ServerAsyncImpl : public MozoLMService::AsyncService {
   bool IncrementRpcPending();  // Locks, increments & releases counter.
   bool DecrementRpcPending();  // Locks, decrements & releases counter.
 
+  // Returns the current model hub, which remains valid for the caller after
+  // a reload.
+  std::shared_ptr<models::LanguageModelHub> GetModelHub() const
+      ABSL_LOCKS_EXCLUDED(model_hub_lock_);
+
+  // Runs the request handler on the thread pool, if one is configured,
+  // otherwise runs it inline, unless the request is shed by the scheduler
+  // because of its deadline or the queue limit, in which case the reject
+  // callback is run instead.
+  void ScheduleRequest(const ::grpc::ServerContext& ctx,
+                       RequestScheduler::Priority priority,
+                       std::function<void()> handler,
+                       std::function<void(const ::grpc::Status&)> reject);
+
+  // Latencies and errors of the requests of one of the methods.
+  struct RpcMetrics {
+    LatencyHistogram latency;
+    std::atomic<int64> num_errors{0};
+  };
+
+  // Returns the metrics of the method, created on first use.
+  RpcMetrics* GetRpcMetrics(absl::string_view rpc_name)
+      ABSL_LOCKS_EXCLUDED(metrics_lock_);
+
+  // Tag of an operation started against the completion queue, which proceeds
+  // to the next step of its call once the operation completes. The tags are
+  // the per-call states themselves, which have at most one operation in
+  // flight, so that the steps do not allocate.
+  class CompletionTag {
+   public:
+    virtual ~CompletionTag() = default;
+    virtual void Proceed(bool ok) = 0;
+  };
+
   // Manages the UpdateLMScores steps.
   ::grpc::Status ManageUpdateLMScores(const UpdateLMScoresRequest* request,
                                       LMScores* response);
 
-  // Steps for handling a GetNextState request: 1) initializes request and
-  // starts waiting for new requests; 2) processes and finishes received
-  // requests; and 3) cleans up allocated data.
-  void RequestNextGetNextState() ABSL_LOCKS_EXCLUDED(shutdown_lock_);
-  void ProcessGetNextState(
-      ::grpc::ServerContext* ctx, GetContextRequest* request,
-      ::grpc::ServerAsyncResponseWriter<NextState>* responder, bool ok)
+  // Evaluates the batch requests, spreading them over the thread pool, if one
+  // is configured.
+  void RunBatch(int num_requests, const std::function<void(int)>& handler);
+
+  // Method of the asynchronous service requesting a new unary RPC.
+  template <class Request, class Response>
+  using RequestMethod = void (MozoLMService::AsyncService::*)(
+      ::grpc::ServerContext*, Request*,
+      ::grpc::ServerAsyncResponseWriter<Response>*, ::grpc::CompletionQueue*,
+      ::grpc::ServerCompletionQueue*, void*);
+
+  // Unary method of the service, which keeps the states of its completed
+  // calls for reuse by the next ones. Defined in the implementation for each
+  // of the request and response types.
+  class UnaryMethodBase {
+   public:
+    virtual ~UnaryMethodBase() = default;
+  };
+  template <class Request, class Response>
+  class UnaryMethod;
+  template <class Request, class Response>
+  struct UnaryCall;
+
+  // Registers the unary method, to be handled by the corresponding
+  // HandleRequest() overload, and starts waiting for its requests.
+  template <class Request, class Response>
+  void AddUnaryMethod(RequestMethod<Request, Response> request_method,
+                      const char* rpc_name);
+
+  // Steps for handling a unary request: 1) prepares a call of the method and
+  // starts waiting for a new request; 2) processes and finishes the received
+  // request; and 3) returns the call to its method.
+  template <class Request, class Response>
+  void RequestNextUnary(UnaryMethod<Request, Response>* method)
+      ABSL_LOCKS_EXCLUDED(shutdown_lock_);
+  template <class Request, class Response>
+  void ProcessUnary(UnaryCall<Request, Response>* call, bool ok)
       ABSL_LOCKS_EXCLUDED(shutdown_lock_);
-  void CleanupAfterGetNextState(
-      ::grpc::ServerContext* ctx, GetContextRequest* request,
-      ::grpc::ServerAsyncResponseWriter<NextState>* responder, bool ignored_ok)
+  template <class Request, class Response>
+  void CleanupAfterUnary(UnaryCall<Request, Response>* call)
       ABSL_LOCKS_EXCLUDED(shutdown_lock_);
 
-  // Steps for handling a GetLMScore request: 1) initializes request and
-  // starts waiting for new requests; 2) processes and finishes received
-  // requests; and 3) cleans up allocated data.
-  void RequestNextGetLMScore() ABSL_LOCKS_EXCLUDED(shutdown_lock_);
-  void ProcessGetLMScore(
-      ::grpc::ServerContext* ctx, GetContextRequest* request,
-      ::grpc::ServerAsyncResponseWriter<LMScores>* responder, bool ok)
+  // Per-stream data of a typing session, which is the tag of its operations.
+  struct SessionData : public CompletionTag {
+    // Step run once the operation in flight completes.
+    enum class Step { kStart, kRead, kWrite, kFinish };
+
+    explicit SessionData(ServerAsyncImpl* server)
+        : server(server), stream(&ctx) {}
+    void Proceed(bool ok) override;
+
+    ServerAsyncImpl* const server;
+    Step step = Step::kStart;
+    ::grpc::ServerContext ctx;
+    ::grpc::ServerAsyncReaderWriter<LMScores, SessionRequest> stream;
+    SessionRequest request;  // Last request read from the stream.
+    LMScores response;       // Response to the last request.
+    bool started = false;    // Whether the session state has been set.
+    int state = 0;           // Current hub state of the session.
+  };
+
+  // Steps for handling a Session request: 1) initializes the session and
+  // starts waiting for new sessions; 2) alternates between reading a request
+  // from the stream, processing it and writing the response until the client
+  // is done; and 3) finishes the stream and cleans up allocated data.
+  void RequestNextSession() ABSL_LOCKS_EXCLUDED(shutdown_lock_);
+  void ProcessSessionStart(SessionData* session, bool ok)
       ABSL_LOCKS_EXCLUDED(shutdown_lock_);
-  void CleanupAfterGetLMScore(
-      ::grpc::ServerContext* ctx, GetContextRequest* request,
-      ::grpc::ServerAsyncResponseWriter<LMScores>* responder, bool ignored_ok)
+  void ReadSessionRequest(SessionData* session);
+  void ProcessSessionRead(SessionData* session, bool ok)
       ABSL_LOCKS_EXCLUDED(shutdown_lock_);
-
-  // Steps for handling an UpdateLMScores request: 1) initializes request and
-  // starts waiting for new requests; 2) processes and finishes received
-  // requests; and 3) cleans up allocated data.
-  void RequestNextUpdateLMScores() ABSL_LOCKS_EXCLUDED(shutdown_lock_);
-  void ProcessUpdateLMScores(
-      ::grpc::ServerContext* ctx, UpdateLMScoresRequest* request,
-      ::grpc::ServerAsyncResponseWriter<LMScores>* responder, bool ok)
+  void ProcessSessionWrite(SessionData* session, bool ok)
       ABSL_LOCKS_EXCLUDED(shutdown_lock_);
-  void CleanupAfterUpdateLMScores(
-      ::grpc::ServerContext* ctx, UpdateLMScoresRequest* request,
-      ::grpc::ServerAsyncResponseWriter<LMScores>* responder, bool ignored_ok)
+  void FinishSession(SessionData* session, const ::grpc::Status& status);
+  void CleanupAfterSession(SessionData* session)
       ABSL_LOCKS_EXCLUDED(shutdown_lock_);
 
-  // Model hub instance owned by the server.
-  std::unique_ptr<models::LanguageModelHub> model_hub_;
+  // Applies the last request read on the session and fills in the response.
+  ::grpc::Status ManageSessionRequest(SessionData* session);
+
+  // Writes the snapshots every interval until stopped.
+  void RunSnapshots(absl::Duration interval);
+
+  // Stops the snapshot thread, if any, and writes a last snapshot if the
+  // model hub has a snapshot file.
+  void StopSnapshots();
+
+  // Rebalances the memory of the model hub every interval until stopped.
+  void RunMemoryBudget(absl::Duration interval);
+
+  // Stops the memory budget thread, if any.
+  void StopMemoryBudget();
+
+  // Reloads the model hub whenever its model files change, every interval
+  // until stopped.
+  void RunModelWatch(absl::Duration interval) ABSL_LOCKS_EXCLUDED(reload_lock_);
+
+  // Stops the model watch thread, if any.
+  void StopModelWatch();
+
+  // Model hub instance, shared by the server with the requests in flight.
+  // The hub itself is thread-safe, the lock only guards the swaps.
+  mutable absl::Mutex model_hub_lock_;
+  std::shared_ptr<models::LanguageModelHub> model_hub_
+      ABSL_GUARDED_BY(model_hub_lock_);
+
+  // Held shared while updating the counts of the hub, and exclusively while
+  // a reload moves the counts to the new hub, so that no update is applied to
+  // the current hub after its final snapshot. Taken before the hub lock.
+  absl::Mutex counts_lock_;
+
+  // Serializes the reloads of the models, holding the configuration used by
+  // default.
+  absl::Mutex reload_lock_;
+  ModelHubConfig model_hub_config_ ABSL_GUARDED_BY(reload_lock_);
+  // Storage fingerprints of the models of the hub serving, for the watch.
+  std::vector<uint64> model_fingerprints_ ABSL_GUARDED_BY(reload_lock_);
+  std::atomic<int64> num_model_reloads_{0};
 
   std::unique_ptr<::grpc::ServerCompletionQueue> cq_;
+  // Unary methods, registered when the request processing starts.
+  std::vector<std::unique_ptr<UnaryMethodBase>> unary_methods_;
   MozoLMService::AsyncService service_;
   absl::Mutex shutdown_lock_;
   std::unique_ptr<::grpc::Server> server_
@@ -142,19 +366,49 @@ class ServerAsyncImpl : public MozoLMService::AsyncService {
   bool server_shutdown_ ABSL_GUARDED_BY(shutdown_lock_) = false;
 
   // Count of the number of pending rpcs, incremented and decremented as
-  // requests come in and are finished.
+  // requests come in and are finished. The shutdown waits for this to reach
+  // zero.
   int rpcs_pending_ ABSL_GUARDED_BY(shutdown_lock_) = 0;
 
-  // Notified when pending rpc count is zero.
-  absl::Notification rpcs_completed_;
-
   // Actual port used by the server after the endpoint has been fully
   // bound. This is useful in tests where the port may be selected dynamically
   // and is not known in advance.
   int selected_port_;
 
+  // Tracer of the sampled requests, if any. Declared before the pool, which
+  // may still run requests while being destroyed.
+  std::unique_ptr<Tracer> tracer_;
+
+  // Picks the requests handled by the pool below. Declared first, since the
+  // pool may still run the scheduler while being destroyed.
+  std::unique_ptr<RequestScheduler> scheduler_;
+
   // Pool for asynchronous request handling.
   std::unique_ptr<ThreadPool> async_pool_;
+
+  // Single thread applying the bulk count updates in the background.
+  std::unique_ptr<ThreadPool> background_pool_;
+
+  // Thread writing the snapshots of the count updates, if enabled, and its
+  // stop signal.
+  std::unique_ptr<std::thread> snapshot_thread_;
+  absl::Notification snapshot_stop_;
+
+  // Memory budget of the model hub, if enabled, and the thread rebalancing it
+  // with its stop signal.
+  std::unique_ptr<models::MemoryBudget> memory_budget_;
+  std::unique_ptr<std::thread> memory_budget_thread_;
+  absl::Notification memory_budget_stop_;
+
+  // Thread reloading the models when their files change, if enabled, and its
+  // stop signal.
+  std::unique_ptr<std::thread> model_watch_thread_;
+  absl::Notification model_watch_stop_;
+
+  // Guards the metrics of the methods, which are never removed once created.
+  absl::Mutex metrics_lock_;
+  absl::flat_hash_map<std::string, std::unique_ptr<RpcMetrics>> rpc_metrics_
+      ABSL_GUARDED_BY(metrics_lock_);
 };
 
 }  // namespace grpc
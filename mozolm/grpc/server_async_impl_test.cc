@@ -12,7 +12,11 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <cmath>
+#include <cstdio>
+#include <numeric>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "include/grpcpp/grpcpp.h"
@@ -22,11 +26,19 @@
 #include "protobuf-matchers/protocol-buffer-matchers.h"
 #include "gtest/gtest.h"
 #include "absl/status/status.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "mozolm/grpc/server_async_impl.h"
 #include "mozolm/grpc/service.grpc.pb.h"
+#include "mozolm/models/language_model.h"
+#include "mozolm/models/lm_scores.pb.h"
 #include "mozolm/models/model_config.pb.h"
 #include "mozolm/models/model_factory.h"
 #include "mozolm/models/model_storage.pb.h"
+#include "mozolm/utils/file_util.h"
+#include "mozolm/utils/tracing.h"
 #include "mozolm/utils/utf8_util.h"
 
 namespace mozolm {
@@ -37,6 +49,7 @@ constexpr float kFloatDelta = 0.00001;  // Delta for float comparisons.
 
 using ::grpc::Status;
 using ::grpc::ServerContext;
+using ::protobuf_matchers::EqualsProto;
 
 class ServerAsyncImplMock : public ServerAsyncImpl {
  public:
@@ -76,6 +89,40 @@ void CheckGetLMScores(int state, const std::string& context_str = "") {
   }
 }
 
+// Check that the compact scores expand to the scores in full format.
+void CheckGetLMScoresCompact(const std::string& context_str) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  GetContextRequest request;
+  request.set_context(context_str);
+  LMScores full_response;
+  const GetContextRequest* request_ptr(&request);
+  Status status = server.HandleRequest(&context, request_ptr, &full_response);
+  ASSERT_TRUE(status.ok());
+
+  request.set_format(LM_SCORES_COMPACT);
+  LMScores compact_response;
+  status = server.HandleRequest(&context, request_ptr, &compact_response);
+  ASSERT_TRUE(status.ok());
+  EXPECT_EQ(compact_response.symbols_size(), 0);
+  EXPECT_EQ(compact_response.compact_probabilities_size(), 28);
+
+  GetVocabularyRequest vocab_request;
+  Vocabulary vocab;
+  status = server.HandleRequest(&context, &vocab_request, &vocab);
+  ASSERT_TRUE(status.ok());
+  EXPECT_EQ(vocab.symbols_size(), 28);
+  EXPECT_OK(models::ExpandLMScores(vocab, &compact_response));
+  ASSERT_EQ(compact_response.symbols_size(), full_response.symbols_size());
+  for (int i = 0; i < full_response.symbols_size(); ++i) {
+    EXPECT_EQ(compact_response.symbols(i), full_response.symbols(i));
+    EXPECT_NEAR(compact_response.probabilities(i),
+                full_response.probabilities(i), kFloatDelta);
+  }
+  EXPECT_NEAR(compact_response.normalization(),
+              full_response.normalization(), kFloatDelta);
+}
+
 // Check that a call to UpdateLMScores returns the expected status code.
 void CheckUpdateLMScoresError(int state, int utf8_sym, int count,
                               ::grpc::StatusCode error_code) {
@@ -124,6 +171,121 @@ void CheckUpdateLMScoresContent(int state, int count) {
   }
 }
 
+// Check that a batch of GetLMScores requests returns the scores for each of the
+// requests, in order.
+void CheckGetLMScoresBatch(const std::vector<std::string>& contexts) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  GetContextBatchRequest request;
+  for (const auto& context_str : contexts) {
+    GetContextRequest* state_request = request.add_requests();
+    state_request->set_state(0);
+    state_request->set_context(context_str);
+  }
+  LMScoresBatch response;
+  const GetContextBatchRequest* request_ptr(&request);
+  Status status = server.HandleRequest(&context, request_ptr, &response);
+  ASSERT_TRUE(status.ok());
+  const int num_contexts = contexts.size();
+  ASSERT_EQ(response.scores_size(), num_contexts);
+  for (int i = 0; i < num_contexts; ++i) {
+    LMScores expected;
+    status = server.HandleRequest(&context, &request.requests(i), &expected);
+    ASSERT_TRUE(status.ok());
+    EXPECT_THAT(response.scores(i), EqualsProto(expected));
+  }
+}
+
+// Check that a batch of GetNextState requests returns the same states as the
+// individual requests.
+void CheckGetNextStateBatch(const std::vector<std::string>& contexts) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  GetContextBatchRequest request;
+  for (const auto& context_str : contexts) {
+    GetContextRequest* state_request = request.add_requests();
+    state_request->set_state(0);
+    state_request->set_context(context_str);
+  }
+  NextStateBatch response;
+  const GetContextBatchRequest* request_ptr(&request);
+  Status status = server.HandleRequest(&context, request_ptr, &response);
+  ASSERT_TRUE(status.ok());
+  const int num_contexts = contexts.size();
+  ASSERT_EQ(response.next_states_size(), num_contexts);
+  for (int i = 0; i < num_contexts; ++i) {
+    NextState expected;
+    status = server.HandleRequest(&context, &request.requests(i), &expected);
+    ASSERT_TRUE(status.ok());
+    EXPECT_EQ(response.next_states(i), expected.next_state());
+  }
+}
+
+// Check that a ScoreStrings request returns the uniform costs of each of the
+// strings, in order.
+void CheckScoreStrings(const std::vector<std::string>& texts,
+                       bool score_end_of_string, bool return_bits) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  ScoreStringsRequest request;
+  for (const auto& text : texts) request.add_texts(text);
+  request.set_score_end_of_string(score_end_of_string);
+  request.set_return_bits(return_bits);
+  ScoreStringsResponse response;
+  const ScoreStringsRequest* request_ptr(&request);
+  Status status = server.HandleRequest(&context, request_ptr, &response);
+  ASSERT_TRUE(status.ok());
+  const int num_texts = texts.size();
+  ASSERT_EQ(response.scores_size(), num_texts);
+  const double uniform_cost = return_bits ? std::log2(28.0) : std::log(28.0);
+  for (int i = 0; i < num_texts; ++i) {
+    int num_costs = utf8::StrSplitByChar(texts[i]).size();
+    if (score_end_of_string) ++num_costs;
+    const StringScore& score = response.scores(i);
+    ASSERT_EQ(score.costs_size(), num_costs);
+    for (const double cost : score.costs()) {
+      EXPECT_NEAR(cost, uniform_cost, kFloatDelta);
+    }
+    EXPECT_NEAR(score.total_cost(), num_costs * uniform_cost, kFloatDelta);
+  }
+}
+
+// Check that a BulkUpdateLMCounts request updates the counts of the strings.
+void CheckBulkUpdateLMCounts(const std::string& text, int num_strings) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  BulkUpdateRequest request;
+  request.set_text(text);
+  request.set_count(1);
+  BulkUpdateResponse response;
+  Status status = server.HandleRequest(&context, &request, &response);
+  ASSERT_TRUE(status.ok());
+  EXPECT_EQ(response.num_strings(), num_strings);
+
+  // Following "a", the symbol "b" is now more likely than the other symbols.
+  GetContextRequest scores_request;
+  scores_request.set_context("a");
+  scores_request.set_top_k(1);
+  LMScores scores;
+  status = server.HandleRequest(&context, &scores_request, &scores);
+  ASSERT_TRUE(status.ok());
+  ASSERT_EQ(scores.symbols_size(), 1);
+  EXPECT_EQ(scores.symbols(0), "b");
+}
+
+// Returns the state reached by the context from the given state, or the
+// error code of the request.
+std::pair<int64, ::grpc::StatusCode> GetNextState(
+    ServerAsyncImpl* server, int state, const std::string& context_str) {
+  ServerContext context;
+  GetContextRequest request;
+  request.set_state(state);
+  request.set_context(context_str);
+  NextState response;
+  const Status status = server->HandleRequest(&context, &request, &response);
+  return {response.next_state(), status.error_code()};
+}
+
 }  // namespace
 
 // The following tests are one-liners feeding in different sets of arguments
@@ -141,6 +303,52 @@ TEST(ServerAsyncTest, GetLMScores_WorksOnOtherState) {
   CheckGetLMScores(0, "abcxyzff");
 }
 
+TEST(ServerAsyncTest, GetLMScores_WorksInCompactFormat) {
+  CheckGetLMScoresCompact("");
+  CheckGetLMScoresCompact("abcxyzff");
+}
+
+TEST(ServerAsyncTest, GetLMScores_ReturnsTopK) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  GetContextRequest request;
+  request.set_top_k(5);
+  LMScores response;
+  const GetContextRequest* request_ptr(&request);
+  Status status = server.HandleRequest(&context, request_ptr, &response);
+  ASSERT_TRUE(status.ok());
+  ASSERT_EQ(response.probabilities_size(), 5);
+  ASSERT_EQ(response.symbols_size(), 5);
+  double uniform_value = static_cast<double>(1.0) / static_cast<double>(28);
+  for (int i = 0; i < 5; i++) {
+    ASSERT_NEAR(response.probabilities(i), uniform_value, kFloatDelta);
+  }
+  ASSERT_NEAR(response.remaining_probability(), 23 * uniform_value,
+              kFloatDelta);
+}
+
+TEST(ServerAsyncTest, GetLMScoresBatch_ReturnsAppErrorOnBadState) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  GetContextBatchRequest request;
+  request.add_requests()->set_state(0);
+  request.add_requests()->set_state(999);
+  LMScoresBatch response;
+  const GetContextBatchRequest* request_ptr(&request);
+  Status status = server.HandleRequest(&context, request_ptr, &response);
+  EXPECT_EQ(status.error_code(), ::grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+TEST(ServerAsyncTest, GetLMScoresBatch_Works) {
+  CheckGetLMScoresBatch({});
+  CheckGetLMScoresBatch({"", "a", "abcxyzff", "zz"});
+}
+
+TEST(ServerAsyncTest, GetNextStateBatch_Works) {
+  CheckGetNextStateBatch({});
+  CheckGetNextStateBatch({"", "a", "ab", "abcxyzff", "a"});
+}
+
 TEST(ServerAsyncTest, UpdateLMScore_ReturnsAppErrorOnBadSymbol) {
   CheckUpdateLMScoresError(2, 999, 1, ::grpc::StatusCode::INVALID_ARGUMENT);
 }
@@ -161,5 +369,513 @@ TEST(ServerAsyncTest, UpdateLMScore_SetsLMScoreWitCountTen) {
   CheckUpdateLMScoresContent(0, 10);
 }
 
+TEST(ServerAsyncTest, ScoreStrings_Works) {
+  CheckScoreStrings({}, /*score_end_of_string=*/true, /*return_bits=*/true);
+  CheckScoreStrings({"", "a", "abcxyzff", "zz"}, /*score_end_of_string=*/true,
+                    /*return_bits=*/true);
+  CheckScoreStrings({"", "ab", "ba"}, /*score_end_of_string=*/false,
+                    /*return_bits=*/false);
+}
+
+TEST(ServerAsyncTest, ScoreStrings_ReturnsAppErrorOnBadRequest) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  ScoreStringsRequest request;
+  request.add_texts("ab");
+  request.set_state(999);
+  ScoreStringsResponse response;
+  const ScoreStringsRequest* request_ptr(&request);
+  Status status = server.HandleRequest(&context, request_ptr, &response);
+  EXPECT_EQ(status.error_code(), ::grpc::StatusCode::INVALID_ARGUMENT);
+
+  request.set_state(0);
+  request.add_texts("\xff");
+  status = server.HandleRequest(&context, request_ptr, &response);
+  EXPECT_EQ(status.error_code(), ::grpc::StatusCode::INVALID_ARGUMENT);
+
+  // Characters out of the vocabulary have no cost.
+  request.clear_texts();
+  request.add_texts("a#");
+  status = server.HandleRequest(&context, request_ptr, &response);
+  EXPECT_EQ(status.error_code(), ::grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+TEST(ServerAsyncTest, GetCompletions_Works) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  BulkUpdateRequest update_request;
+  update_request.set_text("hello\nhelp\nhe said\n");
+  update_request.set_count(20);
+  BulkUpdateResponse update_response;
+  ASSERT_TRUE(
+      server.HandleRequest(&context, &update_request, &update_response).ok());
+
+  CompletionRequest request;
+  request.set_context("he");
+  request.set_beam_width(4);
+  request.set_max_length(5);
+  request.add_stop_symbols(" ");
+  CompletionResponse response;
+  const CompletionRequest* request_ptr(&request);
+  Status status = server.HandleRequest(&context, request_ptr, &response);
+  ASSERT_TRUE(status.ok());
+  ASSERT_EQ(response.completions_size(), 4);
+  for (int i = 0; i < response.completions_size(); ++i) {
+    const Completion& completion = response.completions(i);
+    EXPECT_LE(utf8::StrSplitByChar(completion.text()).size(), 5);
+    if (i > 0) {
+      EXPECT_LE(response.completions(i - 1).cost(), completion.cost());
+    }
+    // The costs agree with the scores of the completions.
+    ScoreStringsRequest score_request;
+    score_request.add_texts(absl::StrCat("he", completion.text()));
+    score_request.set_score_end_of_string(
+        completion.finished() && !absl::EndsWith(completion.text(), " "));
+    ScoreStringsResponse score_response;
+    ASSERT_TRUE(
+        server.HandleRequest(&context, &score_request, &score_response).ok());
+    const auto& costs = score_response.scores(0).costs();
+    EXPECT_NEAR(completion.cost(),
+                std::accumulate(costs.begin() + 2, costs.end(), 0.0),
+                kFloatDelta);
+  }
+
+  request.set_sample(true);
+  status = server.HandleRequest(&context, request_ptr, &response);
+  ASSERT_TRUE(status.ok());
+  EXPECT_EQ(response.completions_size(), 4);
+}
+
+TEST(ServerAsyncTest, GetCompletions_ReturnsAppErrorOnBadRequest) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  CompletionRequest request;
+  request.set_max_length(5);
+  CompletionResponse response;
+  const CompletionRequest* request_ptr(&request);
+  Status status = server.HandleRequest(&context, request_ptr, &response);
+  EXPECT_EQ(status.error_code(), ::grpc::StatusCode::INVALID_ARGUMENT);
+
+  request.set_beam_width(2);
+  request.set_state(999);
+  status = server.HandleRequest(&context, request_ptr, &response);
+  EXPECT_EQ(status.error_code(), ::grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+TEST(ServerAsyncTest, BulkUpdateLMCounts_ReturnsAppErrorOnBadCount) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  BulkUpdateRequest request;
+  request.set_text("ab");
+  BulkUpdateResponse response;
+  Status status = server.HandleRequest(&context, &request, &response);
+  EXPECT_EQ(status.error_code(), ::grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+TEST(ServerAsyncTest, BulkUpdateLMCounts_UpdatesCounts) {
+  CheckBulkUpdateLMCounts("ab\nab\r\n\nabc\n", 3);
+}
+
+TEST(ServerAsyncTest, GetNextState_FollowsCachedContexts) {
+  ServerAsyncImplMock server;
+  const auto prefix = GetNextState(&server, 0, "ab");
+  ASSERT_EQ(prefix.second, ::grpc::StatusCode::OK);
+  const auto next = GetNextState(&server, prefix.first, "c");
+  ASSERT_EQ(next.second, ::grpc::StatusCode::OK);
+
+  // Extends the cached context, or finds it in the cache.
+  for (int i = 0; i < 2; ++i) {
+    const auto state = GetNextState(&server, 0, "abc");
+    ASSERT_EQ(state.second, ::grpc::StatusCode::OK);
+    EXPECT_EQ(state.first, next.first);
+  }
+
+  // Invalid UTF-8 contexts are ignored.
+  const auto invalid = GetNextState(&server, prefix.first, "c\xfe");
+  ASSERT_EQ(invalid.second, ::grpc::StatusCode::OK);
+  EXPECT_EQ(invalid.first, prefix.first);
+}
+
+TEST(ServerAsyncTest, GetNextState_RecyclesIdleStates) {
+  ModelHubConfig config;
+  config.set_maximim_maintained_states(10);
+  ServerAsyncImpl server(models::MakeModelHub(config).value());
+  const auto active = GetNextState(&server, 0, "a");
+  const auto idle = GetNextState(&server, 0, "b");
+  ASSERT_EQ(active.second, ::grpc::StatusCode::OK);
+  ASSERT_EQ(idle.second, ::grpc::StatusCode::OK);
+
+  // Creates more states than the hub keeps, while using the active state.
+  for (char c = 'c'; c <= 'z'; ++c) {
+    ASSERT_EQ(GetNextState(&server, 0, std::string(1, c)).second,
+              ::grpc::StatusCode::OK);
+    ASSERT_EQ(GetNextState(&server, active.first, "").second,
+              ::grpc::StatusCode::OK);
+  }
+  const auto next = GetNextState(&server, active.first, "");
+  ASSERT_EQ(next.second, ::grpc::StatusCode::OK);
+  EXPECT_EQ(next.first, active.first);
+
+  // The idle state has been overwritten, so its id is no longer valid.
+  EXPECT_EQ(GetNextState(&server, idle.first, "").second,
+            ::grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+TEST(ServerAsyncTest, GetNextState_RejectsStaleStateInCache) {
+  ModelHubConfig config;
+  config.set_maximim_maintained_states(10);
+  ServerAsyncImpl server(models::MakeModelHub(config).value());
+  const auto idle = GetNextState(&server, 0, "b");
+  ASSERT_EQ(idle.second, ::grpc::StatusCode::OK);
+  const auto active = GetNextState(&server, idle.first, "c");
+  ASSERT_EQ(active.second, ::grpc::StatusCode::OK);
+
+  // Overwrites the idle state, while using the state cached from it.
+  for (char c = 'd'; c <= 'z'; ++c) {
+    ASSERT_EQ(GetNextState(&server, 0, std::string(1, c)).second,
+              ::grpc::StatusCode::OK);
+    ASSERT_EQ(GetNextState(&server, active.first, "").second,
+              ::grpc::StatusCode::OK);
+  }
+
+  // The cached context is not followed from the overwritten state.
+  EXPECT_EQ(GetNextState(&server, idle.first, "c").second,
+            ::grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+TEST(ServerAsyncTest, GetStats_CountsHubStates) {
+  ModelHubConfig config;
+  config.set_maximim_maintained_states(10);
+  ServerAsyncImpl server(models::MakeModelHub(config).value());
+  for (char c = 'a'; c <= 'z'; ++c) {
+    ASSERT_EQ(GetNextState(&server, 0, std::string(1, c)).second,
+              ::grpc::StatusCode::OK);
+  }
+  ASSERT_EQ(GetNextState(&server, 0, "z").second, ::grpc::StatusCode::OK);
+
+  ServerContext context;
+  GetStatsRequest request;
+  ServerStats response;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &response).ok());
+  // The handlers called directly are not timed.
+  EXPECT_EQ(response.rpcs_size(), 0);
+  EXPECT_EQ(response.num_queued_requests(), 0);
+  EXPECT_EQ(response.num_active_requests(), 0);
+
+  // Each of the letters creates a state, overwriting the oldest ones once
+  // the nine states next to the start state are taken.
+  const HubStats& hub = response.hub();
+  EXPECT_EQ(hub.max_states(), 10);
+  EXPECT_EQ(hub.num_states(), 10);
+  EXPECT_EQ(hub.num_allocated_states(), 26);
+  EXPECT_EQ(hub.num_overwritten_states(), 17);
+  EXPECT_EQ(hub.context_cache_misses(), 26);
+  EXPECT_EQ(hub.context_cache_hits(), 1);
+
+  // The default bigram model has no state cache.
+  ASSERT_EQ(response.models_size(), 1);
+  EXPECT_EQ(response.models(0).next_state().count(), 26);
+  EXPECT_FALSE(response.models(0).has_cache());
+}
+
+TEST(ServerAsyncTest, UpdateLMScores_AdaptsToUserOnly) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  UpdateLMScoresRequest update;
+  update.set_state(0);
+  update.add_utf8_sym('a');
+  update.set_count(3);
+  update.set_user_id("alice");
+  LMScores update_response;
+  ASSERT_TRUE(server.HandleRequest(&context, &update, &update_response).ok());
+
+  // With the default prior weight of 5, the three counts of "a" at the start
+  // state are mixed with the uniform scores of the shared model.
+  GetContextRequest request;
+  request.set_state(0);
+  request.set_user_id("alice");
+  LMScores response;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &response).ok());
+  ASSERT_EQ(response.probabilities_size(), 28);
+  const double uniform_value = 1.0 / 28.0;
+  double total = 0.0;
+  for (int i = 0; i < 28; ++i) {
+    total += response.probabilities(i);
+    if (response.symbols(i) == "a") {
+      EXPECT_NEAR(response.probabilities(i), (3 + 5 * uniform_value) / 8.0,
+                  kFloatDelta);
+    } else {
+      EXPECT_NEAR(response.probabilities(i), 5 * uniform_value / 8.0,
+                  kFloatDelta);
+    }
+  }
+  EXPECT_NEAR(total, 1.0, kFloatDelta);
+
+  // The shared model and the other users are unaffected.
+  for (const std::string user : {"", "bob"}) {
+    request.set_user_id(user);
+    response.Clear();
+    ASSERT_TRUE(server.HandleRequest(&context, &request, &response).ok());
+    for (int i = 0; i < response.probabilities_size(); ++i) {
+      EXPECT_NEAR(response.probabilities(i), uniform_value, kFloatDelta);
+    }
+  }
+
+  GetStatsRequest stats_request;
+  ServerStats stats;
+  ASSERT_TRUE(server.HandleRequest(&context, &stats_request, &stats).ok());
+  EXPECT_EQ(stats.hub().num_users(), 1);
+}
+
+TEST(ServerAsyncTest, UpdateLMScores_RejectsUserCountsOfForgottenContext) {
+  ModelHubConfig config;
+  config.set_maximim_maintained_states(10);
+  ServerAsyncImpl server(models::MakeModelHub(config).value());
+  const auto idle = GetNextState(&server, 0, "b");
+  ASSERT_EQ(idle.second, ::grpc::StatusCode::OK);
+  const auto active = GetNextState(&server, idle.first, "c");
+  ASSERT_EQ(active.second, ::grpc::StatusCode::OK);
+
+  // Overwrites the idle state, which precedes the active state.
+  for (char c = 'd'; c <= 'z'; ++c) {
+    ASSERT_EQ(GetNextState(&server, 0, std::string(1, c)).second,
+              ::grpc::StatusCode::OK);
+    ASSERT_EQ(GetNextState(&server, active.first, "").second,
+              ::grpc::StatusCode::OK);
+  }
+
+  // The context of the active state is cut short, hence cannot key the
+  // counts of the user, while the shared counts are still updated.
+  ServerContext context;
+  UpdateLMScoresRequest update;
+  update.set_state(active.first);
+  update.add_utf8_sym('a');
+  update.set_count(3);
+  update.set_user_id("alice");
+  LMScores response;
+  EXPECT_EQ(server.HandleRequest(&context, &update, &response).error_code(),
+            ::grpc::StatusCode::INVALID_ARGUMENT);
+  update.clear_user_id();
+  response.Clear();
+  EXPECT_TRUE(server.HandleRequest(&context, &update, &response).ok());
+}
+
+TEST(ServerAsyncTest, StartSnapshots_RequiresSnapshotFile) {
+  ServerAsyncImplMock server;
+  EXPECT_FALSE(server.StartSnapshots(absl::Seconds(1)).ok());
+}
+
+TEST(ServerAsyncTest, StartSnapshots_KeepsCountUpdates) {
+  ModelHubConfig config;
+  config.set_snapshot_file(file::TempFilePath("server.counts"));
+  std::remove(config.snapshot_file().c_str());
+  {
+    ServerAsyncImpl server(models::MakeModelHub(config).value());
+    ASSERT_OK(server.StartSnapshots(absl::Hours(1)));
+    ServerContext context;
+    UpdateLMScoresRequest request;
+    request.set_state(0);
+    request.add_utf8_sym('a');
+    request.set_count(3);
+    LMScores response;
+    ASSERT_TRUE(server.HandleRequest(&context, &request, &response).ok());
+  }  // The last snapshot is written when the server is destroyed.
+
+  // The counts are restored by the next server using the snapshot file.
+  ServerAsyncImpl server(models::MakeModelHub(config).value());
+  ServerContext context;
+  GetContextRequest request;
+  request.set_state(0);
+  LMScores response;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &response).ok());
+  ASSERT_EQ(response.probabilities_size(), 28);
+  EXPECT_NEAR(response.normalization(), 31.0, kFloatDelta);
+  for (int i = 0; i < 28; ++i) {
+    EXPECT_NEAR(response.probabilities(i),
+                (response.symbols(i) == "a" ? 4.0 : 1.0) / 31.0, kFloatDelta);
+  }
+}
+
+TEST(ServerAsyncTest, Shutdown_WritesSnapshotWithoutSnapshotThread) {
+  ModelHubConfig config;
+  config.set_snapshot_file(file::TempFilePath("server.counts"));
+  std::remove(config.snapshot_file().c_str());
+  {
+    ServerAsyncImpl server(models::MakeModelHub(config).value());
+    ServerContext context;
+    UpdateLMScoresRequest request;
+    request.set_state(0);
+    request.add_utf8_sym('a');
+    request.set_count(3);
+    LMScores response;
+    ASSERT_TRUE(server.HandleRequest(&context, &request, &response).ok());
+  }  // The snapshots were never started, but the updates are still kept.
+
+  ServerAsyncImpl server(models::MakeModelHub(config).value());
+  ServerContext context;
+  GetContextRequest request;
+  request.set_state(0);
+  LMScores response;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &response).ok());
+  EXPECT_NEAR(response.normalization(), 31.0, kFloatDelta);
+}
+
+TEST(ServerAsyncTest, StartMemoryBudget_LimitsHubStates) {
+  ModelHubConfig config;
+  config.set_maximim_maintained_states(1000);
+  ServerAsyncImpl server(models::MakeModelHub(config).value());
+  EXPECT_FALSE(server.StartMemoryBudget(0, absl::Hours(1)).ok());
+  for (char c = 'a'; c <= 'z'; ++c) {
+    ASSERT_EQ(GetNextState(&server, 0, std::string(1, c)).second,
+              ::grpc::StatusCode::OK);
+  }
+
+  // The first rebalance, on the budget thread, keeps the fewest states.
+  ASSERT_OK(server.StartMemoryBudget(1, absl::Hours(1)));
+  EXPECT_FALSE(server.StartMemoryBudget(1, absl::Hours(1)).ok());
+  ServerContext context;
+  GetStatsRequest request;
+  ServerStats response;
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_TRUE(server.HandleRequest(&context, &request, &response).ok());
+    if (response.hub().max_states() < 1000) break;
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+  EXPECT_EQ(response.hub().max_states(), 10);
+  EXPECT_EQ(response.hub().num_states(), 10);
+  EXPECT_LT(0, response.hub().hub_states_bytes());
+}
+
+TEST(ServerAsyncTest, ReloadModels_SwitchesToNewModels) {
+  ServerAsyncImplMock server;
+  const auto state_a = GetNextState(&server, 0, "a");
+  ASSERT_EQ(state_a.second, ::grpc::StatusCode::OK);
+  ServerContext context;
+  BulkUpdateRequest update;
+  update.set_text("a");
+  update.set_count(5);
+  BulkUpdateResponse update_response;
+  ASSERT_TRUE(server.HandleRequest(&context, &update, &update_response).ok());
+
+  ReloadModelsRequest request;
+  ReloadModelsResponse response;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &response).ok());
+  EXPECT_EQ(response.num_models(), 1);
+
+  // The reloaded model has lost the count updates, and only the start state
+  // remains valid.
+  GetContextRequest scores_request;
+  LMScores scores;
+  ASSERT_TRUE(server.HandleRequest(&context, &scores_request, &scores).ok());
+  EXPECT_NEAR(scores.normalization(), 28.0, kFloatDelta);
+  EXPECT_EQ(GetNextState(&server, state_a.first, "").second,
+            ::grpc::StatusCode::INVALID_ARGUMENT);
+  const auto new_state_a = GetNextState(&server, 0, "a");
+  ASSERT_EQ(new_state_a.second, ::grpc::StatusCode::OK);
+  EXPECT_NE(new_state_a.first, state_a.first);
+
+  GetStatsRequest stats_request;
+  ServerStats stats;
+  ASSERT_TRUE(server.HandleRequest(&context, &stats_request, &stats).ok());
+  EXPECT_EQ(stats.num_model_reloads(), 1);
+}
+
+TEST(ServerAsyncTest, ReloadModels_KeepsSnapshottedCounts) {
+  ModelHubConfig config;
+  config.set_snapshot_file(file::TempFilePath("reload.counts"));
+  std::remove(config.snapshot_file().c_str());
+  ServerAsyncImpl server(models::MakeModelHub(config).value());
+  server.set_model_hub_config(config);
+  ServerContext context;
+  UpdateLMScoresRequest update;
+  update.set_state(0);
+  update.add_utf8_sym('a');
+  update.set_count(3);
+  LMScores update_response;
+  ASSERT_TRUE(server.HandleRequest(&context, &update, &update_response).ok());
+
+  // The updates not snapshotted yet are written by the current hub before
+  // the new one restores them.
+  ReloadModelsRequest request;
+  ReloadModelsResponse response;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &response).ok());
+  GetContextRequest scores_request;
+  LMScores scores;
+  ASSERT_TRUE(server.HandleRequest(&context, &scores_request, &scores).ok());
+  EXPECT_NEAR(scores.normalization(), 31.0, kFloatDelta);
+}
+
+TEST(ServerAsyncTest, ReloadModels_KeepsModelsOnFailure) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  ReloadModelsRequest request;
+  ModelConfig* model_config =
+      request.mutable_model_hub_config()->add_model_config();
+  model_config->set_type(ModelConfig::SIMPLE_CHAR_BIGRAM);
+  model_config->mutable_storage()->set_vocabulary_file("/nonexistent/vocab");
+  ReloadModelsResponse response;
+  EXPECT_FALSE(server.HandleRequest(&context, &request, &response).ok());
+  GetContextRequest scores_request;
+  scores_request.set_context("ab");
+  LMScores scores;
+  ASSERT_TRUE(server.HandleRequest(&context, &scores_request, &scores).ok());
+  EXPECT_EQ(scores.probabilities_size(), 28);
+}
+
+TEST(ServerAsyncTest, StartModelWatch_ReloadsChangedModels) {
+  const auto vocab_status = file::WriteTempTextFile("watch.vocab", "0\n97\n");
+  ASSERT_OK(vocab_status);
+  ModelHubConfig config;
+  ModelConfig* model_config = config.add_model_config();
+  model_config->set_type(ModelConfig::SIMPLE_CHAR_BIGRAM);
+  model_config->mutable_storage()->set_vocabulary_file(vocab_status.value());
+  ServerAsyncImpl server(models::MakeModelHub(config).value());
+  server.set_model_hub_config(config);
+  ASSERT_OK(server.StartModelWatch(absl::Milliseconds(10)));
+  EXPECT_FALSE(server.StartModelWatch(absl::Milliseconds(10)).ok());
+
+  // Replaces the vocabulary, which the watch picks up within a few checks.
+  ASSERT_OK(file::WriteTempTextFile("watch.vocab", "0\n97\n98\n"));
+  ServerContext context;
+  GetStatsRequest stats_request;
+  ServerStats stats;
+  const absl::Time deadline = absl::Now() + absl::Seconds(10);
+  while (stats.num_model_reloads() == 0 && absl::Now() < deadline) {
+    absl::SleepFor(absl::Milliseconds(10));
+    ASSERT_TRUE(server.HandleRequest(&context, &stats_request, &stats).ok());
+  }
+  EXPECT_EQ(stats.num_model_reloads(), 1);
+  GetContextRequest scores_request;
+  LMScores scores;
+  ASSERT_TRUE(server.HandleRequest(&context, &scores_request, &scores).ok());
+  EXPECT_EQ(scores.probabilities_size(), 3);
+  std::remove(vocab_status.value().c_str());
+}
+
+TEST(ServerAsyncTest, HandleRequest_RecordsSpansOfActiveTrace) {
+  ServerAsyncImplMock server;
+  Trace trace(TraceContext{1, 2, 0, true});
+  {
+    ScopedTraceActivation activation(&trace, /* parent_span_id= */0);
+    ServerContext context;
+    GetContextRequest request;
+    request.set_context("ab");
+    LMScores response;
+    ASSERT_TRUE(server.HandleRequest(&context, &request, &response).ok());
+  }
+  std::vector<std::string> names;
+  for (const SpanRecord& span : trace.TakeSpans()) names.push_back(span.name);
+  EXPECT_THAT(names,
+              ::testing::ElementsAre("LanguageModelHub::ContextState",
+                                     "LanguageModelHub::ExtractLMScores"));
+
+  // Nothing is recorded once the trace is no longer active.
+  ServerContext context;
+  GetContextRequest request;
+  LMScores response;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &response).ok());
+  EXPECT_TRUE(trace.TakeSpans().empty());
+}
+
 }  // namespace grpc
 }  // namespace mozolm
@@ -40,6 +40,17 @@
 //
 //   Will wait for queries in terminal, Ctrl-C to quit.
 //
+// o Using a PPM model compiled ahead of time by ppm_as_fst_compiler:
+//
+//   MODELFILE=/tmp/ppm.fst
+//   bazel-bin/mozolm/grpc/server_async \
+//     --server_config="address_uri:\"localhost:50051\" \
+//     model_hub_config { model_config { type:PPM_AS_FST storage { \
+//     model_file:\"$MODELFILE\" ppm_options { max_order: 4 \
+//     static_model: false model_is_fst: true } } } }"
+//
+//   Will wait for queries in terminal, Ctrl-C to quit.
+//
 // o Using the character n-gram FST model:
 //
 //   MODELFILE=${DATADIR}/models/testdata/gutenberg_en_char_ngram_o4_wb.fst
@@ -89,6 +100,14 @@ ABSL_FLAG(std::string, server_config_file, "",
 ABSL_FLAG(int, async_pool_size, 0,
           "Number of threads for handling requests asynchronously.");
 
+ABSL_FLAG(int, max_queued_requests, 0,
+          "Maximum number of requests waiting for a handler thread, beyond "
+          "which the requests are rejected. Unlimited if not positive.");
+
+ABSL_FLAG(int, snapshot_interval_sec, 0,
+          "Interval between the snapshots of the count updates, in seconds, "
+          "if the model hub configuration has a snapshot file.");
+
 ABSL_FLAG(std::string, ssl_server_key_file, "",
           "Private server key for SSL/TLS credentials.");
 
@@ -151,6 +170,13 @@ absl::Status InitConfigFromFlags(ServerConfig *config) {
   if (absl::GetFlag(FLAGS_async_pool_size) > 0) {
     config->set_async_pool_size(absl::GetFlag(FLAGS_async_pool_size));
   }
+  if (absl::GetFlag(FLAGS_max_queued_requests) > 0) {
+    config->set_max_queued_requests(absl::GetFlag(FLAGS_max_queued_requests));
+  }
+  if (absl::GetFlag(FLAGS_snapshot_interval_sec) > 0) {
+    config->set_snapshot_interval_sec(
+        absl::GetFlag(FLAGS_snapshot_interval_sec));
+  }
   InitConfigDefaults(config);
 
   // Initialize credentials.
@@ -18,13 +18,24 @@
 #include "include/grpcpp/security/server_credentials.h"
 #include "absl/memory/memory.h"
 #include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
 #include "mozolm/models/model_factory.h"
+#include "mozolm/utils/tracing.h"
 #include "mozolm/stubs/status_macros.h"
 
 namespace mozolm {
 namespace grpc {
 namespace {
 
+// Maximum number of traces waiting to be written, unless configured.
+constexpr int kDefaultMaxQueuedTraces = 1024;
+
+// Interval between the rebalances of the memory budget, unless configured.
+constexpr int kDefaultRebalanceIntervalSec = 10;
+
+// Interval between the snapshots of the count updates, unless configured.
+constexpr int kDefaultSnapshotIntervalSec = 60;
+
 // Builds SSL server credentials.
 std::shared_ptr<::grpc::ServerCredentials>
 BuildServerCredentials(const ServerAuthConfig::SslConfig &config) {
@@ -63,6 +74,20 @@ BuildServerCredentials(const ServerConfig &config) {
   }
 }
 
+// Creates the tracer of the requests, null if tracing is disabled.
+absl::StatusOr<std::unique_ptr<Tracer>> MakeTracer(
+    const TracingConfig &config) {
+  if (config.output_file().empty()) return std::unique_ptr<Tracer>();
+  const int max_queued_traces = config.max_queued_traces() > 0
+                                    ? config.max_queued_traces()
+                                    : kDefaultMaxQueuedTraces;
+  auto exporter_status =
+      FileTraceExporter::Create(config.output_file(), max_queued_traces);
+  if (!exporter_status.ok()) return exporter_status.status();
+  return absl::make_unique<Tracer>(config.sample_rate(),
+                                   std::move(exporter_status.value()));
+}
+
 // Worker thread for processing server requests in a completion queue.
 void ProcessRequests(ServerAsyncImpl *server, absl::Notification *cq_ready) {
   GOOGLE_LOG(INFO) << "Waiting for requests ...";
@@ -81,6 +106,10 @@ void ProcessRequests(ServerAsyncImpl *server, absl::Notification *cq_ready) {
 absl::Status ServerHelper::Init(const ServerConfig& config) {
   if (server_) return absl::InternalError("Server already active");
 
+  // Initialize the tracing, if enabled.
+  auto tracer_status = MakeTracer(config.tracing());
+  if (!tracer_status.ok()) return tracer_status.status();
+
   // Initialize the model hub.
   auto model_status = models::MakeModelHub(config.model_hub_config());
   if (!model_status.ok()) return model_status.status();
@@ -91,8 +120,33 @@ absl::Status ServerHelper::Init(const ServerConfig& config) {
 
   // Initialize and start the server.
   server_ = absl::make_unique<ServerAsyncImpl>(std::move(model_status.value()));
-  return server_->BuildAndStart(config.address_uri(), creds,
-                                config.async_pool_size());
+  server_->set_model_hub_config(config.model_hub_config());
+  server_->set_tracer(std::move(tracer_status.value()));
+  RETURN_IF_ERROR(server_->BuildAndStart(config.address_uri(), creds,
+                                         config.async_pool_size(),
+                                         config.max_queued_requests(),
+                                         config.transport()));
+  if (!config.model_hub_config().snapshot_file().empty()) {
+    // The hub records the count updates as soon as it has a snapshot file,
+    // hence they are always written out periodically.
+    const int interval_sec = config.snapshot_interval_sec() > 0
+                                 ? config.snapshot_interval_sec()
+                                 : kDefaultSnapshotIntervalSec;
+    RETURN_IF_ERROR(server_->StartSnapshots(absl::Seconds(interval_sec)));
+  }
+  const MemoryBudgetConfig& memory_budget = config.memory_budget();
+  if (memory_budget.budget_bytes() > 0) {
+    const int interval_sec = memory_budget.rebalance_interval_sec() > 0
+                                 ? memory_budget.rebalance_interval_sec()
+                                 : kDefaultRebalanceIntervalSec;
+    RETURN_IF_ERROR(server_->StartMemoryBudget(memory_budget.budget_bytes(),
+                                               absl::Seconds(interval_sec)));
+  }
+  if (config.model_watch_interval_sec() > 0) {
+    RETURN_IF_ERROR(server_->StartModelWatch(
+        absl::Seconds(config.model_watch_interval_sec())));
+  }
+  return absl::OkStatus();
 }
 
 absl::Status ServerHelper::Run(bool wait_till_terminated) {
@@ -106,6 +106,22 @@ TEST_F(ServerHelperTest, CheckRunServerWithEventLoop) {
   }
 }
 
+// Same as above, but with the requests handled by a pool of worker threads.
+TEST_F(ServerHelperTest, CheckRunServerWithThreadPool) {
+  constexpr int kNumSteps = 5;
+  constexpr int kPoolSize = 4;
+  config_.set_async_pool_size(kPoolSize);
+  ServerHelper server;
+  for (int i = 0; i < kNumSteps; ++i) {
+    GOOGLE_LOG(INFO) << "Iteration " << i;
+    ASSERT_OK(server.Init(config_));
+    EXPECT_LT(0, server.server().selected_port());
+    EXPECT_OK(server.Run(/* wait_till_terminated= */false));
+    absl::SleepFor(absl::Milliseconds(10));
+    server.Shutdown();
+  }
+}
+
 // Check starting up of the server with valid SSL/TLS credentials.
 TEST_F(ServerHelperTest, CheckStartWithValidSslCreds) {
   // Prepare the initial configuration: Valid key and invalid certificate.
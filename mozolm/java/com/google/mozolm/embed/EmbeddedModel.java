@@ -0,0 +1,136 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// In-process MozoLM model, bound to the native library over JNI.
+
+package com.google.mozolm.embed;
+
+/**
+ * Language model running in the process of the application, such as an
+ * on-device keyboard, rather than behind the gRPC service.
+ *
+ * The probabilities are returned into arrays owned by the caller, indexed by
+ * the vocabulary of the model. The vocabulary only grows, so that the index of
+ * a symbol never changes. The methods may be called from multiple threads.
+ */
+public final class EmbeddedModel implements AutoCloseable {
+  static {
+    System.loadLibrary("mozolm_jni");
+  }
+
+  private long nativeHandle;
+
+  private EmbeddedModel(long nativeHandle) {
+    this.nativeHandle = nativeHandle;
+  }
+
+  /**
+   * Creates the model from the model hub configuration, in protocol buffer
+   * text format.
+   *
+   * @throws IllegalArgumentException if the configuration is invalid or the
+   *     models cannot be read.
+   */
+  public static EmbeddedModel create(String configText) {
+    return new EmbeddedModel(nativeCreate(configText));
+  }
+
+  /** Releases the native model. The model may not be used afterwards. */
+  @Override
+  public synchronized void close() {
+    if (nativeHandle != 0) {
+      nativeDestroy(nativeHandle);
+      nativeHandle = 0;
+    }
+  }
+
+  /**
+   * Returns the state reached from the initial state, or from the start state
+   * if negative, after consuming the context. Returns -1 if the initial state
+   * is invalid.
+   */
+  public int contextState(String context, int initState) {
+    return nativeContextState(handle(), context, initState);
+  }
+
+  /** Returns the state reached from the start state after the context. */
+  public int contextState(String context) {
+    return contextState(context, -1);
+  }
+
+  /**
+   * Returns the state reached from the state following the Unicode codepoint,
+   * -1 if the state is invalid.
+   */
+  public int nextState(int state, int codepoint) {
+    return nativeNextState(handle(), state, codepoint);
+  }
+
+  /** Returns the number of symbols in the vocabulary. */
+  public int numSymbols() {
+    return nativeNumSymbols(handle());
+  }
+
+  /** Returns the vocabulary symbols from the given index onwards. */
+  public String[] symbols(int firstIndex) {
+    return nativeSymbols(handle(), firstIndex);
+  }
+
+  /**
+   * Fills in the probabilities of the symbols at the given state, indexed by
+   * the vocabulary. Returns the number of vocabulary symbols covered, which
+   * exceeds the length of the array if the vocabulary grew, in which case the
+   * new symbols are fetched and the call repeated with a larger array. Returns
+   * -1 if the state is invalid.
+   */
+  public int getProbabilities(int state, double[] probs) {
+    return nativeGetProbabilities(handle(), state, probs);
+  }
+
+  /**
+   * Updates the counts of the codepoints following the state, returning false
+   * if the state is invalid.
+   */
+  public boolean updateCounts(int state, int[] codepoints, long count) {
+    return nativeUpdateCounts(handle(), state, codepoints, count);
+  }
+
+  private synchronized long handle() {
+    if (nativeHandle == 0) {
+      throw new IllegalStateException("The model has been closed");
+    }
+    return nativeHandle;
+  }
+
+  private static native long nativeCreate(String configText);
+
+  private static native void nativeDestroy(long handle);
+
+  private static native int nativeContextState(
+      long handle, String context, int initState);
+
+  private static native int nativeNextState(
+      long handle, int state, int codepoint);
+
+  private static native int nativeNumSymbols(long handle);
+
+  private static native String[] nativeSymbols(long handle, int firstIndex);
+
+  private static native int nativeGetProbabilities(
+      long handle, int state, double[] probs);
+
+  private static native boolean nativeUpdateCounts(
+      long handle, int state, int[] codepoints, long count);
+}
@@ -0,0 +1,361 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/models/counts_journal.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <system_error>
+#include <utility>
+
+#include "mozolm/stubs/logging.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "mozolm/stubs/status_macros.h"
+#include "mozolm/utils/file_util.h"
+
+namespace mozolm {
+namespace models {
+namespace {
+
+// Snapshot file format: magic string, format version, number of models and
+// fingerprint of each model, followed by the chunks. Each chunk holds the
+// size of its payload, the checksum of the payload, and the payload: the
+// updates, each one as its count, number of symbols, model states and
+// symbols. The values are stored in the native byte order. The files of the
+// first version have no model fingerprints.
+constexpr char kSnapshotMagic[] = "MZCOUNTS";
+constexpr int kSnapshotMagicSize = sizeof(kSnapshotMagic) - 1;
+constexpr uint32 kSnapshotVersion = 2;
+constexpr uint32 kUnverifiedSnapshotVersion = 1;
+constexpr int kChunkHeaderSize = 2 * sizeof(uint64);
+
+// Minimum size of the file before it is compacted, which avoids rewriting
+// small files at each snapshot.
+constexpr int64 kMinCompactionSize = 1 << 16;
+
+// FNV-1a parameters of the chunk checksum.
+constexpr uint64 kFnvOffsetBasis = 0xcbf29ce484222325ULL;
+constexpr uint64 kFnvPrime = 0x100000001b3ULL;
+
+template <typename T>
+void AppendValues(const T* values, size_t num_values, std::string* out) {
+  out->append(reinterpret_cast<const char*>(values), num_values * sizeof(T));
+}
+
+template <typename T>
+bool ConsumeValues(absl::string_view* in, size_t num_values, T* values) {
+  const size_t num_bytes = num_values * sizeof(T);
+  if (in->size() < num_bytes) return false;
+  std::memcpy(values, in->data(), num_bytes);
+  in->remove_prefix(num_bytes);
+  return true;
+}
+
+uint64 Checksum(absl::string_view bytes) {
+  uint64 hash = kFnvOffsetBasis;
+  for (const char c : bytes) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * kFnvPrime;
+  }
+  return hash;
+}
+
+// Parses the payload of a chunk into the updates, returning false if it is
+// malformed.
+bool ParseUpdates(absl::string_view payload, int num_models,
+                  std::vector<CountsUpdate>* updates) {
+  while (!payload.empty()) {
+    CountsUpdate update;
+    uint32 num_syms;
+    update.model_states.resize(num_models);
+    if (!ConsumeValues(&payload, 1, &update.count) ||
+        !ConsumeValues(&payload, 1, &num_syms) ||
+        !ConsumeValues(&payload, num_models, update.model_states.data())) {
+      return false;
+    }
+    if (num_syms > payload.size() / sizeof(int32)) return false;
+    update.utf8_syms.resize(num_syms);
+    if (!ConsumeValues(&payload, num_syms, update.utf8_syms.data())) {
+      return false;
+    }
+    updates->push_back(std::move(update));
+  }
+  return true;
+}
+
+// Returns the chunk holding the updates.
+std::string EncodeChunk(const std::vector<CountsUpdate>& updates,
+                        int num_models) {
+  std::string payload;
+  for (const auto& update : updates) {
+    const uint32 num_syms = update.utf8_syms.size();
+    AppendValues(&update.count, 1, &payload);
+    AppendValues(&num_syms, 1, &payload);
+    AppendValues(update.model_states.data(), num_models, &payload);
+    AppendValues(update.utf8_syms.data(), num_syms, &payload);
+  }
+  std::string chunk;
+  const uint64 payload_size = payload.size();
+  const uint64 checksum = Checksum(payload);
+  AppendValues(&payload_size, 1, &chunk);
+  AppendValues(&checksum, 1, &chunk);
+  chunk += payload;
+  return chunk;
+}
+
+// Coalesces the repeated updates from the same model states into their first
+// occurrence, summing their counts.
+std::vector<CountsUpdate> CoalesceUpdates(std::vector<CountsUpdate> updates) {
+  std::vector<CountsUpdate> coalesced;
+  absl::flat_hash_map<std::pair<std::vector<int>, std::vector<int>>, int>
+      first_updates;
+  for (auto& update : updates) {
+    const auto pos = first_updates.emplace(
+        std::make_pair(update.model_states, update.utf8_syms),
+        coalesced.size());
+    if (pos.second) {
+      coalesced.push_back(std::move(update));
+    } else {
+      coalesced[pos.first->second].count += update.count;
+    }
+  }
+  return coalesced;
+}
+
+}  // namespace
+
+uint64 ModelStorageFingerprint(const ModelConfig& config) {
+  ModelConfig storage_config = config;
+  storage_config.clear_weight();
+  std::string key;
+  storage_config.SerializeToString(&key);
+  for (const std::string& path : {config.storage().model_file(),
+                                  config.storage().vocabulary_file()}) {
+    if (path.empty()) continue;
+    std::error_code size_error, time_error;
+    const auto size = std::filesystem::file_size(path, size_error);
+    const auto time = std::filesystem::last_write_time(path, time_error);
+    absl::StrAppend(&key, "\n", path, " ", size_error ? 0 : size, " ",
+                    time_error ? 0 : time.time_since_epoch().count());
+  }
+  return Checksum(key);
+}
+
+CountsJournal::CountsJournal(const std::string& snapshot_file,
+                             const std::vector<uint64>& model_fingerprints)
+    : snapshot_file_(snapshot_file),
+      model_fingerprints_(model_fingerprints),
+      num_models_(model_fingerprints.size()) {}
+
+absl::Status CountsJournal::Read(std::vector<CountsUpdate>* updates) {
+  absl::MutexLock lock(&snapshot_lock_);
+  RETURN_IF_ERROR(ReadLocked(updates));
+  compacted_size_ = snapshot_size_;
+  return absl::OkStatus();
+}
+
+absl::Status CountsJournal::ReadLocked(std::vector<CountsUpdate>* updates) {
+  snapshot_size_ = 0;
+  if (!std::ifstream(snapshot_file_).is_open()) return absl::OkStatus();
+  std::string contents;
+  ASSIGN_OR_RETURN(contents, file::ReadBinaryFile(snapshot_file_));
+  if (contents.empty()) return absl::OkStatus();
+  absl::string_view in = contents;
+  char magic[kSnapshotMagicSize];
+  uint32 version, num_models;
+  if (!ConsumeValues(&in, kSnapshotMagicSize, magic) ||
+      std::memcmp(magic, kSnapshotMagic, kSnapshotMagicSize) != 0 ||
+      !ConsumeValues(&in, 1, &version) || !ConsumeValues(&in, 1, &num_models)) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Not a counts snapshot file: ", snapshot_file_));
+  }
+  if (version == kUnverifiedSnapshotVersion) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "Counts snapshot ", snapshot_file_, " has no model fingerprints"));
+  }
+  if (version != kSnapshotVersion) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Unsupported counts snapshot version ", version));
+  }
+  if (num_models != num_models_) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "Counts snapshot written for ", num_models, " models, expected ",
+        num_models_));
+  }
+  std::vector<uint64> model_fingerprints(num_models);
+  if (!ConsumeValues(&in, num_models, model_fingerprints.data())) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Not a counts snapshot file: ", snapshot_file_));
+  }
+  for (int idx = 0; idx < num_models; ++idx) {
+    if (model_fingerprints[idx] != model_fingerprints_[idx]) {
+      return absl::FailedPreconditionError(absl::StrCat(
+          "Counts snapshot written for another version of model ", idx));
+    }
+  }
+  int64 valid_size = contents.size() - in.size();
+  while (!in.empty()) {
+    uint64 payload_size, checksum;
+    std::vector<CountsUpdate> chunk_updates;
+    if (!ConsumeValues(&in, 1, &payload_size) ||
+        !ConsumeValues(&in, 1, &checksum) || payload_size > in.size() ||
+        Checksum(in.substr(0, payload_size)) != checksum ||
+        !ParseUpdates(in.substr(0, payload_size), num_models_,
+                      &chunk_updates)) {
+      GOOGLE_LOG(WARNING) << "Ignoring the broken end of the counts snapshot "
+                          << snapshot_file_ << " after " << valid_size
+                          << " bytes";
+      break;
+    }
+    in.remove_prefix(payload_size);
+    valid_size += kChunkHeaderSize + payload_size;
+    updates->insert(updates->end(),
+                    std::make_move_iterator(chunk_updates.begin()),
+                    std::make_move_iterator(chunk_updates.end()));
+  }
+  snapshot_size_ = valid_size;
+  return absl::OkStatus();
+}
+
+void CountsJournal::Record(CountsUpdate update) {
+  absl::MutexLock lock(&pending_lock_);
+  pending_.push_back(std::move(update));
+}
+
+absl::StatusOr<int64> CountsJournal::Write() {
+  absl::MutexLock snapshot_lock(&snapshot_lock_);
+  std::vector<CountsUpdate> updates;
+  {
+    absl::MutexLock lock(&pending_lock_);
+    updates.swap(pending_);
+  }
+  if (updates.empty()) return 0;
+  const absl::Status status = WriteChunk(updates);
+  if (!status.ok()) {
+    // Keeps the updates, ahead of the ones recorded since.
+    absl::MutexLock lock(&pending_lock_);
+    updates.insert(updates.end(), std::make_move_iterator(pending_.begin()),
+                   std::make_move_iterator(pending_.end()));
+    pending_.swap(updates);
+    return status;
+  }
+  if (snapshot_size_ >= kMinCompactionSize &&
+      snapshot_size_ >= 2 * compacted_size_) {
+    const auto num_compacted = CompactLocked();
+    if (!num_compacted.ok()) {
+      // The updates are written, only the compaction is postponed.
+      GOOGLE_LOG(WARNING) << "Failed to compact the counts snapshot "
+                          << snapshot_file_ << ": "
+                          << num_compacted.status().ToString();
+      compacted_size_ = snapshot_size_;
+    }
+  }
+  return updates.size();
+}
+
+absl::StatusOr<int64> CountsJournal::Compact() {
+  absl::MutexLock lock(&snapshot_lock_);
+  return CompactLocked();
+}
+
+absl::StatusOr<int64> CountsJournal::CompactLocked() {
+  std::vector<CountsUpdate> updates;
+  const int64 written_size = snapshot_size_;
+  const absl::Status read_status = ReadLocked(&updates);
+  snapshot_size_ = written_size;  // The file is left unchanged until renamed.
+  RETURN_IF_ERROR(read_status);
+  if (updates.empty()) return 0;
+  const std::vector<CountsUpdate> compacted =
+      CoalesceUpdates(std::move(updates));
+
+  // Writes the compacted file aside, then moves it over the snapshot file, so
+  // that the snapshot file is complete at any time.
+  const std::string contents = Header() + EncodeChunk(compacted, num_models_);
+  const std::string compacted_file = absl::StrCat(snapshot_file_, ".tmp");
+  {
+    std::ofstream outfile(compacted_file, std::ios_base::out |
+                                              std::ios_base::binary |
+                                              std::ios_base::trunc);
+    if (!outfile.is_open()) {
+      return absl::PermissionDeniedError(
+          absl::StrCat("Cannot open ", compacted_file));
+    }
+    outfile.write(contents.data(), contents.size());
+    outfile.flush();
+    if (!outfile) {
+      return absl::InternalError(
+          absl::StrCat("Failed to write ", compacted_file));
+    }
+  }
+  if (std::rename(compacted_file.c_str(), snapshot_file_.c_str()) != 0) {
+    return absl::InternalError(
+        absl::StrCat("Failed to replace ", snapshot_file_));
+  }
+  snapshot_size_ = contents.size();
+  compacted_size_ = snapshot_size_;
+  return compacted.size();
+}
+
+int64 CountsJournal::num_pending() const {
+  absl::MutexLock lock(&pending_lock_);
+  return pending_.size();
+}
+
+std::string CountsJournal::Header() const {
+  std::string header;
+  const uint32 num_models = num_models_;
+  AppendValues(kSnapshotMagic, kSnapshotMagicSize, &header);
+  AppendValues(&kSnapshotVersion, 1, &header);
+  AppendValues(&num_models, 1, &header);
+  AppendValues(model_fingerprints_.data(), num_models_, &header);
+  return header;
+}
+
+absl::Status CountsJournal::WriteChunk(
+    const std::vector<CountsUpdate>& updates) {
+  std::string chunk;
+  if (snapshot_size_ == 0) chunk = Header();
+  chunk += EncodeChunk(updates, num_models_);
+
+  // Overwrites whatever follows the valid contents, such as the end of an
+  // interrupted snapshot.
+  std::fstream outfile;
+  if (snapshot_size_ == 0) {
+    outfile.open(snapshot_file_, std::ios_base::out | std::ios_base::binary |
+                                     std::ios_base::trunc);
+  } else {
+    outfile.open(snapshot_file_, std::ios_base::in | std::ios_base::out |
+                                     std::ios_base::binary);
+    outfile.seekp(snapshot_size_);
+  }
+  if (!outfile.is_open()) {
+    return absl::PermissionDeniedError(
+        absl::StrCat("Cannot open ", snapshot_file_));
+  }
+  outfile.write(chunk.data(), chunk.size());
+  outfile.flush();
+  if (!outfile) {
+    return absl::InternalError(
+        absl::StrCat("Failed to write ", snapshot_file_));
+  }
+  snapshot_size_ += chunk.size();
+  return absl::OkStatus();
+}
+
+}  // namespace models
+}  // namespace mozolm
@@ -0,0 +1,140 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Journal of the count updates applied to the models of the hub, snapshotted
+// to a binary file so that the adaptation survives server restarts.
+//
+// Rather than writing whole models, the snapshot file holds the sequence of
+// count updates applied since the models were read: replaying them onto the
+// same models, read from the same storage, reproduces the adapted counts
+// exactly, since the model states are assigned deterministically, even by
+// the models trained from text with several threads. The header of the file
+// records a fingerprint of the configuration and storage of each model, so
+// that the updates are not replayed onto other models, such as retrained
+// ones, whose states are unrelated. Each snapshot only appends the updates
+// recorded since the previous one, as a chunk with its own checksum, so that
+// a snapshot interrupted by a crash only loses its own updates.
+//
+// Once the file has doubled in size since it was last compacted, the next
+// snapshot compacts it, coalescing the repeated updates from the same model
+// states into their first occurrence. The counts of the updates add up in
+// the models, and the repeated updates create no new model states, so that
+// the compacted file restores the same counts.
+
+#ifndef MOZOLM_MOZOLM_MODELS_COUNTS_JOURNAL_H_
+#define MOZOLM_MOZOLM_MODELS_COUNTS_JOURNAL_H_
+
+#include <string>
+#include <vector>
+
+#include "mozolm/stubs/integral_types.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "mozolm/models/model_config.pb.h"
+
+namespace mozolm {
+namespace models {
+
+// Count update applied to each of the models in turn, from the given model
+// states.
+struct CountsUpdate {
+  std::vector<int> model_states;  // One state per model.
+  std::vector<int> utf8_syms;
+  int64 count = 0;
+};
+
+// Returns the fingerprint of the model configuration, not counting its
+// mixture weight, and of the size and modification time of its files, which
+// change when the model is retrained. The fingerprint is stable across
+// processes.
+uint64 ModelStorageFingerprint(const ModelConfig& config);
+
+// Records the count updates and appends them to the snapshot file.
+// Thread-safe.
+class CountsJournal {
+ public:
+  // Creates the journal of the updates to the models with the given
+  // fingerprints, snapshotted to the given file.
+  CountsJournal(const std::string& snapshot_file,
+                const std::vector<uint64>& model_fingerprints);
+  ~CountsJournal() = default;
+
+  CountsJournal(const CountsJournal&) = delete;
+  CountsJournal& operator=(const CountsJournal&) = delete;
+
+  // Reads the updates in the snapshot file, in the order they were applied,
+  // none if there is no such file yet. A broken chunk at the end of the file,
+  // left by an interrupted snapshot, is ignored and overwritten by the next
+  // snapshot. Returns a failed precondition error if the file was written
+  // for other models, with other fingerprints, and an invalid argument error
+  // if it is not a snapshot file.
+  absl::Status Read(std::vector<CountsUpdate>* updates)
+      ABSL_LOCKS_EXCLUDED(snapshot_lock_);
+
+  // Records the update, to be written by the next snapshot.
+  void Record(CountsUpdate update) ABSL_LOCKS_EXCLUDED(pending_lock_);
+
+  // Appends the updates recorded since the last snapshot to the file,
+  // returning their number. The updates are only written, outside of the lock
+  // of the recording, so that the updates keep being recorded meanwhile. If
+  // the snapshot fails, the updates are kept for the next one. Compacts the
+  // file if it has doubled in size since the last compaction.
+  absl::StatusOr<int64> Write()
+      ABSL_LOCKS_EXCLUDED(snapshot_lock_, pending_lock_);
+
+  // Rewrites the file with the repeated updates coalesced, replacing it
+  // atomically. Returns the number of updates kept.
+  absl::StatusOr<int64> Compact() ABSL_LOCKS_EXCLUDED(snapshot_lock_);
+
+  // Number of updates recorded since the last snapshot.
+  int64 num_pending() const ABSL_LOCKS_EXCLUDED(pending_lock_);
+
+  const std::string& snapshot_file() const { return snapshot_file_; }
+
+ private:
+  // Reads the updates in the file, setting the size of its valid contents.
+  absl::Status ReadLocked(std::vector<CountsUpdate>* updates)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(snapshot_lock_);
+
+  // Same as Compact().
+  absl::StatusOr<int64> CompactLocked()
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(snapshot_lock_);
+
+  // Appends the chunk of the updates to the file, after its valid contents.
+  absl::Status WriteChunk(const std::vector<CountsUpdate>& updates)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(snapshot_lock_);
+
+  // Returns the header of the file.
+  std::string Header() const;
+
+  const std::string snapshot_file_;
+  const std::vector<uint64> model_fingerprints_;
+  const int num_models_;
+
+  // Serializes the snapshots. Size of the valid contents of the file, zero if
+  // it has not been written yet, and its size after the last compaction or
+  // read.
+  absl::Mutex snapshot_lock_;
+  int64 snapshot_size_ ABSL_GUARDED_BY(snapshot_lock_) = 0;
+  int64 compacted_size_ ABSL_GUARDED_BY(snapshot_lock_) = 0;
+
+  mutable absl::Mutex pending_lock_;
+  std::vector<CountsUpdate> pending_ ABSL_GUARDED_BY(pending_lock_);
+};
+
+}  // namespace models
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_MODELS_COUNTS_JOURNAL_H_
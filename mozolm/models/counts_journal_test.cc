@@ -0,0 +1,178 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/models/counts_journal.h"
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "mozolm/utils/file_util.h"
+
+namespace mozolm {
+namespace models {
+namespace {
+
+using ::testing::ElementsAre;
+
+// Returns a fresh path for the snapshot file.
+std::string SnapshotPath(const std::string& filename) {
+  const std::string path = file::TempFilePath(filename);
+  std::remove(path.c_str());
+  return path;
+}
+
+TEST(CountsJournalTest, CheckIncrementalSnapshots) {
+  const std::string path = SnapshotPath("incremental.counts");
+  CountsJournal journal(path, /* model_fingerprints= */{1, 2});
+  std::vector<CountsUpdate> updates;
+  EXPECT_TRUE(journal.Read(&updates).ok());
+  EXPECT_TRUE(updates.empty());
+  EXPECT_EQ(0, journal.Write().value());
+
+  journal.Record({{0, 1}, {'a', 'b'}, 3});
+  journal.Record({{2, 5}, {0}, 1});
+  EXPECT_EQ(2, journal.num_pending());
+  EXPECT_EQ(2, journal.Write().value());
+  EXPECT_EQ(0, journal.num_pending());
+  journal.Record({{7, 8}, {}, 2});
+  EXPECT_EQ(1, journal.Write().value());
+
+  // The updates of both snapshots are read back in order.
+  CountsJournal restored(path, /* model_fingerprints= */{1, 2});
+  ASSERT_TRUE(restored.Read(&updates).ok());
+  ASSERT_EQ(3, updates.size());
+  EXPECT_THAT(updates[0].model_states, ElementsAre(0, 1));
+  EXPECT_THAT(updates[0].utf8_syms, ElementsAre('a', 'b'));
+  EXPECT_EQ(3, updates[0].count);
+  EXPECT_THAT(updates[1].model_states, ElementsAre(2, 5));
+  EXPECT_THAT(updates[1].utf8_syms, ElementsAre(0));
+  EXPECT_EQ(1, updates[1].count);
+  EXPECT_THAT(updates[2].model_states, ElementsAre(7, 8));
+  EXPECT_TRUE(updates[2].utf8_syms.empty());
+  EXPECT_EQ(2, updates[2].count);
+
+  // The restored journal appends to the file.
+  restored.Record({{3, 4}, {'c'}, 1});
+  EXPECT_EQ(1, restored.Write().value());
+  updates.clear();
+  ASSERT_TRUE(CountsJournal(path, {1, 2}).Read(&updates).ok());
+  ASSERT_EQ(4, updates.size());
+  EXPECT_THAT(updates[3].utf8_syms, ElementsAre('c'));
+}
+
+TEST(CountsJournalTest, CheckIgnoresBrokenEnd) {
+  const std::string path = SnapshotPath("broken.counts");
+  CountsJournal journal(path, /* model_fingerprints= */{1});
+  std::vector<CountsUpdate> updates;
+  ASSERT_TRUE(journal.Read(&updates).ok());
+  journal.Record({{0}, {'a'}, 1});
+  ASSERT_TRUE(journal.Write().ok());
+  {
+    // Simulates a snapshot interrupted in the middle of its chunk.
+    std::ofstream out(path, std::ios_base::app | std::ios_base::binary);
+    out << "garbage bytes of a broken chunk";
+  }
+  CountsJournal restored(path, /* model_fingerprints= */{1});
+  ASSERT_TRUE(restored.Read(&updates).ok());
+  ASSERT_EQ(1, updates.size());
+
+  // The next snapshot overwrites the broken end.
+  restored.Record({{1}, {'b'}, 2});
+  ASSERT_TRUE(restored.Write().ok());
+  updates.clear();
+  ASSERT_TRUE(CountsJournal(path, {1}).Read(&updates).ok());
+  ASSERT_EQ(2, updates.size());
+  EXPECT_THAT(updates[1].utf8_syms, ElementsAre('b'));
+}
+
+TEST(CountsJournalTest, CheckRejectsOtherModels) {
+  const std::string path = SnapshotPath("other.counts");
+  CountsJournal journal(path, /* model_fingerprints= */{1});
+  std::vector<CountsUpdate> updates;
+  ASSERT_TRUE(journal.Read(&updates).ok());
+  journal.Record({{0}, {'a'}, 1});
+  ASSERT_TRUE(journal.Write().ok());
+  EXPECT_TRUE(absl::IsFailedPrecondition(
+      CountsJournal(path, /* model_fingerprints= */{1, 2}).Read(&updates)));
+
+  // The model has been retrained, its states are not the same.
+  EXPECT_TRUE(absl::IsFailedPrecondition(
+      CountsJournal(path, /* model_fingerprints= */{3}).Read(&updates)));
+
+  const auto text_path = file::WriteTempTextFile("text.counts", "not counts");
+  ASSERT_TRUE(text_path.ok());
+  EXPECT_TRUE(absl::IsInvalidArgument(
+      CountsJournal(text_path.value(), {1}).Read(&updates)));
+}
+
+TEST(CountsJournalTest, CheckCompaction) {
+  const std::string path = SnapshotPath("compacted.counts");
+  CountsJournal journal(path, /* model_fingerprints= */{1});
+  std::vector<CountsUpdate> updates;
+  ASSERT_TRUE(journal.Read(&updates).ok());
+  EXPECT_EQ(0, journal.Compact().value());
+  journal.Record({{0}, {'a', 'b'}, 1});
+  journal.Record({{2}, {'c'}, 1});
+  ASSERT_TRUE(journal.Write().ok());
+  journal.Record({{0}, {'a', 'b'}, 2});
+  journal.Record({{0}, {'a'}, 1});
+  ASSERT_TRUE(journal.Write().ok());
+
+  // The repeated updates are coalesced into their first occurrence.
+  EXPECT_EQ(3, journal.Compact().value());
+  ASSERT_TRUE(CountsJournal(path, {1}).Read(&updates).ok());
+  ASSERT_EQ(3, updates.size());
+  EXPECT_THAT(updates[0].utf8_syms, ElementsAre('a', 'b'));
+  EXPECT_EQ(3, updates[0].count);
+  EXPECT_THAT(updates[1].utf8_syms, ElementsAre('c'));
+  EXPECT_THAT(updates[2].utf8_syms, ElementsAre('a'));
+
+  // The compacted file is appended to.
+  journal.Record({{2}, {'c'}, 4});
+  EXPECT_EQ(1, journal.Write().value());
+  updates.clear();
+  ASSERT_TRUE(CountsJournal(path, {1}).Read(&updates).ok());
+  ASSERT_EQ(4, updates.size());
+  EXPECT_EQ(4, updates[3].count);
+}
+
+TEST(CountsJournalTest, CheckModelStorageFingerprint) {
+  ModelConfig config;
+  const auto model_path = file::WriteTempTextFile("model.txt", "a b");
+  ASSERT_TRUE(model_path.ok());
+  config.mutable_storage()->set_model_file(model_path.value());
+  const uint64 fingerprint = ModelStorageFingerprint(config);
+  EXPECT_EQ(fingerprint, ModelStorageFingerprint(config));
+
+  // The mixture weight does not change the model states.
+  config.set_weight(0.5);
+  EXPECT_EQ(fingerprint, ModelStorageFingerprint(config));
+
+  // Other files or other types of models do.
+  ASSERT_TRUE(file::WriteTempTextFile("model.txt", "a b c").ok());
+  EXPECT_NE(fingerprint, ModelStorageFingerprint(config));
+  ModelConfig other_config = config;
+  other_config.set_type(ModelConfig::PPM_AS_FST);
+  EXPECT_NE(ModelStorageFingerprint(config),
+            ModelStorageFingerprint(other_config));
+}
+
+}  // namespace
+}  // namespace models
+}  // namespace mozolm
@@ -16,8 +16,8 @@
 
 #include <algorithm>
 
-#include "ngram/ngram-model.h"
 #include "absl/strings/str_cat.h"
+#include "mozolm/models/score_kernels.h"
 #include "mozolm/utils/utf8_util.h"
 
 namespace mozolm {
@@ -25,10 +25,8 @@ namespace models {
 
 int LanguageModel::ContextState(const std::string& context, int init_state) {
   int this_state = init_state < 0 ? start_state_ : init_state;
-  if (!context.empty()) {
-    const std::vector<int> context_utf8 =
-        utf8::StrSplitByCharToUnicode(context);
-    for (const auto& sym : context_utf8) {
+  if (!context.empty() && utf8::IsValidUTF8(context)) {
+    for (const char32 sym : utf8::Codepoints(context)) {
       this_state = NextState(this_state, static_cast<int>(sym));
       if (this_state < 0) {
         // Returns to start state if symbol not found.
@@ -40,6 +38,38 @@ int LanguageModel::ContextState(const std::string& context, int init_state) {
   return this_state;
 }
 
+bool LanguageModel::ExtractLMScores(int state, LMScores* response) {
+  std::vector<double> neg_log_probs;
+  double normalization;
+  if (!ExtractNegLogProbs(state, &neg_log_probs, &normalization)) return false;
+  std::vector<std::string> symbols;
+  symbols.reserve(neg_log_probs.size());
+  AppendSymbols(/* first_index= */0, &symbols);
+  if (symbols.size() < neg_log_probs.size()) return false;
+
+  // The symbols appended after the scores were computed are ignored.
+  const int num_symbols = neg_log_probs.size();
+  response->mutable_symbols()->Reserve(num_symbols);
+  for (int i = 0; i < num_symbols; ++i) {
+    *response->add_symbols() = std::move(symbols[i]);
+  }
+  const int first_index = response->probabilities_size();
+  response->mutable_probabilities()->Resize(first_index + num_symbols, 0.0);
+  NegLogProbsToProbs(
+      neg_log_probs.data(), num_symbols, /* offset= */0.0,
+      response->mutable_probabilities()->mutable_data() + first_index);
+  response->set_normalization(normalization);
+  return true;
+}
+
+bool LanguageModel::BulkUpdateLMCounts(
+    const std::vector<std::vector<int>>& utf8_strings, int64 count) {
+  for (const auto& utf8_syms : utf8_strings) {
+    if (!UpdateLMCounts(start_state_, utf8_syms, count)) return false;
+  }
+  return true;
+}
+
 absl::StatusOr<std::vector<std::pair<double, std::string>>>
 GetTopHypotheses(const LMScores &scores, int top_n) {
   const int num_entries = scores.probabilities().size();
@@ -70,16 +100,76 @@ GetTopHypotheses(const LMScores &scores, int top_n) {
   return std::move(hyps);
 }
 
-void SoftmaxRenormalize(std::vector<double> *neg_log_probs) {
-  double tot_prob = (*neg_log_probs)[0];
-  double kahan_factor = 0.0;
-  for (int i = 1; i < neg_log_probs->size(); ++i) {
-    tot_prob =
-        ngram::NegLogSum(tot_prob, (*neg_log_probs)[i], &kahan_factor);
+void PruneLMScores(int top_k, double min_probability, LMScores *scores) {
+  if (top_k <= 0 && min_probability <= 0.0) return;
+  const int num_entries = scores->probabilities_size();
+  std::vector<int> kept;
+  kept.reserve(num_entries);
+  double total_prob = 0.0;
+  for (int i = 0; i < num_entries; ++i) {
+    const double prob = scores->probabilities(i);
+    total_prob += prob;
+    if (prob >= min_probability) kept.push_back(i);
+  }
+  const auto more_likely = [scores](int a, int b) {
+    return scores->probabilities(a) > scores->probabilities(b);
+  };
+  if (top_k > 0 && kept.size() > top_k) {
+    std::nth_element(kept.begin(), kept.begin() + top_k, kept.end(),
+                     more_likely);
+    kept.resize(top_k);
+  }
+  std::sort(kept.begin(), kept.end(), more_likely);
+
+  // Moves the kept entries to the front, in the sorted order.
+  google::protobuf::RepeatedPtrField<std::string> symbols;
+  google::protobuf::RepeatedField<double> probabilities;
+  symbols.Reserve(kept.size());
+  probabilities.Reserve(kept.size());
+  double kept_prob = 0.0;
+  for (const int i : kept) {
+    *symbols.Add() = std::move(*scores->mutable_symbols(i));
+    probabilities.Add(scores->probabilities(i));
+    kept_prob += scores->probabilities(i);
+  }
+  scores->mutable_symbols()->Swap(&symbols);
+  scores->mutable_probabilities()->Swap(&probabilities);
+  scores->set_remaining_probability(std::max(0.0, total_prob - kept_prob));
+}
+
+absl::Status ExpandLMScores(const Vocabulary &vocabulary, LMScores *scores) {
+  if (scores->vocabulary_version() != vocabulary.version()) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "Mismatching vocabulary version: ", scores->vocabulary_version(),
+        " (expected ", vocabulary.version(), ")"));
   }
-  for (int i = 0; i < neg_log_probs->size(); ++i) {
-    (*neg_log_probs)[i] -= tot_prob;
+  const int num_entries = scores->compact_probabilities_size();
+  const bool dense = scores->vocabulary_indices().empty();
+  if (dense ? num_entries != vocabulary.symbols_size()
+            : num_entries != scores->vocabulary_indices_size()) {
+    return absl::InternalError(absl::StrCat(
+        "Mismatching number of compact probabilities: ", num_entries));
   }
+  scores->mutable_symbols()->Reserve(num_entries);
+  scores->mutable_probabilities()->Reserve(num_entries);
+  for (int i = 0; i < num_entries; ++i) {
+    const int index = dense ? i : scores->vocabulary_indices(i);
+    if (index < 0 || index >= vocabulary.symbols_size()) {
+      return absl::InternalError(absl::StrCat(
+          "Invalid vocabulary index: ", index));
+    }
+    scores->add_symbols(vocabulary.symbols(index));
+    scores->add_probabilities(scores->compact_probabilities(i));
+  }
+  scores->clear_vocabulary_indices();
+  scores->clear_compact_probabilities();
+  return absl::OkStatus();
+}
+
+void SoftmaxRenormalize(std::vector<double> *neg_log_probs) {
+  const double tot_prob =
+      NegLogSumOfProbs(neg_log_probs->data(), neg_log_probs->size());
+  for (double &neg_log_prob : *neg_log_probs) neg_log_prob -= tot_prob;
 }
 
 }  // namespace models
@@ -28,6 +28,43 @@
 namespace mozolm {
 namespace models {
 
+// Options for the scores returned to the clients.
+struct LMScoresOptions {
+  // Encoding of the scores.
+  LMScoresFormat format = LM_SCORES_FULL;
+
+  // If positive, only the top_k most likely symbols are returned.
+  int top_k = 0;
+
+  // If positive, only the symbols with at least this probability are
+  // returned.
+  double min_probability = 0.0;
+
+  // If non-empty, the scores returned by the model hub are adapted to the
+  // counts of this user. Ignored by the individual models.
+  std::string user;
+};
+
+// Counters of the lookups in the internal state cache of a model.
+struct ModelCacheStats {
+  int64 hits = 0;       // Lookups served by a fresh cache entry.
+  int64 misses = 0;     // Lookups which had to (re)compute the entry.
+  int64 evictions = 0;  // Entries replaced to make room for other states.
+};
+
+// Approximate memory held by a model, in bytes.
+struct ModelMemoryUsage {
+  int64 model_bytes = 0;  // Structures of the model itself, e.g., the FST.
+  int64 cache_bytes = 0;  // Internal caches, which the model can shrink.
+};
+
+// Base class for the language models.
+//
+// Once the model has been read, the implementations are required to be
+// thread-safe: StateSym, NextState and ExtractLMScores may be called
+// concurrently with each other and with UpdateLMCounts. These read calls
+// are on the hot serving path and should avoid exclusive locks whenever the
+// model does not need to be modified.
 class LanguageModel {
  public:
   virtual ~LanguageModel() = default;
@@ -53,7 +90,30 @@ class LanguageModel {
   int start_state() const { return start_state_; }
 
   // Copies the probs and normalization from the given state into the response.
-  virtual bool ExtractLMScores(int state, LMScores* response) {
+  // The symbols are returned in the same order for all the states. If the
+  // vocabulary of the model grows, the new symbols are appended. By default
+  // this is built on top of the dense scores below.
+  virtual bool ExtractLMScores(int state, LMScores* response);
+
+  // Dense scores API, for the in-process callers that do not need protocol
+  // buffers. The symbols are identified by their vocabulary index, which never
+  // changes: new symbols are appended to the vocabulary.
+
+  // Returns the number of symbols in the vocabulary.
+  virtual int NumSymbols() {
+    return 0;  // Requires a derived class to complete.
+  }
+
+  // Appends the symbols with vocabulary indices from first_index onwards.
+  virtual void AppendSymbols(int first_index,
+                             std::vector<std::string>* symbols) {}
+
+  // Fills in the negative log probabilities indexed by the vocabulary for the
+  // given state, resizing the caller-provided vector to the number of symbols
+  // covered, and the normalization. The number of symbols may be lower than
+  // NumSymbols() if the vocabulary grew since the state was last scored.
+  virtual bool ExtractNegLogProbs(int state, std::vector<double>* neg_log_probs,
+                                  double* normalization) {
     return false;  // Requires a derived class to complete.
   }
 
@@ -63,6 +123,27 @@ class LanguageModel {
     return false;  // Requires a derived class to complete.
   }
 
+  // Updates the counts for each of the utf8_strings, starting from the start
+  // state, as if UpdateLMCounts was called for each of them in turn. Models
+  // can override this to amortize the locking and the cache maintenance over
+  // the strings.
+  virtual bool BulkUpdateLMCounts(
+      const std::vector<std::vector<int>>& utf8_strings, int64 count);
+
+  // Fills in the counters of the internal state cache of the model, returning
+  // false if the model has no such cache.
+  virtual bool GetCacheStats(ModelCacheStats* stats) const { return false; }
+
+  // Fills in the memory held by the model, returning false if the model does
+  // not track it.
+  virtual bool GetMemoryUsage(ModelMemoryUsage* usage) const { return false; }
+
+  // Limits the memory held by the internal caches of the model to about
+  // max_bytes, evicting the entries over the limit, or restores the limit of
+  // the configuration if max_bytes is negative. The caches keep the few
+  // entries they need to work even if max_bytes is lower.
+  virtual void SetCacheMemoryLimit(int64 max_bytes) {}
+
  protected:
   LanguageModel() : start_state_(0) {}
 
@@ -80,6 +161,17 @@ class LanguageModel {
 absl::StatusOr<std::vector<std::pair<double, std::string>>> GetTopHypotheses(
     const LMScores &scores, int top_n = -1);
 
+// Keeps only the most likely symbols in the scores as requested by the top_k
+// and min_probability options, sorted by decreasing probability, and sets the
+// remaining probability mass. Uses partial selection, hence is linear in the
+// number of scores for small top_k.
+void PruneLMScores(int top_k, double min_probability, LMScores *scores);
+
+// Converts the scores in compact format back to the full format, given the
+// vocabulary they refer to. Returns an error if the vocabulary version does
+// not match, in which case the client should fetch the current vocabulary.
+absl::Status ExpandLMScores(const Vocabulary &vocabulary, LMScores *scores);
+
 // Renormalizes negative log probabilities over vector.
 void SoftmaxRenormalize(std::vector<double> *neg_log_probs);
 
@@ -0,0 +1,322 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks for the hot paths of the models and of the model hub.
+//
+// Each benchmark takes two arguments: the ensemble of models in the hub (see
+// kEnsembleNames below) and the maximum number of hub states, which is also
+// used as the maximum size of the PPM state cache. The models are evaluated on
+// the held-out sample of the English Wikipedia text. For example, to measure
+// the mixing of the PPM and the character n-gram FST:
+//
+//   bazel run -c opt //mozolm/models:language_model_benchmark --
+//     --benchmark_filter='BM_ExtractLMScores/ensemble:3/.*'
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "mozolm/stubs/logging.h"
+#include "benchmark/benchmark.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "mozolm/models/language_model_hub.h"
+#include "mozolm/models/lm_scores.pb.h"
+#include "mozolm/models/model_config.pb.h"
+#include "mozolm/models/model_factory.h"
+#include "mozolm/utils/file_util.h"
+#include "mozolm/utils/utf8_util.h"
+
+namespace mozolm {
+namespace models {
+namespace {
+
+const char kDataDir[] = "mozolm/data";
+const char kTestDataDir[] = "mozolm/models/testdata";
+const char kBigramVocabFilename[] = "en_wiki_1Mline_char_bigram.rows.txt";
+const char kBigramCountsFilename[] = "en_wiki_1Mline_char_bigram.matrix.txt";
+const char kTrainTextFilename[] = "en_wiki_1Kline_sample.txt";
+const char kEvalTextFilename[] = "en_wiki_100line_dev_sample.txt";
+const char kCharFstModelFilename[] = "gutenberg_en_char_ngram_o4_wb.fst";
+
+// Ensembles of models, indexed by the first argument of the benchmarks.
+enum Ensemble {
+  kBigram = 0,       // Character bigram.
+  kCharFst,          // Character 4-gram FST.
+  kPpm,              // Adaptive 4-gram PPM.
+  kPpmAndFst,        // Interpolation of the PPM and the FST.
+  kPpmFstAndBigram,  // Interpolation of all three models.
+  kNumEnsembles
+};
+const char* const kEnsembleNames[kNumEnsembles] = {
+    "bigram", "fst", "ppm", "ppm+fst", "ppm+fst+bigram"};
+
+// Maximum numbers of hub states swept by the benchmarks.
+const int kCacheSizes[] = {1 << 10, 1 << 14, 1 << 18};
+
+// Returns full path to the data file.
+std::string DataPath(absl::string_view data_dir, absl::string_view filename) {
+  const std::filesystem::path path =
+      (std::filesystem::current_path() / std::string(data_dir) /
+       std::string(filename)).make_preferred();
+  return path.string();
+}
+
+// Adds the configuration of a single model to the hub configuration.
+void AddModelConfig(ModelConfig::ModelType type, int cache_size,
+                    ModelHubConfig* config) {
+  ModelConfig* model = config->add_model_config();
+  model->set_type(type);
+  ModelStorage* storage = model->mutable_storage();
+  switch (type) {
+    case ModelConfig::SIMPLE_CHAR_BIGRAM:
+      storage->set_vocabulary_file(DataPath(kDataDir, kBigramVocabFilename));
+      storage->set_model_file(DataPath(kDataDir, kBigramCountsFilename));
+      break;
+    case ModelConfig::CHAR_NGRAM_FST:
+      storage->set_model_file(DataPath(kTestDataDir, kCharFstModelFilename));
+      break;
+    case ModelConfig::PPM_AS_FST: {
+      storage->set_model_file(DataPath(kDataDir, kTrainTextFilename));
+      PpmAsFstOptions* options = storage->mutable_ppm_options();
+      options->set_max_order(4);
+      options->set_static_model(false);
+      options->set_max_cache_size(cache_size);
+      break;
+    }
+    default:
+      GOOGLE_LOG(FATAL) << "Unsupported model type: " << type;
+  }
+}
+
+// Makes the hub for the given ensemble and maximum number of states.
+std::unique_ptr<LanguageModelHub> MakeHub(int ensemble, int cache_size) {
+  ModelHubConfig config;
+  config.set_maximim_maintained_states(cache_size);
+  switch (ensemble) {
+    case kBigram:
+      AddModelConfig(ModelConfig::SIMPLE_CHAR_BIGRAM, cache_size, &config);
+      break;
+    case kCharFst:
+      AddModelConfig(ModelConfig::CHAR_NGRAM_FST, cache_size, &config);
+      break;
+    case kPpm:
+      AddModelConfig(ModelConfig::PPM_AS_FST, cache_size, &config);
+      break;
+    case kPpmAndFst:
+      AddModelConfig(ModelConfig::PPM_AS_FST, cache_size, &config);
+      AddModelConfig(ModelConfig::CHAR_NGRAM_FST, cache_size, &config);
+      config.set_mixture_type(ModelHubConfig::INTERPOLATION);
+      break;
+    case kPpmFstAndBigram:
+      AddModelConfig(ModelConfig::PPM_AS_FST, cache_size, &config);
+      AddModelConfig(ModelConfig::CHAR_NGRAM_FST, cache_size, &config);
+      AddModelConfig(ModelConfig::SIMPLE_CHAR_BIGRAM, cache_size, &config);
+      config.set_mixture_type(ModelHubConfig::INTERPOLATION);
+      break;
+    default:
+      GOOGLE_LOG(FATAL) << "Unknown ensemble: " << ensemble;
+  }
+  auto hub_status = MakeModelHub(config);
+  GOOGLE_CHECK(hub_status.ok()) << "Failed to make the hub for "
+                                << kEnsembleNames[ensemble] << ": "
+                                << hub_status.status().ToString();
+  return std::move(hub_status.value());
+}
+
+// Returns the hub for the given ensemble and maximum number of states, made
+// once and shared by the benchmarks, except for the benchmarks updating the
+// counts which get their own hub.
+LanguageModelHub* GetHub(int ensemble, int cache_size, bool for_updates) {
+  static absl::Mutex* mu = new absl::Mutex;
+  static auto* hubs =
+      new std::map<std::tuple<int, int, bool>,
+                   std::unique_ptr<LanguageModelHub>>;
+  absl::MutexLock lock(mu);
+  auto& hub = (*hubs)[std::make_tuple(ensemble, cache_size, for_updates)];
+  if (hub == nullptr) hub = MakeHub(ensemble, cache_size);
+  return hub.get();
+}
+
+// Returns the non-empty lines of the evaluation text.
+const std::vector<std::string>& EvalLines() {
+  static const auto* lines = [] {
+    const auto text_status =
+        file::ReadBinaryFile(DataPath(kDataDir, kEvalTextFilename));
+    GOOGLE_CHECK(text_status.ok()) << text_status.status().ToString();
+    return new std::vector<std::string>(
+        absl::StrSplit(text_status.value(), '\n', absl::SkipEmpty()));
+  }();
+  return *lines;
+}
+
+// Returns the codepoints of the evaluation text, one vector per line.
+const std::vector<std::vector<int>>& EvalCodepoints() {
+  static const auto* codepoints = [] {
+    auto* result = new std::vector<std::vector<int>>;
+    for (const std::string& line : EvalLines()) {
+      result->push_back(utf8::StrSplitByCharToUnicode(line));
+    }
+    return result;
+  }();
+  return *codepoints;
+}
+
+// Returns the hub states reached by the prefixes of the evaluation text, up
+// to half of the maximum number of hub states. The states recycled while
+// walking the text are left out.
+std::vector<int> EvalStates(LanguageModelHub* hub, int cache_size) {
+  std::vector<int> states;
+  for (const std::vector<int>& line : EvalCodepoints()) {
+    int state = 0;
+    for (const int utf8_sym : line) {
+      if (states.size() * 2 >= cache_size) break;
+      state = hub->NextState(state, utf8_sym);
+      states.push_back(state);
+    }
+  }
+  std::vector<int> valid_states;
+  for (const int state : states) {
+    if (hub->StateSym(state) >= 0) valid_states.push_back(state);
+  }
+  GOOGLE_CHECK(!valid_states.empty());
+  return valid_states;
+}
+
+// Follows the characters of the evaluation text, one character per iteration.
+void BM_NextState(benchmark::State& state) {
+  LanguageModelHub* hub = GetHub(state.range(0), state.range(1),
+                                 /*for_updates=*/false);
+  const std::vector<std::vector<int>>& lines = EvalCodepoints();
+  size_t line = 0, pos = 0;
+  int hub_state = 0;
+  for (auto _ : state) {
+    if (pos == lines[line].size()) {
+      line = (line + 1) % lines.size();
+      pos = 0;
+      hub_state = 0;
+    }
+    hub_state = hub->NextState(hub_state, lines[line][pos++]);
+    benchmark::DoNotOptimize(hub_state);
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetLabel(kEnsembleNames[state.range(0)]);
+}
+
+// Extracts the scores at the states reached by the evaluation text, which
+// includes the mixing of the scores for the ensembles.
+void BM_ExtractLMScores(benchmark::State& state) {
+  LanguageModelHub* hub = GetHub(state.range(0), state.range(1),
+                                 /*for_updates=*/false);
+  const std::vector<int> states = EvalStates(hub, state.range(1));
+  size_t i = 0;
+  LMScores scores;
+  for (auto _ : state) {
+    scores.Clear();
+    benchmark::DoNotOptimize(hub->ExtractLMScores(states[i], &scores));
+    if (++i == states.size()) i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetLabel(kEnsembleNames[state.range(0)]);
+}
+
+// Same as above, for the top ten symbols in compact format.
+void BM_ExtractLMScoresCompactTopK(benchmark::State& state) {
+  LanguageModelHub* hub = GetHub(state.range(0), state.range(1),
+                                 /*for_updates=*/false);
+  const std::vector<int> states = EvalStates(hub, state.range(1));
+  LMScoresOptions options;
+  options.format = LM_SCORES_COMPACT;
+  options.top_k = 10;
+  size_t i = 0;
+  LMScores scores;
+  for (auto _ : state) {
+    scores.Clear();
+    benchmark::DoNotOptimize(hub->ExtractLMScores(states[i], options,
+                                                  &scores));
+    if (++i == states.size()) i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetLabel(kEnsembleNames[state.range(0)]);
+}
+
+// Looks up the state of each of the growing prefixes of the evaluation text,
+// as sent by the clients after each typed character.
+void BM_ContextState(benchmark::State& state) {
+  LanguageModelHub* hub = GetHub(state.range(0), state.range(1),
+                                 /*for_updates=*/false);
+  std::vector<std::string> contexts;
+  for (const std::string& line : EvalLines()) {
+    std::string context;
+    for (const std::string& utf8_sym : utf8::StrSplitByChar(line)) {
+      context += utf8_sym;
+      contexts.push_back(context);
+    }
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(hub->ContextState(contexts[i]));
+    if (++i == contexts.size()) i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetLabel(kEnsembleNames[state.range(0)]);
+}
+
+// Updates the counts with the characters of the evaluation text, one
+// character per iteration.
+void BM_UpdateLMCounts(benchmark::State& state) {
+  LanguageModelHub* hub = GetHub(state.range(0), state.range(1),
+                                 /*for_updates=*/true);
+  const std::vector<std::vector<int>>& lines = EvalCodepoints();
+  size_t line = 0, pos = 0;
+  int hub_state = 0;
+  for (auto _ : state) {
+    if (pos == lines[line].size()) {
+      line = (line + 1) % lines.size();
+      pos = 0;
+      hub_state = 0;
+    }
+    const int utf8_sym = lines[line][pos++];
+    benchmark::DoNotOptimize(hub->UpdateLMCounts(hub_state, {utf8_sym}, 1));
+    hub_state = hub->NextState(hub_state, utf8_sym);
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetLabel(kEnsembleNames[state.range(0)]);
+}
+
+// Sweeps all the ensembles and cache sizes.
+void EnsemblesAndCacheSizes(benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"ensemble", "cache_size"});
+  for (int ensemble = 0; ensemble < kNumEnsembles; ++ensemble) {
+    for (const int cache_size : kCacheSizes) {
+      benchmark->Args({ensemble, cache_size});
+    }
+  }
+}
+
+BENCHMARK(BM_NextState)->Apply(EnsemblesAndCacheSizes);
+BENCHMARK(BM_ExtractLMScores)->Apply(EnsemblesAndCacheSizes);
+BENCHMARK(BM_ExtractLMScoresCompactTopK)->Apply(EnsemblesAndCacheSizes);
+BENCHMARK(BM_ContextState)->Apply(EnsemblesAndCacheSizes);
+BENCHMARK(BM_UpdateLMCounts)->Apply(EnsemblesAndCacheSizes);
+
+}  // namespace
+}  // namespace models
+}  // namespace mozolm
+
+BENCHMARK_MAIN();
@@ -16,9 +16,21 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <numeric>
 
 #include "mozolm/stubs/logging.h"
 #include "ngram/ngram-model.h"
+#include "absl/hash/hash.h"
+#include "absl/memory/memory.h"
+#include "absl/random/random.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
+#include "mozolm/models/score_kernels.h"
+#include "mozolm/utils/file_util.h"
+#include "mozolm/utils/tracing.h"
 #include "mozolm/utils/utf8_util.h"
 #include "mozolm/stubs/status_macros.h"
 
@@ -26,49 +38,75 @@ namespace mozolm {
 namespace models {
 
 constexpr int kMaxHubStates = 10000;  // Max number of hub states to maintain.
+constexpr int kMinHubStates = 10;  // Min number of hub states under a limit.
+
+// Bound on the bits of the state ids used by the hub state index, leaving the
+// remaining bits for the generation of the state.
+constexpr int kMaxHubStateIndexBits = 24;
+
+// Number of lines applied under a single lock by the bulk count updates.
+constexpr int kBulkUpdateBatchSize = 64;
+
+// Initial number of slots of the hub transition table, a power of two.
+constexpr size_t kMinHubTransitionSlots = 64;
+
+// Marks the empty slots of the hub transition table. Never a valid key, since
+// the hub states are non-negative.
+constexpr uint64 kEmptyTransitionKey = ~0ULL;
+
+// Parameters of the 64-bit FNV-1a hash used for the vocabulary versions.
+constexpr uint64 kFnvOffsetBasis = 0xcbf29ce484222325ULL;
+constexpr uint64 kFnvPrime = 0x100000001b3ULL;
 
 namespace impl {
 namespace {
 
-// Scans through lm_scores, adding each item to existing flat hash map, scaled
-// with mix_weight and combined with already existing values for the string.
-double MixResults(const LMScores& lm_scores, double mix_weight,
-                  absl::flat_hash_map<std::string, double>* mixed_values) {
-  for (int i = 0; i < lm_scores.probabilities_size(); i++) {
-    const std::string key = lm_scores.symbols(i);
-    double value = -std::log(lm_scores.probabilities(i)) + mix_weight;
-    if (mixed_values->contains(key)) {
-      value = ngram::NegLogSum(value, mixed_values->find(key)->second);
-    }
-    mixed_values->insert_or_assign(key, value);
+// Extends the FNV-1a hash with the symbol, including its terminator so that
+// the version depends on the symbol boundaries.
+uint64 FingerprintSymbol(const std::string& symbol, uint64 hash) {
+  for (const char c : symbol) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * kFnvPrime;
   }
-  // Weights the normalization value by the mixture weight.
-  return lm_scores.normalization() * std::exp(-mix_weight);
+  return (hash ^ 0xff) * kFnvPrime;
 }
 
-void ExtractMixture(
-    const absl::flat_hash_map<std::string, double>& mixed_values,
-    double mixed_normalization, LMScores* response) {
-  std::vector<std::pair<std::string, double>> values(mixed_values.size());
-  int idx = 0;
-  double norm;
-  for (const auto& mixed_value : mixed_values) {
-    if (idx == 0) {
-      norm = mixed_value.second;
-    } else {
-      norm = ngram::NegLogSum(norm, mixed_value.second);
-    }
-    values[idx++] = std::make_pair(mixed_value.first, mixed_value.second);
-  }
-  // Sorts in lexicographic order, normalizes and converts from -log to probs.
-  std::sort(values.begin(), values.end());
-  response->mutable_symbols()->Reserve(values.size());
-  response->mutable_probabilities()->Reserve(values.size());
-  for (int i = 0; i < values.size(); ++i) {
-    response->add_symbols(values[i].first);
-    response->add_probabilities(std::exp(-values[i].second + norm));
+// Mixes the bits of the transition key, so that its low bits can be used as
+// the table index.
+inline size_t HashTransitionKey(uint64 key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key;
+}
+
+// Returns the byte position of the last codepoint of the non-empty UTF-8
+// text, skipping back over the continuation bytes.
+size_t LastCharPosition(absl::string_view text) {
+  size_t pos = text.size() - 1;
+  while (pos > 0 && (static_cast<unsigned char>(text[pos]) & 0xC0) == 0x80) {
+    --pos;
   }
-  response->set_normalization(mixed_normalization);
+  return pos;
+}
+
+// Returns whether the symbol of the scores stands for the end-of-string: the
+// empty symbol, or the encoding of the codepoint 0 used by some of the models.
+bool IsEndOfStringSymbol(absl::string_view symbol) {
+  return symbol.empty() || (symbol.size() == 1 && symbol[0] == '\0');
+}
+
+// Buffers of the dense probabilities, kept by each thread between the calls
+// so that the repeated extractions, e.g., by the in-process callers, do not
+// allocate once the buffers have grown to the vocabularies.
+struct DenseScratch {
+  std::vector<std::vector<double>> model_neg_log_probs;  // Of each model.
+  std::vector<double> mixed_probs;  // Indexed by the mixture symbols.
+  std::vector<double> model_probs;  // Weighted probabilities of one model.
+};
+
+DenseScratch& ThreadDenseScratch() {
+  thread_local DenseScratch scratch;
+  return scratch;
 }
 
 }  // namespace
@@ -108,221 +146,1426 @@ bool LanguageModelHub::InitializeModels(const ModelHubConfig& config) {
     default:
       return false;  // Unknown mixture type.
   }
-  // Creates a start hub state, by convention index 0.
-  hub_states_.clear();
-  hub_states_.push_back(std::unique_ptr<LanguageModelHubState>());
-  const std::vector<int> dummy_states(language_models_.size());
-  hub_states_[0] = std::unique_ptr<LanguageModelHubState>(
-      new LanguageModelHubState(dummy_states, -1, 0));
-  if (InitializeStartHubState() != absl::OkStatus()) {
-    return false;
+  int max_hub_states = kMaxHubStates;
+  if (config.maximim_maintained_states() >= 10) {
+    max_hub_states = std::min(config.maximim_maintained_states(),
+                              1 << kMaxHubStateIndexBits);
   }
-  if (config.maximim_maintained_states() < 10) {
-    max_hub_states_ = kMaxHubStates;
-  } else {
-    max_hub_states_ = config.maximim_maintained_states();
+  {
+    // Creates a start hub state, by convention index 0.
+    absl::WriterMutexLock lock(&hub_lock_);
+    index_bits_ = 0;
+    while ((1 << index_bits_) < max_hub_states) ++index_bits_;
+    hub_states_.Reset(language_models_.size(), max_hub_states);
+    std::vector<int> start_states(language_models_.size());
+    for (auto idx = 0; idx < language_models_.size(); ++idx) {
+      start_states[idx] = language_models_[idx]->start_state();
+    }
+    hub_states_.AddState(start_states, -1, 0);
+  }
+  {
+    absl::WriterMutexLock lock(&context_cache_lock_);
+    context_cache_.Reset(max_hub_states);
+  }
+  user_adaptation_ = absl::make_unique<UserAdaptation>(
+      config.user_adaptation());
+
+  // Builds the mixture layout and seeds the vocabulary with the symbols at the
+  // start state. Further symbols are added as they show up in the responses.
+  {
+    absl::WriterMutexLock lock(&mix_lock_);
+    mix_symbols_.clear();
+    mix_indices_.clear();
+    mix_identity_.clear();
+    mix_vocab_indices_.clear();
+    mix_vocab_size_ = 0;
+  }
+  {
+    absl::WriterMutexLock lock(&vocab_lock_);
+    vocab_symbols_.clear();
+    vocab_indices_.clear();
+    vocab_version_ = kFnvOffsetBasis;
+  }
+  LMScores start_scores;
+  if (ExtractLMScores(0, &start_scores)) {
+    absl::WriterMutexLock lock(&vocab_lock_);
+    ExtendVocabulary(start_scores);
   }
-  last_created_hub_state_ = 0;
   return true;
 }
 
 int LanguageModelHub::StateSym(int state) {
-  if (state < 0 || state >= hub_states_.size()) {
+  absl::ReaderMutexLock lock(&hub_lock_);
+  const int index = DecodeState(state);
+  if (index < 0) {
     return -1;
   }
-  return hub_states_[state]->state_sym();
+  return hub_states_.state_sym(index);
 }
 
 absl::Status LanguageModelHub::UpdateHubState(
-    int idx, const std::vector<int>& model_states, int prev_state,
+    int idx, absl::Span<const int> model_states, int prev_state,
     int state_sym) {
-  std::vector<int> old_next_states;
-  ASSIGN_OR_RETURN(old_next_states,
-                   hub_states_[idx]->UpdateHubState(LanguageModelHubState(
-                       model_states, prev_state, state_sym)));
-  for (auto next_state : old_next_states) {
-    // Removes prev_state_ values that refer to old, overwritten hub state.
-    hub_states_[next_state]->ResetPrevState();
+  if (model_states.size() != hub_states_.num_models()) {
+    return absl::InternalError("Size difference between hub state and models.");
   }
+  hub_states_.ResetState(idx, model_states, prev_state, state_sym);
   return absl::OkStatus();
 }
 
-absl::Status LanguageModelHub::InitializeStartHubState() {
-  std::vector<int> start_states(language_models_.size());
-  for (auto idx = 0; idx < language_models_.size(); ++idx) {
-    start_states[idx] = language_models_[idx]->start_state();
+void LanguageModelHub::ReplaceHub(const LanguageModelHub& replaced) {
+  uint32 replaced_offset;
+  {
+    absl::ReaderMutexLock lock(&replaced.hub_lock_);
+    replaced_offset = replaced.generation_offset_;
   }
-  return UpdateHubState(0, start_states, -1, 0);
+  // Shifts the generations by half of their range, so that the ids of the
+  // replaced hub are only accepted once a state has been overwritten as many
+  // times.
+  absl::WriterMutexLock lock(&hub_lock_);
+  generation_offset_ = replaced_offset + (1U << (30 - index_bits_));
+}
+
+int LanguageModelHub::EncodeState(int index) const {
+  if (index == 0) return 0;  // The start state.
+  const uint32 generation_mask = (1U << (31 - index_bits_)) - 1;
+  const uint32 generation = hub_states_.generation(index) + generation_offset_;
+  return static_cast<int>((generation & generation_mask) << index_bits_) |
+         index;
+}
+
+int LanguageModelHub::DecodeState(int state) const {
+  if (state < 0) return -1;
+  const int index = state & ((1 << index_bits_) - 1);
+  if (index >= hub_states_.size() || EncodeState(index) != state) return -1;
+  return index;
 }
 
 absl::StatusOr<int> LanguageModelHub::AssignNewHubState(
     const std::vector<int>& model_states, int prev_state, int state_sym) {
   int idx;
-  if (hub_states_.size() >= max_hub_states_) {
-    idx = last_created_hub_state_ + 1;
-    if (idx >= max_hub_states_) {
-      // Going back to overwrite earlier states, reinitializes start state.
-      auto init_hub_state_status = InitializeStartHubState();
-      if (init_hub_state_status != absl::OkStatus()) {
-        return init_hub_state_status;
-      }
-      idx = 1;
-    }
-    auto update_hub_state =
-        UpdateHubState(idx, model_states, prev_state, state_sym);
-    if (update_hub_state != absl::OkStatus()) {
-      return update_hub_state;
-    }
+  if (hub_states_.size() >= hub_states_.capacity()) {
+    // Recycles a state which has not been used recently. The start state and
+    // the state being extended are never recycled.
+    ScopedSpan span("LanguageModelHub::OverwriteHubState");
+    idx = hub_states_.NextVictim(prev_state);
+    RETURN_IF_ERROR(UpdateHubState(idx, model_states, prev_state, state_sym));
+    num_overwritten_states_.fetch_add(1, std::memory_order_relaxed);
   } else {
-    idx = hub_states_.size();
-    hub_states_.push_back(std::unique_ptr<LanguageModelHubState>());
-    hub_states_[idx] = std::unique_ptr<LanguageModelHubState>(
-        new LanguageModelHubState(model_states, prev_state, state_sym));
+    idx = hub_states_.AddState(model_states, prev_state, state_sym);
   }
-  last_created_hub_state_ = idx;
-  hub_states_[prev_state]->AddNextState(state_sym, idx);
-  return idx;
+  num_allocated_states_.fetch_add(1, std::memory_order_relaxed);
+  return EncodeState(idx);
 }
 
 int LanguageModelHub::NextState(int state, int utf8_sym) {
-  if (state < 0 || state >= hub_states_.size()) {
-    // Resets invalid state to the start state, by convention 0.
-    state = 0;
-  }
-  int next_state = hub_states_[state]->next_state(utf8_sym);
-  if (next_state >= 0) {
-    // Already created next state for that symbol.
-    return next_state;
+  std::vector<int> model_states;
+  int index = 0;  // Starts from the start state by default.
+  {
+    absl::ReaderMutexLock lock(&hub_lock_);
+    if (state >= 0) {
+      index = DecodeState(state);
+      if (index < 0) return -1;
+    }
+    hub_states_.MarkUsed(index);
+    const int next_state = hub_states_.next_state(index, utf8_sym);
+    if (next_state >= 0) {
+      // Already created next state for that symbol.
+      hub_states_.MarkUsed(next_state);
+      return EncodeState(next_state);
+    }
+    const auto hub_model_states = hub_states_.model_states(index);
+    model_states.assign(hub_model_states.begin(), hub_model_states.end());
   }
+  // Component models are queried without holding the hub lock.
   std::vector<int> next_states(language_models_.size());
   for (auto idx = 0; idx < language_models_.size(); ++idx) {
-    next_states[idx] = language_models_[idx]->NextState(
-        hub_states_[state]->model_state(idx), utf8_sym);
+    next_states[idx] = ModelNextState(idx, model_states[idx], utf8_sym);
   }
-  auto new_state_status = AssignNewHubState(next_states, state, utf8_sym);
+  absl::WriterMutexLock lock(&hub_lock_);
+  if (state >= 0 && DecodeState(state) != index) {
+    // The state has been overwritten in the meantime.
+    return -1;
+  }
+  const int next_state = hub_states_.next_state(index, utf8_sym);
+  if (next_state >= 0) {
+    // Created by another thread in the meantime.
+    hub_states_.MarkUsed(next_state);
+    return EncodeState(next_state);
+  }
+  if (hub_states_.model_states(index) != absl::MakeConstSpan(model_states)) {
+    // The state has been corrected in the meantime, hence the next model
+    // states need to be recomputed.
+    for (auto idx = 0; idx < language_models_.size(); ++idx) {
+      next_states[idx] =
+          ModelNextState(idx, hub_states_.model_state(index, idx), utf8_sym);
+    }
+  }
+  auto new_state_status = AssignNewHubState(next_states, index, utf8_sym);
   if (new_state_status.ok()) {
     return new_state_status.value();
   }
   return 0;  // Returns start state (0) if fails to assign new hub state.
 }
 
+int LanguageModelHub::ModelNextState(int idx, int model_state, int utf8_sym) {
+  ScopedLatencyTimer timer(&model_timings_[idx].next_state);
+  return language_models_[idx]->NextState(model_state, utf8_sym);
+}
+
 int LanguageModelHub::ContextState(const std::string& context, int init_state) {
-  // Sets initial state to start state if not otherwise valid.
-  int this_state = init_state < 0 ? 0 : init_state;
-  if (!context.empty()) {
-    const std::vector<int> context_utf8 =
-        utf8::StrSplitByCharToUnicode(context);
-    for (const auto& utf8_code : context_utf8) {
-      this_state = NextState(this_state, utf8_code);
-      if (this_state < 0) {
-        // Returns to start state if symbol not found.
-        // TODO: should it return to a null context state?
-        this_state = 0;
+  ScopedSpan span("LanguageModelHub::ContextState");
+  span.AddAttribute("context_bytes", context.size());
+  // Sets initial state to start state if negative.
+  const int start_state = init_state < 0 ? 0 : init_state;
+  {
+    // Rejects a stale initial state before the cache, whose entries from the
+    // old state could otherwise be returned.
+    absl::ReaderMutexLock lock(&hub_lock_);
+    if (DecodeState(start_state) < 0) return -1;
+  }
+  const absl::string_view full_context(context);
+  int this_state = start_state;
+  absl::string_view rest = full_context;
+  int cached_state = -1;
+  if (!full_context.empty()) {
+    cached_state = LookupContextCache(start_state, full_context);
+    if (cached_state >= 0) {
+      context_cache_hits_.fetch_add(1, std::memory_order_relaxed);
+      span.AddAttribute("cached_context_bytes", full_context.size());
+      this_state = cached_state;
+      rest = absl::string_view();
+    } else {
+      const size_t last_pos = impl::LastCharPosition(full_context);
+      const int prefix_state =
+          last_pos > 0
+              ? LookupContextCache(start_state, full_context.substr(0, last_pos))
+              : -1;
+      if (prefix_state >= 0) {
+        context_cache_prefix_hits_.fetch_add(1, std::memory_order_relaxed);
+        span.AddAttribute("cached_context_bytes", last_pos);
+        this_state = prefix_state;
+        rest = full_context.substr(last_pos);
+      } else {
+        context_cache_misses_.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  }
+  absl::StatusOr<int> state = WalkContext(this_state, rest);
+  if (state.ok() && state.value() < 0 && this_state != start_state) {
+    // The cached state has been overwritten, walks from the initial state.
+    span.AddAttribute("cached_state_overwritten", 1);
+    state = WalkContext(start_state, full_context);
+  }
+  if (!state.ok()) {
+    // Invalid UTF-8 contexts are ignored.
+    return WalkContext(start_state, absl::string_view()).value();
+  }
+  if (state.value() >= 0 && state.value() != cached_state &&
+      !full_context.empty()) {
+    InsertContextCache(start_state, full_context, state.value());
+  }
+  return state.value();
+}
+
+absl::StatusOr<int> LanguageModelHub::WalkContext(int state,
+                                                  absl::string_view context) {
+  char32 utf8_sym;
+  {
+    // Follows the existing hub transitions under a single shared lock.
+    absl::ReaderMutexLock lock(&hub_lock_);
+    int index = DecodeState(state);
+    if (index < 0) return -1;
+    hub_states_.MarkUsed(index);
+    while (!context.empty()) {
+      const int num_bytes = utf8::DecodeLeadingUnicodeChar(context, &utf8_sym);
+      if (num_bytes == 0) {
+        return absl::InvalidArgumentError("Context is not valid UTF-8");
       }
+      const int next_state = hub_states_.next_state(index, utf8_sym);
+      if (next_state < 0) break;
+      index = next_state;
+      hub_states_.MarkUsed(index);
+      context.remove_prefix(num_bytes);
+    }
+    state = EncodeState(index);
+  }
+  while (!context.empty()) {
+    const int num_bytes = utf8::DecodeLeadingUnicodeChar(context, &utf8_sym);
+    if (num_bytes == 0) {
+      return absl::InvalidArgumentError("Context is not valid UTF-8");
+    }
+    state = NextState(state, utf8_sym);
+    if (state < 0) {
+      // The state has been overwritten while extending the context.
+      return -1;
+    }
+    context.remove_prefix(num_bytes);
+  }
+  return state;
+}
+
+int LanguageModelHub::LookupContextCache(int init_state,
+                                         absl::string_view context) const {
+  absl::ReaderMutexLock lock(&context_cache_lock_);
+  return context_cache_.Lookup(init_state, context);
+}
+
+void LanguageModelHub::InsertContextCache(int init_state,
+                                          absl::string_view context,
+                                          int state) {
+  absl::WriterMutexLock lock(&context_cache_lock_);
+  context_cache_.Insert(init_state, context, state);
+}
+
+bool LanguageModelHub::ExtractLMScores(int state,
+                                       const LMScoresOptions& options,
+                                       LMScores* response) {
+  ScopedSpan span("LanguageModelHub::ExtractLMScores");
+  if (!ExtractLMScores(state, response)) return false;
+  if (!options.user.empty()) AdaptToUser(options.user, state, response);
+  PruneLMScores(options.top_k, options.min_probability, response);
+  if (options.format == LM_SCORES_COMPACT) CompactLMScores(response);
+  return true;
+}
+
+bool LanguageModelHub::StateContext(int state, int max_chars,
+                                    std::string* context) const {
+  std::vector<int> reversed_syms;
+  {
+    absl::ReaderMutexLock lock(&hub_lock_);
+    int index = DecodeState(state);
+    if (index < 0) return false;
+    // The start state, at index 0, has no previous state.
+    while (index > 0 && reversed_syms.size() < max_chars) {
+      reversed_syms.push_back(hub_states_.state_sym(index));
+      index = hub_states_.prev_state(index);
     }
+    // Some of the previous states have been overwritten, hence the context
+    // would be cut short.
+    if (index < 0) return false;
   }
-  return this_state;
+  context->clear();
+  for (auto pos = reversed_syms.rbegin(); pos != reversed_syms.rend(); ++pos) {
+    *context += utf8::EncodeUnicodeChar(*pos);
+  }
+  return true;
+}
+
+void LanguageModelHub::AdaptToUser(const std::string& user, int state,
+                                   LMScores* scores) const {
+  if (user_adaptation_ == nullptr) return;
+  const std::shared_ptr<UserCounts> counts =
+      user_adaptation_->GetUser(user, /* create= */false);
+  if (counts == nullptr) return;
+  std::string context;
+  if (!StateContext(state, user_adaptation_->order() - 1, &context)) return;
+  counts->Adapt(context, user_adaptation_->prior_weight(), scores);
+}
+
+bool LanguageModelHub::CopyModelStates(int state,
+                                       std::vector<int>* model_states) {
+  absl::ReaderMutexLock lock(&hub_lock_);
+  const int index = DecodeState(state);
+  if (index < 0) return false;
+  hub_states_.MarkUsed(index);
+  const auto hub_model_states = hub_states_.model_states(index);
+  model_states->assign(hub_model_states.begin(), hub_model_states.end());
+  return true;
 }
 
 bool LanguageModelHub::ExtractLMScores(int state, LMScores* response) {
-  bool result = state >= 0 && state < hub_states_.size();
+  std::vector<int> model_states;
+  if (!CopyModelStates(state, &model_states)) return false;
+  return ExtractModelScores(model_states, response);
+}
+
+bool LanguageModelHub::ExtractProbabilities(int state,
+                                            std::vector<double>* probs) {
+  std::vector<int> model_states;
+  if (!CopyModelStates(state, &model_states)) return false;
+  return ExtractModelProbabilities(model_states, probs);
+}
+
+int LanguageModelHub::ExtractProbabilities(int state, double* probs,
+                                           int num_probs) {
+  std::vector<int> model_states;
+  if (!CopyModelStates(state, &model_states)) return -1;
+  return ExtractModelProbabilities(model_states, probs, num_probs);
+}
+
+bool LanguageModelHub::ExtractModelProbabilities(
+    const std::vector<int>& model_states, std::vector<double>* probs) {
+  // Sized by the vocabulary, so that the probabilities are written in place.
+  // They are extracted again only if the vocabulary grew in the meantime.
+  probs->resize(std::max<int>(probs->size(), VocabularySize()));
+  while (true) {
+    const int num_symbols = ExtractModelProbabilities(
+        model_states, probs->data(), probs->size());
+    if (num_symbols < 0) return false;
+    const bool complete = num_symbols <= probs->size();
+    probs->resize(num_symbols);
+    if (complete) return true;
+  }
+}
+
+int LanguageModelHub::ExtractModelProbabilities(
+    const std::vector<int>& model_states, double* probs, int num_probs) {
+  // Goes through the mixture layout even for a single model, whose symbols
+  // need to be mapped to the vocabulary anyway. The normalizations are not
+  // needed, since the mixture is normalized.
+  std::vector<std::vector<double>>& model_neg_log_probs =
+      impl::ThreadDenseScratch().model_neg_log_probs;
+  model_neg_log_probs.resize(mixture_weights_.size());
+  for (int idx = 0; idx < mixture_weights_.size(); ++idx) {
+    double normalization;
+    ScopedLatencyTimer timer(&model_timings_[idx].extract_scores);
+    if (!language_models_[idx]->ExtractNegLogProbs(
+            model_states[idx], &model_neg_log_probs[idx], &normalization)) {
+      return -1;
+    }
+  }
+  {
+    absl::ReaderMutexLock lock(&mix_lock_);
+    if (MixtureLayoutMatches(model_neg_log_probs)) {
+      return MixVocabularyProbabilities(model_neg_log_probs, probs, num_probs);
+    }
+  }
+  // Some of the model vocabularies have changed since the layout was built.
+  absl::WriterMutexLock lock(&mix_lock_);
+  if (!MixtureLayoutMatches(model_neg_log_probs)) BuildMixtureLayout();
+  return MixVocabularyProbabilities(model_neg_log_probs, probs, num_probs);
+}
+
+absl::StatusOr<std::vector<double>> LanguageModelHub::ScoreString(
+    int init_state, absl::string_view text, bool score_end_of_string,
+    bool return_bits) {
+  std::vector<int> model_states;
+  {
+    absl::ReaderMutexLock lock(&hub_lock_);
+    const int index = DecodeState(init_state < 0 ? 0 : init_state);
+    if (index < 0) return absl::InvalidArgumentError("Invalid state");
+    hub_states_.MarkUsed(index);
+    const auto hub_model_states = hub_states_.model_states(index);
+    model_states.assign(hub_model_states.begin(), hub_model_states.end());
+  }
+  if (!utf8::IsValidUTF8(text)) {
+    return absl::InvalidArgumentError("Text is not valid UTF-8");
+  }
+  const utf8::Codepoints text_chars(text);
+  std::vector<double> probs;
+  if (!ExtractModelProbabilities(model_states, &probs)) {
+    return absl::InternalError("Failed to extract scores");
+  }
+  // The dense probabilities are indexed by the vocabulary, which now holds
+  // the symbols of the models and only grows, so that the indices of the
+  // characters are looked up once.
+  std::vector<int> sym_indices;
+  std::vector<int> end_of_string_indices;
+  {
+    absl::ReaderMutexLock lock(&vocab_lock_);
+    for (auto pos = text_chars.begin(); pos != text_chars.end(); ++pos) {
+      const auto it = vocab_indices_.find(pos.bytes());
+      if (it == vocab_indices_.end()) {
+        return absl::InvalidArgumentError(absl::StrCat(
+            "Character \"", pos.bytes(), "\" is not in the vocabulary"));
+      }
+      sym_indices.push_back(it->second);
+    }
+    // The models may use either symbol for the end-of-string.
+    for (const std::string& symbol : {std::string(), std::string(1, '\0')}) {
+      const auto it = vocab_indices_.find(symbol);
+      if (it != vocab_indices_.end()) {
+        end_of_string_indices.push_back(it->second);
+      }
+    }
+  }
+  std::vector<double> costs;
+  auto pos = text_chars.begin();
+  for (int i = 0;; ++i, ++pos) {
+    const bool end_of_string = i == sym_indices.size();
+    if (end_of_string && !score_end_of_string) break;
+    if (i > 0 && !ExtractModelProbabilities(model_states, &probs)) {
+      return absl::InternalError("Failed to extract scores");
+    }
+    // The symbols added to the vocabulary since the layout was built, which
+    // are not covered by the probabilities, are not in the models.
+    double prob = 0.0;
+    if (end_of_string) {
+      for (const int index : end_of_string_indices) {
+        if (index < probs.size()) prob += probs[index];
+      }
+    } else if (sym_indices[i] < probs.size()) {
+      prob = probs[sym_indices[i]];
+    }
+    if (prob <= 0.0) {
+      return absl::InvalidArgumentError(
+          end_of_string ? std::string("End-of-string has no probability")
+                        : absl::StrCat("Character \"", pos.bytes(),
+                                       "\" has no probability"));
+    }
+    costs.push_back(return_bits ? -std::log2(prob) : -std::log(prob));
+    if (end_of_string) break;
+    for (int idx = 0; idx < language_models_.size(); ++idx) {
+      model_states[idx] = ModelNextState(idx, model_states[idx], *pos);
+    }
+  }
+  return costs;
+}
+
+absl::StatusOr<std::vector<ContextCompletion>>
+LanguageModelHub::CompleteContext(int init_state, const std::string& context,
+                                  const CompletionOptions& options) {
+  if (options.num_completions <= 0) {
+    return absl::InvalidArgumentError("Number of completions must be positive");
+  }
+  if (options.max_length <= 0) {
+    return absl::InvalidArgumentError("Maximum length must be positive");
+  }
+  const int state = ContextState(context, init_state);
+  std::vector<int> model_states;
+  if (state < 0 || !CopyModelStates(state, &model_states)) {
+    return absl::InvalidArgumentError("Invalid state");
+  }
+  return options.sample ? SampleCompletions(model_states, options)
+                        : BeamSearchCompletions(model_states, options);
+}
+
+absl::StatusOr<std::vector<ContextCompletion>>
+LanguageModelHub::BeamSearchCompletions(
+    const std::vector<int>& model_states, const CompletionOptions& options) {
+  // Hypothesis of the beam, which follows the states of the component models
+  // rather than hub states, so that the search neither creates nor recycles
+  // any. The next states of the candidates are only computed for the
+  // candidates kept in the beam.
+  struct Hypothesis {
+    ContextCompletion completion;
+    std::vector<int> model_states;
+    int next_sym;  // Symbol leading to the next states, -1 if none.
+  };
+  const auto less_costly = [](const Hypothesis& a, const Hypothesis& b) {
+    return a.completion.cost < b.completion.cost ||
+           (a.completion.cost == b.completion.cost &&
+            a.completion.text < b.completion.text);
+  };
+  LMScores scores;
+  std::vector<Hypothesis> beam = {{ContextCompletion(), model_states, -1}};
+  std::vector<Hypothesis> candidates;
+  for (int length = 0; length < options.max_length; ++length) {
+    candidates.clear();
+    bool extended = false;
+    for (Hypothesis& hyp : beam) {
+      if (hyp.completion.finished) {
+        candidates.push_back(std::move(hyp));
+        continue;
+      }
+      scores.Clear();
+      if (!ExtractModelScores(hyp.model_states, &scores)) {
+        return absl::InternalError("Failed to extract scores");
+      }
+      // Only the most likely symbols of each hypothesis may make it to the
+      // beam.
+      PruneLMScores(options.num_completions, /*min_probability=*/0.0,
+                    &scores);
+      for (int i = 0; i < scores.symbols_size(); ++i) {
+        const double prob = scores.probabilities(i);
+        if (prob <= 0.0) continue;
+        Hypothesis next = {hyp.completion, hyp.model_states, -1};
+        next.completion.cost -= std::log(prob);
+        const std::string& symbol = scores.symbols(i);
+        if (impl::IsEndOfStringSymbol(symbol)) {
+          next.completion.finished = true;
+        } else {
+          char32 utf8_sym;
+          if (utf8::DecodeLeadingUnicodeChar(symbol, &utf8_sym) == 0) continue;
+          next.completion.text += symbol;
+          next.completion.finished =
+              std::find(options.stop_symbols.begin(),
+                        options.stop_symbols.end(),
+                        symbol) != options.stop_symbols.end();
+          if (!next.completion.finished) next.next_sym = utf8_sym;
+        }
+        candidates.push_back(std::move(next));
+        extended = true;
+      }
+    }
+    if (!extended) break;  // All the hypotheses are finished.
+    const int beam_size =
+        std::min<int>(options.num_completions, candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + beam_size,
+                      candidates.end(), less_costly);
+    candidates.resize(beam_size);
+    for (Hypothesis& hyp : candidates) {
+      if (hyp.next_sym < 0) continue;
+      for (int idx = 0; idx < language_models_.size(); ++idx) {
+        hyp.model_states[idx] =
+            ModelNextState(idx, hyp.model_states[idx], hyp.next_sym);
+      }
+      hyp.next_sym = -1;
+    }
+    beam.swap(candidates);
+  }
+  std::sort(beam.begin(), beam.end(), less_costly);
+  std::vector<ContextCompletion> completions;
+  completions.reserve(beam.size());
+  for (Hypothesis& hyp : beam) {
+    completions.push_back(std::move(hyp.completion));
+  }
+  return completions;
+}
+
+absl::StatusOr<std::vector<ContextCompletion>>
+LanguageModelHub::SampleCompletions(const std::vector<int>& model_states,
+                                    const CompletionOptions& options) {
+  absl::BitGen gen;
+  LMScores scores;
+  std::vector<ContextCompletion> completions(options.num_completions);
+  std::vector<int> curr_states;
+  for (ContextCompletion& completion : completions) {
+    // Follows the states of the component models, as the beam search does.
+    curr_states = model_states;
+    for (int length = 0; length < options.max_length; ++length) {
+      scores.Clear();
+      if (!ExtractModelScores(curr_states, &scores) ||
+          scores.symbols_size() == 0) {
+        return absl::InternalError("Failed to extract scores");
+      }
+      // Picks the symbol whose cumulative probability covers the threshold.
+      const double threshold = absl::Uniform(gen, 0.0, 1.0);
+      double total_prob = 0.0;
+      int pos = 0;
+      for (; pos + 1 < scores.symbols_size(); ++pos) {
+        total_prob += scores.probabilities(pos);
+        if (total_prob > threshold) break;
+      }
+      completion.cost -= std::log(scores.probabilities(pos));
+      const std::string& symbol = scores.symbols(pos);
+      if (impl::IsEndOfStringSymbol(symbol)) {
+        completion.finished = true;
+        break;
+      }
+      char32 utf8_sym;
+      if (utf8::DecodeLeadingUnicodeChar(symbol, &utf8_sym) == 0) {
+        return absl::InternalError("Symbol is not valid UTF-8");
+      }
+      completion.text += symbol;
+      if (std::find(options.stop_symbols.begin(), options.stop_symbols.end(),
+                    symbol) != options.stop_symbols.end()) {
+        completion.finished = true;
+        break;
+      }
+      for (int idx = 0; idx < language_models_.size(); ++idx) {
+        curr_states[idx] = ModelNextState(idx, curr_states[idx], utf8_sym);
+      }
+    }
+  }
+  return completions;
+}
+
+bool LanguageModelHub::ExtractModelScores(const std::vector<int>& model_states,
+                                          LMScores* response) {
   int idx = 0;
-  if (result && mixture_weights_.size() < 2) {
+  if (mixture_weights_.size() < 2) {
     // Returns from first model as no mixing is required.
-    return language_models_[idx]->ExtractLMScores(
-        hub_states_[state]->model_state(idx), response);
+    ScopedLatencyTimer timer(&model_timings_[idx].extract_scores);
+    return language_models_[idx]->ExtractLMScores(model_states[idx], response);
   }
-  absl::flat_hash_map<std::string, double> mixed_values;
+  // Mixes the dense scores of the models, which avoids building and parsing
+  // the intermediate protocol buffers.
+  std::vector<std::vector<double>>& model_neg_log_probs =
+      impl::ThreadDenseScratch().model_neg_log_probs;
+  model_neg_log_probs.resize(mixture_weights_.size());
   double mixed_normalization = 0;
-  while (result && idx < mixture_weights_.size()) {
-    LMScores this_response;
-    result = language_models_[idx]->ExtractLMScores(
-        hub_states_[state]->model_state(idx), &this_response);
-    if (result) {
-      mixed_normalization +=
-          impl::MixResults(this_response, mixture_weights_[idx], &mixed_values);
+  for (; idx < mixture_weights_.size(); ++idx) {
+    double normalization;
+    {
+      ScopedLatencyTimer timer(&model_timings_[idx].extract_scores);
+      ScopedSpan model_span("LanguageModel::ExtractNegLogProbs");
+      model_span.AddAttribute("model", idx);
+      if (!language_models_[idx]->ExtractNegLogProbs(
+              model_states[idx], &model_neg_log_probs[idx], &normalization)) {
+        return false;
+      }
     }
-    ++idx;
+    // Weights the normalization value by the mixture weight.
+    mixed_normalization += normalization * std::exp(-mixture_weights_[idx]);
   }
-  if (result) {
-    impl::ExtractMixture(mixed_values, mixed_normalization, response);
+  ScopedSpan mix_span("LanguageModelHub::MixScores");
+  {
+    absl::ReaderMutexLock lock(&mix_lock_);
+    if (MixtureLayoutMatches(model_neg_log_probs)) {
+      MixScores(model_neg_log_probs, response);
+      response->set_normalization(mixed_normalization);
+      return true;
+    }
+  }
+  // Some of the model vocabularies have changed since the layout was built.
+  absl::WriterMutexLock lock(&mix_lock_);
+  if (!MixtureLayoutMatches(model_neg_log_probs)) {
+    mix_span.AddAttribute("layout_rebuilt", 1);
+    BuildMixtureLayout();
+  }
+  MixScores(model_neg_log_probs, response);
+  response->set_normalization(mixed_normalization);
+  return true;
+}
+
+bool LanguageModelHub::MixtureLayoutMatches(
+    const std::vector<std::vector<double>>& model_neg_log_probs) const {
+  if (mix_indices_.size() != model_neg_log_probs.size()) return false;
+  for (int idx = 0; idx < model_neg_log_probs.size(); ++idx) {
+    if (mix_indices_[idx].size() < model_neg_log_probs[idx].size()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void LanguageModelHub::BuildMixtureLayout() {
+  // The mixture symbols are kept in lexicographic order.
+  // Only the models which are mixed are covered.
+  const int num_models = mixture_weights_.size();
+  std::vector<std::vector<std::string>> model_symbols(num_models);
+  mix_symbols_.clear();
+  for (int idx = 0; idx < num_models; ++idx) {
+    language_models_[idx]->AppendSymbols(/* first_index= */0,
+                                         &model_symbols[idx]);
+    mix_symbols_.insert(mix_symbols_.end(), model_symbols[idx].begin(),
+                        model_symbols[idx].end());
+  }
+  std::sort(mix_symbols_.begin(), mix_symbols_.end());
+  mix_symbols_.erase(std::unique(mix_symbols_.begin(), mix_symbols_.end()),
+                     mix_symbols_.end());
+  absl::flat_hash_map<std::string, int> mix_index;
+  mix_index.reserve(mix_symbols_.size());
+  for (int i = 0; i < mix_symbols_.size(); ++i) {
+    mix_index.emplace(mix_symbols_[i], i);
+  }
+  mix_indices_.resize(num_models);
+  mix_identity_.resize(num_models);
+  for (int idx = 0; idx < num_models; ++idx) {
+    const std::vector<std::string>& symbols = model_symbols[idx];
+    std::vector<int>& indices = mix_indices_[idx];
+    indices.resize(symbols.size());
+    bool identity = symbols.size() == mix_symbols_.size();
+    for (int i = 0; i < symbols.size(); ++i) {
+      indices[i] = mix_index[symbols[i]];
+      identity = identity && indices[i] == i;
+    }
+    mix_identity_[idx] = identity;
+  }
+
+  // Maps the mixture symbols to the vocabulary, which only grows, so that
+  // the indices remain valid until the layout is rebuilt.
+  absl::WriterMutexLock lock(&vocab_lock_);
+  mix_vocab_indices_.resize(mix_symbols_.size());
+  for (int i = 0; i < mix_symbols_.size(); ++i) {
+    AddVocabularySymbol(mix_symbols_[i]);
+    mix_vocab_indices_[i] = vocab_indices_[mix_symbols_[i]];
+  }
+  mix_vocab_size_ = vocab_symbols_.size();
+}
+
+void LanguageModelHub::MixProbabilities(
+    const std::vector<std::vector<double>>& model_neg_log_probs,
+    std::vector<double>* mixed_probs_out) const {
+  // Interpolates the probabilities over contiguous arrays. The mixture weights
+  // are normalized, hence the mixture is normalized if the models are.
+  const int num_symbols = mix_symbols_.size();
+  std::vector<double>& mixed_probs = *mixed_probs_out;
+  mixed_probs.assign(num_symbols, 0.0);
+  std::vector<double>& model_probs = impl::ThreadDenseScratch().model_probs;
+  for (int idx = 0; idx < model_neg_log_probs.size(); ++idx) {
+    const double mixture_weight = mixture_weights_[idx];
+    const double* neg_log_probs = model_neg_log_probs[idx].data();
+    const int num_probs = model_neg_log_probs[idx].size();
+    if (mix_identity_[idx]) {
+      AddNegLogProbsToProbs(neg_log_probs, num_probs, mixture_weight,
+                            mixed_probs.data());
+    } else {
+      // Computes the weighted probabilities contiguously before scattering
+      // them to the mixture symbols.
+      model_probs.resize(num_probs);
+      NegLogProbsToProbs(neg_log_probs, num_probs, mixture_weight,
+                         model_probs.data());
+      const int* indices = mix_indices_[idx].data();
+      for (int i = 0; i < num_probs; ++i) {
+        mixed_probs[indices[i]] += model_probs[i];
+      }
+    }
+  }
+  const double total_prob =
+      std::accumulate(mixed_probs.begin(), mixed_probs.end(), 0.0);
+  const double scale = total_prob > 0.0 ? 1.0 / total_prob : 0.0;
+  for (double& prob : mixed_probs) prob *= scale;
+}
+
+int LanguageModelHub::MixVocabularyProbabilities(
+    const std::vector<std::vector<double>>& model_neg_log_probs,
+    double* probs, int num_probs) const {
+  std::vector<double>& mixed_probs = impl::ThreadDenseScratch().mixed_probs;
+  MixProbabilities(model_neg_log_probs, &mixed_probs);
+  std::fill(probs, probs + num_probs, 0.0);
+  for (int i = 0; i < mixed_probs.size(); ++i) {
+    const int index = mix_vocab_indices_[i];
+    if (index < num_probs) probs[index] = mixed_probs[i];
+  }
+  return mix_vocab_size_;
+}
+
+void LanguageModelHub::MixScores(
+    const std::vector<std::vector<double>>& model_neg_log_probs,
+    LMScores* response) const {
+  std::vector<double> mixed_probs;
+  MixProbabilities(model_neg_log_probs, &mixed_probs);
+  const int num_symbols = mix_symbols_.size();
+  response->mutable_symbols()->Reserve(num_symbols);
+  response->mutable_probabilities()->Reserve(num_symbols);
+  for (int i = 0; i < num_symbols; ++i) {
+    response->add_symbols(mix_symbols_[i]);
+    response->add_probabilities(mixed_probs[i]);
+  }
+}
+
+void LanguageModelHub::GetVocabulary(Vocabulary* vocabulary) {
+  absl::ReaderMutexLock lock(&vocab_lock_);
+  vocabulary->set_version(vocab_version_);
+  vocabulary->mutable_symbols()->Reserve(vocab_symbols_.size());
+  for (const auto& symbol : vocab_symbols_) {
+    vocabulary->add_symbols(symbol);
+  }
+}
+
+int LanguageModelHub::VocabularySize() const {
+  absl::ReaderMutexLock lock(&vocab_lock_);
+  return vocab_symbols_.size();
+}
+
+void LanguageModelHub::AppendVocabularySymbols(
+    int first_index, std::vector<std::string>* symbols) const {
+  absl::ReaderMutexLock lock(&vocab_lock_);
+  if (first_index < 0) first_index = 0;
+  for (int i = first_index; i < vocab_symbols_.size(); ++i) {
+    symbols->push_back(vocab_symbols_[i]);
+  }
+}
+
+void LanguageModelHub::CompactLMScores(LMScores* response) {
+  const int num_symbols = response->symbols_size();
+  std::vector<int> indices(num_symbols);
+  int vocab_size;
+  uint64 vocab_version;
+  bool found;
+  {
+    absl::ReaderMutexLock lock(&vocab_lock_);
+    found = FindVocabIndices(*response, &indices);
+    vocab_size = vocab_symbols_.size();
+    vocab_version = vocab_version_;
+  }
+  if (!found) {
+    absl::WriterMutexLock lock(&vocab_lock_);
+    ExtendVocabulary(*response);
+    FindVocabIndices(*response, &indices);
+    vocab_size = vocab_symbols_.size();
+    vocab_version = vocab_version_;
+  }
+  response->set_vocabulary_version(vocab_version);
+  if (num_symbols == vocab_size) {
+    // The symbols are distinct, hence cover the whole vocabulary and the
+    // indices are implicit.
+    response->mutable_compact_probabilities()->Resize(vocab_size, 0.0);
+    for (int i = 0; i < num_symbols; ++i) {
+      response->set_compact_probabilities(indices[i],
+                                          response->probabilities(i));
+    }
+  } else {
+    response->mutable_vocabulary_indices()->Reserve(num_symbols);
+    response->mutable_compact_probabilities()->Reserve(num_symbols);
+    for (int i = 0; i < num_symbols; ++i) {
+      response->add_vocabulary_indices(indices[i]);
+      response->add_compact_probabilities(response->probabilities(i));
+    }
+  }
+  response->clear_symbols();
+  response->clear_probabilities();
+}
+
+bool LanguageModelHub::FindVocabIndices(const LMScores& response,
+                                        std::vector<int>* indices) const {
+  for (int i = 0; i < response.symbols_size(); ++i) {
+    const auto it = vocab_indices_.find(response.symbols(i));
+    if (it == vocab_indices_.end()) return false;
+    (*indices)[i] = it->second;
+  }
+  return true;
+}
+
+void LanguageModelHub::ExtendVocabulary(const LMScores& response) {
+  for (const auto& symbol : response.symbols()) AddVocabularySymbol(symbol);
+}
+
+void LanguageModelHub::AddVocabularySymbol(const std::string& symbol) {
+  if (vocab_indices_.emplace(symbol, vocab_symbols_.size()).second) {
+    vocab_symbols_.push_back(symbol);
+    vocab_version_ = impl::FingerprintSymbol(symbol, vocab_version_);
   }
-  return result;
 }
 
 bool LanguageModelHub::UpdateLMCounts(int32 state,
                                       const std::vector<int>& utf8_syms,
                                       int64 count) {
-  bool result = state >= 0 && state < hub_states_.size();
+  // Count updates are serialized with respect to each other and to the
+  // creation of new hub states.
+  absl::WriterMutexLock lock(&hub_lock_);
+  const int index = DecodeState(state);
+  bool result = index >= 0;
+  if (result && counts_journal_ != nullptr) {
+    CountsUpdate update;
+    for (int idx = 0; idx < language_models_.size(); ++idx) {
+      update.model_states.push_back(hub_states_.model_state(index, idx));
+    }
+    update.utf8_syms = utf8_syms;
+    update.count = count;
+    counts_journal_->Record(std::move(update));
+  }
   int idx = 0;
   while (result && idx < mixture_weights_.size()) {
     result = language_models_[idx]->UpdateLMCounts(
-        hub_states_[state]->model_state(idx), utf8_syms, count);
+        hub_states_.model_state(index, idx), utf8_syms, count);
     ++idx;
   }
   if (result) {
-    result = VerifyOrCorrectModelStates(state, utf8_syms);
+    result = VerifyOrCorrectModelStates(index, utf8_syms);
   }
   return result;
 }
 
+bool LanguageModelHub::UpdateUserCounts(const std::string& user, int32 state,
+                                        const std::vector<int>& utf8_syms,
+                                        int64 count) {
+  if (user_adaptation_ == nullptr) return false;
+  std::string context;
+  if (!StateContext(state, user_adaptation_->order() - 1, &context)) {
+    return false;
+  }
+  user_adaptation_->GetUser(user, /* create= */true)
+      ->Update(context, utf8_syms, count);
+  return true;
+}
+
+absl::StatusOr<int64> LanguageModelHub::BulkUpdateLMCounts(
+    const std::string& text, int64 count) {
+  if (count <= 0) {
+    return absl::InvalidArgumentError("Count must be positive");
+  }
+  const std::vector<absl::string_view> lines =
+      absl::StrSplit(text, '\n', absl::SkipEmpty());
+  std::vector<std::vector<int>> utf8_strings;
+  for (size_t begin = 0; begin < lines.size(); begin += kBulkUpdateBatchSize) {
+    const size_t end = std::min(lines.size(), begin + kBulkUpdateBatchSize);
+    utf8_strings.clear();
+    for (size_t i = begin; i < end; ++i) {
+      absl::string_view line = lines[i];
+      absl::ConsumeSuffix(&line, "\r");
+      utf8_strings.push_back(utf8::StrSplitByCharToUnicode(line));
+      utf8_strings.back().push_back(0);  // End-of-string.
+    }
+    absl::WriterMutexLock lock(&hub_lock_);
+    // Same models as UpdateLMCounts: only the models in the mixture.
+    for (int idx = 0; idx < mixture_weights_.size(); ++idx) {
+      if (!language_models_[idx]->BulkUpdateLMCounts(utf8_strings, count)) {
+        return absl::InternalError(
+            absl::StrCat("Failed to update the counts of model ", idx));
+      }
+    }
+    if (counts_journal_ != nullptr) {
+      // Bulk updates are equivalent to updating each string in turn from the
+      // start states. They are recorded once applied, so that a failed batch
+      // is not replayed on restore.
+      std::vector<int> start_states;
+      for (const auto& model : language_models_) {
+        start_states.push_back(model->start_state());
+      }
+      for (const auto& utf8_syms : utf8_strings) {
+        counts_journal_->Record({start_states, utf8_syms, count});
+      }
+    }
+    // The hub states reached by the strings may now map to other model states.
+    for (const auto& utf8_syms : utf8_strings) {
+      if (!VerifyOrCorrectModelStates(/*index=*/0, utf8_syms)) {
+        return absl::InternalError("Failed to correct the hub states");
+      }
+    }
+  }
+  return lines.size();
+}
+
+absl::StatusOr<int64> LanguageModelHub::BulkUpdateLMCountsFromFile(
+    const std::string& text_file, int64 count) {
+  std::string text;
+  ASSIGN_OR_RETURN(text, file::ReadBinaryFile(text_file));
+  return BulkUpdateLMCounts(text, count);
+}
+
+absl::Status LanguageModelHub::RestoreSnapshot(
+    const std::string& snapshot_file,
+    const std::vector<uint64>& model_fingerprints) {
+  if (counts_journal_ != nullptr) {
+    return absl::FailedPreconditionError("Snapshot already restored");
+  }
+  if (model_fingerprints.size() != language_models_.size()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Expected ", language_models_.size(), " model fingerprints, got ",
+        model_fingerprints.size()));
+  }
+  auto journal = absl::make_unique<CountsJournal>(snapshot_file,
+                                                  model_fingerprints);
+  std::vector<CountsUpdate> updates;
+  absl::Status status = journal->Read(&updates);
+  if (absl::IsFailedPrecondition(status)) {
+    // The model states of the updates are unrelated to the ones of these
+    // models. Keeps the snapshot aside rather than replaying it.
+    const std::string stale_file = absl::StrCat(snapshot_file, ".stale");
+    GOOGLE_LOG(WARNING) << "Not restoring the counts: " << status.ToString()
+                        << ". Moving " << snapshot_file << " to "
+                        << stale_file;
+    if (std::rename(snapshot_file.c_str(), stale_file.c_str()) != 0) {
+      return absl::InternalError(
+          absl::StrCat("Failed to move ", snapshot_file, " aside"));
+    }
+    journal = absl::make_unique<CountsJournal>(snapshot_file,
+                                               model_fingerprints);
+    status = journal->Read(&updates);
+  }
+  RETURN_IF_ERROR(status);
+  int64 num_failed = 0;
+  {
+    absl::WriterMutexLock lock(&hub_lock_);
+    for (const auto& update : updates) {
+      // Same as UpdateLMCounts, stopping at the first model failing the
+      // update, which failed it when the update was first applied as well.
+      for (int idx = 0; idx < mixture_weights_.size(); ++idx) {
+        if (!language_models_[idx]->UpdateLMCounts(
+                update.model_states[idx], update.utf8_syms, update.count)) {
+          ++num_failed;
+          break;
+        }
+      }
+    }
+    counts_journal_ = std::move(journal);
+  }
+  GOOGLE_LOG(INFO) << "Restored " << updates.size() << " count updates from "
+                   << snapshot_file << " (" << num_failed << " failed)";
+  return absl::OkStatus();
+}
+
+absl::StatusOr<int64> LanguageModelHub::WriteSnapshot() {
+  if (counts_journal_ == nullptr) {
+    return absl::FailedPreconditionError("No snapshot file restored");
+  }
+  return counts_journal_->Write();
+}
+
+void LanguageModelHub::GetStats(HubStats* stats) const {
+  {
+    absl::ReaderMutexLock lock(&hub_lock_);
+    stats->num_states = hub_states_.size();
+    stats->max_states = hub_states_.capacity();
+  }
+  stats->num_allocated_states =
+      num_allocated_states_.load(std::memory_order_relaxed);
+  stats->num_overwritten_states =
+      num_overwritten_states_.load(std::memory_order_relaxed);
+  stats->context_cache_hits =
+      context_cache_hits_.load(std::memory_order_relaxed);
+  stats->context_cache_prefix_hits =
+      context_cache_prefix_hits_.load(std::memory_order_relaxed);
+  stats->context_cache_misses =
+      context_cache_misses_.load(std::memory_order_relaxed);
+  stats->num_users =
+      user_adaptation_ != nullptr ? user_adaptation_->num_users() : 0;
+  stats->models.clear();
+  stats->models.resize(language_models_.size());
+  for (int idx = 0; idx < language_models_.size(); ++idx) {
+    HubStats::Model* model_stats = &stats->models[idx];
+    model_stats->next_state = model_timings_[idx].next_state;
+    model_stats->extract_scores = model_timings_[idx].extract_scores;
+    model_stats->has_cache =
+        language_models_[idx]->GetCacheStats(&model_stats->cache);
+  }
+  GetMemoryUsage(&stats->memory);
+}
+
+void LanguageModelHub::GetMemoryUsage(HubMemoryUsage* usage) const {
+  {
+    absl::ReaderMutexLock lock(&hub_lock_);
+    usage->hub_states_bytes = hub_states_.MemoryBytes();
+  }
+  {
+    absl::ReaderMutexLock lock(&context_cache_lock_);
+    usage->hub_states_bytes += context_cache_.MemoryBytes();
+  }
+  usage->user_bytes =
+      user_adaptation_ != nullptr ? user_adaptation_->MemoryBytes() : 0;
+  usage->models.clear();
+  usage->models.resize(language_models_.size());
+  for (int idx = 0; idx < language_models_.size(); ++idx) {
+    language_models_[idx]->GetMemoryUsage(&usage->models[idx]);
+  }
+}
+
+void LanguageModelHub::SetMemoryLimits(const HubMemoryLimits& limits) {
+  int capacity;
+  {
+    absl::WriterMutexLock lock(&hub_lock_);
+    int64 max_states = hub_states_.max_capacity();
+    if (limits.hub_states_bytes >= 0) {
+      // Each state may also have an entry in the context cache.
+      const int64 state_bytes =
+          HubStateArena::StateBytes(language_models_.size()) +
+          ContextStateCache::EntryBytes();
+      max_states = std::min(max_states, limits.hub_states_bytes / state_bytes);
+    }
+    hub_states_.SetCapacity(std::max<int64>(max_states, kMinHubStates));
+    capacity = hub_states_.capacity();
+  }
+  {
+    absl::WriterMutexLock lock(&context_cache_lock_);
+    context_cache_.SetCapacity(capacity);
+  }
+  if (user_adaptation_ != nullptr) {
+    user_adaptation_->SetMemoryLimit(limits.user_bytes);
+  }
+  for (int idx = 0; idx < language_models_.size(); ++idx) {
+    language_models_[idx]->SetCacheMemoryLimit(
+        idx < limits.model_cache_bytes.size() ? limits.model_cache_bytes[idx]
+                                              : -1);
+  }
+}
+
+int64 HubMemoryUsage::TotalBytes() const {
+  int64 total_bytes = hub_states_bytes + user_bytes;
+  for (const ModelMemoryUsage& model : models) {
+    total_bytes += model.model_bytes + model.cache_bytes;
+  }
+  return total_bytes;
+}
+
 bool LanguageModelHub::VerifyOrCorrectModelStates(
     int32 state, const std::vector<int>& utf8_syms) {
   for (int utf8_sym : utf8_syms) {
     // Checks for next state; if there, verifies (and updates if needed) model
     // state information.
-    int next_state = hub_states_[state]->next_state(utf8_sym);
-    bool result;
-    if (next_state >= 0) {
-      // Collects model next state vector to double check.
-      std::vector<int> next_states(language_models_.size());
-      for (auto idx = 0; idx < next_states.size(); ++idx) {
-        next_states[idx] = language_models_[idx]->NextState(
-            hub_states_[state]->model_state(idx), utf8_sym);
-      }
-      result = hub_states_[next_state]->VerifyOrCorrectModelStates(
-          state, utf8_sym, next_states);
-    } else {
+    const int next_state = hub_states_.next_state(state, utf8_sym);
+    if (next_state < 0) {
       // Returns true, since new states will be created anyhow for all
       // continuations from this point.
       return true;
     }
-    if (!result) {
+    if (hub_states_.prev_state(next_state) != state ||
+        hub_states_.state_sym(next_state) != utf8_sym) {
       return false;
     }
+    // Collects model next state vector to double check.
+    std::vector<int> next_states(language_models_.size());
+    for (auto idx = 0; idx < next_states.size(); ++idx) {
+      next_states[idx] =
+          ModelNextState(idx, hub_states_.model_state(state, idx), utf8_sym);
+    }
+    hub_states_.SetModelStates(next_state, next_states);
     state = next_state;
   }
   return true;
 }
 
-bool LanguageModelHubState::VerifyOrCorrectModelStates(
-    int prev_state, int utf8_sym, const std::vector<int>& model_states) {
-  if (prev_state_ != prev_state || state_sym_ != utf8_sym) {
-    return false;
+void HubStateArena::Reset(int num_models, int capacity) {
+  num_models_ = num_models;
+  capacity_ = capacity;
+  max_capacity_ = capacity;
+  model_states_.clear();
+  prev_states_.clear();
+  state_syms_.clear();
+  first_next_states_.clear();
+  next_siblings_.clear();
+  generations_.clear();
+  used_.reset(new std::atomic<bool>[capacity]);
+  clock_hand_ = 0;
+  transitions_.assign(kMinHubTransitionSlots, {kEmptyTransitionKey, -1});
+  num_transitions_ = 0;
+}
+
+int HubStateArena::next_state(int state, int utf8_sym) const {
+  const Transition& slot = transitions_[FindSlot(TransitionKey(state,
+                                                               utf8_sym))];
+  return slot.key != kEmptyTransitionKey ? slot.next_state : -1;
+}
+
+int HubStateArena::AddState(absl::Span<const int> model_states,
+                            int prev_state, int state_sym) {
+  const int state = size();
+  model_states_.insert(model_states_.end(), model_states.begin(),
+                       model_states.end());
+  prev_states_.push_back(prev_state);
+  state_syms_.push_back(state_sym);
+  first_next_states_.push_back(-1);
+  next_siblings_.push_back(-1);
+  // The generation of a state removed by SetCapacity() has been incremented.
+  if (state == static_cast<int>(generations_.size())) {
+    generations_.push_back(0);
   }
-  for (auto idx = 0; idx < model_states.size(); ++idx) {
-    model_states_[idx] = model_states[idx];
+  used_[state].store(false, std::memory_order_relaxed);
+  LinkState(state);
+  return state;
+}
+
+void HubStateArena::ResetState(int state, absl::Span<const int> model_states,
+                               int prev_state, int state_sym) {
+  UnlinkState(state);
+  DetachNextStates(state);
+  ++generations_[state];
+  used_[state].store(false, std::memory_order_relaxed);
+  SetModelStates(state, model_states);
+  prev_states_[state] = prev_state;
+  state_syms_[state] = state_sym;
+  LinkState(state);
+}
+
+int HubStateArena::NextVictim(int keep_state) {
+  // Terminates within two rounds, since the first one clears all the marks.
+  while (true) {
+    clock_hand_ = clock_hand_ + 1 < size() ? clock_hand_ + 1 : 1;
+    if (clock_hand_ == keep_state) continue;
+    if (!used_[clock_hand_].exchange(false, std::memory_order_relaxed)) {
+      return clock_hand_;
+    }
   }
-  return true;
 }
 
-absl::StatusOr<std::vector<int>> LanguageModelHubState::UpdateHubState(
-    const LanguageModelHubState& hub_state) {
-  if (model_states_.size() != hub_state.ModelStateSize()) {
-    return absl::InternalError("Size difference between hub state and models.");
+void HubStateArena::SetCapacity(int capacity) {
+  capacity_ = std::max(std::min(capacity, max_capacity_), 3);
+  if (size() <= capacity_) return;
+  // Removes the states from the last one down, so that the states reached
+  // from each removed state are either kept or already removed.
+  for (int state = size() - 1; state >= capacity_; --state) {
+    UnlinkState(state);
+    DetachNextStates(state);
+    ++generations_[state];
   }
-  std::vector<int> old_next_states(next_states_.size());
-  int idx = 0;
-  for (auto next_state : next_states_) {
-    old_next_states[idx++] = next_state.second;
+  model_states_.resize(capacity_ * num_models_);
+  prev_states_.resize(capacity_);
+  state_syms_.resize(capacity_);
+  first_next_states_.resize(capacity_);
+  next_siblings_.resize(capacity_);
+  model_states_.shrink_to_fit();
+  prev_states_.shrink_to_fit();
+  state_syms_.shrink_to_fit();
+  first_next_states_.shrink_to_fit();
+  next_siblings_.shrink_to_fit();
+  size_t num_slots = kMinHubTransitionSlots;
+  while (num_slots < 2 * (num_transitions_ + 1)) num_slots *= 2;
+  if (num_slots < transitions_.size()) ResizeTransitions(num_slots);
+}
+
+int64 HubStateArena::MemoryBytes() const {
+  return (model_states_.capacity() + prev_states_.capacity() +
+          state_syms_.capacity() + first_next_states_.capacity() +
+          next_siblings_.capacity()) * sizeof(int) +
+         generations_.capacity() * sizeof(uint32) +
+         max_capacity_ * sizeof(std::atomic<bool>) +
+         transitions_.capacity() * sizeof(Transition);
+}
+
+int64 HubStateArena::StateBytes(int num_models) {
+  // The transition table is between a quarter and half full.
+  return (num_models + 5) * sizeof(int) + sizeof(uint32) +
+         sizeof(std::atomic<bool>) + 3 * sizeof(Transition);
+}
+
+void HubStateArena::SetModelStates(int state,
+                                   absl::Span<const int> model_states) {
+  std::copy(model_states.begin(), model_states.end(),
+            model_states_.begin() + state * num_models_);
+}
+
+void HubStateArena::DetachNextStates(int state) {
+  for (int next_state = first_next_states_[state]; next_state >= 0;) {
+    // Removes prev_state values that refer to old, overwritten hub state.
+    EraseTransition(TransitionKey(state, state_syms_[next_state]));
+    prev_states_[next_state] = -1;
+    const int sibling = next_siblings_[next_state];
+    next_siblings_[next_state] = -1;
+    next_state = sibling;
   }
-  next_states_.clear();
-  for (int i = 0; i < model_states_.size(); ++i) {
-    model_states_[i] = hub_state.model_state(i);
+  first_next_states_[state] = -1;
+}
+
+void HubStateArena::LinkState(int state) {
+  const int prev_state = prev_states_[state];
+  if (prev_state < 0) return;
+  InsertTransition(TransitionKey(prev_state, state_syms_[state]), state);
+  next_siblings_[state] = first_next_states_[prev_state];
+  first_next_states_[prev_state] = state;
+}
+
+void HubStateArena::UnlinkState(int state) {
+  const int prev_state = prev_states_[state];
+  if (prev_state < 0) return;
+  EraseTransition(TransitionKey(prev_state, state_syms_[state]));
+  int* link = &first_next_states_[prev_state];
+  while (*link >= 0 && *link != state) link = &next_siblings_[*link];
+  if (*link == state) *link = next_siblings_[state];
+  next_siblings_[state] = -1;
+  prev_states_[state] = -1;
+}
+
+size_t HubStateArena::FindSlot(uint64 key) const {
+  const size_t mask = transitions_.size() - 1;
+  size_t slot = impl::HashTransitionKey(key) & mask;
+  while (transitions_[slot].key != key &&
+         transitions_[slot].key != kEmptyTransitionKey) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+void HubStateArena::InsertTransition(uint64 key, int next_state) {
+  if (2 * (num_transitions_ + 1) > transitions_.size()) {
+    // Keeps the table at most half full, so that the probes stay short.
+    ResizeTransitions(2 * transitions_.size());
+  }
+  Transition& slot = transitions_[FindSlot(key)];
+  if (slot.key == kEmptyTransitionKey) ++num_transitions_;
+  slot = {key, next_state};
+}
+
+void HubStateArena::ResizeTransitions(size_t num_slots) {
+  std::vector<Transition> old_transitions(num_slots,
+                                          {kEmptyTransitionKey, -1});
+  old_transitions.swap(transitions_);
+  for (const Transition& transition : old_transitions) {
+    if (transition.key != kEmptyTransitionKey) {
+      transitions_[FindSlot(transition.key)] = transition;
+    }
+  }
+}
+
+void HubStateArena::EraseTransition(uint64 key) {
+  size_t hole = FindSlot(key);
+  if (transitions_[hole].key == kEmptyTransitionKey) return;
+  // Shifts back the following entries of the probe sequence which would no
+  // longer be found past the hole.
+  const size_t mask = transitions_.size() - 1;
+  for (size_t slot = (hole + 1) & mask;
+       transitions_[slot].key != kEmptyTransitionKey;
+       slot = (slot + 1) & mask) {
+    const size_t home = impl::HashTransitionKey(transitions_[slot].key) & mask;
+    const bool reachable = hole <= slot ? (hole < home && home <= slot)
+                                        : (hole < home || home <= slot);
+    if (!reachable) {
+      transitions_[hole] = transitions_[slot];
+      hole = slot;
+    }
+  }
+  transitions_[hole].key = kEmptyTransitionKey;
+  --num_transitions_;
+}
+
+void ContextStateCache::Reset(int capacity) {
+  capacity_ = std::max(capacity, 0);
+  entries_.clear();
+  indices_.clear();
+  used_.reset(new std::atomic<bool>[capacity_]);
+  clock_hand_ = 0;
+  context_bytes_ = 0;
+}
+
+void ContextStateCache::SetCapacity(int capacity) {
+  capacity = std::max(capacity, 0);
+  if (capacity == capacity_) return;
+  const int num_kept = std::min(size(), capacity);
+  for (int index = num_kept; index < size(); ++index) {
+    const Entry& entry = entries_[index];
+    indices_.erase(EntryKey(entry.init_state, entry.context));
+    context_bytes_ -= entry.context.size();
+  }
+  entries_.resize(num_kept);
+  if (num_kept < capacity_) {
+    entries_.shrink_to_fit();
+    indices_.rehash(0);
+  }
+  std::unique_ptr<std::atomic<bool>[]> used(new std::atomic<bool>[capacity]);
+  for (int index = 0; index < num_kept; ++index) {
+    used[index].store(used_[index].load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+  }
+  used_ = std::move(used);
+  capacity_ = capacity;
+  if (clock_hand_ >= num_kept) clock_hand_ = 0;
+}
+
+int ContextStateCache::Lookup(int init_state,
+                              absl::string_view context) const {
+  const auto pos = indices_.find(EntryKey(init_state, context));
+  if (pos == indices_.end()) return -1;
+  const Entry& entry = entries_[pos->second];
+  if (entry.init_state != init_state || entry.context != context) return -1;
+  used_[pos->second].store(true, std::memory_order_relaxed);
+  return entry.state;
+}
+
+void ContextStateCache::Insert(int init_state, absl::string_view context,
+                               int state) {
+  if (capacity_ == 0) return;
+  const size_t key = EntryKey(init_state, context);
+  int index;
+  const auto pos = indices_.find(key);
+  if (pos != indices_.end()) {
+    // Same context, or the rare collision, whose entry is replaced.
+    index = pos->second;
+  } else if (size() < capacity_) {
+    index = size();
+    entries_.emplace_back();
+    indices_.emplace(key, index);
+  } else {
+    index = NextVictim();
+    const Entry& victim = entries_[index];
+    indices_.erase(EntryKey(victim.init_state, victim.context));
+    indices_.emplace(key, index);
+  }
+  Entry& entry = entries_[index];
+  context_bytes_ += static_cast<int64>(context.size()) - entry.context.size();
+  entry.init_state = init_state;
+  entry.context.assign(context.data(), context.size());
+  entry.state = state;
+  used_[index].store(false, std::memory_order_relaxed);
+}
+
+int64 ContextStateCache::MemoryBytes() const {
+  return entries_.capacity() * sizeof(Entry) + context_bytes_ +
+         capacity_ * sizeof(std::atomic<bool>) +
+         indices_.capacity() * (sizeof(std::pair<size_t, int>) + 1);
+}
+
+int64 ContextStateCache::EntryBytes() {
+  // The index is between a half and seven eighths full.
+  return sizeof(Entry) + sizeof(std::atomic<bool>) +
+         2 * (sizeof(std::pair<size_t, int>) + 1);
+}
+
+size_t ContextStateCache::EntryKey(int init_state,
+                                   absl::string_view context) {
+  return absl::Hash<std::pair<int, absl::string_view>>()(
+      std::make_pair(init_state, context));
+}
+
+int ContextStateCache::NextVictim() {
+  // Terminates within two rounds, since the first one clears all the marks.
+  while (true) {
+    clock_hand_ = clock_hand_ + 1 < size() ? clock_hand_ + 1 : 0;
+    if (!used_[clock_hand_].exchange(false, std::memory_order_relaxed)) {
+      return clock_hand_;
+    }
   }
-  prev_state_ = hub_state.prev_state();
-  state_sym_ = hub_state.state_sym();
-  return std::move(old_next_states);
 }
 
 }  // namespace models
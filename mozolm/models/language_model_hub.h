@@ -15,6 +15,7 @@
 #ifndef MOZOLM_MOZOLM_MODELS_LANGUAGE_MODEL_HUB_H_
 #define MOZOLM_MOZOLM_MODELS_LANGUAGE_MODEL_HUB_H_
 
+#include <atomic>
 #include <memory>
 #include <string>
 #include <vector>
@@ -23,70 +24,344 @@
 #include "absl/container/flat_hash_map.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+#include "mozolm/models/counts_journal.h"
 #include "mozolm/models/language_model.h"
 #include "mozolm/models/lm_scores.pb.h"
 #include "mozolm/models/model_config.pb.h"
+#include "mozolm/models/user_adaptation.h"
+#include "mozolm/utils/latency_histogram.h"
 
 namespace mozolm {
 namespace models {
 
-class LanguageModelHubState {
+// Options of the completions found by LanguageModelHub::CompleteContext().
+struct CompletionOptions {
+  // Number of completions returned, which is also the width of the beam.
+  int num_completions = 1;
+
+  // Maximum number of characters in each completion.
+  int max_length = 1;
+
+  // Characters ending a completion, in addition to the end-of-string.
+  std::vector<std::string> stop_symbols;
+
+  // Whether to draw the completions at random from the model rather than to
+  // search for the most likely ones.
+  bool sample = false;
+};
+
+// Completion of a context found by LanguageModelHub::CompleteContext().
+struct ContextCompletion {
+  // Characters following the context, including the stop symbol, if any, but
+  // not the end-of-string.
+  std::string text;
+
+  // Negative log probability of the characters, in nats.
+  double cost = 0.0;
+
+  // Whether the completion was ended by the end-of-string or a stop symbol,
+  // rather than by the maximum length.
+  bool finished = false;
+};
+
+// Approximate memory held by the hub and by its models, in bytes.
+struct HubMemoryUsage {
+  // Hub states, with the cache of the states of the recent contexts.
+  int64 hub_states_bytes = 0;
+
+  // Counts of the users.
+  int64 user_bytes = 0;
+
+  // Memory of the models, in the order of the configuration, left at zero for
+  // the models which do not track it.
+  std::vector<ModelMemoryUsage> models;
+
+  // Sum of all of the above.
+  int64 TotalBytes() const;
+};
+
+// Limits, in bytes, on the memory which the hub and its models can release
+// under pressure. The negative limits, as well as the limits missing for
+// some of the models, restore the limits of the configuration, which are
+// never exceeded.
+struct HubMemoryLimits {
+  int64 hub_states_bytes = -1;
+  int64 user_bytes = -1;
+  std::vector<int64> model_cache_bytes;
+};
+
+// Snapshot of the counters and the timings of the hub and of its models.
+struct HubStats {
+  // Number of hub states currently kept and the maximum number kept.
+  int num_states = 0;
+  int max_states = 0;
+
+  // Number of hub states created for new contexts, and the number of those
+  // which overwrote a recycled state.
+  int64 num_allocated_states = 0;
+  int64 num_overwritten_states = 0;
+
+  // Lookups of the contexts in the cache of the recent contexts: found with
+  // the whole context, found without its last character, or not found.
+  int64 context_cache_hits = 0;
+  int64 context_cache_prefix_hits = 0;
+  int64 context_cache_misses = 0;
+
+  // Number of users whose counts are kept for adapting their scores.
+  int num_users = 0;
+
+  // Memory held by the hub and by its models.
+  HubMemoryUsage memory;
+
+  // Timings and cache counters of one of the component models.
+  struct Model {
+    // Transitions of the model followed by the hub.
+    LatencyHistogram next_state;
+
+    // Scores extracted from the model, either as protocol buffers or as
+    // dense scores for the mixture.
+    LatencyHistogram extract_scores;
+
+    // Whether the model has a state cache, counted below.
+    bool has_cache = false;
+    ModelCacheStats cache;
+  };
+
+  // Statistics of the models, in the order of the configuration.
+  std::vector<Model> models;
+};
+
+// Storage for the hub states, kept in a few flat arrays rather than as
+// separate heap objects. The states of the component models are stored in a
+// single block with one row of num_models() entries per hub state, and the
+// transitions between the hub states in an open-addressing hash table keyed
+// by the origin state and the symbol. Every hub state other than the start
+// state is reached by a single transition from its previous state; the states
+// reached from each state are linked into a list, so that the transitions can
+// be removed when a state is overwritten.
+//
+// Once the arena reaches its capacity, the states are recycled using the
+// CLOCK approximation of least-recently-used eviction: each access marks the
+// state as used, and the recycling sweep clears the marks, picking the first
+// state found unmarked. Every overwrite increments the generation of the
+// recycled slot, so that the hub can tell stale state ids apart.
+//
+// Not thread-safe, except that MarkUsed may be called concurrently with the
+// other const methods.
+class HubStateArena {
  public:
-  LanguageModelHubState() = default;
+  HubStateArena() = default;
+  ~HubStateArena() = default;
 
-  // Initializes given a vector of states, default values used for start state.
-  explicit LanguageModelHubState(const std::vector<int>& model_states,
-                                 int prev_state = -1, int state_sym = 0)
-      : model_states_(model_states),
-        prev_state_(prev_state),
-        state_sym_(state_sym) {}
+  // Removes all the states, setting the number of component models and the
+  // maximum number of states to keep.
+  void Reset(int num_models, int capacity);
 
-  ~LanguageModelHubState() = default;
+  // Number of hub states.
+  int size() const { return prev_states_.size(); }
 
-  int ModelStateSize() const { return model_states_.size(); }
-  int state_sym() const { return state_sym_; }
-  int prev_state() const { return prev_state_; }
+  // Maximum number of hub states.
+  int capacity() const { return capacity_; }
 
-  // Returns existing next state for symbol if exists; -1 otherwise.
-  int next_state(int utf8_sym) const {
-    return next_states_.contains(utf8_sym) ? next_states_.find(utf8_sym)->second
-                                           : -1;
+  // Capacity given to Reset(), which bounds the capacity set below.
+  int max_capacity() const { return max_capacity_; }
+
+  // Changes the maximum number of hub states, within three states and
+  // max_capacity(). Lowering it below the number of states removes the
+  // states with the highest indices, as if they had been overwritten, and
+  // releases their memory.
+  void SetCapacity(int capacity);
+
+  // Approximate number of bytes held by the states and the transitions.
+  int64 MemoryBytes() const;
+
+  // Approximate number of bytes per state, given the number of component
+  // models, for turning a memory limit into a capacity.
+  static int64 StateBytes(int num_models);
+
+  // Number of times the state has been overwritten.
+  uint32 generation(int state) const { return generations_[state]; }
+
+  // Records an access to the state, protecting it from the next sweep.
+  void MarkUsed(int state) const {
+    used_[state].store(true, std::memory_order_relaxed);
   }
 
-  // Returns model state for index within range; -1 otherwise.
-  int model_state(int idx) const {
-    return idx >= 0 && idx < model_states_.size() ? model_states_[idx] : -1;
+  // Picks the state to overwrite next, which is neither the start state nor
+  // keep_state. Requires at least three states.
+  int NextVictim(int keep_state);
+
+  // Number of component model states stored for each hub state.
+  int num_models() const { return num_models_; }
+
+  // Returns the states of all the component models.
+  absl::Span<const int> model_states(int state) const {
+    return absl::MakeConstSpan(model_states_.data() + state * num_models_,
+                               num_models_);
   }
 
-  // Adds next state to next_states_.
-  void AddNextState(int utf8_sym, int next_state) {
-    next_states_.insert({utf8_sym, next_state});
+  // Returns model state for index within range; -1 otherwise.
+  int model_state(int state, int idx) const {
+    return idx >= 0 && idx < num_models_
+               ? model_states_[state * num_models_ + idx]
+               : -1;
   }
 
-  // Resets values with those from given hub_state.
-  absl::StatusOr<std::vector<int>> UpdateHubState(
-      const LanguageModelHubState& hub_state);
+  // Previous state in the hub, -1 if none or if it has been overwritten.
+  int prev_state(int state) const { return prev_states_[state]; }
 
-  // For a given hub state, this verifies model state information which may have
-  // changed due to count updates. Returns false if base information is wrong.
-  bool VerifyOrCorrectModelStates(int prev_state, int utf8_sym,
-                                  const std::vector<int>& model_states);
+  // Last symbol leading to the state.
+  int state_sym(int state) const { return state_syms_[state]; }
 
-  // Resets previous state when previous state has been overwritten.
-  void ResetPrevState() {
-    prev_state_ = -1;
-  }
+  // Returns existing next state for symbol if exists; -1 otherwise.
+  int next_state(int state, int utf8_sym) const;
+
+  // Appends a new state reached from prev_state (if non-negative) following
+  // state_sym. Returns the index of the new state.
+  int AddState(absl::Span<const int> model_states, int prev_state,
+               int state_sym);
+
+  // Overwrites the existing state with new information, moving it to the next
+  // generation. The transitions from and to the old state are removed, and
+  // the states previously reached from it no longer have a previous state.
+  void ResetState(int state, absl::Span<const int> model_states,
+                  int prev_state, int state_sym);
+
+  // Replaces the states of the component models, e.g., after count updates.
+  void SetModelStates(int state, absl::Span<const int> model_states);
 
  private:
+  // Slot of the transition table; the key packs the origin and the symbol.
+  struct Transition {
+    uint64 key;
+    int next_state;
+  };
+
+  static uint64 TransitionKey(int state, int utf8_sym) {
+    return (static_cast<uint64>(static_cast<uint32>(state)) << 32) |
+           static_cast<uint32>(utf8_sym);
+  }
+
+  // Links the state to the transition from its previous state.
+  void LinkState(int state);
+
+  // Removes the transition leading to the state, if any.
+  void UnlinkState(int state);
+
+  // Removes the transitions from the state, the states reached from it no
+  // longer having a previous state.
+  void DetachNextStates(int state);
+
+  // Rebuilds the transition table with the given number of slots, a power of
+  // two.
+  void ResizeTransitions(size_t num_slots);
+
+  // Returns the slot holding the key, or the empty slot ending its probe.
+  size_t FindSlot(uint64 key) const;
+
+  void InsertTransition(uint64 key, int next_state);
+  void EraseTransition(uint64 key);
+
+  int num_models_ = 0;
+  int capacity_ = 0;
+  int max_capacity_ = 0;
   std::vector<int> model_states_;  // Stores state IDs from component models.
-  std::vector<std::string>
-      model_state_prefixes_;  // Stores word prefixes at state in models.
-  int prev_state_;            // Previous state in the model hub.
-  absl::flat_hash_map<int, int> next_states_;  // Set of next states.
-  int state_sym_;             // Last symbol leading to this state.
+  std::vector<int> prev_states_;   // Previous state in the model hub.
+  std::vector<int> state_syms_;    // Last symbol leading to each state.
+  std::vector<int> first_next_states_;  // Head of the list of next states.
+  std::vector<int> next_siblings_;      // Next state with the same origin.
+  // Overwrites of each state, kept for the states removed by SetCapacity() so
+  // that the states added back at their indices get new ids.
+  std::vector<uint32> generations_;
+  // Whether each state has been used since the last sweep, for all of the
+  // capacity since the atomics cannot be moved.
+  std::unique_ptr<std::atomic<bool>[]> used_;
+  int clock_hand_ = 0;                  // Last state visited by the sweep.
+  std::vector<Transition> transitions_;  // Power-of-two sized table.
+  size_t num_transitions_ = 0;
+};
+
+// Cache of the hub states reached by the recent contexts from their initial
+// states. The entries keep their contexts, which are compared on lookup, so
+// that a collision of the context hashes is a miss rather than the state of
+// another context. Once full, the entries are evicted using the CLOCK
+// algorithm, as for the hub states.
+//
+// Not thread-safe, except that Lookup may be called concurrently with the
+// other const methods.
+class ContextStateCache {
+ public:
+  ContextStateCache() = default;
+  ~ContextStateCache() = default;
+
+  // Removes all the entries, setting the maximum number of entries to keep.
+  void Reset(int capacity);
+
+  // Number of cached contexts.
+  int size() const { return entries_.size(); }
+
+  // Maximum number of cached contexts.
+  int capacity() const { return capacity_; }
+
+  // Changes the maximum number of cached contexts, evicting the entries over
+  // the new capacity.
+  void SetCapacity(int capacity);
+
+  // Returns the state cached for the context from init_state, -1 if none,
+  // and protects the entry from the next eviction sweep. The state may have
+  // been overwritten since it was cached.
+  int Lookup(int init_state, absl::string_view context) const;
+
+  // Caches the state reached from init_state by the context, evicting an
+  // entry if the cache is full.
+  void Insert(int init_state, absl::string_view context, int state);
+
+  // Approximate number of bytes held by the entries.
+  int64 MemoryBytes() const;
+
+  // Approximate number of bytes per entry, not counting the context, for
+  // turning a memory limit into a capacity.
+  static int64 EntryBytes();
+
+ private:
+  struct Entry {
+    int init_state;
+    std::string context;
+    int state;
+  };
+
+  static size_t EntryKey(int init_state, absl::string_view context);
+
+  // Picks the entry to overwrite next. Requires a non-empty cache.
+  int NextVictim();
+
+  int capacity_ = 0;
+  std::vector<Entry> entries_;
+  // Entries keyed by the hash of their initial state and context.
+  absl::flat_hash_map<size_t, int> indices_;
+  // Whether each entry has been looked up since the last sweep, for all of
+  // the capacity since the atomics cannot be moved.
+  std::unique_ptr<std::atomic<bool>[]> used_;
+  int clock_hand_ = 0;      // Last entry visited by the sweep.
+  int64 context_bytes_ = 0;  // Total size of the cached contexts.
 };
 
 // TODO: Initialize with a desired target alphabet.
+//
+// The state ids handed out by the hub combine the index of the hub state with
+// its generation in the upper bits, so that the ids of overwritten states are
+// rejected: the methods taking a state return an error value for them, as
+// for any other invalid state. The start state always has id 0, even in a hub
+// replacing another one.
+//
+// The hub is thread-safe: the public methods may be called concurrently from
+// multiple server threads. Lookups of the existing hub states and score
+// extraction only require a shared lock on the hub states, while creating new
+// hub states and updating the counts are serialized. The component models are
+// responsible for their own synchronization.
 class LanguageModelHub {
  public:
   LanguageModelHub() = default;
@@ -95,51 +370,361 @@ class LanguageModelHub {
   // Adds language model to collection of models.
   void AddModel(std::unique_ptr<LanguageModel> language_model) {
     language_models_.push_back(std::move(language_model));
+    model_timings_.emplace_back();
   }
 
   // Initializes set of models after all models have been added.
   bool InitializeModels(const ModelHubConfig &config);
 
-  // Provides the last symbol to reach the state.
-  int StateSym(int state);
+  // Makes the ids of the hub states, other than the start state, differ from
+  // the ones handed out by the given hub, which this hub replaces, so that
+  // the ids still held by the clients of the replaced hub are rejected rather
+  // than taken for unrelated states. Called after InitializeModels() and
+  // before serving.
+  void ReplaceHub(const LanguageModelHub& replaced)
+      ABSL_LOCKS_EXCLUDED(hub_lock_);
+
+  // Provides the last symbol to reach the state; -1 if the state is invalid.
+  int StateSym(int state) ABSL_LOCKS_EXCLUDED(hub_lock_);
 
-  // Provides the state reached from state following utf8_sym.
-  int NextState(int state, int utf8_sym);
+  // Provides the state reached from state following utf8_sym. If state is
+  // less than zero, starts from the start state. Returns -1 if the state is
+  // invalid or has been overwritten.
+  int NextState(int state, int utf8_sym) ABSL_LOCKS_EXCLUDED(hub_lock_);
 
   // Provides the state reached from the init_state after consuming the context
   // string. If string is empty, returns the init_state.  If init_state is less
-  // than zero, the model will start at the start state of the model.
-  int ContextState(const std::string& context = "", int init_state = -1);
+  // than zero, the model will start at the start state of the model. Returns
+  // -1 if the init_state is invalid or has been overwritten.
+  //
+  // Clients typically resend the whole context after each typed character, so
+  // the states reached by recent contexts are cached: the context, or the
+  // context without its last character, is usually found in the cache, and
+  // only the remaining character needs to be followed.
+  int ContextState(const std::string& context = "", int init_state = -1)
+      ABSL_LOCKS_EXCLUDED(hub_lock_, context_cache_lock_);
 
   // Copies the probs and normalization from the given state into the response.
-  bool ExtractLMScores(int state, LMScores* response);
+  bool ExtractLMScores(int state, LMScores* response)
+      ABSL_LOCKS_EXCLUDED(hub_lock_);
+
+  // Copies the probs and normalization from the given state into the response,
+  // adapted to the user, pruned and encoded as requested by the options.
+  bool ExtractLMScores(int state, const LMScoresOptions& options,
+                       LMScores* response)
+      ABSL_LOCKS_EXCLUDED(hub_lock_, vocab_lock_);
+
+  // Scores the UTF-8 text from the given state, which is validated as for
+  // ContextState: returns the negative log probability of each of the
+  // characters of the text, followed by the one of the end-of-string if
+  // score_end_of_string is set. The costs are in bits if return_bits is set,
+  // otherwise in nats. The component model states are followed directly, so
+  // that scoring many candidate strings neither creates nor recycles any hub
+  // states, and the counts are left unchanged. Returns an error for the
+  // characters which are not in the vocabulary of the models, or which the
+  // models give no probability, rather than infinite costs.
+  absl::StatusOr<std::vector<double>> ScoreString(int init_state,
+                                                  absl::string_view text,
+                                                  bool score_end_of_string,
+                                                  bool return_bits)
+      ABSL_LOCKS_EXCLUDED(hub_lock_, mix_lock_, vocab_lock_);
+
+  // Returns the completions of the context read from the given state, which
+  // is validated as for ContextState. The completions are found by a beam
+  // search, most likely first, or sampled from the model, as requested by the
+  // options. As for ScoreString, the component model states are followed
+  // directly, so that the searches neither create nor recycle any hub states
+  // beyond the one of the context, and the counts are left unchanged.
+  absl::StatusOr<std::vector<ContextCompletion>> CompleteContext(
+      int init_state, const std::string& context,
+      const CompletionOptions& options)
+      ABSL_LOCKS_EXCLUDED(hub_lock_, context_cache_lock_);
+
+  // Dense scores API, for the in-process callers that do not need protocol
+  // buffers: fills in the probabilities at the given state indexed by the
+  // vocabulary of the compact scores, extending it with any new symbols of the
+  // models. The caller-provided vector is resized to the number of symbols
+  // covered, which may be lower than VocabularySize() if the vocabulary grew
+  // since, the other symbols having zero probability. The scores are neither
+  // adapted to the users nor pruned. Returns false if the state is invalid.
+  bool ExtractProbabilities(int state, std::vector<double>* probs)
+      ABSL_LOCKS_EXCLUDED(hub_lock_, mix_lock_, vocab_lock_);
+
+  // Same as above, but writes the probabilities into the first num_probs
+  // elements of the caller-provided array, which are zero past the symbols
+  // covered. Returns the number of symbols covered, which may exceed
+  // num_probs, or -1 if the state is invalid. The intermediate buffers are
+  // kept by the calling thread, so that the repeated calls do not allocate.
+  int ExtractProbabilities(int state, double* probs, int num_probs)
+      ABSL_LOCKS_EXCLUDED(hub_lock_, mix_lock_, vocab_lock_);
+
+  // Copies the current vocabulary, referred to by the compact scores.
+  void GetVocabulary(Vocabulary* vocabulary) ABSL_LOCKS_EXCLUDED(vocab_lock_);
+
+  // Returns the number of symbols in the vocabulary. The vocabulary only
+  // grows, so that the index of a symbol never changes.
+  int VocabularySize() const ABSL_LOCKS_EXCLUDED(vocab_lock_);
+
+  // Appends the vocabulary symbols from first_index onwards.
+  void AppendVocabularySymbols(int first_index,
+                               std::vector<std::string>* symbols) const
+      ABSL_LOCKS_EXCLUDED(vocab_lock_);
 
   // Updates the count for the utf8_syms at the current state.
   bool UpdateLMCounts(int32 state, const std::vector<int>& utf8_syms,
-                      int64 count);
+                      int64 count) ABSL_LOCKS_EXCLUDED(hub_lock_);
+
+  // Same as above, but only updates the counts of the user, which adapt the
+  // scores extracted for that user, leaving the shared models unchanged.
+  // Returns false if the state is invalid, or if its context, which keys the
+  // counts of the user, is no longer known since some of its previous states
+  // have been overwritten.
+  bool UpdateUserCounts(const std::string& user, int32 state,
+                        const std::vector<int>& utf8_syms, int64 count)
+      ABSL_LOCKS_EXCLUDED(hub_lock_);
+
+  // Updates the counts with each line of the text, read from the start state
+  // and followed by the end-of-string, without computing any scores. The lines
+  // are applied in batches, each under the exclusive lock, so that the other
+  // requests are served in between. Returns the number of lines used.
+  absl::StatusOr<int64> BulkUpdateLMCounts(const std::string& text,
+                                           int64 count)
+      ABSL_LOCKS_EXCLUDED(hub_lock_);
+
+  // Same as above, reading the text from the given file.
+  absl::StatusOr<int64> BulkUpdateLMCountsFromFile(
+      const std::string& text_file, int64 count) ABSL_LOCKS_EXCLUDED(hub_lock_);
+
+  // Fills in the counters and the timings accumulated since the hub was
+  // created, and the memory currently held.
+  void GetStats(HubStats* stats) const ABSL_LOCKS_EXCLUDED(hub_lock_);
+
+  // Measures the memory held by the hub and by its models, which is linear in
+  // the number of model states and user contexts.
+  void GetMemoryUsage(HubMemoryUsage* usage) const
+      ABSL_LOCKS_EXCLUDED(hub_lock_, context_cache_lock_);
+
+  // Limits the memory held by the hub states, the user counts and the model
+  // caches, releasing the memory over the limits: the hub states and the
+  // cached states with the highest indices are removed, as if they had been
+  // overwritten, and the least recently used users and cached distributions
+  // are evicted. The hub keeps at least a few states.
+  void SetMemoryLimits(const HubMemoryLimits& limits)
+      ABSL_LOCKS_EXCLUDED(hub_lock_, context_cache_lock_);
+
+  // Restores the adapted counts from the snapshot file, replaying the count
+  // updates it holds onto the models, given the fingerprints of their storage
+  // (see ModelStorageFingerprint()). A snapshot written for models with other
+  // fingerprints is not replayed: it is moved aside, to the same path with a
+  // ".stale" suffix, and a new snapshot is started. The further count updates
+  // are recorded for WriteSnapshot(), the file being created by the first
+  // snapshot if it does not exist yet. Called once, after InitializeModels()
+  // and before serving.
+  absl::Status RestoreSnapshot(const std::string& snapshot_file,
+                               const std::vector<uint64>& model_fingerprints)
+      ABSL_LOCKS_EXCLUDED(hub_lock_);
+
+  // Appends the count updates applied since the last snapshot to the snapshot
+  // file, returning their number. The count updates are only blocked while
+  // being handed over, so that the snapshots can be written by a background
+  // thread while serving. Returns an error if RestoreSnapshot() was not
+  // called.
+  absl::StatusOr<int64> WriteSnapshot();
 
  private:
-  // Determines vector index for new state, creates state and returns index.
+  // Determines index for new state, creates state and returns its id.
   absl::StatusOr<int> AssignNewHubState(const std::vector<int>& model_states,
-                                        int prev_state, int state_sym);
+                                        int prev_state, int state_sym)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(hub_lock_);
 
   // Updates already allocated hub state to new information.
-  absl::Status UpdateHubState(int idx, const std::vector<int>& model_states,
-                              int prev_state, int state_sym);
+  absl::Status UpdateHubState(int idx, absl::Span<const int> model_states,
+                              int prev_state, int state_sym)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(hub_lock_);
+
+  // Fills in the last characters, at most max_chars of them, of the context
+  // leading to the state, fewer if the start state is reached. Returns false
+  // if the state is invalid, or if some of the previous states have been
+  // overwritten, since the context would then be cut short.
+  bool StateContext(int state, int max_chars, std::string* context) const
+      ABSL_LOCKS_EXCLUDED(hub_lock_);
+
+  // Adapts the scores extracted from the state to the counts of the user,
+  // if any. The scores are left unadapted if the context of the state is
+  // no longer known.
+  void AdaptToUser(const std::string& user, int state, LMScores* scores)
+      const ABSL_LOCKS_EXCLUDED(hub_lock_);
+
+  // Provides the state of the component model reached from model_state
+  // following utf8_sym, timing the model.
+  int ModelNextState(int idx, int model_state, int utf8_sym);
+
+  // Follows the UTF-8 context from the given state, which is validated as for
+  // ContextState. Returns an error if the context is not valid UTF-8.
+  absl::StatusOr<int> WalkContext(int state, absl::string_view context)
+      ABSL_LOCKS_EXCLUDED(hub_lock_);
+
+  // Returns the cached state reached from init_state by the context, -1 if
+  // not cached. The state may have been overwritten since.
+  int LookupContextCache(int init_state, absl::string_view context) const
+      ABSL_LOCKS_EXCLUDED(context_cache_lock_);
+
+  // Caches the state reached from init_state by the context.
+  void InsertContextCache(int init_state, absl::string_view context,
+                          int state) ABSL_LOCKS_EXCLUDED(context_cache_lock_);
+
+  // Copies the probs and normalization from the given component model states
+  // into the response, mixing them if required.
+  bool ExtractModelScores(const std::vector<int>& model_states,
+                          LMScores* response) ABSL_LOCKS_EXCLUDED(mix_lock_);
 
-  // Initializes already allocated start hub state with start states.
-  absl::Status InitializeStartHubState();
+  // Same as ExtractProbabilities, from the given component model states.
+  bool ExtractModelProbabilities(const std::vector<int>& model_states,
+                                 std::vector<double>* probs)
+      ABSL_LOCKS_EXCLUDED(mix_lock_, vocab_lock_);
+  int ExtractModelProbabilities(const std::vector<int>& model_states,
+                                double* probs, int num_probs)
+      ABSL_LOCKS_EXCLUDED(mix_lock_, vocab_lock_);
+
+  // Finds the most likely completions from the given component model states
+  // by a beam search.
+  absl::StatusOr<std::vector<ContextCompletion>> BeamSearchCompletions(
+      const std::vector<int>& model_states, const CompletionOptions& options)
+      ABSL_LOCKS_EXCLUDED(mix_lock_);
+
+  // Draws the completions from the given component model states at random.
+  absl::StatusOr<std::vector<ContextCompletion>> SampleCompletions(
+      const std::vector<int>& model_states, const CompletionOptions& options)
+      ABSL_LOCKS_EXCLUDED(mix_lock_);
+
+  // Returns the id of the hub state at the given index.
+  int EncodeState(int index) const ABSL_SHARED_LOCKS_REQUIRED(hub_lock_);
+
+  // Returns the index of the hub state with the given id, -1 if there is no
+  // such state or if it has been overwritten since the id was handed out.
+  int DecodeState(int state) const ABSL_SHARED_LOCKS_REQUIRED(hub_lock_);
 
   // Verifies model states after updating counts, and corrects if they differ.
+  // Takes the index of the hub state rather than its id.
   bool VerifyOrCorrectModelStates(int32 state,
-                                  const std::vector<int>& utf8_syms);
+                                  const std::vector<int>& utf8_syms)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(hub_lock_);
+
+  // Checks whether the mixture layout covers the symbols of the dense scores
+  // returned by the models.
+  bool MixtureLayoutMatches(
+      const std::vector<std::vector<double>>& model_neg_log_probs) const
+      ABSL_SHARED_LOCKS_REQUIRED(mix_lock_);
+
+  // Copies the states of the component models at the given hub state,
+  // returning false if the state is invalid.
+  bool CopyModelStates(int state, std::vector<int>* model_states)
+      ABSL_LOCKS_EXCLUDED(hub_lock_);
+
+  // Builds the mixture layout from the current vocabularies of the models,
+  // extending the vocabulary of the compact scores with their symbols.
+  void BuildMixtureLayout() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mix_lock_)
+      ABSL_LOCKS_EXCLUDED(vocab_lock_);
+
+  // Interpolates the dense scores returned by the models into normalized
+  // probabilities indexed by the mixture symbols.
+  void MixProbabilities(
+      const std::vector<std::vector<double>>& model_neg_log_probs,
+      std::vector<double>* mixed_probs) const
+      ABSL_SHARED_LOCKS_REQUIRED(mix_lock_);
+
+  // Same as above, but the probabilities are written into the first num_probs
+  // elements of the array, indexed by the vocabulary of the compact scores.
+  // Returns the number of vocabulary symbols covered by the mixture.
+  int MixVocabularyProbabilities(
+      const std::vector<std::vector<double>>& model_neg_log_probs,
+      double* probs, int num_probs) const
+      ABSL_SHARED_LOCKS_REQUIRED(mix_lock_);
+
+  // Interpolates the dense scores returned by the models into the response.
+  void MixScores(const std::vector<std::vector<double>>& model_neg_log_probs,
+                 LMScores* response) const
+      ABSL_SHARED_LOCKS_REQUIRED(mix_lock_);
+
+  // Converts the scores in full format to the compact format, extending the
+  // vocabulary with any new symbols.
+  void CompactLMScores(LMScores* response) ABSL_LOCKS_EXCLUDED(vocab_lock_);
+
+  // Looks up the vocabulary indices of the response symbols. Returns false if
+  // some of the symbols are not in the vocabulary.
+  bool FindVocabIndices(const LMScores& response, std::vector<int>* indices)
+      const ABSL_SHARED_LOCKS_REQUIRED(vocab_lock_);
+
+  // Adds the symbols to the vocabulary, unless already present, updating the
+  // version.
+  void ExtendVocabulary(const LMScores& response)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(vocab_lock_);
+  void AddVocabularySymbol(const std::string& symbol)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(vocab_lock_);
+
+  // Guards the hub states.
+  mutable absl::Mutex hub_lock_;
 
   // States in the model hub, tracking states in all component models.
-  std::vector<std::unique_ptr<LanguageModelHubState>> hub_states_;
-  int last_created_hub_state_;  // Tracks which hub states recently created.
-  int max_hub_states_;          // Maximum number of hub states to allow.
+  HubStateArena hub_states_ ABSL_GUARDED_BY(hub_lock_);
+  // Number of low bits of the state ids holding the hub state index.
+  int index_bits_ ABSL_GUARDED_BY(hub_lock_) = 0;
+  // Offset of the generations in the state ids, which differs from the one of
+  // the replaced hub, if any.
+  uint32 generation_offset_ ABSL_GUARDED_BY(hub_lock_) = 0;
   std::vector<double> mixture_weights_;  // Weight for each model in mixture.
   std::vector<std::unique_ptr<LanguageModel>> language_models_;
+
+  // Timings of the calls to each of the component models.
+  struct ModelTimings {
+    LatencyHistogram next_state;
+    LatencyHistogram extract_scores;
+  };
+  std::vector<ModelTimings> model_timings_;
+
+  // Counts of the users, created by InitializeModels().
+  std::unique_ptr<UserAdaptation> user_adaptation_;
+
+  // Journal of the count updates, created by RestoreSnapshot() before
+  // serving. The updates are recorded under the exclusive hub lock, hence in
+  // the order they are applied.
+  std::unique_ptr<CountsJournal> counts_journal_;
+
+  // Counters of the hub states and of the context cache lookups, updated
+  // under any of the locks.
+  std::atomic<int64> num_allocated_states_{0};
+  std::atomic<int64> num_overwritten_states_{0};
+  std::atomic<int64> context_cache_hits_{0};
+  std::atomic<int64> context_cache_prefix_hits_{0};
+  std::atomic<int64> context_cache_misses_{0};
+
+  // Guards the layout of the mixture, which maps the symbols of each model to
+  // a dense index over the union of the model symbols. The models return
+  // their symbols in the same order for all the states, so the layout only
+  // needs to be rebuilt when a model vocabulary grows.
+  mutable absl::Mutex mix_lock_;
+  std::vector<std::string> mix_symbols_ ABSL_GUARDED_BY(mix_lock_);
+  std::vector<std::vector<int>> mix_indices_ ABSL_GUARDED_BY(mix_lock_);
+  // Whether the model symbols are in the same order as the mixture symbols.
+  std::vector<bool> mix_identity_ ABSL_GUARDED_BY(mix_lock_);
+  // Vocabulary indices of the mixture symbols, and the vocabulary size when
+  // the layout was built.
+  std::vector<int> mix_vocab_indices_ ABSL_GUARDED_BY(mix_lock_);
+  int mix_vocab_size_ ABSL_GUARDED_BY(mix_lock_) = 0;
+
+  // Guards the cache of the states reached by the recent contexts, which
+  // keeps up to one entry per hub state. Not held together with the hub lock.
+  mutable absl::Mutex context_cache_lock_;
+  ContextStateCache context_cache_ ABSL_GUARDED_BY(context_cache_lock_);
+
+  // Guards the vocabulary used by the compact scores. Neither this lock nor
+  // the mixture or context cache lock is held together with the hub lock.
+  // This lock is taken after the mixture lock when the layout is built.
+  mutable absl::Mutex vocab_lock_;
+  std::vector<std::string> vocab_symbols_ ABSL_GUARDED_BY(vocab_lock_);
+  absl::flat_hash_map<std::string, int> vocab_indices_
+      ABSL_GUARDED_BY(vocab_lock_);
+  uint64 vocab_version_ ABSL_GUARDED_BY(vocab_lock_) = 0;
 };
 
 }  // namespace models
@@ -18,18 +18,23 @@
 #include <cmath>
 #include <iterator>
 #include <numeric>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "gmock/gmock.h"
 #include "mozolm/stubs/status-matchers.h"
 #include "protobuf-matchers/protocol-buffer-matchers.h"
 #include "gtest/gtest.h"
+#include "absl/status/status.h"
 #include "mozolm/models/lm_scores.pb.h"
 
 namespace mozolm {
 namespace models {
 namespace {
 
+using ::protobuf_matchers::EqualsProto;
+
 TEST(LanguageModelTest, CheckGetTopHypotheses) {
   LMScores scores_proto;
   auto scores_status = GetTopHypotheses(scores_proto);
@@ -66,6 +71,87 @@ TEST(LanguageModelTest, CheckGetTopHypotheses) {
   EXPECT_EQ(scores[0].second, "c");
 }
 
+TEST(LanguageModelTest, CheckPruneLMScores) {
+  LMScores scores;
+  const std::vector<std::pair<std::string, double>> entries = {
+    {"a", 0.1}, {"b", 0.4}, {"c", 0.05}, {"d", 0.3}, {"e", 0.15}};
+  for (const auto& entry : entries) {
+    scores.add_symbols(entry.first);
+    scores.add_probabilities(entry.second);
+  }
+
+  // No pruning requested.
+  LMScores pruned = scores;
+  PruneLMScores(/* top_k= */0, /* min_probability= */0.0, &pruned);
+  EXPECT_THAT(pruned, EqualsProto(scores));
+
+  // Top-k.
+  pruned = scores;
+  PruneLMScores(/* top_k= */2, /* min_probability= */0.0, &pruned);
+  ASSERT_EQ(2, pruned.symbols_size());
+  ASSERT_EQ(2, pruned.probabilities_size());
+  EXPECT_EQ("b", pruned.symbols(0));
+  EXPECT_EQ("d", pruned.symbols(1));
+  EXPECT_NEAR(0.3, pruned.remaining_probability(), 1E-6);
+
+  // Threshold.
+  pruned = scores;
+  PruneLMScores(/* top_k= */0, /* min_probability= */0.12, &pruned);
+  ASSERT_EQ(3, pruned.symbols_size());
+  EXPECT_EQ("b", pruned.symbols(0));
+  EXPECT_EQ("d", pruned.symbols(1));
+  EXPECT_EQ("e", pruned.symbols(2));
+  EXPECT_NEAR(0.15, pruned.remaining_probability(), 1E-6);
+
+  // Both, with more symbols requested than available above the threshold.
+  pruned = scores;
+  PruneLMScores(/* top_k= */4, /* min_probability= */0.2, &pruned);
+  ASSERT_EQ(2, pruned.symbols_size());
+  EXPECT_NEAR(0.3, pruned.remaining_probability(), 1E-6);
+}
+
+TEST(LanguageModelTest, CheckExpandLMScores) {
+  Vocabulary vocab;
+  vocab.set_version(1234);
+  vocab.add_symbols("a");
+  vocab.add_symbols("b");
+  vocab.add_symbols("c");
+
+  // Dense scores covering the whole vocabulary.
+  LMScores scores;
+  scores.set_vocabulary_version(1234);
+  scores.add_compact_probabilities(0.25);
+  scores.add_compact_probabilities(0.5);
+  scores.add_compact_probabilities(0.25);
+  EXPECT_OK(ExpandLMScores(vocab, &scores));
+  ASSERT_EQ(3, scores.symbols_size());
+  ASSERT_EQ(3, scores.probabilities_size());
+  EXPECT_EQ("b", scores.symbols(1));
+  EXPECT_FLOAT_EQ(0.5, scores.probabilities(1));
+  EXPECT_TRUE(scores.compact_probabilities().empty());
+
+  // Sparse scores.
+  scores.Clear();
+  scores.set_vocabulary_version(1234);
+  scores.add_vocabulary_indices(2);
+  scores.add_compact_probabilities(1.0);
+  EXPECT_OK(ExpandLMScores(vocab, &scores));
+  ASSERT_EQ(1, scores.symbols_size());
+  EXPECT_EQ("c", scores.symbols(0));
+  EXPECT_FLOAT_EQ(1.0, scores.probabilities(0));
+
+  // Invalid index.
+  scores.Clear();
+  scores.set_vocabulary_version(1234);
+  scores.add_vocabulary_indices(3);
+  scores.add_compact_probabilities(1.0);
+  EXPECT_FALSE(ExpandLMScores(vocab, &scores).ok());
+
+  // Stale vocabulary.
+  scores.set_vocabulary_version(4321);
+  EXPECT_TRUE(absl::IsFailedPrecondition(ExpandLMScores(vocab, &scores)));
+}
+
 TEST(LanguageModelTest, CheckSoftmaxRenormalize) {
   std::vector<double> costs = {
     -std::log(0.4), -std::log(0.1), -std::log(0.3), 0.0 };
@@ -0,0 +1,63 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/models/memory_budget.h"
+
+#include <algorithm>
+
+namespace mozolm {
+namespace models {
+
+std::vector<int64> SplitMemoryBudget(int64 available_bytes,
+                                     const std::vector<int64>& used_bytes) {
+  std::vector<int64> limits(used_bytes.size(), 0);
+  if (used_bytes.empty() || available_bytes <= 0) return limits;
+  int64 total_bytes = 0;
+  for (const int64 bytes : used_bytes) total_bytes += bytes;
+  const double scale =
+      total_bytes > available_bytes
+          ? static_cast<double>(available_bytes) / total_bytes
+          : 1.0;
+  const int64 share =
+      std::max<int64>(available_bytes - total_bytes, 0) / used_bytes.size();
+  for (int i = 0; i < used_bytes.size(); ++i) {
+    limits[i] = static_cast<int64>(used_bytes[i] * scale) + share;
+  }
+  return limits;
+}
+
+HubMemoryUsage MemoryBudget::Rebalance(LanguageModelHub* hub) const {
+  HubMemoryUsage usage;
+  hub->GetMemoryUsage(&usage);
+
+  // The parts are the hub states, the user counts and the model caches, in
+  // this order.
+  int64 available_bytes = budget_bytes_;
+  std::vector<int64> used_bytes = {usage.hub_states_bytes, usage.user_bytes};
+  for (const ModelMemoryUsage& model : usage.models) {
+    available_bytes -= model.model_bytes;
+    used_bytes.push_back(model.cache_bytes);
+  }
+  const std::vector<int64> limits = SplitMemoryBudget(available_bytes,
+                                                      used_bytes);
+  HubMemoryLimits hub_limits;
+  hub_limits.hub_states_bytes = limits[0];
+  hub_limits.user_bytes = limits[1];
+  hub_limits.model_cache_bytes.assign(limits.begin() + 2, limits.end());
+  hub->SetMemoryLimits(hub_limits);
+  return usage;
+}
+
+}  // namespace models
+}  // namespace mozolm
@@ -0,0 +1,65 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Memory budget shared by the parts of the model hub which can release memory
+// under pressure: the hub states, the user counts and the caches of the
+// models. The structures of the models themselves are counted against the
+// budget but are not evicted.
+//
+// The budget is applied periodically rather than on every allocation: each
+// rebalance measures the memory held and sets the limits of the next period,
+// which bound the memory between the rebalances. Over the budget, the limits
+// scale the memory of all the parts down in proportion; under the budget,
+// each part is allowed to grow by an equal share of the free memory, so that
+// the busy parts take over the memory left unused by the others.
+
+#ifndef MOZOLM_MOZOLM_MODELS_MEMORY_BUDGET_H_
+#define MOZOLM_MOZOLM_MODELS_MEMORY_BUDGET_H_
+
+#include <vector>
+
+#include "mozolm/stubs/integral_types.h"
+#include "mozolm/models/language_model_hub.h"
+
+namespace mozolm {
+namespace models {
+
+// Returns the limits of the parts, given the bytes available to them all and
+// the bytes they currently hold: the current bytes, scaled down if they
+// exceed the available bytes, plus an equal share of the bytes left
+// available.
+std::vector<int64> SplitMemoryBudget(int64 available_bytes,
+                                     const std::vector<int64>& used_bytes);
+
+// Keeps a model hub and its models within the budget. Thread-safe.
+class MemoryBudget {
+ public:
+  explicit MemoryBudget(int64 budget_bytes) : budget_bytes_(budget_bytes) {}
+
+  // Measures the memory held by the hub and by its models, and sets the
+  // memory limits of the hub so that the hub states, the user counts and the
+  // model caches fit in the budget left by the model structures. Returns the
+  // memory measured, before the limits are applied.
+  HubMemoryUsage Rebalance(LanguageModelHub* hub) const;
+
+  int64 budget_bytes() const { return budget_bytes_; }
+
+ private:
+  const int64 budget_bytes_;
+};
+
+}  // namespace models
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_MODELS_MEMORY_BUDGET_H_
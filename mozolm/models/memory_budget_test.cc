@@ -0,0 +1,88 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the memory budget.
+
+#include "mozolm/models/memory_budget.h"
+
+#include <memory>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "mozolm/models/model_config.pb.h"
+#include "mozolm/models/model_factory.h"
+
+namespace mozolm {
+namespace models {
+namespace {
+
+TEST(MemoryBudgetTest, CheckSplitMemoryBudget) {
+  // Under the budget, the parts share the free memory equally.
+  EXPECT_EQ(std::vector<int64>({150, 350}),
+            SplitMemoryBudget(500, {100, 300}));
+
+  // Over the budget, the parts shrink in proportion.
+  EXPECT_EQ(std::vector<int64>({50, 150}),
+            SplitMemoryBudget(200, {100, 300}));
+
+  // Nothing is left to the parts.
+  EXPECT_EQ(std::vector<int64>({0, 0}), SplitMemoryBudget(-10, {100, 300}));
+  EXPECT_TRUE(SplitMemoryBudget(100, {}).empty());
+}
+
+TEST(MemoryBudgetTest, CheckRebalance) {
+  ModelHubConfig config;
+  config.set_maximim_maintained_states(1000);
+  auto hub_status = MakeModelHub(config);
+  ASSERT_TRUE(hub_status.ok());
+  std::unique_ptr<LanguageModelHub> hub = std::move(hub_status.value());
+  std::vector<int> states;
+  int state = 0;
+  for (int i = 0; i < 100; ++i) {
+    state = hub->NextState(state, 'a' + i % 26);
+    ASSERT_LE(0, state);
+    states.push_back(state);
+  }
+  HubStats stats;
+  hub->GetStats(&stats);
+  EXPECT_EQ(101, stats.num_states);
+  EXPECT_EQ(1000, stats.max_states);
+  EXPECT_LT(0, stats.memory.hub_states_bytes);
+
+  // A budget too low for any state keeps a few states, removing the others.
+  const MemoryBudget low_budget(1);
+  const HubMemoryUsage usage = low_budget.Rebalance(hub.get());
+  EXPECT_EQ(stats.memory.hub_states_bytes, usage.hub_states_bytes);
+  hub->GetStats(&stats);
+  EXPECT_EQ(10, stats.num_states);
+  EXPECT_EQ(10, stats.max_states);
+  EXPECT_GT(usage.hub_states_bytes, stats.memory.hub_states_bytes);
+  EXPECT_LE(0, hub->NextState(states[5], 'b'));
+  EXPECT_EQ(-1, hub->NextState(states[50], 'b'));
+
+  // The states removed are created again with new ids.
+  const int new_state = hub->NextState(states[8], 'j');
+  ASSERT_LE(0, new_state);
+  EXPECT_NE(states[9], new_state);
+
+  // A larger budget lets the hub grow again, up to its configuration.
+  const MemoryBudget high_budget(1 << 30);
+  high_budget.Rebalance(hub.get());
+  hub->GetStats(&stats);
+  EXPECT_EQ(1000, stats.max_states);
+}
+
+}  // namespace
+}  // namespace models
+}  // namespace mozolm
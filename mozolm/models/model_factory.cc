@@ -14,15 +14,21 @@
 
 #include "mozolm/models/model_factory.h"
 
+#include <algorithm>
 #include <utility>
+#include <vector>
 
 #include "mozolm/stubs/logging.h"
+#include "absl/status/status.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "mozolm/models/counts_journal.h"
 #include "mozolm/models/ngram_char_fst_model.h"
 #include "mozolm/models/ppm_as_fst_model.h"
+#include "mozolm/models/quantized_ngram_char_model.h"
 #include "mozolm/models/simple_bigram_char_model.h"
 #include "mozolm/stubs/status_macros.h"
+#include "mozolm/stubs/thread_pool.h"
 
 namespace mozolm {
 namespace models {
@@ -30,10 +36,25 @@ namespace models {
 absl::StatusOr<std::unique_ptr<LanguageModel>> MakeModel(
     const ModelConfig::ModelType &model_type, const ModelStorage &storage) {
   std::unique_ptr<LanguageModel> model;
-  if (model_type == ModelConfig::SIMPLE_CHAR_BIGRAM) {
+  const Quantization quantization = storage.quantization();
+  if (quantization != QUANTIZATION_NONE) {
+    if (model_type != ModelConfig::CHAR_NGRAM_FST &&
+        model_type != ModelConfig::CHAR_NGRAM_CONST_FST) {
+      return absl::InvalidArgumentError(
+          "Quantization is only supported by the character n-gram models");
+    }
+    if (quantization != QUANTIZATION_16_BIT &&
+        quantization != QUANTIZATION_8_BIT) {
+      return absl::InvalidArgumentError("Unsupported quantization");
+    }
+    model.reset(new QuantizedNGramCharModel(
+        model_type == ModelConfig::CHAR_NGRAM_CONST_FST, quantization));
+  } else if (model_type == ModelConfig::SIMPLE_CHAR_BIGRAM) {
     model.reset(new SimpleBigramCharModel);
   } else if (model_type == ModelConfig::CHAR_NGRAM_FST) {
     model.reset(new NGramCharFstModel);
+  } else if (model_type == ModelConfig::CHAR_NGRAM_CONST_FST) {
+    model.reset(new NGramCharFstModel(/* const_fst= */true));
   } else if (model_type == ModelConfig::PPM_AS_FST) {
     model.reset(new PpmAsFstModel);
   } else {  // Shouldn't be here.
@@ -61,15 +82,50 @@ absl::StatusOr<std::unique_ptr<LanguageModelHub>> MakeModelHub(
     if (!model_status.ok()) return model_status.status();
     model_hub->AddModel(std::move(model_status.value()));
   } else {
-    for (auto idx = 0; idx < config.model_config_size(); ++idx) {
-      auto model_status = models::MakeModel(config.model_config(idx));
+    // Reads the models concurrently, which bounds the loading time by the
+    // slowest model, and adds them in the order of the configuration.
+    const int num_models = config.model_config_size();
+    const int num_threads =
+        config.num_loading_threads() > 0
+            ? std::min(config.num_loading_threads(), num_models)
+            : num_models;
+    std::vector<absl::StatusOr<std::unique_ptr<LanguageModel>>> read_models(
+        num_models);
+    const auto read_model = [&config, &read_models](int idx) {
+      read_models[idx] = models::MakeModel(config.model_config(idx));
+    };
+    if (num_threads <= 1) {
+      for (auto idx = 0; idx < num_models; ++idx) read_model(idx);
+    } else {
+      // The calling thread reads models too.
+      ThreadPool pool(num_threads - 1);
+      pool.StartWorkers();
+      pool.ParallelFor(0, num_models, read_model);
+    }
+    for (auto &model_status : read_models) {
       if (!model_status.ok()) return model_status.status();
       model_hub->AddModel(std::move(model_status.value()));
     }
   }
   model_hub->InitializeModels(config);
+  if (!config.snapshot_file().empty()) {
+    RETURN_IF_ERROR(model_hub->RestoreSnapshot(
+        config.snapshot_file(), ModelStorageFingerprints(config)));
+  }
   return std::move(model_hub);
 }
 
+std::vector<uint64> ModelStorageFingerprints(const ModelHubConfig &config) {
+  std::vector<uint64> model_fingerprints;
+  if (config.model_config_size() == 0) {
+    // The default model, as read by MakeModelHub().
+    model_fingerprints.push_back(ModelStorageFingerprint(ModelConfig()));
+  }
+  for (const auto &model_config : config.model_config()) {
+    model_fingerprints.push_back(ModelStorageFingerprint(model_config));
+  }
+  return model_fingerprints;
+}
+
 }  // namespace models
 }  // namespace mozolm
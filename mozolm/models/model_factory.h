@@ -16,7 +16,9 @@
 #define MOZOLM_MOZOLM_MODELS_MODEL_FACTORY_H_
 
 #include <memory>
+#include <vector>
 
+#include "mozolm/stubs/integral_types.h"
 #include "absl/status/statusor.h"
 #include "mozolm/models/language_model.h"
 #include "mozolm/models/language_model_hub.h"
@@ -40,6 +42,10 @@ absl::StatusOr<std::unique_ptr<LanguageModel>> MakeModel(
 absl::StatusOr<std::unique_ptr<LanguageModelHub>> MakeModelHub(
     const ModelHubConfig &config);
 
+// Returns the fingerprints of the storage of the models of the hub, which
+// identify the models to which the count snapshots apply.
+std::vector<uint64> ModelStorageFingerprints(const ModelHubConfig &config);
+
 }  // namespace models
 }  // namespace mozolm
 
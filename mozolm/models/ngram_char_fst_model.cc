@@ -14,41 +14,64 @@
 
 #include "mozolm/models/ngram_char_fst_model.h"
 
+#include <algorithm>
 #include <cmath>
 
 #include "mozolm/stubs/logging.h"
 #include "fst/fst.h"
 #include "fst/matcher.h"
 #include "absl/memory/memory.h"
-#include "mozolm/utils/utf8_util.h"
+#include "mozolm/stubs/status_macros.h"
 
+using fst::ArcIterator;
 using fst::MATCH_INPUT;
 using fst::Matcher;
 using fst::StdArc;
-using fst::StdVectorFst;
+using fst::StdFst;
 using fst::Times;
 
 namespace mozolm {
 namespace models {
 
+absl::Status NGramCharFstModel::Read(const ModelStorage &storage) {
+  RETURN_IF_ERROR(NGramFstModel::Read(storage));
+  const auto &symbols = *fst_->InputSymbols();
+  const int num_symbols = symbols.NumSymbols();
+  labels_.clear();
+  symbols_.clear();
+  label_indices_.clear();
+  codepoint_labels_.Clear();
+  labels_.reserve(num_symbols - 1);
+  symbols_.reserve(num_symbols - 1);
+  label_indices_.reserve(num_symbols - 1);
+  for (int i = 1; i < num_symbols; ++i) {  // Ignore epsilon.
+    const StdArc::Label label = symbols.GetNthKey(i);
+    label_indices_.emplace(label, labels_.size());
+    labels_.push_back(label);
+    symbols_.push_back(symbols.Find(label));
+    codepoint_labels_.AddSymbol(symbols_.back(), label);
+  }
+  absl::MutexLock lock(&cache_lock_);
+  cache_.clear();
+  cache_index_.clear();
+  return absl::OkStatus();
+}
+
 int NGramCharFstModel::NextState(int state, int utf8_sym) {
   // Perform sanity check on the incoming unicode label.
-  int64_t label = utf8_sym;
-  const std::string u_char = utf8::EncodeUnicodeChar(utf8_sym);
-  if (fst_->InputSymbols()->Find(u_char) == fst::kNoSymbol) {
-    label = oov_label_;
-  }
+  int64_t label = codepoint_labels_.Find(utf8_sym);
+  if (label == utf8::CodepointMap::kNoLabel) label = oov_label_;
 
   StdArc::Weight bo_weight;
   StdArc::StateId current_state = CheckCurrentState(state);
   while (true) {
-    Matcher<StdVectorFst> matcher(*fst_, MATCH_INPUT);
+    Matcher<StdFst> matcher(*fst_, MATCH_INPUT);
     matcher.SetState(current_state);
     if (matcher.Find(label)) {  // Arc found out of current state.
       const StdArc arc = matcher.Value();
       return arc.nextstate;
     } else {
-      current_state = model_->GetBackoff(current_state, &bo_weight);
+      current_state = GetBackoff(current_state, &bo_weight);
       if (current_state < 0) return current_state;
     }
   }
@@ -56,36 +79,113 @@ int NGramCharFstModel::NextState(int state, int utf8_sym) {
   return current_state;
 }
 
-bool NGramCharFstModel::ExtractLMScores(int state, LMScores *response) {
+void NGramCharFstModel::AppendSymbols(int first_index,
+                                      std::vector<std::string>* symbols) {
+  if (first_index < 0) first_index = 0;
+  for (int i = first_index; i < symbols_.size(); ++i) {
+    symbols->push_back(symbols_[i]);
+  }
+}
+
+bool NGramCharFstModel::ExtractNegLogProbs(int state,
+                                           std::vector<double>* neg_log_probs,
+                                           double* normalization) {
   const StdArc::StateId current_state = CheckCurrentState(state);
+  if (current_state < 0 || current_state >= fst_->NumStates()) return false;
+  *neg_log_probs = GetDistribution(current_state)->neg_log_probs;
+  *normalization = 1.0;
+  return true;
+}
 
-  // Compute the label probability distribution for the given state.
-  const auto &symbols = *fst_->InputSymbols();
-  const int num_symbols = symbols.NumSymbols();
-  response->mutable_symbols()->Reserve(num_symbols - 1);
-  response->mutable_probabilities()->Reserve(num_symbols - 1);
-  std::vector<double> costs;
-  costs.reserve(num_symbols - 1);
-  for (int i = 1; i < num_symbols; ++i) {  // Ignore epsilon.
-    const StdArc::Label label = symbols.GetNthKey(i);
-    const StdArc::Weight cost = LabelCostInState(current_state, label);
-    costs.push_back(cost.Value());
-    response->add_symbols(symbols.Find(label));
+NGramCharFstModel::StateDistributionPtr NGramCharFstModel::GetDistribution(
+    StdArc::StateId state) {
+  {
+    absl::MutexLock lock(&cache_lock_);
+    const auto pos = cache_index_.find(state);
+    if (pos != cache_index_.end()) {
+      cache_.splice(cache_.begin(), cache_, pos->second);
+      return pos->second->second;
+    }
+  }
+  // The model is immutable, hence the distribution is computed without holding
+  // the lock. Concurrent misses on the same state compute the same values.
+  StateDistributionPtr distribution = ComputeDistribution(state);
+  absl::MutexLock lock(&cache_lock_);
+  const auto pos = cache_index_.find(state);
+  if (pos != cache_index_.end()) return pos->second->second;
+  cache_.emplace_front(state, distribution);
+  cache_index_.emplace(state, cache_.begin());
+  TrimCache();
+  return distribution;
+}
+
+void NGramCharFstModel::TrimCache() {
+  while (static_cast<int>(cache_.size()) > max_cached_distributions_) {
+    cache_index_.erase(cache_.back().first);
+    cache_.pop_back();
   }
-  SoftmaxRenormalize(&costs);
-  for (auto cost : costs) {
-    response->add_probabilities(std::exp(-cost));
+}
+
+int64 NGramCharFstModel::DistributionBytes() const {
+  // The list node and the index entry take a few pointers.
+  return sizeof(StateDistribution) + 2 * labels_.size() * sizeof(double) +
+         sizeof(CacheEntry) + 4 * sizeof(void*);
+}
+
+bool NGramCharFstModel::GetMemoryUsage(ModelMemoryUsage* usage) const {
+  NGramFstModel::GetMemoryUsage(usage);
+  usage->model_bytes += labels_.capacity() * sizeof(StdArc::Label);
+  for (const std::string& symbol : symbols_) {
+    usage->model_bytes += sizeof(std::string) + symbol.capacity();
   }
-  response->set_normalization(1.0);
+  absl::MutexLock lock(&cache_lock_);
+  usage->cache_bytes = cache_.size() * DistributionBytes();
   return true;
 }
 
+void NGramCharFstModel::SetCacheMemoryLimit(int64 max_bytes) {
+  int64 max_distributions = kMaxCachedDistributions;
+  if (max_bytes >= 0) {
+    max_distributions = std::min(max_distributions,
+                                 max_bytes / DistributionBytes());
+  }
+  absl::MutexLock lock(&cache_lock_);
+  // Keeps at least the distribution computed last.
+  max_cached_distributions_ = std::max<int64>(max_distributions, 1);
+  TrimCache();
+}
+
+NGramCharFstModel::StateDistributionPtr NGramCharFstModel::ComputeDistribution(
+    StdArc::StateId state) {
+  auto distribution = std::make_shared<StateDistribution>();
+  std::vector<double>& costs = distribution->costs;
+
+  // The labels not found in the state are scored by backing off.
+  StdArc::Weight backoff_cost;
+  const StdArc::StateId backoff_state = GetBackoff(state,
+                                                           &backoff_cost);
+  if (backoff_state >= 0) {
+    costs = GetDistribution(backoff_state)->costs;
+    for (double& cost : costs) cost += backoff_cost.Value();
+  } else {
+    costs.assign(labels_.size(), StdArc::Weight::Zero().Value());
+  }
+  for (ArcIterator<StdFst> aiter(*fst_, state); !aiter.Done();
+       aiter.Next()) {
+    const StdArc& arc = aiter.Value();
+    const auto pos = label_indices_.find(arc.ilabel);
+    if (pos != label_indices_.end()) costs[pos->second] = arc.weight.Value();
+  }
+  distribution->neg_log_probs = costs;
+  SoftmaxRenormalize(&distribution->neg_log_probs);
+  return distribution;
+}
+
 StdArc::StateId NGramCharFstModel::CheckCurrentState(
     StdArc::StateId state) const {
   StdArc::StateId current_state = state;
   if (state < 0) {
-    current_state = model_->UnigramState();
-    if (current_state < 0) current_state = fst_->Start();
+    current_state = unigram_state_;
   }
   return current_state;
 }
@@ -94,7 +194,7 @@ StdArc::Weight NGramCharFstModel::LabelCostInState(StdArc::StateId state,
                                                    StdArc::Label label) const {
   StdArc::Weight cost = StdArc::Weight::One();
   StdArc::StateId current_state = state;
-  Matcher<StdVectorFst> matcher(*fst_, MATCH_INPUT);
+  Matcher<StdFst> matcher(*fst_, MATCH_INPUT);
   while (current_state >= 0) {
     matcher.SetState(current_state);
     if (matcher.Find(label)) {
@@ -103,7 +203,7 @@ StdArc::Weight NGramCharFstModel::LabelCostInState(StdArc::StateId state,
       return cost;
     } else {
       StdArc::Weight bo_cost;
-      current_state = model_->GetBackoff(current_state, &bo_cost);
+      current_state = GetBackoff(current_state, &bo_cost);
       cost = Times(cost, bo_cost);
     }
   }
@@ -17,27 +17,67 @@
 #ifndef MOZOLM_MOZOLM_MODELS_NGRAM_CHAR_FST_MODEL_H_
 #define MOZOLM_MOZOLM_MODELS_NGRAM_CHAR_FST_MODEL_H_
 
+#include <list>
 #include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "mozolm/stubs/integral_types.h"
-#include "fst/vector-fst.h"
+#include "fst/fst.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
 #include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
 #include "mozolm/models/ngram_fst_model.h"
+#include "mozolm/utils/codepoint_map.h"
 
 namespace mozolm {
 namespace models {
 
+// Maximum number of state distributions to cache.
+constexpr int kMaxCachedDistributions = 2000;
+
+// The distributions over the vocabulary are computed once per state, in one
+// pass over the arcs of the state on top of the distribution of its backoff
+// state. The distributions are kept in a cache with least recently used
+// eviction, which is protected by its own lock. The cache keeps at most
+// kMaxCachedDistributions distributions, fewer under a memory limit.
 class NGramCharFstModel : public NGramFstModel {
  public:
   NGramCharFstModel() = default;
+
+  // Reads the model in ConstFst format if const_fst is set.
+  explicit NGramCharFstModel(bool const_fst) : NGramFstModel(const_fst) {}
   ~NGramCharFstModel() override = default;
 
+  // Reads the model from the model storage.
+  absl::Status Read(const ModelStorage &storage) override;
+
   // Provides the state reached from state following utf8_sym.
   int NextState(int state, int utf8_sym) override;
 
-  // Copies the probs and normalization from the given state into the response.
-  bool ExtractLMScores(int state, LMScores* response) override;
+  // Returns the number of symbols in the vocabulary, which excludes epsilon.
+  int NumSymbols() override { return labels_.size(); }
+
+  // Appends the symbols with vocabulary indices from first_index onwards.
+  void AppendSymbols(int first_index,
+                     std::vector<std::string>* symbols) override;
+
+  // Fills in the negative log probabilities for the state. The normalization
+  // is always one.
+  bool ExtractNegLogProbs(int state, std::vector<double>* neg_log_probs,
+                          double* normalization) override;
+
+  // Fills in the memory held by the FST and the vocabulary, and by the cached
+  // distributions.
+  bool GetMemoryUsage(ModelMemoryUsage* usage) const
+      ABSL_LOCKS_EXCLUDED(cache_lock_) override;
+
+  // Lowers the number of cached distributions to fit about max_bytes, evicting
+  // the least recently used ones.
+  void SetCacheMemoryLimit(int64 max_bytes)
+      ABSL_LOCKS_EXCLUDED(cache_lock_) override;
 
  protected:
   // Computes negative log probability for observing the supplied label in a
@@ -51,6 +91,49 @@ class NGramCharFstModel : public NGramFstModel {
   // state.
   fst::StdArc::StateId CheckCurrentState(
       fst::StdArc::StateId state) const;
+
+  // Distribution over the vocabulary for a state.
+  struct StateDistribution {
+    // Costs accumulated over the backoff arcs, prior to renormalization. These
+    // are shared by the distributions of the higher order states.
+    std::vector<double> costs;
+    // Renormalized negative log probabilities.
+    std::vector<double> neg_log_probs;
+  };
+  using StateDistributionPtr = std::shared_ptr<const StateDistribution>;
+
+  // Returns the distribution for the state, computing it if not cached.
+  StateDistributionPtr GetDistribution(fst::StdArc::StateId state)
+      ABSL_LOCKS_EXCLUDED(cache_lock_);
+
+  // Computes the distribution for the state from the distribution of its
+  // backoff state.
+  StateDistributionPtr ComputeDistribution(fst::StdArc::StateId state)
+      ABSL_LOCKS_EXCLUDED(cache_lock_);
+
+  // Number of bytes of a cached distribution, with its cache entry.
+  int64 DistributionBytes() const;
+
+  // Evicts the least recently used distributions over the limit.
+  void TrimCache() ABSL_EXCLUSIVE_LOCKS_REQUIRED(cache_lock_);
+
+  // Labels and symbols of the vocabulary, in symbol table order.
+  std::vector<fst::StdArc::Label> labels_;
+  std::vector<std::string> symbols_;
+  // Mapping from labels to their vocabulary indices.
+  absl::flat_hash_map<fst::StdArc::Label, int> label_indices_;
+  // Mapping from codepoints to labels.
+  utf8::CodepointMap codepoint_labels_;
+
+  // Guards the cache of the state distributions, which keeps the most recently
+  // used distributions at the front of the list.
+  mutable absl::Mutex cache_lock_;
+  int max_cached_distributions_ ABSL_GUARDED_BY(cache_lock_) =
+      kMaxCachedDistributions;
+  using CacheEntry = std::pair<fst::StdArc::StateId, StateDistributionPtr>;
+  std::list<CacheEntry> cache_ ABSL_GUARDED_BY(cache_lock_);
+  absl::flat_hash_map<fst::StdArc::StateId, std::list<CacheEntry>::iterator>
+      cache_index_ ABSL_GUARDED_BY(cache_lock_);
 };
 
 }  // namespace models
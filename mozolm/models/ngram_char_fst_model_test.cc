@@ -17,11 +17,15 @@
 #include "mozolm/models/ngram_char_fst_model.h"
 
 #include <algorithm>
+#include <cmath>
 #include <filesystem>
+#include <fstream>
 #include <numeric>
 #include <string>
 #include <vector>
 
+#include "fst/arcsort.h"
+#include "fst/const-fst.h"
 #include "fst/vector-fst.h"
 #include "gmock/gmock.h"
 #include "mozolm/stubs/status-matchers.h"
@@ -30,6 +34,7 @@
 #include "absl/flags/flag.h"
 #include "absl/strings/str_join.h"
 #include "mozolm/models/model_storage.pb.h"
+#include "mozolm/utils/file_util.h"
 #include "mozolm/utils/utf8_util.h"
 
 using fst::StdArc;
@@ -119,6 +124,95 @@ TEST_F(NGramCharFstModelTest, BasicCheck) {
       model_.fst().Start(), kOutOfVocabQuery));
 }
 
+TEST_F(NGramCharFstModelTest, CheckCachedDistributions) {
+  const std::vector<int> input_chars = utf8::StrSplitByCharToUnicode(
+      kSampleText);
+  const auto &symbols = *model_.fst().InputSymbols();
+  int state = -1;
+  for (int input_char : input_chars) {
+    state = model_.NextState(state, input_char);
+
+    // Computes the distribution symbol by symbol, following the backoff arcs.
+    std::vector<double> expected_neg_log_probs;
+    for (int i = 1; i < symbols.NumSymbols(); ++i) {
+      expected_neg_log_probs.push_back(model_.LabelCostInState(
+          state, symbols.GetNthKey(i)).Value());
+    }
+    SoftmaxRenormalize(&expected_neg_log_probs);
+
+    // Scores twice, the second time from the cache.
+    for (int i = 0; i < 2; ++i) {
+      std::vector<double> neg_log_probs;
+      double normalization;
+      EXPECT_TRUE(model_.ExtractNegLogProbs(state, &neg_log_probs,
+                                            &normalization));
+      EXPECT_EQ(1.0, normalization);
+      ASSERT_EQ(expected_neg_log_probs.size(), neg_log_probs.size());
+      for (int j = 0; j < neg_log_probs.size(); ++j) {
+        if (std::isinf(expected_neg_log_probs[j])) {
+          EXPECT_TRUE(std::isinf(neg_log_probs[j]));
+        } else {
+          EXPECT_NEAR(expected_neg_log_probs[j], neg_log_probs[j], 1E-5);
+        }
+      }
+    }
+  }
+}
+
+TEST_F(NGramCharFstModelTest, CheckConstFst) {
+  // Converts the model to an aligned constant FST with sorted arcs.
+  fst::StdVectorFst sorted_fst(model_.fst());
+  fst::ArcSort(&sorted_fst, fst::ILabelCompare<StdArc>());
+  const fst::StdConstFst const_fst(sorted_fst);
+  const std::string const_fst_path = file::TempFilePath("const.fst");
+  {
+    std::ofstream output(const_fst_path,
+                         std::ios_base::out | std::ios_base::binary);
+    fst::FstWriteOptions options(const_fst_path);
+    options.align = true;
+    ASSERT_TRUE(const_fst.Write(output, options));
+  }
+  ModelStorage const_fst_storage;
+  const_fst_storage.set_model_file(const_fst_path);
+  NGramCharFstModel const_fst_model(/* const_fst= */true);
+  ASSERT_OK(const_fst_model.Read(const_fst_storage));
+  EXPECT_EQ("const", const_fst_model.fst().Type());
+
+  // The models in both formats have the same vocabulary and scores.
+  const std::vector<int> input_chars = utf8::StrSplitByCharToUnicode(
+      kSampleText);
+  int state = -1, const_fst_state = -1;
+  for (int input_char : input_chars) {
+    state = model_.NextState(state, input_char);
+    const_fst_state = const_fst_model.NextState(const_fst_state, input_char);
+    LMScores result, const_fst_result;
+    ASSERT_TRUE(model_.ExtractLMScores(state, &result));
+    ASSERT_TRUE(const_fst_model.ExtractLMScores(const_fst_state,
+                                                &const_fst_result));
+    ASSERT_EQ(result.symbols_size(), const_fst_result.symbols_size());
+    for (int i = 0; i < result.symbols_size(); ++i) {
+      EXPECT_EQ(result.symbols(i), const_fst_result.symbols(i));
+      EXPECT_NEAR(result.probabilities(i), const_fst_result.probabilities(i),
+                  1E-6);
+    }
+  }
+  std::filesystem::remove(const_fst_path);
+
+  // Models with unsorted arcs are rejected.
+  fst::StdVectorFst unsorted_fst;
+  unsorted_fst.SetInputSymbols(model_.fst().InputSymbols());
+  unsorted_fst.AddState();
+  unsorted_fst.SetStart(0);
+  unsorted_fst.AddArc(0, StdArc(2, 2, 1.0, 0));
+  unsorted_fst.AddArc(0, StdArc(1, 1, 1.0, 0));
+  const std::string unsorted_fst_path = file::TempFilePath("unsorted.fst");
+  ASSERT_TRUE(fst::StdConstFst(unsorted_fst).Write(unsorted_fst_path));
+  const_fst_storage.set_model_file(unsorted_fst_path);
+  NGramCharFstModel unsorted_fst_model(/* const_fst= */true);
+  EXPECT_FALSE(unsorted_fst_model.Read(const_fst_storage).ok());
+  std::filesystem::remove(unsorted_fst_path);
+}
+
 TEST_F(NGramCharFstModelTest, TopCandidates) {
   constexpr int kMaxString = 15;
   std::string buffer = "H";
@@ -14,13 +14,21 @@
 
 #include "mozolm/models/ngram_fst_model.h"
 
+#include <fstream>
+
 #include "mozolm/stubs/logging.h"
-#include "fst/fst.h"
+#include "fst/arcsort.h"
+#include "fst/const-fst.h"
 #include "fst/symbol-table.h"
+#include "fst/vector-fst.h"
+#include "ngram/ngram-model.h"
 #include "absl/memory/memory.h"
 #include "absl/strings/str_cat.h"
 
+using fst::ArcIterator;
 using fst::StdArc;
+using fst::StdConstFst;
+using fst::StdExpandedFst;
 using fst::StdVectorFst;
 using fst::SymbolTable;
 
@@ -31,36 +39,105 @@ namespace {
 // Label that maps to unknown symbols.
 const char kUnknownSymbol[] = "<unk>";
 
-}  // namespace
-
-absl::Status NGramFstModel::Read(const ModelStorage &storage) {
-  if (storage.model_file().empty()) {
-    return absl::InvalidArgumentError("Model file not specified");
-  }
-  GOOGLE_LOG(INFO) << "Initializing from " << storage.model_file() << " ...";
-  std::unique_ptr<fst::StdVectorFst> fst;
-  fst.reset(StdVectorFst::Read(storage.model_file()));
+// Reads the model in VectorFst format, sorting the arcs by input label if
+// required.
+absl::StatusOr<std::unique_ptr<const StdExpandedFst>> ReadVectorFst(
+    const ModelStorage &storage) {
+  std::unique_ptr<StdVectorFst> fst(StdVectorFst::Read(storage.model_file()));
   if (!fst) {
     return absl::NotFoundError(absl::StrCat("Failed to read FST from ",
                                             storage.model_file()));
   }
-  const SymbolTable *input_symbols = fst->InputSymbols();
-  if (input_symbols == nullptr) {
+  if (fst->InputSymbols() == nullptr) {
     if (storage.vocabulary_file().empty()) {
       return absl::NotFoundError("FST is missing an input symbol table");
     }
     // Read symbol table from configuration.
-    input_symbols = SymbolTable::Read(storage.vocabulary_file());
+    std::unique_ptr<SymbolTable> input_symbols(
+        SymbolTable::Read(storage.vocabulary_file()));
     if (input_symbols == nullptr) {
       return absl::NotFoundError(absl::StrCat("Failed to read symbols from ",
                                               storage.vocabulary_file()));
     }
-    fst->SetInputSymbols(input_symbols);
+    fst->SetInputSymbols(input_symbols.get());
+  }
+  if (!fst->Properties(fst::kILabelSorted, /* test= */true)) {
+    fst::ArcSort(fst.get(), fst::ILabelCompare<StdArc>());
+  }
+  return std::unique_ptr<const StdExpandedFst>(std::move(fst));
+}
+
+// Reads the model in ConstFst format, memory-mapping the states and the arcs
+// if supported by the platform.
+absl::StatusOr<std::unique_ptr<const StdExpandedFst>> ReadConstFst(
+    const ModelStorage &storage) {
+  std::ifstream input(storage.model_file(),
+                      std::ios_base::in | std::ios_base::binary);
+  if (!input) {
+    return absl::NotFoundError(absl::StrCat("Failed to open ",
+                                            storage.model_file()));
+  }
+  fst::FstReadOptions options(storage.model_file());
+  options.mode = fst::FstReadOptions::MAP;
+  std::unique_ptr<StdConstFst> fst(StdConstFst::Read(input, options));
+  if (!fst) {
+    return absl::NotFoundError(absl::StrCat("Failed to read ConstFst from ",
+                                            storage.model_file()));
+  }
+  if (fst->InputSymbols() == nullptr) {
+    return absl::NotFoundError("ConstFst is missing an input symbol table");
+  }
+  // Only relies on the stored properties.
+  if (!fst->Properties(fst::kILabelSorted, /* test= */false)) {
+    return absl::FailedPreconditionError(
+        "ConstFst arcs are not sorted by input label");
   }
-  oov_label_ = input_symbols->Find(kUnknownSymbol);
+  return std::unique_ptr<const StdExpandedFst>(std::move(fst));
+}
+
+}  // namespace
+
+absl::Status NGramFstModel::Read(const ModelStorage &storage) {
+  if (storage.model_file().empty()) {
+    return absl::InvalidArgumentError("Model file not specified");
+  }
+  GOOGLE_LOG(INFO) << "Initializing from " << storage.model_file() << " ...";
+  auto fst_status = const_fst_ ? ReadConstFst(storage) : ReadVectorFst(storage);
+  if (!fst_status.ok()) return fst_status.status();
+  std::unique_ptr<const StdExpandedFst> fst = std::move(fst_status.value());
+  if (!const_fst_) {
+    const absl::Status check_status = CheckModel(*fst);
+    if (!check_status.ok()) return check_status;
+  }
+  oov_label_ = fst->InputSymbols()->Find(kUnknownSymbol);
   fst_ = std::move(fst);
-  model_ = absl::make_unique<const ngram::NGramModel<StdArc>>(*fst_);
-  return CheckModel();
+  std::ifstream model_file(storage.model_file(),
+                           std::ios_base::in | std::ios_base::binary |
+                               std::ios_base::ate);
+  model_file_bytes_ = model_file ? static_cast<int64>(model_file.tellg()) : 0;
+
+  // Follows the backoff arcs from the start state.
+  unigram_state_ = fst_->Start();
+  StdArc::Weight backoff_cost;
+  for (StdArc::StateId state = GetBackoff(unigram_state_, &backoff_cost);
+       state >= 0; state = GetBackoff(state, &backoff_cost)) {
+    unigram_state_ = state;
+  }
+  return absl::OkStatus();
+}
+
+StdArc::StateId NGramFstModel::GetBackoff(StdArc::StateId state,
+                                          StdArc::Weight *cost) const {
+  ArcIterator<fst::StdFst> aiter(*fst_, state);
+  if (aiter.Done() || aiter.Value().ilabel != 0) return fst::kNoStateId;
+  *cost = aiter.Value().weight;
+  return aiter.Value().nextstate;
+}
+
+bool NGramFstModel::GetMemoryUsage(ModelMemoryUsage* usage) const {
+  usage->model_bytes = model_file_bytes_;
+  usage->cache_bytes = 0;
+  return true;
 }
 
 bool NGramFstModel::UpdateLMCounts(int32 state,
@@ -70,13 +147,14 @@ bool NGramFstModel::UpdateLMCounts(int32 state,
   return true;  // Treat as a no-op.
 }
 
-absl::Status NGramFstModel::CheckModel() const {
-  if (model_->Error()) {
+absl::Status NGramFstModel::CheckModel(const fst::StdFst &fst) {
+  const ngram::NGramModel<StdArc> model(fst);
+  if (model.Error()) {
     return absl::InternalError("Model initialization failed");
-  } else if (!model_->CheckTopology()) {
+  } else if (!model.CheckTopology()) {
     return absl::InternalError(
         "FST topology does not correspond to a valid language model");
-  } else if (!model_->CheckNormalization()) {
+  } else if (!model.CheckNormalization()) {
     return absl::InternalError("FST states are not fully normalized");
   }
   return absl::OkStatus();
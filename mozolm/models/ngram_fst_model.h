@@ -21,8 +21,8 @@
 #include <vector>
 
 #include "mozolm/stubs/integral_types.h"
-#include "fst/vector-fst.h"
-#include "ngram/ngram-model.h"
+#include "fst/expanded-fst.h"
+#include "fst/fst.h"
 #include "absl/status/status.h"
 #include "mozolm/models/language_model.h"
 #include "mozolm/models/model_storage.pb.h"
@@ -30,6 +30,19 @@
 namespace mozolm {
 namespace models {
 
+// Read-only n-gram model. The model is immutable once read, hence all the
+// accesses are thread-safe without any locking.
+//
+// The model is either read into memory in VectorFst format, or memory-mapped
+// in ConstFst format, in which case the start up does not depend on the size
+// of the model and the pages of the model are shared between the processes
+// serving it. The ConstFst models are expected to be converted from valid
+// models with the arcs sorted by input label, e.g. using
+//
+//   fstarcsort --sort_type=ilabel model.fst sorted.fst
+//   fstconvert --fst_type=const --fst_align sorted.fst model.const.fst
+//
+// and are not checked when read, which would require touching all the arcs.
 class NGramFstModel : public LanguageModel {
  public:
   ~NGramFstModel() override = default;
@@ -43,23 +56,44 @@ class NGramFstModel : public LanguageModel {
                       int64 count) override;
 
   // Returns underlying FST, which must be initialized.
-  const fst::StdVectorFst &fst() const { return *fst_; }
+  const fst::StdExpandedFst &fst() const { return *fst_; }
+
+  // Fills in the memory held by the FST, approximated by the size of the
+  // model file in either format.
+  bool GetMemoryUsage(ModelMemoryUsage* usage) const override;
 
  protected:
   NGramFstModel() = default;
 
-  // Language model represented by vector FST.
-  std::unique_ptr<const fst::StdVectorFst> fst_;
+  // Reads the model in ConstFst rather than VectorFst format if const_fst is
+  // set.
+  explicit NGramFstModel(bool const_fst) : const_fst_(const_fst) {}
 
-  // N-Gram model helper wrapping the FST above.
-  std::unique_ptr<const ngram::NGramModel<ngram::StdArc>> model_;
+  // Returns the backoff state for the given state, or -1 if there is none,
+  // storing the backoff cost. Since the arcs are sorted by input label, the
+  // backoff arc is the first arc of the state.
+  fst::StdArc::StateId GetBackoff(fst::StdArc::StateId state,
+                                  fst::StdArc::Weight *cost) const;
+
+  // Language model represented by vector or constant FST, with the arcs sorted
+  // by input label.
+  std::unique_ptr<const fst::StdExpandedFst> fst_;
+
+  // Unigram state, reached by backing off from all the states.
+  fst::StdArc::StateId unigram_state_ = fst::kNoStateId;
 
   // Label for the unknown symbol, if any.
   fst::StdArc::Label oov_label_ = fst::kNoSymbol;
 
+  // Size of the model file read, in bytes.
+  int64 model_file_bytes_ = 0;
+
  private:
   // Performs model sanity check.
-  absl::Status CheckModel() const;
+  static absl::Status CheckModel(const fst::StdFst &fst);
+
+  // Whether the model is in ConstFst format.
+  const bool const_fst_ = false;
 };
 
 }  // namespace models
@@ -0,0 +1,99 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compiles a PPM model from a text corpus into an FST ahead of time.
+//
+// The resulting FST already has the update exclusions and prior counts of the
+// trained model, so servers read it directly instead of training from the text
+// on every start.
+//
+// Example usage:
+// --------------
+//   DATADIR=mozolm/data
+//   TEXTFILE="${DATADIR}"/en_wiki_1Kline_sample.txt
+//   bazel-bin/mozolm/models/ppm_as_fst_compiler --text_file="${TEXTFILE}"
+//     --output_fst=/tmp/ppm.fst --ppm_options="max_order: 4"
+//
+// The compiled model is then served by setting `model_file` to the output FST
+// and enabling `model_is_fst` in the PPM options of the model storage (see the
+// examples in mozolm/grpc/server_async_main.cc).
+
+#include <string>
+
+#include "mozolm/stubs/logging.h"
+#include "google/protobuf/text_format.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "mozolm/models/model_storage.pb.h"
+#include "mozolm/models/ppm_as_fst_model.h"
+#include "mozolm/models/ppm_as_fst_options.pb.h"
+#include "mozolm/stubs/status_macros.h"
+
+ABSL_FLAG(std::string, text_file, "",
+          "Training corpus in text format, one string per line.");
+
+ABSL_FLAG(std::string, vocabulary_file, "",
+          "Optional file with additional characters to add to the model.");
+
+ABSL_FLAG(std::string, ppm_options, "",
+          "Contents of (`mozolm.PpmAsFstOptions`) protocol buffer in text "
+          "format.");
+
+ABSL_FLAG(std::string, output_fst, "", "Output file for the compiled model.");
+
+namespace mozolm {
+namespace models {
+namespace {
+
+// Trains the model from the corpus given by the flags and writes it out.
+absl::Status CompileModel() {
+  const std::string output_fst = absl::GetFlag(FLAGS_output_fst);
+  if (output_fst.empty()) {
+    return absl::InvalidArgumentError("Specify --output_fst");
+  }
+  ModelStorage storage;
+  storage.set_model_file(absl::GetFlag(FLAGS_text_file));
+  storage.set_vocabulary_file(absl::GetFlag(FLAGS_vocabulary_file));
+  PpmAsFstOptions* ppm_options = storage.mutable_ppm_options();
+  if (!google::protobuf::TextFormat::ParseFromString(
+          absl::GetFlag(FLAGS_ppm_options), ppm_options)) {
+    return absl::InvalidArgumentError(
+        "Failed to parse PPM options from contents");
+  }
+  if (ppm_options->model_is_fst()) {
+    return absl::InvalidArgumentError(
+        "The model is compiled from text, unset model_is_fst");
+  }
+  PpmAsFstModel model;
+  RETURN_IF_ERROR(model.Read(storage));
+  RETURN_IF_ERROR(model.WriteFst(output_fst));
+  GOOGLE_LOG(INFO) << "Compiled model written to \"" << output_fst << "\"";
+  return absl::OkStatus();
+}
+
+}  // namespace
+}  // namespace models
+}  // namespace mozolm
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  const auto status = mozolm::models::CompileModel();
+  if (!status.ok()) {
+    GOOGLE_LOG(ERROR) << "Failed to compile model: " << status.ToString();
+    return 1;
+  }
+  return 0;
+}
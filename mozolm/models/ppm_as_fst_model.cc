@@ -14,22 +14,32 @@
 
 #include "mozolm/models/ppm_as_fst_model.h"
 
+#include <algorithm>
 #include <cmath>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <tuple>
+#include <utility>
 
 #include "mozolm/stubs/logging.h"
 #include "fst/arcsort.h"
 #include "fst/symbol-table.h"
 #include "fst/vector-fst.h"
+#include "ngram/ngram-count-merge.h"
 #include "ngram/ngram-count.h"
 #include "ngram/ngram-model.h"
 #include "absl/container/flat_hash_set.h"
+#include "absl/container/inlined_vector.h"
 #include "absl/memory/memory.h"
 #include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "mozolm/utils/tracing.h"
 #include "mozolm/utils/utf8_util.h"
 #include "mozolm/stubs/status_macros.h"
+#include "mozolm/stubs/thread_pool.h"
 
 namespace mozolm {
 namespace models {
@@ -43,6 +53,20 @@ using fst::StdVectorFst;
 using fst::SymbolTable;
 using fst::SymbolTableIterator;
 
+namespace {
+
+// Number of strings counted by a single training task.
+constexpr size_t kTrainingBatchSize = 100;
+
+// Number of training lines between progress reports.
+constexpr int64 kTrainingProgressLines = 1000000;
+
+// Number of states of the backoff chains kept on the stack when ensuring the
+// caches, which covers the orders of the models in use.
+constexpr int kInlinedBackoffChainSize = 8;
+
+}  // namespace
+
 namespace impl {
 namespace {
 
@@ -267,6 +291,122 @@ double BitsFromNats(double nats) {
   return nats / std::log(2.0);
 }
 
+// Counts n-grams of batches of linear FSTs in parallel. Each batch is counted
+// into one of several counters, one per thread, which are merged at the end.
+// The symbols are assigned by the caller, so the labels agree across counters.
+// The batches of each counter are counted in the order they are scheduled,
+// whichever worker runs them, so that the states of the merged counts, which
+// the count snapshots refer to, do not depend on the scheduling.
+class ShardedNGramCounter {
+ public:
+  ShardedNGramCounter(int num_shards, int order) : pool_(num_shards) {
+    for (int i = 0; i < num_shards; ++i) {
+      shards_.push_back(absl::make_unique<Shard>(order));
+    }
+    pool_.StartWorkers();
+  }
+
+  // Schedules the counting of the batch. Blocks while too many batches are
+  // pending, to bound the memory held by the batches that are read ahead.
+  void Count(std::vector<StdVectorFst> batch) {
+    {
+      absl::MutexLock lock(&mu_);
+      mu_.Await(absl::Condition(this, &ShardedNGramCounter::CanSchedule));
+      ++num_pending_;
+    }
+    Shard* shard = shards_[next_shard_].get();
+    next_shard_ = (next_shard_ + 1) % shards_.size();
+    {
+      absl::MutexLock lock(&shard->queue_mu);
+      shard->batches.push_back(std::move(batch));
+    }
+    // Each task counts the oldest batch of the shard rather than the one it
+    // was scheduled for, since the tasks may start in any order.
+    pool_.Schedule([this, shard]() {
+      bool counted = true;
+      {
+        absl::MutexLock lock(&shard->mu);
+        std::vector<StdVectorFst> batch;
+        {
+          absl::MutexLock queue_lock(&shard->queue_mu);
+          batch = std::move(shard->batches.front());
+          shard->batches.pop_front();
+        }
+        for (const auto& fst : batch) {
+          if (!shard->counter.Count(fst)) {
+            counted = false;
+            break;
+          }
+        }
+        shard->num_counted += batch.size();
+      }
+      absl::MutexLock lock(&mu_);
+      if (!counted) {
+        status_ = absl::InternalError("Failure to count ngrams from string.");
+      }
+      --num_pending_;
+    });
+  }
+
+  // Waits for the pending batches and stores the merged counts in fst.
+  absl::Status GetFst(StdVectorFst* fst) {
+    {
+      absl::MutexLock lock(&mu_);
+      mu_.Await(absl::Condition(this, &ShardedNGramCounter::NonePending));
+      RETURN_IF_ERROR(status_);
+    }
+    std::unique_ptr<ngram::NGramCountMerge> merge;
+    for (auto& shard : shards_) {
+      absl::MutexLock lock(&shard->mu);
+      if (shard->num_counted == 0) continue;
+      if (merge == nullptr) {
+        shard->counter.GetFst(fst);
+        ArcSort(fst, ILabelCompare<StdArc>());
+        merge = absl::make_unique<ngram::NGramCountMerge>(fst);
+        continue;
+      }
+      StdVectorFst shard_fst;
+      shard->counter.GetFst(&shard_fst);
+      ArcSort(&shard_fst, ILabelCompare<StdArc>());
+      // Count merging with unit weights (zero in the negative log domain).
+      merge->MergeNGramModels(shard_fst, /*alpha=*/0.0, /*beta=*/0.0);
+      if (merge->Error()) {
+        return absl::InternalError("Failed to merge the n-gram counts.");
+      }
+    }
+    if (merge == nullptr) shards_[0]->counter.GetFst(fst);
+    return absl::OkStatus();
+  }
+
+ private:
+  struct Shard {
+    explicit Shard(int order) : counter(order) {}
+
+    absl::Mutex mu;  // Held while a batch is counted.
+    ngram::NGramCounter<Log64Weight> counter ABSL_GUARDED_BY(mu);
+    int64 num_counted ABSL_GUARDED_BY(mu) = 0;  // Number of strings counted.
+    absl::Mutex queue_mu;  // Only held while a batch is queued or dequeued.
+    // Batches yet to be counted, in the order they were scheduled.
+    std::deque<std::vector<StdVectorFst>> batches ABSL_GUARDED_BY(queue_mu);
+  };
+
+  bool CanSchedule() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return num_pending_ < 2 * static_cast<int>(shards_.size());
+  }
+
+  bool NonePending() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return num_pending_ == 0;
+  }
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+  int next_shard_ = 0;  // Shard for the next batch, only used by the caller.
+  absl::Mutex mu_;
+  int num_pending_ ABSL_GUARDED_BY(mu_) = 0;  // Batches yet to be counted.
+  absl::Status status_ ABSL_GUARDED_BY(mu_);  // First counting failure.
+  // Declared last so that the workers are joined before the shards go away.
+  ThreadPool pool_;
+};
+
 }  // namespace
 }  // namespace impl
 
@@ -293,7 +433,7 @@ absl::Status PpmAsFstModel::AddExtraCharacters(
 
 absl::StatusOr<int> PpmAsFstModel::CalculateStateOrder(int s) {
   if (state_orders_[s] >= 0) return state_orders_[s];
-  int backoff_state = impl::GetBackoffState(*fst_, s);
+  const int backoff_state = BackoffState(s);
   if (backoff_state < 0) {
     return absl::InternalError(
         "No backoff state found when computing state orders.");
@@ -309,8 +449,7 @@ absl::StatusOr<int> PpmAsFstModel::CalculateStateOrder(int s) {
 absl::Status PpmAsFstModel::CalculateStateOrders(bool save_state_orders) {
   state_orders_.resize(fst_->NumStates(), -1);
   state_orders_[fst_->Start()] = 1;
-  int unigram_state = impl::GetBackoffState(*fst_, fst_->Start());
-  state_orders_[unigram_state] = 0;
+  state_orders_[unigram_state_] = 0;
   int max_state_order = 1;
   for (int s = 0; s < state_orders_.size(); ++s) {
     const auto this_state_order_status = CalculateStateOrder(s);
@@ -398,47 +537,80 @@ absl::StatusOr<StdVectorFst> PpmAsFstModel::String2Fst(
 }
 
 absl::Status PpmAsFstModel::TrainFromText(const std::string& input_file) {
-  std::vector<std::string> istrings;
   std::ifstream infile(input_file);
   if (!infile.is_open()) {
     return absl::NotFoundError(absl::StrCat("File not found: ", input_file));
   }
-  GOOGLE_LOG(INFO) << "Loading from \"" << input_file << "\" ...";
-  std::string input_line;
-  while (std::getline(infile, input_line)) {
-    istrings.push_back(input_line);
-  }
-  infile.close();
-  GOOGLE_LOG(INFO) << "Constructing ...";
-  return TrainFromText(istrings);
+  GOOGLE_LOG(INFO) << "Constructing from \"" << input_file << "\" ...";
+  return TrainFromLines([&infile](std::string* input_line) {
+    return static_cast<bool>(std::getline(infile, *input_line));
+  });
 }
 
 absl::Status PpmAsFstModel::TrainFromText(
     const std::vector<std::string>& istrings) {
+  auto next_string = istrings.begin();
+  return TrainFromLines([&istrings, &next_string](std::string* input_line) {
+    if (next_string == istrings.end()) return false;
+    *input_line = *next_string++;
+    return true;
+  });
+}
+
+absl::Status PpmAsFstModel::TrainFromLines(
+    const std::function<bool(std::string*)>& next_line) {
+  // The symbols are added to the table as the lines are read, hence the
+  // conversion to FSTs stays in this thread and only the counting is sharded.
+  std::unique_ptr<impl::ShardedNGramCounter> sharded_counter;
+  if (num_training_threads_ > 1) {
+    sharded_counter = absl::make_unique<impl::ShardedNGramCounter>(
+        num_training_threads_, max_order_);
+  }
+  std::vector<StdVectorFst> batch;
+  int64 num_lines = 0;
+  std::string input_line;
+  while (next_line(&input_line)) {
+    ++num_lines;
+    if (num_lines % kTrainingProgressLines == 0) {
+      GOOGLE_LOG(INFO) << "Read " << num_lines << " lines ...";
+    }
+    if (input_line.empty()) continue;
+    auto fst_status = String2Fst(input_line);
+    if (!fst_status.ok()) {
+      return fst_status.status();
+    }
+    if (fst_status.value().NumStates() <= 0) {
+      return absl::InternalError("Line read as empty string.");
+    }
+    if (sharded_counter == nullptr) {
+      if (!ngram_counter_->Count(fst_status.value())) {
+        return absl::InternalError("Failure to count ngrams from string.");
+      }
+      continue;
+    }
+    batch.push_back(std::move(fst_status.value()));
+    if (batch.size() >= kTrainingBatchSize) {
+      sharded_counter->Count(std::move(batch));
+      batch.clear();
+    }
+  }
+  if (!batch.empty()) sharded_counter->Count(std::move(batch));
+
   absl::Status train_status = absl::OkStatus();
-  if (istrings.empty()) {
+  if (num_lines == 0) {
     int start_state = fst_->AddState();
     int unigram_state = fst_->AddState();
     fst_->SetStart(start_state);
     fst_->SetFinal(unigram_state, 0.0);
     fst_->AddArc(start_state, StdArc(0, 0, 0.0, unigram_state));
   } else {
-    for (const auto& input_line : istrings) {
-      if (!input_line.empty()) {
-        const auto fst_status = String2Fst(input_line);
-        if (!fst_status.ok()) {
-          return fst_status.status();
-        }
-        const StdVectorFst& fst = fst_status.value();
-        if (fst.NumStates() <= 0) {
-          return absl::InternalError("Line read as empty string.");
-        }
-        if (!ngram_counter_->Count(fst)) {
-          return absl::InternalError("Failure to count ngrams from string.");
-        }
-      }
+    GOOGLE_LOG(INFO) << "Counted " << num_lines << " lines using "
+                     << std::max(num_training_threads_, 1) << " thread(s).";
+    if (sharded_counter == nullptr) {
+      ngram_counter_->GetFst(fst_.get());
+    } else {
+      RETURN_IF_ERROR(sharded_counter->GetFst(fst_.get()));
     }
-    ngram_counter_->GetFst(fst_.get());
     ArcSort(fst_.get(), ILabelCompare<StdArc>());
     train_status = impl::CalculateUpdateExclusions(fst_.get());
     if (train_status == absl::OkStatus()) {
@@ -453,6 +625,7 @@ absl::Status PpmAsFstModel::TrainFromText(
 }
 
 absl::Status PpmAsFstModel::WriteFst(const std::string& ofile) {
+  absl::WriterMutexLock lock(&model_lock_);
   ArcSort(fst_.get(), ILabelCompare<StdArc>());
   if (!fst_->Write(ofile)) {
     return absl::InternalError(absl::StrCat("Failed to write to ", ofile));
@@ -476,9 +649,12 @@ absl::Status PpmAsFstModel::Read(const ModelStorage& storage) {
     beta_ = kBeta;
   }
   static_model_ = ppm_as_fst_config.static_model();
+  num_training_threads_ = ppm_as_fst_config.num_training_threads();
   max_cache_size_ = ppm_as_fst_config.max_cache_size() > max_order_
                         ? ppm_as_fst_config.max_cache_size()
                         : kMaxCache;
+  warm_up_order_ = ppm_as_fst_config.warm_up_order();
+  max_warm_up_states_ = ppm_as_fst_config.max_warm_up_states();
   if (!storage.model_file().empty() && ppm_as_fst_config.model_is_fst()) {
     fst_ = absl::WrapUnique(StdVectorFst::Read(storage.model_file()));
     const auto syms = *fst_->InputSymbols();
@@ -512,41 +688,100 @@ absl::Status PpmAsFstModel::Read(const ModelStorage& storage) {
     }
     infile.close();
   }
-  RETURN_IF_ERROR(CalculateStateOrders(/*save_state_orders=*/!static_model_));
+  CacheBackoffStates();
+  // Static models only need the state orders for warming up the cache.
+  RETURN_IF_ERROR(CalculateStateOrders(
+      /*save_state_orders=*/!static_model_ || warm_up_order_ > 0));
   if (max_cache_size_ < max_order_) {
     // To descent backoff needs at least max_order_ worth of cache.
     max_cache_size_ = max_order_ + 1;
   }
+  configured_max_cache_size_ = max_cache_size_;
   cache_accessed_ = 0;
+  cache_clock_hand_ = 0;
   cache_index_.resize(fst_->NumStates(), -1);
   set_start_state(fst_->Start());
+
+  // Index 0 is for the end-of-string, by convention the empty string.
+  const SymbolTable& syms = *fst_->InputSymbols();
+  symbol_strings_.assign(1, "");
+  codepoint_labels_.Clear();
+  for (int i = 1; i < syms.AvailableKey(); ++i) {
+    symbol_strings_.push_back(syms.Find(i));
+    codepoint_labels_.AddSymbol(symbol_strings_.back(), i);
+  }
+  RETURN_IF_ERROR(WarmUpCache());
+  if (static_model_) state_orders_.clear();
   return absl::OkStatus();
 }
 
-int PpmAsFstModel::FindOldestLastAccessedCache() const {
-  int least_accessed_cache = 0;
-  int oldest_access = state_cache_[0].last_accessed();
-  for (size_t i = 1; i < state_cache_.size(); ++i) {
-    if (state_cache_[i].last_accessed() < oldest_access) {
-      least_accessed_cache = i;
-      oldest_access = state_cache_[i].last_accessed();
+void PpmAsFstModel::CacheBackoffStates() {
+  backoff_states_.assign(fst_->NumStates(), -1);
+  for (int s = 0; s < backoff_states_.size(); ++s) {
+    backoff_states_[s] = impl::GetBackoffState(*fst_, s);
+  }
+  unigram_state_ = BackoffState(fst_->Start());
+}
+
+absl::Status PpmAsFstModel::WarmUpCache() {
+  if (warm_up_order_ <= 0) return absl::OkStatus();
+  const absl::Time before_t = absl::Now();
+  std::vector<std::tuple<int, double, StdArc::StateId>> warm_up_states;
+  for (StdArc::StateId s = 0; s < state_orders_.size(); ++s) {
+    if (state_orders_[s] < warm_up_order_) {
+      warm_up_states.emplace_back(state_orders_[s],
+                                  impl::GetTotalStateCount(*fst_, s), s);
     }
   }
-  return least_accessed_cache;
+  // Sorts by order, then by decreasing count (increasing negative log count).
+  std::sort(warm_up_states.begin(), warm_up_states.end());
+  const int64 max_states =
+      max_warm_up_states_ > 0
+          ? std::min<int64>(max_warm_up_states_, max_cache_size_)
+          : max_cache_size_ / 2;
+  if (static_cast<int64>(warm_up_states.size()) > max_states) {
+    warm_up_states.resize(max_states);
+  }
+  for (const auto& warm_up_state : warm_up_states) {
+    RETURN_IF_ERROR(EnsureCacheAtState(std::get<2>(warm_up_state)).status());
+  }
+  GOOGLE_LOG(INFO) << "Cached " << warm_up_states.size() << " states in "
+                   << (absl::Now() - before_t) / absl::Milliseconds(1)
+                   << " msec.";
+  return absl::OkStatus();
 }
 
-absl::Status PpmAsFstModel::GetNewCacheIndex(StdArc::StateId s) {
+absl::StatusOr<int> PpmAsFstModel::FindCacheToReplace(
+    StdArc::StateId keep_state) {
+  // Every entry but the kept one has had its access mark cleared after one
+  // full sweep, hence the replacement is found within two sweeps.
+  const int cache_size = state_cache_.size();
+  for (int i = 0; i < 2 * cache_size; ++i) {
+    const int index = cache_clock_hand_;
+    cache_clock_hand_ = (cache_clock_hand_ + 1) % cache_size;
+    const PpmStateCache& state_cache = state_cache_[index];
+    if (state_cache.state() != keep_state && !state_cache.ClearAccessed()) {
+      return index;
+    }
+  }
+  return absl::InternalError("No cache entry can be replaced.");
+}
+
+absl::Status PpmAsFstModel::GetNewCacheIndex(StdArc::StateId s,
+                                             StdArc::StateId keep_state) {
   if (state_cache_.size() < max_cache_size_) {
     cache_index_[s] = state_cache_.size();
     state_cache_.push_back(PpmStateCache(s));
   } else {
-    const int index_to_update = FindOldestLastAccessedCache();
+    int index_to_update;
+    ASSIGN_OR_RETURN(index_to_update, FindCacheToReplace(keep_state));
     const StdArc::StateId old_state = state_cache_[index_to_update].state();
     if (cache_index_[old_state] != index_to_update) {
       return absl::InternalError("Cache index not updated correctly.");
     }
     cache_index_[old_state] = -1;
     state_cache_[index_to_update] = PpmStateCache(s);
+    cache_evictions_.fetch_add(1, std::memory_order_relaxed);
     cache_index_[s] = index_to_update;
   }
   return absl::OkStatus();
@@ -646,7 +881,8 @@ absl::Status PpmAsFstModel::UpdateCacheAtNonEmptyState(
       s, backoff_state, denominator, &arc_origin_states, &destination_states,
       &neg_log_probabilities);
   if (update_status == absl::OkStatus() && cache_index_[s] < 0) {
-    update_status = GetNewCacheIndex(s);
+    // The backoff cache is no longer needed.
+    update_status = GetNewCacheIndex(s, /*keep_state=*/-1);
   }
   if (update_status == absl::OkStatus()) {
     state_cache_[cache_index_[s]].UpdateCache(
@@ -657,27 +893,41 @@ absl::Status PpmAsFstModel::UpdateCacheAtNonEmptyState(
 }
 
 absl::Status PpmAsFstModel::UpdateCacheAtState(StdArc::StateId s) {
+  ScopedSpan span("PpmAsFstModel::UpdateCacheAtState");
   if (s < 0) {
     return absl::InternalError("Updating cache at state index < 0.");
   }
   if (s >= fst_->NumStates()) {
     return absl::InternalError("State index out of bounds");
   }
-  const int backoff_state = impl::GetBackoffState(*fst_, s);
-  PpmStateCache backoff_cache(-1);
+  const int backoff_state = BackoffState(s);
+  const PpmStateCache empty_cache(-1);
+  const PpmStateCache* backoff_cache = &empty_cache;
   if (backoff_state >= 0) {
     ASSIGN_OR_RETURN(backoff_cache, EnsureCacheAtState(backoff_state));
   }
+  return UpdateCacheFromBackoff(s, backoff_state, *backoff_cache);
+}
+
+absl::Status PpmAsFstModel::UpdateCacheFromBackoff(
+    StdArc::StateId s, StdArc::StateId backoff_state,
+    const PpmStateCache& backoff_state_cache) {
+  const PpmStateCache* backoff_cache = &backoff_state_cache;
   if (impl::NoObservations(*fst_, s)) {
     // Only backoff arc, no continuations observed (yet). Just copies cache
     // information from backoff state.
     if (cache_index_[s] < 0) {
-      absl::Status update_status = GetNewCacheIndex(s);
+      absl::Status update_status = GetNewCacheIndex(s, backoff_state);
       if (update_status != absl::OkStatus()) return update_status;
+      if (backoff_state >= 0) {
+        // Growing the cache may have moved the backoff cache.
+        backoff_cache = &state_cache_[cache_index_[backoff_state]];
+      }
     }
-    state_cache_[cache_index_[s]].UpdateCache(cache_accessed_++, backoff_cache);
+    state_cache_[cache_index_[s]].UpdateCache(cache_accessed_++,
+                                              *backoff_cache);
   } else {
-    return UpdateCacheAtNonEmptyState(s, backoff_state, backoff_cache);
+    return UpdateCacheAtNonEmptyState(s, backoff_state, *backoff_cache);
   }
   return absl::OkStatus();
 }
@@ -703,25 +953,91 @@ absl::StatusOr<bool> PpmAsFstModel::NeedsNewState(
 bool PpmAsFstModel::LowerOrderCacheUpdated(StdArc::StateId s) const {
   if (cache_index_[s] < 0) return true;
   const int last_updated = state_cache_[cache_index_[s]].last_updated();
-  int backoff_state = impl::GetBackoffState(*fst_, s);
+  int backoff_state = BackoffState(s);
   while (backoff_state >= 0) {
     if (cache_index_[backoff_state] >= 0 &&
         state_cache_[cache_index_[backoff_state]].last_updated() >
             last_updated) {
       return true;
     }
-    backoff_state = impl::GetBackoffState(*fst_, backoff_state);
+    backoff_state = BackoffState(backoff_state);
   }
   return false;
 }
 
-absl::StatusOr<PpmStateCache> PpmAsFstModel::EnsureCacheAtState(
+double PpmAsFstModel::CacheNormalizingMass(StdArc::StateId s) const {
+  // The renormalized cache probabilities sum the discounted counts and the
+  // backoff mass to the total observed count plus alpha. Unigram probabilities
+  // are relative frequencies of the observed counts.
+  double mass = fst_->Final(s).Value();
+  bool has_backoff = false;
+  for (ArcIterator<StdVectorFst> arc_iterator(*fst_, s); !arc_iterator.Done();
+       arc_iterator.Next()) {
+    const StdArc& arc = arc_iterator.Value();
+    if (arc.ilabel > 0) {
+      mass = ngram::NegLogSum(mass, arc.weight.Value());
+    } else {
+      has_backoff = true;
+    }
+  }
+  return has_backoff ? ngram::NegLogSum(mass, -std::log(alpha_)) : mass;
+}
+
+const PpmStateCache* PpmAsFstModel::GetCacheIfFresh(StdArc::StateId s) const {
+  if (s < 0 || s >= static_cast<int>(cache_index_.size()) ||
+      cache_index_[s] < 0 || LowerOrderCacheUpdated(s)) {
+    return nullptr;
+  }
+  const PpmStateCache& state_cache = state_cache_[cache_index_[s]];
+  state_cache.MarkAccessed();
+  cache_hits_.fetch_add(1, std::memory_order_relaxed);
+  return &state_cache;
+}
+
+absl::StatusOr<const PpmStateCache*> PpmAsFstModel::EnsureCacheAtState(
     StdArc::StateId s) {
-  bool update_access = true;
-  if (cache_index_[s] < 0 || LowerOrderCacheUpdated(s)) {
-    absl::Status update_status = UpdateCacheAtState(s);
-    if (update_status != absl::OkStatus()) return update_status;
-    update_access = false;
+  ScopedSpan span("PpmAsFstModel::EnsureCacheAtState");
+  if (s < 0 || s >= static_cast<int>(cache_index_.size())) {
+    return absl::InternalError("State index out of bounds");
+  }
+  // Backoff chain from the state down to the unigram state.
+  absl::InlinedVector<StdArc::StateId, kInlinedBackoffChainSize> chain;
+  for (StdArc::StateId state = s; state >= 0; state = BackoffState(state)) {
+    chain.push_back(state);
+  }
+
+  // Finds the highest order cache of the chain which is fresh, i.e., cached
+  // and not older than any of the lower order caches, in a single pass up
+  // from the unigram state. The caches of the higher orders are stale.
+  const int chain_size = chain.size();
+  int num_stale = chain_size;
+  int newest_lower_update = -1;
+  for (int i = chain_size - 1; i >= 0; --i) {
+    const int index = cache_index_[chain[i]];
+    if (index < 0) continue;
+    const int last_updated = state_cache_[index].last_updated();
+    if (last_updated >= newest_lower_update) num_stale = i;
+    newest_lower_update = std::max(newest_lower_update, last_updated);
+  }
+  span.AddAttribute("backoff_chain_size", chain_size);
+  span.AddAttribute("stale_caches", num_stale);
+  if (num_stale < chain_size) {
+    cache_hits_.fetch_add(1, std::memory_order_relaxed);
+    state_cache_[cache_index_[chain[num_stale]]].MarkAccessed();
+  }
+
+  // Fills the stale caches from the lowest order up, each one from the cache
+  // of its backoff state, just filled or fresh.
+  const PpmStateCache empty_cache(-1);
+  for (int i = num_stale - 1; i >= 0; --i) {
+    cache_misses_.fetch_add(1, std::memory_order_relaxed);
+    const StdArc::StateId backoff_state = i + 1 < chain_size ? chain[i + 1]
+                                                             : -1;
+    const PpmStateCache& backoff_cache =
+        backoff_state >= 0 ? state_cache_[cache_index_[backoff_state]]
+                           : empty_cache;
+    RETURN_IF_ERROR(UpdateCacheFromBackoff(chain[i], backoff_state,
+                                           backoff_cache));
   }
   if (cache_index_[s] < 0) {
     return absl::InternalError("Cache index less than zero.");
@@ -732,27 +1048,25 @@ absl::StatusOr<PpmStateCache> PpmAsFstModel::EnsureCacheAtState(
   if (state_cache_[cache_index_[s]].state() != s) {
     return absl::InternalError("State not stored correctly in cache index.");
   }
-  if (update_access) {
-    state_cache_[cache_index_[s]].set_last_accessed(cache_accessed_++);
-  }
-  return state_cache_[cache_index_[s]];
+  return &state_cache_[cache_index_[s]];
 }
 
 absl::StatusOr<double> PpmAsFstModel::GetNegLogProb(StdArc::StateId s,
                                                     int sym_index) {
-  PpmStateCache state_cache;
+  const PpmStateCache* state_cache;
   ASSIGN_OR_RETURN(state_cache, EnsureCacheAtState(s));
-  return state_cache.NegLogProbability(sym_index);
+  return state_cache->NegLogProbability(sym_index);
 }
 
 absl::StatusOr<double> PpmAsFstModel::GetNormalization(StdArc::StateId s) {
-  PpmStateCache state_cache;
+  const PpmStateCache* state_cache;
   ASSIGN_OR_RETURN(state_cache, EnsureCacheAtState(s));
-  return state_cache.normalization();
+  return state_cache->normalization();
 }
 
 absl::StatusOr<std::vector<double>> PpmAsFstModel::GetNegLogProbs(
     const std::vector<int>& sym_indices, bool return_bits) {
+  absl::WriterMutexLock lock(&model_lock_);
   std::vector<double> neg_log_probs(sym_indices.size());
   int curr_state = fst_->Start();
   for (size_t i = 0; i < sym_indices.size(); ++i) {
@@ -781,16 +1095,16 @@ absl::StatusOr<std::vector<double>> PpmAsFstModel::GetNegLogProbs(
 
 absl::StatusOr<int> PpmAsFstModel::GetArcOriginState(StdArc::StateId s,
                                                      int sym_index) {
-  PpmStateCache state_cache;
+  const PpmStateCache* state_cache;
   ASSIGN_OR_RETURN(state_cache, EnsureCacheAtState(s));
-  return state_cache.ArcOriginState(sym_index);
+  return state_cache->ArcOriginState(sym_index);
 }
 
 absl::StatusOr<int> PpmAsFstModel::GetDestinationState(StdArc::StateId s,
                                                        int sym_index) {
-  PpmStateCache state_cache;
+  const PpmStateCache* state_cache;
   ASSIGN_OR_RETURN(state_cache, EnsureCacheAtState(s));
-  return state_cache.DestinationState(sym_index);
+  return state_cache->DestinationState(sym_index);
 }
 
 absl::StatusOr<int> PpmAsFstModel::AddNewState(
@@ -802,18 +1116,20 @@ absl::StatusOr<int> PpmAsFstModel::AddNewState(
   state_orders_.push_back(
       backoff_dest_state >= 0 ? state_orders_[backoff_dest_state] + 1 : 0);
   cache_index_.push_back(-1);
+  backoff_states_.push_back(backoff_dest_state);
   if (backoff_dest_state >= 0) {
     fst_->AddArc(new_state_index, StdArc(0, 0, 0.0, backoff_dest_state));
   }
   return new_state_index;
 }
 
-absl::Status PpmAsFstModel::UpdateHighestFoundState(StdArc::StateId curr_state,
-                                                    int sym_index) {
+absl::StatusOr<StdArc::StateId> PpmAsFstModel::UpdateHighestFoundState(
+    StdArc::StateId curr_state, int sym_index) {
   if (sym_index == 0) {
     // Adds one to final cost and sets destination state to start state.
     fst_->SetFinal(curr_state,
                   ngram::NegLogSum(fst_->Final(curr_state).Value(), 0.0));
+    return fst_->Start();
   } else {
     // Arc with sym_index found at current state.
     int new_next_state = -1;
@@ -848,9 +1164,10 @@ absl::Status PpmAsFstModel::UpdateHighestFoundState(StdArc::StateId curr_state,
       if (!add_new_state_status.ok()) {
         return add_new_state_status.status();
       }
+      return new_next_state;
     }
+    return old_next_state;
   }
-  return absl::OkStatus();
 }
 
 absl::Status PpmAsFstModel::UpdateNotFoundState(
@@ -885,11 +1202,25 @@ absl::Status PpmAsFstModel::UpdateNotFoundState(
 absl::StatusOr<StdArc::StateId> PpmAsFstModel::UpdateModel(
     StdArc::StateId curr_state, StdArc::StateId highest_found_state,
     int sym_index) {
+  if (highest_found_state == curr_state && cache_index_[curr_state] >= 0 &&
+      !LowerOrderCacheUpdated(curr_state)) {
+    // Only the count of the symbol changes at this state, hence its fresh
+    // cache is updated in place rather than rebuilt from the backoff cache.
+    const double old_mass = CacheNormalizingMass(curr_state);
+    impl::IncrementBackoffArcReturnBackoffState(fst_.get(), curr_state);
+    StdArc::StateId dest_state;
+    ASSIGN_OR_RETURN(dest_state,
+                     UpdateHighestFoundState(curr_state, sym_index));
+    RETURN_IF_ERROR(state_cache_[cache_index_[curr_state]].IncrementCount(
+        cache_accessed_++, sym_index, dest_state, old_mass));
+    return dest_state;
+  }
   absl::Status update_status;
   const int backoff_state =
       impl::IncrementBackoffArcReturnBackoffState(fst_.get(), curr_state);
   if (highest_found_state == curr_state) {
-    update_status = UpdateHighestFoundState(curr_state, sym_index);
+    update_status =
+        UpdateHighestFoundState(curr_state, sym_index).status();
   } else {
     update_status = UpdateNotFoundState(curr_state, highest_found_state,
                                         backoff_state, sym_index);
@@ -904,40 +1235,149 @@ absl::StatusOr<StdArc::StateId> PpmAsFstModel::UpdateModel(
 }
 
 int PpmAsFstModel::NextState(int state, int utf8_sym) {
-  const std::string sym = utf8::EncodeUnicodeChar(utf8_sym);
-  const int sym_index = fst_->InputSymbols()->Find(sym);
+  {
+    absl::ReaderMutexLock lock(&model_lock_);
+    const PpmStateCache* state_cache = GetCacheIfFresh(state);
+    if (state_cache != nullptr) {
+      return NextStateFromCache(*state_cache, utf8_sym);
+    }
+  }
+  absl::WriterMutexLock lock(&model_lock_);
+  return NextStateLocked(state, utf8_sym);
+}
+
+int PpmAsFstModel::NextStateLocked(int state, int utf8_sym) {
+  const auto ensure_status = EnsureCacheAtState(state);
+  if (!ensure_status.ok()) {
+    return unigram_state_;
+  }
+  return NextStateFromCache(*ensure_status.value(), utf8_sym);
+}
+
+int PpmAsFstModel::NextStateFromCache(const PpmStateCache& state_cache,
+                                      int utf8_sym) const {
+  const int sym_index = codepoint_labels_.Find(utf8_sym);
   if (sym_index > 0) {
-    const auto dest_state_status = GetDestinationState(state, sym_index);
+    const auto dest_state_status = state_cache.DestinationState(sym_index);
     if (dest_state_status.ok()) {
       return dest_state_status.value();
     }
   }
   // If symbol is epsilon or not in vocabulary, or destination state retrieval
   // fails, next state is unigram state (no context).
-  return impl::GetBackoffState(*fst_, fst_->Start());
+  return unigram_state_;
 }
 
-bool PpmAsFstModel::ExtractLMScores(int state, LMScores* response) {
+void PpmAsFstModel::AppendSymbols(int first_index,
+                                  std::vector<std::string>* symbols) {
+  if (first_index < 0) first_index = 0;
+  for (int i = first_index; i < symbol_strings_.size(); ++i) {
+    symbols->push_back(symbol_strings_[i]);
+  }
+}
+
+bool PpmAsFstModel::ExtractNegLogProbs(int state,
+                                       std::vector<double>* neg_log_probs,
+                                       double* normalization) {
+  {
+    absl::ReaderMutexLock lock(&model_lock_);
+    const PpmStateCache* state_cache = GetCacheIfFresh(state);
+    if (state_cache != nullptr) {
+      state_cache->FillNegLogProbs(neg_log_probs, normalization);
+      return true;
+    }
+  }
+  absl::WriterMutexLock lock(&model_lock_);
   const auto ensure_status = EnsureCacheAtState(state);
   if (!ensure_status.ok()) return false;
-  const PpmStateCache state_cache = ensure_status.value();
-  return state_cache.FillLMScores(*fst_->InputSymbols(), response);
+  ensure_status.value()->FillNegLogProbs(neg_log_probs, normalization);
+  return true;
+}
+
+bool PpmAsFstModel::GetCacheStats(ModelCacheStats* stats) const {
+  stats->hits = cache_hits_.load(std::memory_order_relaxed);
+  stats->misses = cache_misses_.load(std::memory_order_relaxed);
+  stats->evictions = cache_evictions_.load(std::memory_order_relaxed);
+  return true;
+}
+
+bool PpmAsFstModel::GetMemoryUsage(ModelMemoryUsage* usage) const {
+  absl::ReaderMutexLock lock(&model_lock_);
+  int64 model_bytes = 0;
+  for (StdArc::StateId s = 0; s < fst_->NumStates(); ++s) {
+    model_bytes += fst_->NumArcs(s) * sizeof(StdArc);
+  }
+  model_bytes += fst_->NumStates() * sizeof(fst::VectorState<StdArc>);
+  model_bytes += (state_orders_.capacity() + backoff_states_.capacity() +
+                  cache_index_.capacity()) * sizeof(int);
+  for (const std::string& symbol : symbol_strings_) {
+    model_bytes += sizeof(std::string) + symbol.capacity();
+  }
+  int64 cache_bytes = (state_cache_.capacity() - state_cache_.size()) *
+                      sizeof(PpmStateCache);
+  for (const PpmStateCache& state_cache : state_cache_) {
+    cache_bytes += state_cache.MemoryBytes();
+  }
+  usage->model_bytes = model_bytes;
+  usage->cache_bytes = cache_bytes;
+  return true;
+}
+
+void PpmAsFstModel::SetCacheMemoryLimit(int64 max_bytes) {
+  absl::WriterMutexLock lock(&model_lock_);
+  int64 max_cache_size = configured_max_cache_size_;
+  if (max_bytes >= 0) {
+    // Each cached state holds three vectors over the vocabulary.
+    const int64 state_bytes =
+        sizeof(PpmStateCache) +
+        symbol_strings_.size() * (2 * sizeof(int) + sizeof(double));
+    max_cache_size = std::min(max_cache_size, max_bytes / state_bytes);
+  }
+  // Descending the backoff chains needs max_order_ worth of cache.
+  max_cache_size_ = std::max<int64>(max_cache_size, max_order_ + 1);
+  const int cache_size = state_cache_.size();
+  if (cache_size <= max_cache_size_) return;
+  for (int i = max_cache_size_; i < cache_size; ++i) {
+    cache_index_[state_cache_[i].state()] = -1;
+  }
+  state_cache_.erase(state_cache_.begin() + max_cache_size_,
+                     state_cache_.end());
+  state_cache_.shrink_to_fit();
+  if (cache_clock_hand_ >= max_cache_size_) cache_clock_hand_ = 0;
+  cache_evictions_.fetch_add(cache_size - max_cache_size_,
+                             std::memory_order_relaxed);
 }
 
 bool PpmAsFstModel::UpdateLMCounts(int32 state,
                                    const std::vector<int>& utf8_syms,
                                    int64 count) {
-  // TODO: needs Mutex locks for model updating.
   if (static_model_ || count <= 0) {
     // Returns true, nothing to update.
     return true;
   }
+  absl::WriterMutexLock lock(&model_lock_);
+  return UpdateLMCountsLocked(state, utf8_syms, count);
+}
+
+bool PpmAsFstModel::BulkUpdateLMCounts(
+    const std::vector<std::vector<int>>& utf8_strings, int64 count) {
+  if (static_model_ || count <= 0) {
+    // Returns true, nothing to update.
+    return true;
+  }
+  absl::WriterMutexLock lock(&model_lock_);
+  for (const auto& utf8_syms : utf8_strings) {
+    if (!UpdateLMCountsLocked(start_state(), utf8_syms, count)) return false;
+  }
+  return true;
+}
+
+bool PpmAsFstModel::UpdateLMCountsLocked(int32 state,
+                                         const std::vector<int>& utf8_syms,
+                                         int64 count) {
   for (auto utf8_sym : utf8_syms) {
     int sym_index = utf8_sym;
-    if (utf8_sym > 0) {
-      const std::string sym = utf8::EncodeUnicodeChar(utf8_sym);
-      sym_index = fst_->InputSymbols()->Find(sym);
-    }
+    if (utf8_sym > 0) sym_index = codepoint_labels_.Find(utf8_sym);
     if (sym_index < 0) {
       // Symbol not in model, ignoring and moves to start state.
       // TODO: Possible to add symbol not covered in model?
@@ -951,17 +1391,40 @@ bool PpmAsFstModel::UpdateLMCounts(int32 state,
       for (int c = 1; c < count; c++) {
         // Any subsequent observations accrue only at state.
         update_status = UpdateModel(state, state, sym_index);
-        if (update_status.ok()) return false;
+        if (!update_status.ok()) return false;
       }
-      state = NextState(state, utf8_sym);
+      state = NextStateLocked(state, utf8_sym);
     }
   }
   return true;
 }
 
+PpmStateCache::PpmStateCache(const PpmStateCache& state_cache) {
+  *this = state_cache;
+}
+
+PpmStateCache& PpmStateCache::operator=(const PpmStateCache& state_cache) {
+  state_ = state_cache.state_;
+  accessed_.store(state_cache.accessed_.load(std::memory_order_relaxed),
+                  std::memory_order_relaxed);
+  last_updated_ = state_cache.last_updated_;
+  arc_origin_states_ = state_cache.arc_origin_states_;
+  destination_states_ = state_cache.destination_states_;
+  neg_log_probabilities_ = state_cache.neg_log_probabilities_;
+  normalization_ = state_cache.normalization_;
+  return *this;
+}
+
+int64 PpmStateCache::MemoryBytes() const {
+  return sizeof(PpmStateCache) +
+         (arc_origin_states_.capacity() + destination_states_.capacity()) *
+             sizeof(int) +
+         neg_log_probabilities_.capacity() * sizeof(double);
+}
+
 void PpmStateCache::UpdateCache(int access_counter,
                                 const PpmStateCache& state_cache) {
-  last_accessed_ = access_counter;
+  accessed_ = true;
   last_updated_ = access_counter;
   arc_origin_states_ = state_cache.arc_origin_states_;
   destination_states_ = state_cache.destination_states_;
@@ -973,7 +1436,7 @@ void PpmStateCache::UpdateCache(
     int access_counter, const std::vector<int>& arc_origin_states,
     const std::vector<int>& destination_states,
     const std::vector<double>& neg_log_probabilities, double normalization) {
-  last_accessed_ = access_counter;
+  accessed_ = true;
   last_updated_ = access_counter;
   arc_origin_states_ = arc_origin_states;
   destination_states_ = destination_states;
@@ -981,6 +1444,29 @@ void PpmStateCache::UpdateCache(
   normalization_ = normalization;
 }
 
+absl::Status PpmStateCache::IncrementCount(int access_counter, int sym_index,
+                                           int destination_state,
+                                           double old_mass) {
+  RETURN_IF_ERROR(VerifyAccess(sym_index, neg_log_probabilities_.size()));
+  accessed_ = true;
+  last_updated_ = access_counter;
+  // With the mass D incremented by one, every probability p is scaled by
+  // D / (D + 1), and the incremented symbol gains 1 / (D + 1).
+  const double new_mass = ngram::NegLogSum(old_mass, 0.0);
+  const double scaled_prob =
+      neg_log_probabilities_[sym_index] + old_mass;
+  const double scale = old_mass - new_mass;
+  for (double& neg_log_prob : neg_log_probabilities_) {
+    neg_log_prob += scale;
+  }
+  neg_log_probabilities_[sym_index] =
+      ngram::NegLogSum(scaled_prob, 0.0) - new_mass;
+  arc_origin_states_[sym_index] = state_;
+  destination_states_[sym_index] = destination_state;
+  normalization_ = ngram::NegLogSum(normalization_, 0.0);
+  return absl::OkStatus();
+}
+
 absl::Status PpmStateCache::VerifyAccess(int sym_index,
                                          size_t vector_size) const {
   absl::Status return_status = absl::OkStatus();
@@ -1024,19 +1510,10 @@ absl::StatusOr<double> PpmStateCache::NegLogProbability(int sym_index) const {
   }
 }
 
-bool PpmStateCache::FillLMScores(const SymbolTable& syms,
-                                 LMScores* response) const {
-  response->set_normalization(std::exp(-normalization_));
-  const int num_scores = neg_log_probabilities_.size() + 1;
-  response->mutable_symbols()->Reserve(num_scores);
-  response->add_symbols("");  // Empty string by default end-of-string.
-  response->mutable_probabilities()->Reserve(num_scores);
-  response->add_probabilities(std::exp(-neg_log_probabilities_[0]));
-  for (size_t i = 1; i < neg_log_probabilities_.size(); i++) {
-    response->add_symbols(syms.Find(i));
-    response->add_probabilities(std::exp(-neg_log_probabilities_[i]));
-  }
-  return true;
+void PpmStateCache::FillNegLogProbs(std::vector<double>* neg_log_probs,
+                                    double* normalization) const {
+  *neg_log_probs = neg_log_probabilities_;
+  *normalization = std::exp(-normalization_);
 }
 
 }  // namespace models
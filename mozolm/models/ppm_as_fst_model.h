@@ -62,6 +62,8 @@
 #ifndef MOZOLM_MOZOLM_MODELS_PPM_AS_FST_MODEL_H_
 #define MOZOLM_MOZOLM_MODELS_PPM_AS_FST_MODEL_H_
 
+#include <atomic>
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
@@ -71,9 +73,11 @@
 #include "fst/vector-fst.h"
 #include "ngram/ngram-count.h"
 #include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
 #include "mozolm/models/language_model.h"
 #include "mozolm/models/model_storage.pb.h"
 #include "mozolm/models/ppm_as_fst_options.pb.h"
+#include "mozolm/utils/codepoint_map.h"
 
 namespace mozolm {
 namespace models {
@@ -90,10 +94,13 @@ class PpmStateCache {
   PpmStateCache() = default;
 
   explicit PpmStateCache(int state) : state_(state) {
-    last_accessed_ = -1;
+    accessed_ = false;
     last_updated_ = -1;
   }
 
+  PpmStateCache(const PpmStateCache& state_cache);
+  PpmStateCache& operator=(const PpmStateCache& state_cache);
+
   // Updates cache information.
   void UpdateCache(int access_counter,
                    const std::vector<int>& arc_origin_states,
@@ -104,13 +111,16 @@ class PpmStateCache {
   // Updates cache with values from provided cache entry.
   void UpdateCache(int access_counter, const PpmStateCache& state_cache);
 
+  // Updates the cache in place after the count of sym_index observed at the
+  // state is incremented, given the mass normalizing the cached probabilities
+  // before the increment. The new observation leads to destination_state.
+  absl::Status IncrementCount(int access_counter, int sym_index,
+                              int destination_state, double old_mass);
+
   // Returns state associated with this cache.
   int state() const { return state_; };
 
-  // Returns index of last time accessed.
-  int last_accessed() const { return last_accessed_; };
-
-  // Returns index of last time accessed.
+  // Returns index of last time updated.
   int last_updated() const { return last_updated_; };
 
   // Returns the size of the cached vectors.
@@ -123,36 +133,51 @@ class PpmStateCache {
   absl::StatusOr<int> ArcOriginState(int sym_index) const;
 
   // Returns all cached arc origin states.
-  std::vector<int> arc_origin_states() const { return arc_origin_states_; }
+  const std::vector<int>& arc_origin_states() const {
+    return arc_origin_states_;
+  }
 
   // Returns the cached destination state for given sym_index.
   absl::StatusOr<int> DestinationState(int sym_index) const;
 
   // Returns all cached destination states.
-  std::vector<int> destination_states() const { return destination_states_; }
+  const std::vector<int>& destination_states() const {
+    return destination_states_;
+  }
 
   // Returns the cached neg_log_probability for given sym_index.
   absl::StatusOr<double> NegLogProbability(int sym_index) const;
 
   // Returns all cached negative log probabilities.
-  std::vector<double> neg_log_probabilities() const {
+  const std::vector<double>& neg_log_probabilities() const {
     return neg_log_probabilities_;
   }
 
   // Returns the normalization from the state.
   double normalization() const { return normalization_; }
 
-  // Updates the last_accessed_ index.
-  void set_last_accessed(int access_counter) {
-    last_accessed_ = access_counter;
+  // Marks the cache as recently accessed. May be called concurrently by the
+  // readers holding a shared lock on the model.
+  void MarkAccessed() const {
+    accessed_.store(true, std::memory_order_relaxed);
+  }
+
+  // Clears the recent access mark, returning whether it was set. Called by the
+  // cache eviction with the exclusive lock on the model.
+  bool ClearAccessed() const {
+    return accessed_.exchange(false, std::memory_order_relaxed);
   }
 
-  // Fills in LMScores proto from values in cached state.
-  bool FillLMScores(const fst::SymbolTable& syms, LMScores* response) const;
+  // Fills in the dense scores from values in cached state.
+  void FillNegLogProbs(std::vector<double>* neg_log_probs,
+                       double* normalization) const;
+
+  // Number of bytes held by the cache, including the capacity of its vectors.
+  int64 MemoryBytes() const;
 
  private:
   int state_;                           // Index of state being cached.
-  int last_accessed_;                   // Stores index of last time accessed.
+  mutable std::atomic<bool> accessed_;  // Whether accessed since last sweep.
   int last_updated_;                    // Stores index of last time updated.
   std::vector<int> arc_origin_states_;  // State originating arc with sym_index.
   std::vector<int> destination_states_;        // Cache of destination states.
@@ -161,6 +186,10 @@ class PpmStateCache {
 };
 
 // PPM class using FST-based counts.
+//
+// The model and its cache are protected by a reader-writer lock. Requests that
+// can be answered from an up-to-date cache entry only take the shared lock,
+// while cache misses and model updates take the exclusive lock.
 class PpmAsFstModel : public LanguageModel {
  public:
   PpmAsFstModel() = default;
@@ -169,40 +198,104 @@ class PpmAsFstModel : public LanguageModel {
   absl::Status Read(const ModelStorage& storage) override;
 
   // Writes fst_ model to file.
-  absl::Status WriteFst(const std::string& ofile);
+  absl::Status WriteFst(const std::string& ofile)
+      ABSL_LOCKS_EXCLUDED(model_lock_);
 
   // Returns fst_.
-  const fst::StdVectorFst GetFst() const { return *fst_; }
+  const fst::StdVectorFst GetFst() const ABSL_LOCKS_EXCLUDED(model_lock_) {
+    absl::ReaderMutexLock lock(&model_lock_);
+    return *fst_;
+  }
 
   // Provides the state reached from state following utf8_sym.
-  int NextState(int state, int utf8_sym) override;
+  int NextState(int state, int utf8_sym)
+      ABSL_LOCKS_EXCLUDED(model_lock_) override;
+
+  // Returns the number of symbols in the vocabulary, indexed by the symbol
+  // table labels, with index 0 for the end-of-string.
+  int NumSymbols() override { return symbol_strings_.size(); }
 
-  // Copies the probs and normalization from the given state into the response.
-  bool ExtractLMScores(int state, LMScores* response) override;
+  // Appends the symbols with vocabulary indices from first_index onwards.
+  void AppendSymbols(int first_index,
+                     std::vector<std::string>* symbols) override;
+
+  // Fills in the negative log probabilities and the normalization for the
+  // state.
+  bool ExtractNegLogProbs(int state, std::vector<double>* neg_log_probs,
+                          double* normalization)
+      ABSL_LOCKS_EXCLUDED(model_lock_) override;
 
   // Updates the counts for the utf8_syms at the current state.
   bool UpdateLMCounts(int32 state, const std::vector<int>& utf8_syms,
-                      int64 count) override;
+                      int64 count) ABSL_LOCKS_EXCLUDED(model_lock_) override;
+
+  // Updates the counts for each of the utf8_strings from the start state,
+  // holding the exclusive lock once for all of them.
+  bool BulkUpdateLMCounts(const std::vector<std::vector<int>>& utf8_strings,
+                          int64 count)
+      ABSL_LOCKS_EXCLUDED(model_lock_) override;
+
+  // Fills in the counters of the state cache since the model was created.
+  bool GetCacheStats(ModelCacheStats* stats) const override;
+
+  // Fills in the memory held by the FST and its per-state vectors, and by the
+  // state cache.
+  bool GetMemoryUsage(ModelMemoryUsage* usage) const
+      ABSL_LOCKS_EXCLUDED(model_lock_) override;
+
+  // Lowers the maximum number of cached states to fit about max_bytes, given
+  // the size of the vocabulary, dropping the cached states over the limit.
+  // The limit never exceeds the configured max_cache_size.
+  void SetCacheMemoryLimit(int64 max_bytes)
+      ABSL_LOCKS_EXCLUDED(model_lock_) override;
 
   // Converts string to vector of symbol table indices. Requires sticking to
   // allowed symbols.
   absl::StatusOr<std::vector<int>> GetSymsVector(
-      const std::string& input_string) {
+      const std::string& input_string) ABSL_LOCKS_EXCLUDED(model_lock_) {
+    absl::ReaderMutexLock lock(&model_lock_);
     return GetSymsVector(input_string, /*add_sym=*/false);
   }
 
   // Returns probabilities of vector of symbols, treated as string.  Converts to
   // bits (base 2) if bool argument is set to true; otherwise nats (base e).
   absl::StatusOr<std::vector<double>> GetNegLogProbs(
-      const std::vector<int>& sym_indices, bool return_bits = false);
+      const std::vector<int>& sym_indices, bool return_bits = false)
+      ABSL_LOCKS_EXCLUDED(model_lock_);
 
  private:
+  // Implementation of NextState, called with the exclusive lock held.
+  int NextStateLocked(int state, int utf8_sym)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(model_lock_);
+
+  // Implementation of UpdateLMCounts, called with the exclusive lock held.
+  bool UpdateLMCountsLocked(int32 state, const std::vector<int>& utf8_syms,
+                            int64 count)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(model_lock_);
+
+  // Returns the state reached from the state with the given cache following
+  // utf8_sym.
+  int NextStateFromCache(const PpmStateCache& state_cache, int utf8_sym) const
+      ABSL_SHARED_LOCKS_REQUIRED(model_lock_);
+
+  // Returns the cache for the state if it exists and is up to date, marking it
+  // as accessed. Returns nullptr otherwise, in which case the cache needs to be
+  // updated under the exclusive lock.
+  const PpmStateCache* GetCacheIfFresh(fst::StdArc::StateId s) const
+      ABSL_SHARED_LOCKS_REQUIRED(model_lock_);
+
   // Trains fst model from text corpus.
   absl::Status TrainFromText(const std::string& ifile);
 
   // Trains fst model from vector of strings.
   absl::Status TrainFromText(const std::vector<std::string>& istrings);
 
+  // Trains fst model from the lines returned by next_line until it returns
+  // false. The n-grams are counted by num_training_threads_ threads if there
+  // is more than one.
+  absl::Status TrainFromLines(
+      const std::function<bool(std::string*)>& next_line);
+
   // Converts string to vector of symbol table indices.
   absl::StatusOr<std::vector<int>> GetSymsVector(
       const std::string& input_string, bool add_sym);
@@ -210,6 +303,16 @@ class PpmAsFstModel : public LanguageModel {
   // Initializes Fst class from options.
   void InitFst(const PpmAsFstOptions& ppm_as_fst_config);
 
+  // Caches the backoff state of each state and the unigram state, once the
+  // states of the model read are final. The new states are added to the cache
+  // when the model is updated.
+  void CacheBackoffStates();
+
+  // Returns the cached backoff state of the state, -1 if it has none.
+  int BackoffState(fst::StdArc::StateId s) const {
+    return backoff_states_[s];
+  }
+
   // Calculates the state order for given state, using backoffs.
   absl::StatusOr<int> CalculateStateOrder(int s);
 
@@ -230,6 +333,12 @@ class PpmAsFstModel : public LanguageModel {
   // backoff states are cached.
   absl::Status UpdateCacheAtState(fst::StdArc::StateId s);
 
+  // Implementation of UpdateCacheAtState, given the fresh cache of the backoff
+  // state, or an empty cache if there is no backoff state.
+  absl::Status UpdateCacheFromBackoff(fst::StdArc::StateId s,
+                                      fst::StdArc::StateId backoff_state,
+                                      const PpmStateCache& backoff_cache);
+
   // Initializes negative log probabilities for cache based on backoff.
   std::vector<double> InitCacheProbs(fst::StdArc::StateId s,
                                      fst::StdArc::StateId backoff_state,
@@ -259,14 +368,32 @@ class PpmAsFstModel : public LanguageModel {
   // Checks if lower order state caches have updated more recently.
   bool LowerOrderCacheUpdated(fst::StdArc::StateId s) const;
 
-  // Ensures cache exists for state, creates it if not.
-  absl::StatusOr<PpmStateCache> EnsureCacheAtState(fst::StdArc::StateId s);
-
-  // Finds cache entry with oldest last access, for replacement.
-  int FindOldestLastAccessedCache() const;
-
-  // Establishes cache index, after performing garbage collection if needed.
-  absl::Status GetNewCacheIndex(fst::StdArc::StateId s);
+  // Returns the negative log of the mass normalizing the probabilities cached
+  // at the state: the observed count plus alpha, or the observed count at the
+  // unigram state.
+  double CacheNormalizingMass(fst::StdArc::StateId s) const;
+
+  // Caches the states of order lower than warm_up_order_, starting with the
+  // lowest orders and the most frequent states, until max_warm_up_states_
+  // states are cached.
+  absl::Status WarmUpCache();
+
+  // Ensures cache exists for state, creates it if not. The returned cache is
+  // owned by the model and remains valid until the next cache update. The
+  // backoff chain of the state is walked once, iteratively, and the stale
+  // caches along it are filled from the lowest order up.
+  absl::StatusOr<const PpmStateCache*> EnsureCacheAtState(
+      fst::StdArc::StateId s);
+
+  // Finds the cache entry to replace using the CLOCK algorithm, which gives a
+  // second chance to the entries accessed since the last sweep. The entry for
+  // keep_state, if any, is never replaced.
+  absl::StatusOr<int> FindCacheToReplace(fst::StdArc::StateId keep_state);
+
+  // Establishes cache index, after performing garbage collection if needed,
+  // keeping the cache for keep_state.
+  absl::Status GetNewCacheIndex(fst::StdArc::StateId s,
+                                fst::StdArc::StateId keep_state);
 
   // Adds new state to all required data structures and returns index.
   absl::StatusOr<int> AddNewState(fst::StdArc::StateId backoff_dest_state);
@@ -286,9 +413,10 @@ class PpmAsFstModel : public LanguageModel {
   // Returns normalization value at the current state.
   absl::StatusOr<double> GetNormalization(fst::StdArc::StateId s);
 
-  // Updates model at highest found state for given symbol.
-  absl::Status UpdateHighestFoundState(fst::StdArc::StateId curr_state,
-                                       int sym_index);
+  // Updates model at highest found state for given symbol, returning the
+  // destination state of the symbol.
+  absl::StatusOr<fst::StdArc::StateId> UpdateHighestFoundState(
+      fst::StdArc::StateId curr_state, int sym_index);
 
   // Updates model at state where given symbol is not found.
   absl::Status UpdateNotFoundState(fst::StdArc::StateId curr_state,
@@ -313,17 +441,43 @@ class PpmAsFstModel : public LanguageModel {
   double alpha_;       // Alpha hyper-parameter for PPM.
   double beta_;        // Beta hyper-parameter for PPM.
   bool static_model_;  // Whether to use the model as static or dynamic.
+  int num_training_threads_;  // Number of threads counting the training text.
   std::vector<int> state_orders_;  // Stores the order of each state.
+  // Backoff state of each state, -1 for the unigram state, and the unigram
+  // state, which the model falls back to when there is no context. Saves
+  // looking up the backoff arcs when descending the backoff chains.
+  std::vector<int> backoff_states_;
+  int unigram_state_ = -1;
   std::unique_ptr<fst::StdVectorFst> fst_;  // Model (counts) stored in FST.
   // For counting character n-grams if training from text file.
   std::unique_ptr<ngram::NGramCounter<fst::Log64Weight>> ngram_counter_;
   std::unique_ptr<fst::SymbolTable> syms_;  // Character symbols.
 
+  // Protects the model and the cache below. The hyper-parameters are
+  // immutable after the model has been read.
+  mutable absl::Mutex model_lock_;
+
+  // Symbols of the vocabulary indexed by label, with the end-of-string at
+  // index 0, and the labels of their codepoints. The vocabulary only changes
+  // while the model is read.
+  std::vector<std::string> symbol_strings_;
+  utf8::CodepointMap codepoint_labels_;
+
   // For caching probabilities and destination states for quick access.
   int max_cache_size_;  // Limit on caching for garbage collection.
-  int cache_accessed_;  // Counter of cache accesses to determine priority.
+  int configured_max_cache_size_;  // Limit before any memory limit.
+  int warm_up_order_;   // States of lower order are cached on reading.
+  int64 max_warm_up_states_;  // Limit on the states cached on reading.
+  // Counter of cache updates to determine which caches are stale.
+  mutable std::atomic<int> cache_accessed_;
+  int cache_clock_hand_;  // Next cache entry considered for replacement.
   std::vector<int> cache_index_;  // Index of cache for state if it exists.
   std::vector<PpmStateCache> state_cache_;  // Cache for state information.
+
+  // Counters of the cache lookups, updated under either lock.
+  mutable std::atomic<int64> cache_hits_{0};
+  std::atomic<int64> cache_misses_{0};
+  std::atomic<int64> cache_evictions_{0};
 };
 
 }  // namespace models
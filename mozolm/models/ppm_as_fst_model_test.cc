@@ -19,8 +19,11 @@
 #include <filesystem>
 #include <fstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "fst/arcsort.h"
+#include "fst/equal.h"
 #include "fst/isomorphic.h"
 #include "fst/symbol-table.h"
 #include "fst/vector-fst.h"
@@ -304,6 +307,236 @@ TEST_F(PpmAsFstTest, DynamicProbsMatchHand) {
   ASSERT_NEAR(neg_log_probs[3], -log(0.3659612), kFloatDelta);
 }
 
+// Replacing cache entries does not change the probabilities.
+TEST_F(PpmAsFstTest, SmallCacheMatchesDefault) {
+  PpmAsFstModel model;
+  ModelStorage storage = storage_;
+  storage.mutable_ppm_options()->set_static_model(false);
+  ASSERT_OK(model.Read(storage));
+  PpmAsFstModel small_cache_model;
+  storage.mutable_ppm_options()->set_max_cache_size(max_order_ + 1);
+  ASSERT_OK(small_cache_model.Read(storage));
+
+  const std::string test_string = "abbabaababbbaaab";
+  auto sym_indices_status = model.GetSymsVector(test_string);
+  ASSERT_TRUE(sym_indices_status.ok());
+  const std::vector<int> sym_indices = sym_indices_status.value();
+  auto neg_log_probs_status = model.GetNegLogProbs(sym_indices);
+  ASSERT_TRUE(neg_log_probs_status.ok());
+  auto small_cache_neg_log_probs_status =
+      small_cache_model.GetNegLogProbs(sym_indices);
+  ASSERT_TRUE(small_cache_neg_log_probs_status.ok());
+  const std::vector<double> neg_log_probs = neg_log_probs_status.value();
+  const std::vector<double> small_cache_neg_log_probs =
+      small_cache_neg_log_probs_status.value();
+  ASSERT_EQ(neg_log_probs.size(), small_cache_neg_log_probs.size());
+  for (int i = 0; i < neg_log_probs.size(); ++i) {
+    EXPECT_NEAR(neg_log_probs[i], small_cache_neg_log_probs[i], kFloatDelta);
+  }
+}
+
+// Filling the caches along long backoff chains, with a cache just large enough
+// for one chain and while the counts are updated, does not change the
+// probabilities.
+TEST_F(PpmAsFstTest, HighOrderSmallCacheMatchesDefault) {
+  constexpr int kMaxOrder = 6;
+  ModelStorage storage = storage_;
+  storage.set_model_file(corpus_file_);
+  storage.mutable_ppm_options()->set_max_order(kMaxOrder);
+  storage.mutable_ppm_options()->set_static_model(false);
+  storage.mutable_ppm_options()->set_model_is_fst(false);
+  PpmAsFstModel model;
+  ASSERT_OK(model.Read(storage));
+  storage.mutable_ppm_options()->set_max_cache_size(kMaxOrder + 1);
+  PpmAsFstModel small_cache_model;
+  ASSERT_OK(small_cache_model.Read(storage));
+
+  const auto sym_indices_status = model.GetSymsVector("abaabbabaababbbaaab");
+  ASSERT_TRUE(sym_indices_status.ok());
+  std::vector<int> sym_indices = sym_indices_status.value();
+  sym_indices.push_back(0);
+  for (int i = 0; i < 3; ++i) {
+    const auto neg_log_probs_status = model.GetNegLogProbs(sym_indices);
+    ASSERT_TRUE(neg_log_probs_status.ok());
+    const auto small_cache_neg_log_probs_status =
+        small_cache_model.GetNegLogProbs(sym_indices);
+    ASSERT_TRUE(small_cache_neg_log_probs_status.ok());
+    const std::vector<double>& neg_log_probs = neg_log_probs_status.value();
+    const std::vector<double>& small_cache_neg_log_probs =
+        small_cache_neg_log_probs_status.value();
+    ASSERT_EQ(neg_log_probs.size(), small_cache_neg_log_probs.size());
+    for (int j = 0; j < neg_log_probs.size(); ++j) {
+      EXPECT_NEAR(neg_log_probs[j], small_cache_neg_log_probs[j],
+                  kFloatDelta);
+    }
+    for (PpmAsFstModel* updated_model : {&model, &small_cache_model}) {
+      ASSERT_TRUE(updated_model->UpdateLMCounts(
+          updated_model->ContextState("abab"), {'b', 'b', 'a'}, 1));
+    }
+  }
+}
+
+// The cache counters track the lookups and the replaced entries.
+TEST_F(PpmAsFstTest, CacheStats) {
+  PpmAsFstModel model;
+  ModelStorage storage = storage_;
+  storage.mutable_ppm_options()->set_max_cache_size(max_order_ + 1);
+  ASSERT_OK(model.Read(storage));
+  const int state = model.ContextState("ab");
+  std::vector<double> neg_log_probs;
+  double normalization;
+  ASSERT_TRUE(model.ExtractNegLogProbs(state, &neg_log_probs, &normalization));
+  ModelCacheStats first_stats;
+  ASSERT_TRUE(model.GetCacheStats(&first_stats));
+  EXPECT_LT(0, first_stats.misses);
+
+  // Scoring the same state again is served by the cache.
+  ASSERT_TRUE(model.ExtractNegLogProbs(state, &neg_log_probs, &normalization));
+  ModelCacheStats second_stats;
+  ASSERT_TRUE(model.GetCacheStats(&second_stats));
+  EXPECT_EQ(first_stats.hits + 1, second_stats.hits);
+  EXPECT_EQ(first_stats.misses, second_stats.misses);
+
+  // Scoring a longer string does not fit in the small cache.
+  const auto sym_indices_status = model.GetSymsVector("abbabaababbbaaab");
+  ASSERT_TRUE(sym_indices_status.ok());
+  ASSERT_OK(model.GetNegLogProbs(sym_indices_status.value()).status());
+  ModelCacheStats third_stats;
+  ASSERT_TRUE(model.GetCacheStats(&third_stats));
+  EXPECT_LT(second_stats.misses, third_stats.misses);
+  EXPECT_LT(0, third_stats.evictions);
+}
+
+// Lowering the memory limit of the cache drops the cached states over the
+// limit, without changing the probabilities.
+TEST_F(PpmAsFstTest, CacheMemoryLimit) {
+  PpmAsFstModel model;
+  ASSERT_OK(model.Read(storage_));
+  const auto sym_indices_status = model.GetSymsVector("abbabaababbbaaab");
+  ASSERT_TRUE(sym_indices_status.ok());
+  const std::vector<int>& sym_indices = sym_indices_status.value();
+  const auto neg_log_probs_status = model.GetNegLogProbs(sym_indices);
+  ASSERT_TRUE(neg_log_probs_status.ok());
+  ModelMemoryUsage full_usage;
+  ASSERT_TRUE(model.GetMemoryUsage(&full_usage));
+  EXPECT_LT(0, full_usage.model_bytes);
+  EXPECT_LT(0, full_usage.cache_bytes);
+
+  // No limit is low enough to drop the states needed for the backoff chains.
+  model.SetCacheMemoryLimit(0);
+  ModelMemoryUsage limited_usage;
+  ASSERT_TRUE(model.GetMemoryUsage(&limited_usage));
+  EXPECT_EQ(full_usage.model_bytes, limited_usage.model_bytes);
+  EXPECT_GT(full_usage.cache_bytes, limited_usage.cache_bytes);
+  ModelCacheStats stats;
+  ASSERT_TRUE(model.GetCacheStats(&stats));
+  EXPECT_LT(0, stats.evictions);
+  const auto limited_neg_log_probs_status = model.GetNegLogProbs(sym_indices);
+  ASSERT_TRUE(limited_neg_log_probs_status.ok());
+  const std::vector<double>& neg_log_probs = neg_log_probs_status.value();
+  const std::vector<double>& limited_neg_log_probs =
+      limited_neg_log_probs_status.value();
+  ASSERT_EQ(neg_log_probs.size(), limited_neg_log_probs.size());
+  for (int i = 0; i < neg_log_probs.size(); ++i) {
+    EXPECT_NEAR(neg_log_probs[i], limited_neg_log_probs[i], kFloatDelta);
+  }
+
+  // Restores the configured limit.
+  model.SetCacheMemoryLimit(-1);
+  ASSERT_OK(model.GetNegLogProbs(sym_indices).status());
+  ModelMemoryUsage restored_usage;
+  ASSERT_TRUE(model.GetMemoryUsage(&restored_usage));
+  EXPECT_LT(limited_usage.cache_bytes, restored_usage.cache_bytes);
+}
+
+// Warming up the cache does not change the probabilities.
+TEST_F(PpmAsFstTest, WarmUpCacheMatchesDefault) {
+  PpmAsFstModel model;
+  ModelStorage storage = storage_;
+  storage.mutable_ppm_options()->set_static_model(false);
+  ASSERT_OK(model.Read(storage));
+  PpmAsFstModel warm_model;
+  storage.mutable_ppm_options()->set_warm_up_order(max_order_);
+  ASSERT_OK(warm_model.Read(storage));
+  PpmAsFstModel partially_warm_model;
+  storage.mutable_ppm_options()->set_max_warm_up_states(2);
+  ASSERT_OK(partially_warm_model.Read(storage));
+
+  const std::string test_string = "abbabaababbbaaab";
+  auto sym_indices_status = model.GetSymsVector(test_string);
+  ASSERT_TRUE(sym_indices_status.ok());
+  const std::vector<int> sym_indices = sym_indices_status.value();
+  auto neg_log_probs_status = model.GetNegLogProbs(sym_indices);
+  ASSERT_TRUE(neg_log_probs_status.ok());
+  const std::vector<double> neg_log_probs = neg_log_probs_status.value();
+  for (PpmAsFstModel* warmed_up : {&warm_model, &partially_warm_model}) {
+    auto warm_neg_log_probs_status = warmed_up->GetNegLogProbs(sym_indices);
+    ASSERT_TRUE(warm_neg_log_probs_status.ok());
+    const std::vector<double> warm_neg_log_probs =
+        warm_neg_log_probs_status.value();
+    ASSERT_EQ(neg_log_probs.size(), warm_neg_log_probs.size());
+    for (int i = 0; i < neg_log_probs.size(); ++i) {
+      EXPECT_NEAR(neg_log_probs[i], warm_neg_log_probs[i], kFloatDelta);
+    }
+  }
+}
+
+// Counting the training text in several threads matches a single thread.
+TEST_F(PpmAsFstTest, ParallelTrainingMatchesSerial) {
+  // Enough lines for several counting batches per thread.
+  const std::filesystem::path file_path =
+      std::filesystem::temp_directory_path() / "parallel_corpus.txt";
+  const std::string parallel_corpus_file = file_path.string();
+  {
+    std::ofstream output_file(parallel_corpus_file);
+    ASSERT_TRUE(output_file.good()) << "Failed to open: "
+                                    << parallel_corpus_file;
+    for (int i = 0; i < 2000; ++i) {
+      std::string line;
+      for (int j = 0; j <= i % 17; ++j) {
+        line += static_cast<char>('a' + (i * 7 + j * j) % 11);
+      }
+      output_file << line << "\n";
+    }
+    ASSERT_TRUE(output_file.good()) << "Failed to write to "
+                                    << parallel_corpus_file;
+  }
+  ModelStorage storage = storage_;
+  storage.set_model_file(parallel_corpus_file);
+  storage.mutable_ppm_options()->set_model_is_fst(false);
+  PpmAsFstModel serial_model;
+  ASSERT_OK(serial_model.Read(storage));
+  storage.mutable_ppm_options()->set_num_training_threads(4);
+  PpmAsFstModel parallel_model;
+  ASSERT_OK(parallel_model.Read(storage));
+  EXPECT_EQ(serial_model.GetFst().NumStates(),
+            parallel_model.GetFst().NumStates());
+
+  // Another parallel training numbers the states the same, which the count
+  // snapshots rely on, whatever the scheduling of the threads.
+  PpmAsFstModel other_parallel_model;
+  ASSERT_OK(other_parallel_model.Read(storage));
+  EXPECT_TRUE(fst::Equal(parallel_model.GetFst(),
+                         other_parallel_model.GetFst()));
+
+  const std::string test_string = "abcdefghijkkjihgfedcbaaceg";
+  auto sym_indices_status = serial_model.GetSymsVector(test_string);
+  ASSERT_TRUE(sym_indices_status.ok());
+  std::vector<int> sym_indices = sym_indices_status.value();
+  sym_indices.push_back(0);
+  auto serial_status = serial_model.GetNegLogProbs(sym_indices);
+  ASSERT_TRUE(serial_status.ok());
+  auto parallel_status = parallel_model.GetNegLogProbs(sym_indices);
+  ASSERT_TRUE(parallel_status.ok());
+  const std::vector<double> serial_neg_log_probs = serial_status.value();
+  const std::vector<double> parallel_neg_log_probs = parallel_status.value();
+  ASSERT_EQ(serial_neg_log_probs.size(), parallel_neg_log_probs.size());
+  for (int i = 0; i < serial_neg_log_probs.size(); ++i) {
+    EXPECT_NEAR(serial_neg_log_probs[i], parallel_neg_log_probs[i],
+                kFloatDelta);
+  }
+}
+
 // Calculating ContextState functionality.
 TEST_F(PpmAsFstTest, ContextState) {
   PpmAsFstModel model_from_fst;
@@ -346,6 +579,82 @@ TEST_F(PpmAsFstTest, ExtractLMScores) {
   }
 }
 
+// Caches updated in place by UpdateLMCounts match caches rebuilt from scratch.
+TEST_F(PpmAsFstTest, UpdatedCachesMatchRebuilt) {
+  PpmAsFstModel model;
+  ModelStorage storage = storage_;
+  storage.mutable_ppm_options()->set_static_model(false);
+  ASSERT_OK(model.Read(storage));
+  const std::string test_string = "abbabaababbbaaab";
+  auto sym_indices_status = model.GetSymsVector(test_string);
+  ASSERT_TRUE(sym_indices_status.ok());
+  std::vector<int> sym_indices = sym_indices_status.value();
+  sym_indices.push_back(0);
+  // Caches the states along the test string before updating them.
+  ASSERT_TRUE(model.GetNegLogProbs(sym_indices).ok());
+  for (int i = 0; i < 10; ++i) {
+    int state = model.ContextState("");
+    for (const int utf8_sym : {97, 98, 97, 97, 98}) {
+      ASSERT_TRUE(model.UpdateLMCounts(state, {utf8_sym}, 1));
+      state = model.NextState(state, utf8_sym);
+    }
+    ASSERT_TRUE(model.UpdateLMCounts(state, {0}, 1));
+  }
+  auto neg_log_probs_status = model.GetNegLogProbs(sym_indices);
+  ASSERT_TRUE(neg_log_probs_status.ok());
+  const std::vector<double> neg_log_probs = neg_log_probs_status.value();
+
+  const std::filesystem::path file_path =
+      std::filesystem::temp_directory_path() / "updated_trigram_count.fst";
+  ASSERT_OK(model.WriteFst(file_path.string()));
+  PpmAsFstModel rebuilt_model;
+  storage.set_model_file(file_path.string());
+  ASSERT_OK(rebuilt_model.Read(storage));
+  auto rebuilt_neg_log_probs_status =
+      rebuilt_model.GetNegLogProbs(sym_indices);
+  ASSERT_TRUE(rebuilt_neg_log_probs_status.ok());
+  const std::vector<double> rebuilt_neg_log_probs =
+      rebuilt_neg_log_probs_status.value();
+  ASSERT_EQ(neg_log_probs.size(), rebuilt_neg_log_probs.size());
+  for (int i = 0; i < neg_log_probs.size(); ++i) {
+    EXPECT_NEAR(neg_log_probs[i], rebuilt_neg_log_probs[i], kFloatDelta);
+  }
+}
+
+// Updating with counts above one succeeds and favors the updated symbol.
+TEST_F(PpmAsFstTest, UpdateLMCountsWithLargerCount) {
+  PpmAsFstModel model;
+  ModelStorage storage = storage_;
+  storage.mutable_ppm_options()->set_static_model(false);
+  ASSERT_OK(model.Read(storage));
+  const int start_state = model.ContextState("");
+  auto sym_indices_status = model.GetSymsVector("b");
+  ASSERT_TRUE(sym_indices_status.ok());
+  auto before_status = model.GetNegLogProbs(sym_indices_status.value());
+  ASSERT_TRUE(before_status.ok());
+  ASSERT_TRUE(model.UpdateLMCounts(start_state, {98}, 3));
+  auto after_status = model.GetNegLogProbs(sym_indices_status.value());
+  ASSERT_TRUE(after_status.ok());
+  EXPECT_LT(after_status.value()[0], before_status.value()[0]);
+}
+
+// Bulk updates match the updates of each of the strings in turn.
+TEST_F(PpmAsFstTest, BulkUpdateLMCounts) {
+  ModelStorage storage = storage_;
+  storage.mutable_ppm_options()->set_static_model(false);
+  PpmAsFstModel model;
+  ASSERT_OK(model.Read(storage));
+  PpmAsFstModel bulk_model;
+  ASSERT_OK(bulk_model.Read(storage));
+  const std::vector<std::vector<int>> utf8_strings = {
+      {97, 98, 98, 0}, {98, 97, 97, 98, 0}, {98, 0}};
+  for (const auto& utf8_syms : utf8_strings) {
+    ASSERT_TRUE(model.UpdateLMCounts(model.start_state(), utf8_syms, 1));
+  }
+  ASSERT_TRUE(bulk_model.BulkUpdateLMCounts(utf8_strings, 1));
+  ASSERT_TRUE(Isomorphic<StdArc>(model.GetFst(), bulk_model.GetFst()));
+}
+
 // Updating probs through UpdateLMCounts.
 TEST_F(PpmAsFstTest, UpdateLMCounts) {
   PpmAsFstModel model;
@@ -394,5 +703,42 @@ TEST_F(PpmAsFstTest, UpdateLMCounts) {
   }
 }
 
+// Concurrent score extraction while the model is being updated.
+TEST_F(PpmAsFstTest, ConcurrentExtractAndUpdate) {
+  PpmAsFstModel model;
+  ModelStorage storage = storage_;
+  storage.mutable_ppm_options()->set_static_model(false);
+  ASSERT_OK(model.Read(storage));
+  const std::vector<int> states = {
+      model.ContextState(""), model.ContextState("a"),
+      model.ContextState("ab"), model.ContextState("ba")};
+
+  constexpr int kNumReaders = 4;
+  constexpr int kNumIterations = 200;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumReaders; ++i) {
+    threads.emplace_back([&model, &states, i]() {
+      for (int j = 0; j < kNumIterations; ++j) {
+        LMScores lm_scores;
+        const int state = states[(i + j) % states.size()];
+        EXPECT_TRUE(model.ExtractLMScores(state, &lm_scores));
+        double total_prob = 0.0;
+        for (const double prob : lm_scores.probabilities()) {
+          total_prob += prob;
+        }
+        EXPECT_NEAR(total_prob, 1.0, kFloatDelta);
+        EXPECT_LE(0, model.NextState(state, 97));
+      }
+    });
+  }
+  threads.emplace_back([&model, &states]() {
+    for (int j = 0; j < kNumIterations; ++j) {
+      EXPECT_TRUE(model.UpdateLMCounts(states[j % states.size()],
+                                       {97, 98}, 1));
+    }
+  });
+  for (auto& thread : threads) thread.join();
+}
+
 }  // namespace models
 }  // namespace mozolm
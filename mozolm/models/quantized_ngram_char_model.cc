@@ -0,0 +1,350 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "mozolm/models/quantized_ngram_char_model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <tuple>
+
+#include "mozolm/stubs/logging.h"
+#include "fst/fst.h"
+#include "mozolm/stubs/status_macros.h"
+
+using fst::ArcIterator;
+using fst::StdArc;
+using fst::StdFst;
+
+namespace mozolm {
+namespace models {
+namespace {
+
+// Appends the value as a variable-length integer, seven bits per byte, the
+// high bit being set on all the bytes but the last one.
+void AppendVarint(uint32 value, std::vector<uint8>* bytes) {
+  while (value >= 0x80) {
+    bytes->push_back(static_cast<uint8>(value) | 0x80);
+    value >>= 7;
+  }
+  bytes->push_back(static_cast<uint8>(value));
+}
+
+// Decodes the variable-length integer, advancing the position.
+inline uint32 DecodeVarint(const uint8** pos) {
+  uint32 value = 0;
+  int shift = 0;
+  uint8 byte;
+  do {
+    byte = *(*pos)++;
+    value |= static_cast<uint32>(byte & 0x7F) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return value;
+}
+
+// Appends the code in num_bytes bytes, in little-endian order.
+void AppendCode(int code, int num_bytes, std::vector<uint8>* codes) {
+  for (int i = 0; i < num_bytes; ++i) codes->push_back(code >> (8 * i));
+}
+
+inline int DecodeCode(const std::vector<uint8>& codes, int index,
+                      int num_bytes) {
+  if (num_bytes == 1) return codes[index];
+  return codes[2 * index] | (codes[2 * index + 1] << 8);
+}
+
+}  // namespace
+
+void WeightCodebook::Build(std::vector<float> weights, int max_codes) {
+  std::sort(weights.begin(), weights.end());
+  values_ = weights;
+  values_.erase(std::unique(values_.begin(), values_.end()), values_.end());
+  if (values_.size() > max_codes) {
+    // Each bin holds the same number of weights, up to rounding, hence the
+    // values are denser where the weights are.
+    values_.clear();
+    const size_t num_weights = weights.size();
+    for (int code = 0; code < max_codes; ++code) {
+      const size_t begin = num_weights * code / max_codes;
+      const size_t end = num_weights * (code + 1) / max_codes;
+      if (begin == end) continue;
+      double sum = 0.0;
+      for (size_t i = begin; i < end; ++i) sum += weights[i];
+      values_.push_back(sum / (end - begin));
+    }
+    values_.erase(std::unique(values_.begin(), values_.end()), values_.end());
+  }
+  if (values_.empty()) values_.push_back(0.0);
+  bounds_.clear();
+  for (int i = 1; i < values_.size(); ++i) {
+    bounds_.push_back(values_[i - 1] + (values_[i] - values_[i - 1]) / 2);
+  }
+}
+
+int WeightCodebook::Encode(float weight) const {
+  return std::upper_bound(bounds_.begin(), bounds_.end(), weight) -
+         bounds_.begin();
+}
+
+QuantizedNGramCharModel::QuantizedNGramCharModel(bool const_fst,
+                                                 Quantization quantization)
+    : NGramFstModel(const_fst),
+      code_bytes_(quantization == QUANTIZATION_8_BIT ? 1 : 2) {}
+
+absl::Status QuantizedNGramCharModel::Read(const ModelStorage &storage) {
+  RETURN_IF_ERROR(NGramFstModel::Read(storage));
+  const auto &symbols = *fst_->InputSymbols();
+  const int num_symbols = symbols.NumSymbols();
+  symbols_.clear();
+  codepoint_indices_.Clear();
+  symbols_.reserve(num_symbols - 1);
+  absl::flat_hash_map<StdArc::Label, int> label_indices;
+  label_indices.reserve(num_symbols - 1);
+  for (int i = 1; i < num_symbols; ++i) {  // Ignore epsilon.
+    const StdArc::Label label = symbols.GetNthKey(i);
+    label_indices.emplace(label, symbols_.size());
+    codepoint_indices_.AddSymbol(symbols.Find(label), symbols_.size());
+    symbols_.push_back(symbols.Find(label));
+  }
+  const auto oov_pos = label_indices.find(oov_label_);
+  oov_index_ = oov_pos != label_indices.end() ? oov_pos->second : -1;
+
+  // Builds the codebooks from all the weights. The backoff arc, if any, is
+  // the first arc of the state, and the arcs with labels missing from the
+  // vocabulary are dropped.
+  const int num_states = fst_->NumStates();
+  std::vector<float> arc_weights, backoff_weights;
+  for (int state = 0; state < num_states; ++state) {
+    for (ArcIterator<StdFst> aiter(*fst_, state); !aiter.Done();
+         aiter.Next()) {
+      const StdArc& arc = aiter.Value();
+      if (arc.ilabel == 0) {
+        backoff_weights.push_back(arc.weight.Value());
+      } else if (label_indices.contains(arc.ilabel)) {
+        arc_weights.push_back(arc.weight.Value());
+      }
+    }
+  }
+  const int max_codes = 1 << (8 * code_bytes_);
+  arc_codebook_.Build(std::move(arc_weights), max_codes);
+  backoff_codebook_.Build(std::move(backoff_weights), max_codes);
+
+  // Encodes the states.
+  arc_begin_.clear();
+  label_begin_.clear();
+  label_bytes_.clear();
+  next_states_.clear();
+  arc_codes_.clear();
+  backoff_states_.assign(num_states, -1);
+  backoff_codes_.clear();
+  arc_begin_.reserve(num_states + 1);
+  label_begin_.reserve(num_states + 1);
+  backoff_codes_.reserve(num_states * code_bytes_);
+  std::vector<std::tuple<int, int, float>> state_arcs;
+  for (int state = 0; state < num_states; ++state) {
+    arc_begin_.push_back(next_states_.size());
+    label_begin_.push_back(label_bytes_.size());
+    float backoff_weight = 0.0;
+    state_arcs.clear();
+    for (ArcIterator<StdFst> aiter(*fst_, state); !aiter.Done();
+         aiter.Next()) {
+      const StdArc& arc = aiter.Value();
+      if (arc.ilabel == 0) {
+        backoff_states_[state] = arc.nextstate;
+        backoff_weight = arc.weight.Value();
+        continue;
+      }
+      const auto pos = label_indices.find(arc.ilabel);
+      if (pos == label_indices.end()) continue;
+      state_arcs.emplace_back(pos->second, arc.nextstate, arc.weight.Value());
+    }
+    AppendCode(backoff_codebook_.Encode(backoff_weight), code_bytes_,
+               &backoff_codes_);
+    std::sort(state_arcs.begin(), state_arcs.end());
+    int prev_index = -1;
+    for (const auto& [index, next_state, weight] : state_arcs) {
+      AppendVarint(index - prev_index, &label_bytes_);
+      prev_index = index;
+      next_states_.push_back(next_state);
+      AppendCode(arc_codebook_.Encode(weight), code_bytes_, &arc_codes_);
+    }
+  }
+  arc_begin_.push_back(next_states_.size());
+  label_begin_.push_back(label_bytes_.size());
+  label_bytes_.shrink_to_fit();
+  next_states_.shrink_to_fit();
+  arc_codes_.shrink_to_fit();
+  GOOGLE_LOG(INFO) << "Quantized " << num_states << " states and "
+                   << next_states_.size() << " arcs into " << ModelBytes()
+                   << " bytes";
+
+  // Only the quantized model is kept.
+  fst_.reset();
+  absl::MutexLock lock(&cache_lock_);
+  cache_.clear();
+  cache_index_.clear();
+  return absl::OkStatus();
+}
+
+size_t QuantizedNGramCharModel::ModelBytes() const {
+  size_t num_bytes = 0;
+  for (const std::string& symbol : symbols_) num_bytes += symbol.size();
+  num_bytes += (arc_begin_.size() + label_begin_.size()) * sizeof(uint32);
+  num_bytes += label_bytes_.size() + arc_codes_.size() + backoff_codes_.size();
+  num_bytes += (next_states_.size() + backoff_states_.size()) * sizeof(int32);
+  // Values and bounds of the codebooks.
+  num_bytes +=
+      (arc_codebook_.size() + backoff_codebook_.size()) * 2 * sizeof(float);
+  return num_bytes;
+}
+
+int QuantizedNGramCharModel::FindArc(int state, int index) const {
+  const uint8* pos = label_bytes_.data() + label_begin_[state];
+  int arc_index = -1;
+  for (int arc = arc_begin_[state]; arc < arc_begin_[state + 1]; ++arc) {
+    arc_index += DecodeVarint(&pos);
+    if (arc_index == index) return arc;
+    if (arc_index > index) break;
+  }
+  return -1;
+}
+
+float QuantizedNGramCharModel::ArcWeight(int arc) const {
+  return arc_codebook_.Decode(DecodeCode(arc_codes_, arc, code_bytes_));
+}
+
+float QuantizedNGramCharModel::BackoffWeight(int state) const {
+  return backoff_codebook_.Decode(
+      DecodeCode(backoff_codes_, state, code_bytes_));
+}
+
+int QuantizedNGramCharModel::NextState(int state, int utf8_sym) {
+  int index = codepoint_indices_.Find(utf8_sym);
+  if (index == utf8::CodepointMap::kNoLabel) index = oov_index_;
+  int current_state = state < 0 ? unigram_state_ : state;
+  if (current_state >= backoff_states_.size()) return -1;
+  // As in the FST, where the matcher takes the missing label for epsilon,
+  // the symbols missing from the vocabulary lead to the backoff state.
+  if (index < 0) return backoff_states_[current_state];
+  while (current_state >= 0) {
+    const int arc = FindArc(current_state, index);
+    if (arc >= 0) return next_states_[arc];
+    current_state = backoff_states_[current_state];
+  }
+  return -1;
+}
+
+void QuantizedNGramCharModel::AppendSymbols(int first_index,
+                                            std::vector<std::string>* symbols) {
+  if (first_index < 0) first_index = 0;
+  for (int i = first_index; i < symbols_.size(); ++i) {
+    symbols->push_back(symbols_[i]);
+  }
+}
+
+bool QuantizedNGramCharModel::ExtractNegLogProbs(
+    int state, std::vector<double>* neg_log_probs, double* normalization) {
+  const int current_state = state < 0 ? unigram_state_ : state;
+  if (current_state < 0 || current_state >= backoff_states_.size()) {
+    return false;
+  }
+  const std::vector<float>& probs =
+      GetDistribution(current_state)->neg_log_probs;
+  neg_log_probs->assign(probs.begin(), probs.end());
+  *normalization = 1.0;
+  return true;
+}
+
+QuantizedNGramCharModel::StateDistributionPtr
+QuantizedNGramCharModel::GetDistribution(int state) {
+  {
+    absl::MutexLock lock(&cache_lock_);
+    const auto pos = cache_index_.find(state);
+    if (pos != cache_index_.end()) {
+      cache_.splice(cache_.begin(), cache_, pos->second);
+      return pos->second->second;
+    }
+  }
+  StateDistributionPtr distribution = ComputeDistribution(state);
+  absl::MutexLock lock(&cache_lock_);
+  const auto pos = cache_index_.find(state);
+  if (pos != cache_index_.end()) return pos->second->second;
+  cache_.emplace_front(state, distribution);
+  cache_index_.emplace(state, cache_.begin());
+  TrimCache();
+  return distribution;
+}
+
+void QuantizedNGramCharModel::TrimCache() {
+  while (static_cast<int>(cache_.size()) > max_cached_distributions_) {
+    cache_index_.erase(cache_.back().first);
+    cache_.pop_back();
+  }
+}
+
+int64 QuantizedNGramCharModel::DistributionBytes() const {
+  // The list node and the index entry take a few pointers.
+  return sizeof(StateDistribution) + 2 * symbols_.size() * sizeof(float) +
+         sizeof(CacheEntry) + 4 * sizeof(void*);
+}
+
+bool QuantizedNGramCharModel::GetMemoryUsage(ModelMemoryUsage* usage) const {
+  usage->model_bytes = ModelBytes();
+  absl::MutexLock lock(&cache_lock_);
+  usage->cache_bytes = cache_.size() * DistributionBytes();
+  return true;
+}
+
+void QuantizedNGramCharModel::SetCacheMemoryLimit(int64 max_bytes) {
+  int64 max_distributions = kMaxCachedDistributions;
+  if (max_bytes >= 0) {
+    max_distributions = std::min(max_distributions,
+                                 max_bytes / DistributionBytes());
+  }
+  absl::MutexLock lock(&cache_lock_);
+  // Keeps at least the distribution computed last.
+  max_cached_distributions_ = std::max<int64>(max_distributions, 1);
+  TrimCache();
+}
+
+QuantizedNGramCharModel::StateDistributionPtr
+QuantizedNGramCharModel::ComputeDistribution(int state) {
+  auto distribution = std::make_shared<StateDistribution>();
+  std::vector<float>& costs = distribution->costs;
+  const int backoff_state = backoff_states_[state];
+  if (backoff_state >= 0) {
+    costs = GetDistribution(backoff_state)->costs;
+    const float backoff_weight = BackoffWeight(state);
+    for (float& cost : costs) cost += backoff_weight;
+  } else {
+    costs.assign(symbols_.size(), std::numeric_limits<float>::infinity());
+  }
+  const uint8* pos = label_bytes_.data() + label_begin_[state];
+  int index = -1;
+  for (int arc = arc_begin_[state]; arc < arc_begin_[state + 1]; ++arc) {
+    index += DecodeVarint(&pos);
+    costs[index] = ArcWeight(arc);
+  }
+  // Renormalizes in double precision.
+  std::vector<double> neg_log_probs(costs.begin(), costs.end());
+  SoftmaxRenormalize(&neg_log_probs);
+  distribution->neg_log_probs.assign(neg_log_probs.begin(),
+                                     neg_log_probs.end());
+  return distribution;
+}
+
+}  // namespace models
+}  // namespace mozolm
@@ -0,0 +1,187 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Character n-gram model in OpenFst format, quantized into a compact
+// representation for the on-device memory budgets.
+//
+// When read, the FST and its symbol table are converted into flat arrays and
+// released. The arc and backoff weights are replaced by codes into two
+// codebooks of at most 256 or 65536 values, built from equal-population bins
+// of the weights, so that the codes of the frequent weight ranges are denser.
+// The labels of the arcs of each state are replaced by their vocabulary
+// indices, sorted and delta-coded as variable-length bytes, which mostly take
+// a single byte. The cached distributions are kept in single precision.
+
+#ifndef MOZOLM_MOZOLM_MODELS_QUANTIZED_NGRAM_CHAR_MODEL_H_
+#define MOZOLM_MOZOLM_MODELS_QUANTIZED_NGRAM_CHAR_MODEL_H_
+
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mozolm/stubs/integral_types.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "mozolm/models/model_storage.pb.h"
+#include "mozolm/models/ngram_char_fst_model.h"
+#include "mozolm/models/ngram_fst_model.h"
+#include "mozolm/utils/codepoint_map.h"
+
+namespace mozolm {
+namespace models {
+
+// Codebook of the quantized weights. Each weight is encoded as the index of
+// the nearest codebook value.
+class WeightCodebook {
+ public:
+  WeightCodebook() = default;
+  ~WeightCodebook() = default;
+
+  // Builds the codebook of at most max_codes values from the weights: the
+  // distinct weights if there are few enough, otherwise the means of bins
+  // holding equal numbers of the sorted weights.
+  void Build(std::vector<float> weights, int max_codes);
+
+  // Returns the code of the nearest codebook value.
+  int Encode(float weight) const;
+
+  // Returns the codebook value of the code.
+  float Decode(int code) const { return values_[code]; }
+
+  // Number of codebook values.
+  int size() const { return values_.size(); }
+
+ private:
+  std::vector<float> values_;  // Sorted codebook values.
+  std::vector<float> bounds_;  // Midpoints between consecutive values.
+};
+
+// Read-only quantized model. The distributions are computed and cached as by
+// NGramCharFstModel, up to kMaxCachedDistributions of them, fewer under a
+// memory limit.
+class QuantizedNGramCharModel : public NGramFstModel {
+ public:
+  // Reads the model in ConstFst format if const_fst is set, quantized as
+  // requested, which is neither QUANTIZATION_NONE nor invalid.
+  QuantizedNGramCharModel(bool const_fst, Quantization quantization);
+  ~QuantizedNGramCharModel() override = default;
+
+  // Reads the model from the model storage and quantizes it, releasing the
+  // FST.
+  absl::Status Read(const ModelStorage &storage) override;
+
+  // Provides the state reached from state following utf8_sym.
+  int NextState(int state, int utf8_sym) override;
+
+  // Returns the number of symbols in the vocabulary, which excludes epsilon.
+  int NumSymbols() override { return symbols_.size(); }
+
+  // Appends the symbols with vocabulary indices from first_index onwards.
+  void AppendSymbols(int first_index,
+                     std::vector<std::string>* symbols) override;
+
+  // Fills in the negative log probabilities for the state. The normalization
+  // is always one.
+  bool ExtractNegLogProbs(int state, std::vector<double>* neg_log_probs,
+                          double* normalization) override;
+
+  // Number of bytes of the quantized model, excluding the cache.
+  size_t ModelBytes() const;
+
+  // Fills in the memory held by the quantized model and by the cached
+  // distributions.
+  bool GetMemoryUsage(ModelMemoryUsage* usage) const
+      ABSL_LOCKS_EXCLUDED(cache_lock_) override;
+
+  // Lowers the number of cached distributions to fit about max_bytes, evicting
+  // the least recently used ones.
+  void SetCacheMemoryLimit(int64 max_bytes)
+      ABSL_LOCKS_EXCLUDED(cache_lock_) override;
+
+ private:
+  // Returns the arc of the state with the given vocabulary index, -1 if none.
+  int FindArc(int state, int index) const;
+
+  // Decodes the weight of the arc and the backoff weight of the state.
+  float ArcWeight(int arc) const;
+  float BackoffWeight(int state) const;
+
+  // Distribution over the vocabulary for a state, see NGramCharFstModel.
+  struct StateDistribution {
+    std::vector<float> costs;
+    std::vector<float> neg_log_probs;
+  };
+  using StateDistributionPtr = std::shared_ptr<const StateDistribution>;
+
+  // Returns the distribution for the state, computing it if not cached.
+  StateDistributionPtr GetDistribution(int state)
+      ABSL_LOCKS_EXCLUDED(cache_lock_);
+
+  // Computes the distribution for the state from the distribution of its
+  // backoff state.
+  StateDistributionPtr ComputeDistribution(int state)
+      ABSL_LOCKS_EXCLUDED(cache_lock_);
+
+  // Number of bytes of a cached distribution, with its cache entry.
+  int64 DistributionBytes() const;
+
+  // Evicts the least recently used distributions over the limit.
+  void TrimCache() ABSL_EXCLUSIVE_LOCKS_REQUIRED(cache_lock_);
+
+  // Number of bytes of each weight code, one or two.
+  const int code_bytes_;
+
+  // Symbols of the vocabulary, in symbol table order, and the mapping from
+  // the codepoints to their vocabulary indices.
+  std::vector<std::string> symbols_;
+  utf8::CodepointMap codepoint_indices_;
+  // Vocabulary index of the unknown symbol, if any.
+  int oov_index_ = -1;
+
+  // The arcs of each state, other than the backoff arc, range from
+  // arc_begin_[state] to arc_begin_[state + 1], sorted by vocabulary index.
+  // The labels of the arcs of the state start at label_begin_[state] in the
+  // byte stream holding the differences between consecutive vocabulary
+  // indices, seven bits per byte.
+  std::vector<uint32> arc_begin_;
+  std::vector<uint32> label_begin_;
+  std::vector<uint8> label_bytes_;
+  std::vector<int32> next_states_;
+  std::vector<uint8> arc_codes_;
+  // Backoff state of each state, -1 if none, and the code of its weight.
+  std::vector<int32> backoff_states_;
+  std::vector<uint8> backoff_codes_;
+  WeightCodebook arc_codebook_;
+  WeightCodebook backoff_codebook_;
+
+  // Guards the cache of the state distributions, which keeps the most recently
+  // used distributions at the front of the list.
+  mutable absl::Mutex cache_lock_;
+  int max_cached_distributions_ ABSL_GUARDED_BY(cache_lock_) =
+      kMaxCachedDistributions;
+  using CacheEntry = std::pair<int, StateDistributionPtr>;
+  std::list<CacheEntry> cache_ ABSL_GUARDED_BY(cache_lock_);
+  absl::flat_hash_map<int, std::list<CacheEntry>::iterator> cache_index_
+      ABSL_GUARDED_BY(cache_lock_);
+};
+
+}  // namespace models
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_MODELS_QUANTIZED_NGRAM_CHAR_MODEL_H_
@@ -0,0 +1,166 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Unit tests for the quantized n-gram character model.
+
+#include "mozolm/models/quantized_ngram_char_model.h"
+
+#include <cmath>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "mozolm/stubs/status-matchers.h"
+#include "gtest/gtest.h"
+#include "mozolm/models/model_storage.pb.h"
+#include "mozolm/models/ngram_char_fst_model.h"
+#include "mozolm/utils/utf8_util.h"
+
+namespace mozolm {
+namespace models {
+namespace {
+
+const char kModelPath[] = "mozolm/models/testdata";
+const char kModelName[] = "gutenberg_en_char_ngram_o4_wb.fst";
+const char kSampleText[] = R"(
+    His manner was not effusive. It seldom was; but he was glad, I think,
+    to see me. With hardly a word spoken, but with a kindly eye, he waved
+    me to an armchair, threw across his case of cigars, and indicated a
+    spirit case and a gasogene in the corner.)";
+
+TEST(WeightCodebookTest, CheckDistinctWeights) {
+  // Few enough distinct weights are encoded exactly.
+  WeightCodebook codebook;
+  codebook.Build({3.0, 1.0, 2.0, 1.0, 3.0}, /* max_codes= */4);
+  ASSERT_EQ(codebook.size(), 3);
+  for (const float weight : {1.0, 2.0, 3.0}) {
+    EXPECT_EQ(codebook.Decode(codebook.Encode(weight)), weight);
+  }
+}
+
+TEST(WeightCodebookTest, CheckBins) {
+  std::vector<float> weights;
+  for (int i = 0; i < 1000; ++i) weights.push_back(i * 0.01);
+  WeightCodebook codebook;
+  codebook.Build(weights, /* max_codes= */10);
+  ASSERT_EQ(codebook.size(), 10);
+  // Each weight is encoded as the mean of its bin of 100 weights, and the
+  // values out of range as the extreme values.
+  for (const float weight : weights) {
+    EXPECT_NEAR(codebook.Decode(codebook.Encode(weight)), weight, 0.5);
+  }
+  EXPECT_NEAR(codebook.Decode(codebook.Encode(-5.0)), 0.495, 1E-5);
+  EXPECT_NEAR(codebook.Decode(codebook.Encode(50.0)), 9.495, 1E-5);
+}
+
+class QuantizedNGramCharModelTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    const std::filesystem::path model_path = (
+        std::filesystem::current_path() /
+        kModelPath / kModelName).make_preferred();
+    model_storage_.set_model_file(model_path.string());
+    ASSERT_OK(reference_model_.Read(model_storage_));
+  }
+
+  // Checks that the quantized model follows the same states as the reference
+  // model, and that its probabilities are within the given delta.
+  void CheckQuantizedModel(Quantization quantization, double max_delta) {
+    QuantizedNGramCharModel model(/* const_fst= */false, quantization);
+    ASSERT_OK(model.Read(model_storage_));
+    ASSERT_EQ(model.NumSymbols(), reference_model_.NumSymbols());
+    std::vector<std::string> symbols, reference_symbols;
+    model.AppendSymbols(0, &symbols);
+    reference_model_.AppendSymbols(0, &reference_symbols);
+    EXPECT_EQ(symbols, reference_symbols);
+
+    const std::vector<int> input_chars =
+        utf8::StrSplitByCharToUnicode(kSampleText);
+    int state = -1, reference_state = -1;
+    for (int input_char : input_chars) {
+      state = model.NextState(state, input_char);
+      reference_state = reference_model_.NextState(reference_state,
+                                                   input_char);
+      ASSERT_EQ(state, reference_state);
+      std::vector<double> neg_log_probs, reference_neg_log_probs;
+      double normalization, reference_normalization;
+      ASSERT_TRUE(model.ExtractNegLogProbs(state, &neg_log_probs,
+                                           &normalization));
+      ASSERT_TRUE(reference_model_.ExtractNegLogProbs(
+          reference_state, &reference_neg_log_probs,
+          &reference_normalization));
+      EXPECT_EQ(normalization, 1.0);
+      ASSERT_EQ(neg_log_probs.size(), reference_neg_log_probs.size());
+      double total_prob = 0.0;
+      for (int i = 0; i < neg_log_probs.size(); ++i) {
+        EXPECT_NEAR(std::exp(-neg_log_probs[i]),
+                    std::exp(-reference_neg_log_probs[i]), max_delta);
+        total_prob += std::exp(-neg_log_probs[i]);
+      }
+      EXPECT_NEAR(total_prob, 1.0, 1E-4);
+    }
+  }
+
+  ModelStorage model_storage_;
+  NGramCharFstModel reference_model_;
+};
+
+TEST_F(QuantizedNGramCharModelTest, Check16Bit) {
+  CheckQuantizedModel(QUANTIZATION_16_BIT, 1E-3);
+}
+
+TEST_F(QuantizedNGramCharModelTest, Check8Bit) {
+  CheckQuantizedModel(QUANTIZATION_8_BIT, 5E-2);
+}
+
+TEST_F(QuantizedNGramCharModelTest, CheckModelBytes) {
+  QuantizedNGramCharModel model_16_bit(/* const_fst= */false,
+                                       QUANTIZATION_16_BIT);
+  QuantizedNGramCharModel model_8_bit(/* const_fst= */false,
+                                      QUANTIZATION_8_BIT);
+  ASSERT_OK(model_16_bit.Read(model_storage_));
+  ASSERT_OK(model_8_bit.Read(model_storage_));
+  EXPECT_LT(model_8_bit.ModelBytes(), model_16_bit.ModelBytes());
+
+  // Each arc of the FST takes 16 bytes, against 6 to 7 bytes for the 8-bit
+  // codes, even counting the states.
+  const auto& fst = reference_model_.fst();
+  size_t num_arcs = 0;
+  for (int state = 0; state < fst.NumStates(); ++state) {
+    num_arcs += fst.NumArcs(state);
+  }
+  EXPECT_LT(model_8_bit.ModelBytes(), num_arcs * sizeof(fst::StdArc));
+}
+
+TEST_F(QuantizedNGramCharModelTest, CheckOutOfVocabulary) {
+  QuantizedNGramCharModel model(/* const_fst= */false, QUANTIZATION_8_BIT);
+  ASSERT_OK(model.Read(model_storage_));
+  constexpr int kOutOfVocabQuery = 9924;  // ⛄
+  for (const char* context : {"", "th", "the"}) {
+    const int state = model.ContextState(context);
+    const int reference_state = reference_model_.ContextState(context);
+    ASSERT_EQ(state, reference_state);
+    EXPECT_EQ(model.NextState(state, kOutOfVocabQuery),
+              reference_model_.NextState(reference_state, kOutOfVocabQuery));
+  }
+  std::vector<double> neg_log_probs;
+  double normalization;
+  EXPECT_FALSE(model.ExtractNegLogProbs(1 << 30, &neg_log_probs,
+                                        &normalization));
+}
+
+}  // namespace
+}  // namespace models
+}  // namespace mozolm
@@ -0,0 +1,251 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/models/score_kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include "mozolm/stubs/integral_types.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+// The AVX2 kernels are compiled for that instruction set regardless of the
+// build flags, and only called if the processor supports it.
+#define MOZOLM_SCORE_KERNELS_AVX2 1
+#endif  // __x86_64__
+
+namespace mozolm {
+namespace models {
+namespace {
+
+// Range of the exponents for which the result is a normal double: below it,
+// the exponential is taken as zero, above it as infinity.
+constexpr double kMinExponent = -708.0;
+constexpr double kMaxExponent = 709.0;
+
+// Adding this constant rounds a double of magnitude less than 2^51 to the
+// nearest integer, which is then held in the low bits of the mantissa.
+constexpr double kRoundingShift = 6755399441055744.0;  // 1.5 * 2^52.
+
+// Split of ln(2) whose high part has enough trailing zero bits for its
+// product with the rounded exponent to be exact.
+constexpr double kLog2e = 1.4426950408889634073599;
+constexpr double kLn2Hi = 6.93145751953125E-1;
+constexpr double kLn2Lo = 1.42860682030941723212E-6;
+
+// Coefficients of the rational approximation of exp(r) for |r| <= ln(2) / 2,
+// from the Cephes library.
+constexpr double kP0 = 1.26177193074810590878E-4;
+constexpr double kP1 = 3.02994407707441961300E-2;
+constexpr double kP2 = 9.99999999999999999910E-1;
+constexpr double kQ0 = 3.00198505138664455042E-6;
+constexpr double kQ1 = 2.52448340349684104192E-3;
+constexpr double kQ2 = 2.27265548208155028766E-1;
+constexpr double kQ3 = 2.00000000000000000009E0;
+
+constexpr double kInfinity = std::numeric_limits<double>::infinity();
+
+// Computes exp(x) as 2^k exp(r), with x = k ln(2) + r.
+inline double Exp(double x) {
+  if (x < kMinExponent) return 0.0;
+  if (x > kMaxExponent) return kInfinity;
+  if (std::isnan(x)) return x;
+  const double shifted = x * kLog2e + kRoundingShift;
+  const double k = shifted - kRoundingShift;
+  const double r = (x - k * kLn2Hi) - k * kLn2Lo;
+  const double rr = r * r;
+  const double px = r * ((kP0 * rr + kP1) * rr + kP2);
+  const double qx = ((kQ0 * rr + kQ1) * rr + kQ2) * rr + kQ3;
+  const double exp_r = 1.0 + 2.0 * px / (qx - px);
+
+  // Builds 2^k from the biased exponent, k being in [-1022, 1023].
+  uint64 bits;
+  std::memcpy(&bits, &shifted, sizeof(bits));
+  bits = (bits + 1023) << 52;
+  double scale;
+  std::memcpy(&scale, &bits, sizeof(scale));
+  return exp_r * scale;
+}
+
+void NegLogProbsToProbsScalar(const double* neg_log_probs, int num_values,
+                              double offset, double* probs) {
+  for (int i = 0; i < num_values; ++i) {
+    probs[i] = Exp(-(offset + neg_log_probs[i]));
+  }
+}
+
+void AddNegLogProbsToProbsScalar(const double* neg_log_probs, int num_values,
+                                 double offset, double* probs) {
+  for (int i = 0; i < num_values; ++i) {
+    probs[i] += Exp(-(offset + neg_log_probs[i]));
+  }
+}
+
+double NegLogSumOfProbsScalar(const double* neg_log_probs, int num_values) {
+  double min_value = kInfinity;
+  for (int i = 0; i < num_values; ++i) {
+    min_value = std::min(min_value, neg_log_probs[i]);
+  }
+  if (min_value == kInfinity) return kInfinity;
+  double sum = 0.0;
+  for (int i = 0; i < num_values; ++i) {
+    sum += Exp(min_value - neg_log_probs[i]);
+  }
+  return min_value - std::log(sum);
+}
+
+#if defined(MOZOLM_SCORE_KERNELS_AVX2)
+
+#define MOZOLM_AVX2 __attribute__((target("avx2,fma")))
+
+// Computes exp(x) for the four values as the scalar version, in registers.
+MOZOLM_AVX2 inline __m256d Exp4(__m256d x) {
+  const __m256d too_small = _mm256_cmp_pd(x, _mm256_set1_pd(kMinExponent),
+                                          _CMP_LT_OQ);
+  const __m256d too_large = _mm256_cmp_pd(x, _mm256_set1_pd(kMaxExponent),
+                                          _CMP_GT_OQ);
+  const __m256d is_nan = _mm256_cmp_pd(x, x, _CMP_UNORD_Q);
+  const __m256d clamped =
+      _mm256_min_pd(_mm256_max_pd(x, _mm256_set1_pd(kMinExponent)),
+                    _mm256_set1_pd(kMaxExponent));
+  const __m256d shift = _mm256_set1_pd(kRoundingShift);
+  const __m256d shifted =
+      _mm256_fmadd_pd(clamped, _mm256_set1_pd(kLog2e), shift);
+  const __m256d k = _mm256_sub_pd(shifted, shift);
+  __m256d r = _mm256_fnmadd_pd(k, _mm256_set1_pd(kLn2Hi), clamped);
+  r = _mm256_fnmadd_pd(k, _mm256_set1_pd(kLn2Lo), r);
+  const __m256d rr = _mm256_mul_pd(r, r);
+  __m256d px = _mm256_fmadd_pd(_mm256_set1_pd(kP0), rr, _mm256_set1_pd(kP1));
+  px = _mm256_fmadd_pd(px, rr, _mm256_set1_pd(kP2));
+  px = _mm256_mul_pd(px, r);
+  __m256d qx = _mm256_fmadd_pd(_mm256_set1_pd(kQ0), rr, _mm256_set1_pd(kQ1));
+  qx = _mm256_fmadd_pd(qx, rr, _mm256_set1_pd(kQ2));
+  qx = _mm256_fmadd_pd(qx, rr, _mm256_set1_pd(kQ3));
+  const __m256d two_px = _mm256_add_pd(px, px);
+  const __m256d exp_r = _mm256_add_pd(
+      _mm256_set1_pd(1.0), _mm256_div_pd(two_px, _mm256_sub_pd(qx, px)));
+  const __m256i bits = _mm256_slli_epi64(
+      _mm256_add_epi64(_mm256_castpd_si256(shifted),
+                       _mm256_set1_epi64x(1023)),
+      52);
+  __m256d result = _mm256_mul_pd(exp_r, _mm256_castsi256_pd(bits));
+  result = _mm256_andnot_pd(too_small, result);
+  result = _mm256_blendv_pd(result, _mm256_set1_pd(kInfinity), too_large);
+  return _mm256_blendv_pd(result, x, is_nan);
+}
+
+MOZOLM_AVX2 void NegLogProbsToProbsAvx2(const double* neg_log_probs,
+                                        int num_values, double offset,
+                                        double* probs) {
+  const __m256d minus_offset = _mm256_set1_pd(-offset);
+  int i = 0;
+  for (; i + 4 <= num_values; i += 4) {
+    const __m256d x =
+        _mm256_sub_pd(minus_offset, _mm256_loadu_pd(neg_log_probs + i));
+    _mm256_storeu_pd(probs + i, Exp4(x));
+  }
+  NegLogProbsToProbsScalar(neg_log_probs + i, num_values - i, offset,
+                           probs + i);
+}
+
+MOZOLM_AVX2 void AddNegLogProbsToProbsAvx2(const double* neg_log_probs,
+                                           int num_values, double offset,
+                                           double* probs) {
+  const __m256d minus_offset = _mm256_set1_pd(-offset);
+  int i = 0;
+  for (; i + 4 <= num_values; i += 4) {
+    const __m256d x =
+        _mm256_sub_pd(minus_offset, _mm256_loadu_pd(neg_log_probs + i));
+    _mm256_storeu_pd(probs + i,
+                     _mm256_add_pd(_mm256_loadu_pd(probs + i), Exp4(x)));
+  }
+  AddNegLogProbsToProbsScalar(neg_log_probs + i, num_values - i, offset,
+                              probs + i);
+}
+
+MOZOLM_AVX2 double NegLogSumOfProbsAvx2(const double* neg_log_probs,
+                                        int num_values) {
+  __m256d min_values = _mm256_set1_pd(kInfinity);
+  int i = 0;
+  for (; i + 4 <= num_values; i += 4) {
+    min_values = _mm256_min_pd(min_values, _mm256_loadu_pd(neg_log_probs + i));
+  }
+  double lanes[4];
+  _mm256_storeu_pd(lanes, min_values);
+  double min_value = std::min(std::min(lanes[0], lanes[1]),
+                              std::min(lanes[2], lanes[3]));
+  for (; i < num_values; ++i) {
+    min_value = std::min(min_value, neg_log_probs[i]);
+  }
+  if (min_value == kInfinity) return kInfinity;
+  const __m256d min_vector = _mm256_set1_pd(min_value);
+  __m256d sums = _mm256_setzero_pd();
+  for (i = 0; i + 4 <= num_values; i += 4) {
+    const __m256d x =
+        _mm256_sub_pd(min_vector, _mm256_loadu_pd(neg_log_probs + i));
+    sums = _mm256_add_pd(sums, Exp4(x));
+  }
+  _mm256_storeu_pd(lanes, sums);
+  double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  for (; i < num_values; ++i) sum += Exp(min_value - neg_log_probs[i]);
+  return min_value - std::log(sum);
+}
+
+#undef MOZOLM_AVX2
+
+// Returns whether the processor supports the AVX2 kernels, checked once.
+bool HasAvx2() {
+  static const bool has_avx2 =
+      __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  return has_avx2;
+}
+
+#endif  // MOZOLM_SCORE_KERNELS_AVX2
+
+}  // namespace
+
+void NegLogProbsToProbs(const double* neg_log_probs, int num_values,
+                        double offset, double* probs) {
+#if defined(MOZOLM_SCORE_KERNELS_AVX2)
+  if (HasAvx2()) {
+    NegLogProbsToProbsAvx2(neg_log_probs, num_values, offset, probs);
+    return;
+  }
+#endif  // MOZOLM_SCORE_KERNELS_AVX2
+  NegLogProbsToProbsScalar(neg_log_probs, num_values, offset, probs);
+}
+
+void AddNegLogProbsToProbs(const double* neg_log_probs, int num_values,
+                           double offset, double* probs) {
+#if defined(MOZOLM_SCORE_KERNELS_AVX2)
+  if (HasAvx2()) {
+    AddNegLogProbsToProbsAvx2(neg_log_probs, num_values, offset, probs);
+    return;
+  }
+#endif  // MOZOLM_SCORE_KERNELS_AVX2
+  AddNegLogProbsToProbsScalar(neg_log_probs, num_values, offset, probs);
+}
+
+double NegLogSumOfProbs(const double* neg_log_probs, int num_values) {
+#if defined(MOZOLM_SCORE_KERNELS_AVX2)
+  if (HasAvx2()) return NegLogSumOfProbsAvx2(neg_log_probs, num_values);
+#endif  // MOZOLM_SCORE_KERNELS_AVX2
+  return NegLogSumOfProbsScalar(neg_log_probs, num_values);
+}
+
+}  // namespace models
+}  // namespace mozolm
@@ -0,0 +1,48 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Kernels converting arrays of negative log probabilities, which dominate the
+// cost of the full distributions over large vocabularies.
+//
+// The exponential is computed by range reduction and a rational
+// approximation, within a couple of units in the last place of std::exp. On
+// x86-64, the kernels process four values at once with AVX2 if the processor
+// supports it, checked at run time, and fall back to the scalar loops
+// otherwise.
+
+#ifndef MOZOLM_MOZOLM_MODELS_SCORE_KERNELS_H_
+#define MOZOLM_MOZOLM_MODELS_SCORE_KERNELS_H_
+
+namespace mozolm {
+namespace models {
+
+// Sets each of the probabilities to exp(-(offset + neg_log_probs[i])). The
+// arrays hold num_values values and may be the same.
+void NegLogProbsToProbs(const double* neg_log_probs, int num_values,
+                        double offset, double* probs);
+
+// Adds exp(-(offset + neg_log_probs[i])) to each of the probabilities.
+void AddNegLogProbsToProbs(const double* neg_log_probs, int num_values,
+                           double offset, double* probs);
+
+// Returns the negative log of the sum of the probabilities, shifted by the
+// smallest negative log probability so that the sum neither overflows nor
+// underflows. Returns infinity if there are no values or all the
+// probabilities are zero.
+double NegLogSumOfProbs(const double* neg_log_probs, int num_values);
+
+}  // namespace models
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_MODELS_SCORE_KERNELS_H_
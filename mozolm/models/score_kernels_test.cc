@@ -0,0 +1,106 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the score kernels.
+
+#include "mozolm/models/score_kernels.h"
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace mozolm {
+namespace models {
+namespace {
+
+// Maximum relative error of the exponentials, a few units in the last place.
+constexpr double kMaxRelativeError = 1E-15;
+
+// Returns negative log probabilities spread over the full range of the
+// exponents, in a number of values which is not a multiple of the vector
+// width.
+std::vector<double> TestNegLogProbs() {
+  std::vector<double> neg_log_probs;
+  for (double value = -700.0; value <= 700.0; value += 0.37) {
+    neg_log_probs.push_back(value);
+  }
+  return neg_log_probs;
+}
+
+TEST(ScoreKernelsTest, CheckNegLogProbsToProbs) {
+  const std::vector<double> neg_log_probs = TestNegLogProbs();
+  const int num_values = neg_log_probs.size();
+  constexpr double kOffset = 0.5;
+  std::vector<double> probs(num_values);
+  NegLogProbsToProbs(neg_log_probs.data(), num_values, kOffset, probs.data());
+  for (int i = 0; i < num_values; ++i) {
+    const double expected = std::exp(-(kOffset + neg_log_probs[i]));
+    EXPECT_NEAR(expected, probs[i], expected * kMaxRelativeError);
+  }
+
+  // Adds the probabilities in place.
+  AddNegLogProbsToProbs(neg_log_probs.data(), num_values, kOffset,
+                        probs.data());
+  for (int i = 0; i < num_values; ++i) {
+    const double expected = 2.0 * std::exp(-(kOffset + neg_log_probs[i]));
+    EXPECT_NEAR(expected, probs[i], expected * kMaxRelativeError);
+  }
+}
+
+TEST(ScoreKernelsTest, CheckOutOfRange) {
+  constexpr double kInfinity = std::numeric_limits<double>::infinity();
+  const std::vector<double> neg_log_probs = {
+      kInfinity, 1000.0, 0.0, -1000.0, -kInfinity,
+      kInfinity, 1000.0, 0.0, -1000.0, -kInfinity};
+  std::vector<double> probs(neg_log_probs.size());
+  NegLogProbsToProbs(neg_log_probs.data(), neg_log_probs.size(), 0.0,
+                     probs.data());
+  for (int i = 0; i < probs.size(); i += 5) {
+    EXPECT_EQ(0.0, probs[i]);
+    EXPECT_EQ(0.0, probs[i + 1]);
+    EXPECT_EQ(1.0, probs[i + 2]);
+    EXPECT_EQ(kInfinity, probs[i + 3]);
+    EXPECT_EQ(kInfinity, probs[i + 4]);
+  }
+}
+
+TEST(ScoreKernelsTest, CheckNegLogSumOfProbs) {
+  std::vector<double> neg_log_probs;
+  double sum = 0.0;
+  for (int i = 1; i <= 1001; ++i) {
+    neg_log_probs.push_back(std::log(i));
+    sum += 1.0 / i;
+  }
+  EXPECT_NEAR(-std::log(sum),
+              NegLogSumOfProbs(neg_log_probs.data(), neg_log_probs.size()),
+              1E-12);
+
+  // Shifting the values does not overflow the sum.
+  for (double& neg_log_prob : neg_log_probs) neg_log_prob -= 1000.0;
+  EXPECT_NEAR(-std::log(sum) - 1000.0,
+              NegLogSumOfProbs(neg_log_probs.data(), neg_log_probs.size()),
+              1E-9);
+
+  // Zero probabilities.
+  const std::vector<double> zero_probs(5,
+                                       std::numeric_limits<double>::infinity());
+  EXPECT_TRUE(std::isinf(NegLogSumOfProbs(zero_probs.data(), 5)));
+  EXPECT_TRUE(std::isinf(NegLogSumOfProbs(nullptr, 0)));
+}
+
+}  // namespace
+}  // namespace models
+}  // namespace mozolm
@@ -14,12 +14,17 @@
 
 #include "mozolm/models/simple_bigram_char_model.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <fstream>
+#include <limits>
 
 #include "mozolm/stubs/logging.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
 #include "mozolm/utils/utf8_util.h"
 #include "mozolm/stubs/status_macros.h"
 
@@ -27,6 +32,153 @@ namespace mozolm {
 namespace models {
 namespace {
 
+// Binary model format: magic string, format version, number of bytes per
+// count, number of symbols, codepoints of the symbols, and the count matrix.
+// In the first version, the matrix is dense in row-major order. In the second
+// one, each row holds its number of counts greater than one, followed by the
+// next states and the counts.
+constexpr char kBinaryMagic[] = "MZBIGRAM";
+constexpr int kBinaryMagicSize = sizeof(kBinaryMagic) - 1;
+constexpr uint32 kDenseBinaryVersion = 1;
+constexpr uint32 kBinaryVersion = 2;
+
+template <typename T>
+void WriteBinaryValues(const T* values, size_t num_values, std::ostream* out) {
+  out->write(reinterpret_cast<const char*>(values), num_values * sizeof(T));
+}
+
+template <typename T>
+bool ReadBinaryValues(std::istream* in, size_t num_values, T* values) {
+  in->read(reinterpret_cast<char*>(values), num_values * sizeof(T));
+  return static_cast<bool>(*in);
+}
+
+// Reads num_values counts stored on count_bytes bytes.
+bool ReadBinaryCounts(std::istream* in, uint32 count_bytes, size_t num_values,
+                      std::vector<int64>* counts) {
+  counts->resize(num_values);
+  if (count_bytes == sizeof(int64)) {
+    return ReadBinaryValues(in, num_values, counts->data());
+  }
+  std::vector<int32> narrow_counts(num_values);
+  if (!ReadBinaryValues(in, num_values, narrow_counts.data())) return false;
+  counts->assign(narrow_counts.begin(), narrow_counts.end());
+  return true;
+}
+
+// Checks whether the file starts with the binary format magic string.
+bool IsBinaryModel(const std::string& in_model) {
+  std::ifstream infile(in_model, std::ios_base::in | std::ios_base::binary);
+  char magic[kBinaryMagicSize];
+  return ReadBinaryValues(&infile, kBinaryMagicSize, magic) &&
+         std::memcmp(magic, kBinaryMagic, kBinaryMagicSize) == 0;
+}
+
+// Keeps the counts greater than one of the dense row in the sparse row,
+// returning the normalizer of the row. Counts less than one default to one.
+double SparsifyRow(const std::vector<int64>& counts,
+                   SimpleBigramCharModel::CountsRow* row) {
+  double normalizer = 0.0;
+  row->next_states.clear();
+  row->counts.clear();
+  for (size_t i = 0; i < counts.size(); ++i) {
+    if (counts[i] > 1) {
+      row->next_states.push_back(i);
+      row->counts.push_back(counts[i]);
+      normalizer += counts[i];
+    } else {
+      normalizer += 1;
+    }
+  }
+  row->next_states.shrink_to_fit();
+  row->counts.shrink_to_fit();
+  return normalizer;
+}
+
+// Reads the sparse row of the binary model, returning its normalizer. The
+// stored counts are expected to be greater than one and sorted by next state.
+absl::StatusOr<double> ReadBinaryRow(std::istream* in, uint32 count_bytes,
+                                     uint32 rows,
+                                     SimpleBigramCharModel::CountsRow* row) {
+  uint32 num_counts;
+  if (!ReadBinaryValues(in, 1, &num_counts) || num_counts > rows) {
+    return absl::InternalError("Failed to read binary row size");
+  }
+  row->next_states.resize(num_counts);
+  if (!ReadBinaryValues(in, num_counts, row->next_states.data()) ||
+      !ReadBinaryCounts(in, count_bytes, num_counts, &row->counts)) {
+    return absl::InternalError("Failed to read binary counts");
+  }
+  double normalizer = rows;
+  for (uint32 i = 0; i < num_counts; ++i) {
+    const int32 next_state = row->next_states[i];
+    if (next_state < 0 || static_cast<uint32>(next_state) >= rows ||
+        (i > 0 && next_state <= row->next_states[i - 1])) {
+      return absl::InternalError("Assumes sorted unique binary row states");
+    }
+    if (row->counts[i] <= 1) {
+      return absl::InternalError("Assumes binary row counts greater than one");
+    }
+    normalizer += row->counts[i] - 1;
+  }
+  return normalizer;
+}
+
+// Reads the vocabulary and the counts from the binary model, computing the
+// normalizers. The dense matrix of the first version is read one row at a
+// time, so that it is never held in memory.
+absl::Status ReadBinaryModel(
+    const std::string& in_model, std::vector<int32>* utf8_indices,
+    std::vector<double>* utf8_normalizer,
+    std::vector<SimpleBigramCharModel::CountsRow>* bigram_rows) {
+  std::ifstream infile(in_model, std::ios_base::in | std::ios_base::binary);
+  if (!infile.is_open()) {
+    return absl::NotFoundError(absl::StrCat("File not found: ", in_model));
+  }
+  char magic[kBinaryMagicSize];
+  uint32 version, count_bytes, rows;
+  if (!ReadBinaryValues(&infile, kBinaryMagicSize, magic) ||
+      !ReadBinaryValues(&infile, 1, &version) ||
+      !ReadBinaryValues(&infile, 1, &count_bytes) ||
+      !ReadBinaryValues(&infile, 1, &rows)) {
+    return absl::InternalError("Failed to read binary model header");
+  }
+  if (version != kBinaryVersion && version != kDenseBinaryVersion) {
+    return absl::InternalError(absl::StrCat(
+        "Unsupported binary model version ", version));
+  }
+  if (count_bytes != sizeof(int32) && count_bytes != sizeof(int64)) {
+    return absl::InternalError(absl::StrCat(
+        "Unsupported binary count size ", count_bytes));
+  }
+  if (rows == 0) return absl::InternalError("Empty vocabulary");
+  utf8_indices->resize(rows);
+  if (!ReadBinaryValues(&infile, rows, utf8_indices->data())) {
+    return absl::InternalError("Failed to read binary model vocabulary");
+  }
+  for (uint32 i = 1; i < rows; ++i) {
+    if ((*utf8_indices)[i] <= (*utf8_indices)[i - 1]) {
+      return absl::InternalError("Assumes sorted unique numeric vocab");
+    }
+  }
+  bigram_rows->resize(rows);
+  utf8_normalizer->resize(rows);
+  std::vector<int64> dense_counts;
+  for (uint32 i = 0; i < rows; ++i) {
+    if (version == kDenseBinaryVersion) {
+      if (!ReadBinaryCounts(&infile, count_bytes, rows, &dense_counts)) {
+        return absl::InternalError("Failed to read binary counts");
+      }
+      (*utf8_normalizer)[i] = SparsifyRow(dense_counts, &(*bigram_rows)[i]);
+    } else {
+      ASSIGN_OR_RETURN((*utf8_normalizer)[i],
+                       ReadBinaryRow(&infile, count_bytes, rows,
+                                     &(*bigram_rows)[i]));
+    }
+  }
+  return absl::OkStatus();
+}
+
 absl::StatusOr<std::vector<int32>> ReadVocabSymbols(
     const std::string& in_vocab) {
   int32 last_idx = -1;
@@ -54,33 +206,33 @@ absl::StatusOr<std::vector<int32>> ReadVocabSymbols(
   return utf8_indices;
 }
 
-absl::Status ReadCountMatrix(const std::string& in_counts, int rows,
-                             std::vector<double>* utf8_normalizer,
-                             std::vector<std::vector<int64>>* bigram_matrix) {
+absl::Status ReadCountMatrix(
+    const std::string& in_counts, int rows,
+    std::vector<double>* utf8_normalizer,
+    std::vector<SimpleBigramCharModel::CountsRow>* bigram_rows) {
   int idx = 0;
   std::ifstream infile(in_counts);
   if (!infile.is_open()) {
     return absl::NotFoundError(absl::StrCat("File not found: ", in_counts));
   }
   std::string str;
+  std::vector<int64> counts(rows);
+  bigram_rows->resize(rows);
   while (std::getline(infile, str)) {
     if (str.empty()) return absl::InternalError("Empty line");
-    const std::vector<std::string> str_fields =
+    const std::vector<absl::string_view> str_fields =
         absl::StrSplit(str, ' ', absl::SkipEmpty());
     if (str_fields.size() != rows) {
       return absl::InternalError(absl::StrCat(
           "Expects ", rows, " columns per vocab entry"));
     }
-    std::vector<int64> bigram_counts(rows, 1);
+    if (idx >= rows) {
+      return absl::InternalError("Expects one row per vocab entry");
+    }
     for (size_t i = 0; i < str_fields.size(); i++) {
-      int64 count = std::stol(str_fields[i]);
-      if (count > 1) {
-        // Counts less than one default to one, hence not updated.
-        bigram_counts[i] = count;
-      }
-      (*utf8_normalizer)[idx] += bigram_counts[i];
+      counts[i] = std::stol(std::string(str_fields[i]));
     }
-    bigram_matrix->push_back(bigram_counts);
+    (*utf8_normalizer)[idx] = SparsifyRow(counts, &(*bigram_rows)[idx]);
     ++idx;
   }
   if (idx != rows) {
@@ -93,15 +245,23 @@ absl::Status ReadCountMatrix(const std::string& in_counts, int rows,
 }  // namespace
 
 absl::Status SimpleBigramCharModel::Read(const ModelStorage &storage) {
+  absl::WriterMutexLock lock(&counts_lock_);
   const std::string &vocab_file = storage.vocabulary_file();
   const std::string &counts_file = storage.model_file();
-  if (!vocab_file.empty()) {
+  utf8_indices_.clear();
+  utf8_normalizer_.clear();
+  bigram_rows_.clear();
+  if (!counts_file.empty() && IsBinaryModel(counts_file)) {
+    // The binary model also holds the vocabulary.
+    RETURN_IF_ERROR(ReadBinaryModel(counts_file, &utf8_indices_,
+                                    &utf8_normalizer_, &bigram_rows_));
+  } else if (!vocab_file.empty()) {
     ASSIGN_OR_RETURN(utf8_indices_, ReadVocabSymbols(vocab_file));
     utf8_normalizer_.resize(utf8_indices_.size(), 0);
     if (!counts_file.empty()) {
       // Only reads from bigram count file if vocab file also provided.
       RETURN_IF_ERROR(ReadCountMatrix(counts_file, utf8_indices_.size(),
-                                      &utf8_normalizer_, &bigram_counts_));
+                                      &utf8_normalizer_, &bigram_rows_));
     }
   } else {
     // Assumes uniform distribution over lowercase a-z and whitespace.
@@ -112,28 +272,25 @@ absl::Status SimpleBigramCharModel::Read(const ModelStorage &storage) {
       utf8_indices_.push_back(sym);
     }
   }
-  if (bigram_counts_.empty()) {
-    if (utf8_normalizer_.empty()) {
-      utf8_normalizer_.resize(utf8_indices_.size(), 0);
-    }
-    for (size_t i = 0; i < utf8_indices_.size(); i++) {
-      utf8_normalizer_[i] = utf8_indices_.size();
-      bigram_counts_.push_back(std::vector<int64>(utf8_indices_.size(), 1));
-    }
+  if (bigram_rows_.empty()) {
+    // All the counts default to one.
+    utf8_normalizer_.assign(utf8_indices_.size(), utf8_indices_.size());
+    bigram_rows_.resize(utf8_indices_.size());
   }
-  vocab_indices_.resize(utf8_indices_.back() + 1, -1);
+  vocab_indices_.clear();
+  vocab_indices_.reserve(utf8_indices_.size());
   for (size_t i = 0; i < utf8_indices_.size(); i++) {
     const int utf8_index = utf8_indices_[i];
-    if (utf8_index >= vocab_indices_.size()) {
-      return absl::OutOfRangeError(absl::StrCat(
-          "Invalid UTF8 index ", utf8_index, " for vocab of size ",
-          vocab_indices_.size()));
-    }
     if (utf8_index < 0) {
       return absl::InternalError(absl::StrCat("Invalid UTF index", utf8_index));
     }
     vocab_indices_[utf8_index] = i;
   }
+  symbols_.clear();
+  symbols_.reserve(utf8_indices_.size());
+  for (const int32 utf8_index : utf8_indices_) {
+    symbols_.push_back(utf8::EncodeUnicodeChar(utf8_index));
+  }
   return absl::OkStatus();
 }
 
@@ -143,40 +300,93 @@ int SimpleBigramCharModel::StateSym(int state) {
 }
 
 int SimpleBigramCharModel::SymState(int utf8_sym) {
-  return utf8_sym < static_cast<int>(vocab_indices_.size()) && utf8_sym >= 0
-             ? vocab_indices_[utf8_sym]
-             : -1;
+  const auto pos = vocab_indices_.find(utf8_sym);
+  return pos != vocab_indices_.end() ? pos->second : -1;
 }
 
 int SimpleBigramCharModel::NextState(int state, int utf8_sym) {
   return SymState(utf8_sym);
 }
 
+void SimpleBigramCharModel::AppendSymbols(int first_index,
+                                          std::vector<std::string>* symbols) {
+  if (first_index < 0) first_index = 0;
+  for (int i = first_index; i < symbols_.size(); ++i) {
+    symbols->push_back(symbols_[i]);
+  }
+}
+
 bool SimpleBigramCharModel::ExtractLMScores(int state, LMScores* response) {
-  absl::ReaderMutexLock nl(&normalizer_lock_);
-  absl::ReaderMutexLock cl(&counts_lock_);
+  absl::ReaderMutexLock lock(&counts_lock_);
+  if (state < 0 || state >= static_cast<int>(utf8_indices_.size())) {
+    // Invalid state, switching to start state, by convention state 0.
+    state = 0;
+  }
+  const int num_symbols = utf8_indices_.size();
+  const CountsRow& row = bigram_rows_[state];
+  const double normalizer = utf8_normalizer_[state];
+  response->mutable_symbols()->Reserve(num_symbols);
+  for (const std::string& symbol : symbols_) *response->add_symbols() = symbol;
+  const int first_index = response->probabilities_size();
+  response->mutable_probabilities()->Resize(first_index + num_symbols,
+                                            1.0 / normalizer);
+  double* probs =
+      response->mutable_probabilities()->mutable_data() + first_index;
+  for (size_t i = 0; i < row.next_states.size(); ++i) {
+    probs[row.next_states[i]] = row.counts[i] / normalizer;
+  }
+  response->set_normalization(normalizer);
+  return true;
+}
+
+bool SimpleBigramCharModel::ExtractNegLogProbs(
+    int state, std::vector<double>* neg_log_probs, double* normalization) {
+  absl::ReaderMutexLock lock(&counts_lock_);
   if (state < 0 || state >= static_cast<int>(utf8_indices_.size())) {
     // Invalid state, switching to start state, by convention state 0.
     state = 0;
   }
-  response->set_normalization(utf8_normalizer_[state]);
-  for (size_t i = 0; i < bigram_counts_[state].size(); i++) {
-    response->add_symbols(utf8::EncodeUnicodeChar(utf8_indices_[i]));
-    response->add_probabilities(static_cast<double>(bigram_counts_[state][i]) /
-                                utf8_normalizer_[state]);
+  const int num_symbols = utf8_indices_.size();
+  const CountsRow& row = bigram_rows_[state];
+  const double log_normalizer = std::log(utf8_normalizer_[state]);
+  // The default count of one has the negative log probability of the
+  // normalizer.
+  neg_log_probs->assign(num_symbols, log_normalizer);
+  for (size_t i = 0; i < row.next_states.size(); ++i) {
+    (*neg_log_probs)[row.next_states[i]] =
+        log_normalizer - std::log(row.counts[i]);
   }
+  *normalization = utf8_normalizer_[state];
   return true;
 }
 
 bool SimpleBigramCharModel::UpdateLMCounts(int state,
                                            const std::vector<int>& utf8_syms,
                                            int64 count) {
-  absl::WriterMutexLock nl(&normalizer_lock_);
-  absl::WriterMutexLock cl(&counts_lock_);
   if (count <= 0) {
     // Returns true, nothing to update.
     return true;
   }
+  absl::WriterMutexLock lock(&counts_lock_);
+  UpdateLMCountsLocked(state, utf8_syms, count);
+  return true;
+}
+
+bool SimpleBigramCharModel::BulkUpdateLMCounts(
+    const std::vector<std::vector<int>>& utf8_strings, int64 count) {
+  if (count <= 0) {
+    // Returns true, nothing to update.
+    return true;
+  }
+  absl::WriterMutexLock lock(&counts_lock_);
+  for (const auto& utf8_syms : utf8_strings) {
+    UpdateLMCountsLocked(start_state(), utf8_syms, count);
+  }
+  return true;
+}
+
+void SimpleBigramCharModel::UpdateLMCountsLocked(
+    int state, const std::vector<int>& utf8_syms, int64 count) {
   if (state < 0 || state >= static_cast<int>(utf8_indices_.size())) {
     // Invalid state, switching to start state, by convention state 0.
     state = 0;
@@ -188,11 +398,55 @@ bool SimpleBigramCharModel::UpdateLMCounts(int state,
       next_state = 0;
     } else {
       utf8_normalizer_[state] += count;
-      bigram_counts_[state][next_state] += count;
+      CountsRow& row = bigram_rows_[state];
+      const auto pos = std::lower_bound(row.next_states.begin(),
+                                        row.next_states.end(), next_state);
+      const int i = pos - row.next_states.begin();
+      if (pos != row.next_states.end() && *pos == next_state) {
+        row.counts[i] += count;
+      } else {
+        // Adds the count to the default count of one.
+        row.next_states.insert(pos, next_state);
+        row.counts.insert(row.counts.begin() + i, count + 1);
+      }
     }
     state = next_state;
   }
-  return true;
+}
+
+absl::Status SimpleBigramCharModel::WriteBinary(const std::string &ofile) {
+  absl::ReaderMutexLock lock(&counts_lock_);
+  std::ofstream outfile(ofile, std::ios_base::out | std::ios_base::binary);
+  if (!outfile.is_open()) {
+    return absl::PermissionDeniedError(absl::StrCat("Cannot open ", ofile));
+  }
+  const uint32 rows = utf8_indices_.size();
+  int64 max_count = 1;
+  for (const CountsRow& row : bigram_rows_) {
+    for (const int64 count : row.counts) max_count = std::max(max_count, count);
+  }
+  const bool fits_int32 = max_count <= std::numeric_limits<int32>::max();
+  const uint32 count_bytes = fits_int32 ? sizeof(int32) : sizeof(int64);
+  WriteBinaryValues(kBinaryMagic, kBinaryMagicSize, &outfile);
+  WriteBinaryValues(&kBinaryVersion, 1, &outfile);
+  WriteBinaryValues(&count_bytes, 1, &outfile);
+  WriteBinaryValues(&rows, 1, &outfile);
+  WriteBinaryValues(utf8_indices_.data(), rows, &outfile);
+  for (const CountsRow& row : bigram_rows_) {
+    const uint32 num_counts = row.counts.size();
+    WriteBinaryValues(&num_counts, 1, &outfile);
+    WriteBinaryValues(row.next_states.data(), num_counts, &outfile);
+    if (fits_int32) {
+      const std::vector<int32> counts(row.counts.begin(), row.counts.end());
+      WriteBinaryValues(counts.data(), num_counts, &outfile);
+    } else {
+      WriteBinaryValues(row.counts.data(), num_counts, &outfile);
+    }
+  }
+  if (!outfile) {
+    return absl::InternalError(absl::StrCat("Failed to write ", ofile));
+  }
+  return absl::OkStatus();
 }
 
 }  // namespace models
@@ -15,9 +15,11 @@
 #ifndef MOZOLM_MOZOLM_MODELS_SIMPLE_BIGRAM_CHAR_MODEL_H_
 #define MOZOLM_MOZOLM_MODELS_SIMPLE_BIGRAM_CHAR_MODEL_H_
 
+#include <string>
 #include <vector>
 
 #include "mozolm/stubs/integral_types.h"
+#include "absl/container/flat_hash_map.h"
 #include "absl/status/status.h"
 #include "absl/synchronization/mutex.h"
 #include "mozolm/models/language_model.h"
@@ -26,14 +28,33 @@
 namespace mozolm {
 namespace models {
 
+// Simple character bigram model. The vocabulary is immutable after the model
+// has been read, while the counts and normalizers, which are updated by the
+// adaptation, are protected by a single reader-writer lock.
+//
+// The model is read either from a text vocabulary and a text count matrix, or
+// from a single binary file written by WriteBinary, which holds the vocabulary
+// followed by the count matrix.
+//
+// Since the counts less than one default to one, most of the counts of a
+// large vocabulary are one: the matrix is stored as sparse rows which only
+// hold the counts greater than one, so that the memory grows with the number
+// of observed bigrams rather than with the square of the vocabulary size.
 class SimpleBigramCharModel : public LanguageModel {
  public:
+  // Counts greater than one of the bigrams from one of the states, sorted by
+  // the next state. The other bigrams have a count of one.
+  struct CountsRow {
+    std::vector<int32> next_states;
+    std::vector<int64> counts;
+  };
+
   SimpleBigramCharModel() = default;
   ~SimpleBigramCharModel() override = default;
 
   // Reads the model from the model storage.
   absl::Status Read(const ModelStorage &storage)
-      ABSL_EXCLUSIVE_LOCKS_REQUIRED(normalizer_lock_, counts_lock_) override;
+      ABSL_LOCKS_EXCLUDED(counts_lock_) override;
 
   // Provides the symbol associated with the state.
   int StateSym(int state) override;
@@ -41,27 +62,59 @@ class SimpleBigramCharModel : public LanguageModel {
   // Provides the state reached from state following utf8_sym.
   int NextState(int state, int utf8_sym) override;
 
-  // Copies the probs and normalization from the given state into the response.
+  // Returns the number of symbols in the vocabulary.
+  int NumSymbols() override { return symbols_.size(); }
+
+  // Appends the symbols with vocabulary indices from first_index onwards.
+  void AppendSymbols(int first_index,
+                     std::vector<std::string>* symbols) override;
+
+  // Fills in the scores for the state, scaling the default count of one for
+  // the symbols which are not stored in the row of the state.
   bool ExtractLMScores(int state, LMScores* response)
-      ABSL_LOCKS_EXCLUDED(normalizer_lock_, counts_lock_) override;
+      ABSL_LOCKS_EXCLUDED(counts_lock_) override;
+
+  // Fills in the negative log probabilities and the normalization for the
+  // state.
+  bool ExtractNegLogProbs(int state, std::vector<double>* neg_log_probs,
+                          double* normalization)
+      ABSL_LOCKS_EXCLUDED(counts_lock_) override;
 
   // Updates the counts for the utf8_syms at the current state.
   bool UpdateLMCounts(int32 state, const std::vector<int>& utf8_syms,
                       int64 count)
-      ABSL_LOCKS_EXCLUDED(normalizer_lock_, counts_lock_) override;
+      ABSL_LOCKS_EXCLUDED(counts_lock_) override;
+
+  // Updates the counts for each of the utf8_strings from the start state,
+  // holding the lock once for all of them.
+  bool BulkUpdateLMCounts(const std::vector<std::vector<int>>& utf8_strings,
+                          int64 count)
+      ABSL_LOCKS_EXCLUDED(counts_lock_) override;
+
+  // Writes the vocabulary and the current counts to the file in binary format,
+  // one sparse row per state. The counts are stored as 32-bit integers if
+  // they all fit, as 64-bit integers otherwise, in the native byte order.
+  absl::Status WriteBinary(const std::string &ofile)
+      ABSL_LOCKS_EXCLUDED(counts_lock_);
 
  private:
+  // Implementation of UpdateLMCounts, called with the lock held.
+  void UpdateLMCountsLocked(int state, const std::vector<int>& utf8_syms,
+                            int64 count)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(counts_lock_);
+
   // Provides the state associated with the symbol.
   int SymState(int utf8_sym);
 
   std::vector<int32> utf8_indices_;   // utf8 symbols in vocabulary.
-  std::vector<int32> vocab_indices_;  // dimension is utf8 symbol, stores index.
+  std::vector<std::string> symbols_;  // Encoded utf8 symbols in vocabulary.
+  // Maps the utf8 symbols in vocabulary to their index.
+  absl::flat_hash_map<int32, int32> vocab_indices_;
+  absl::Mutex counts_lock_;  // protects normalizer and count information.
   // stores normalization constant for each item in vocabulary.
-  std::vector<double> utf8_normalizer_ ABSL_GUARDED_BY(normalizer_lock_);
-  absl::Mutex normalizer_lock_;       // protects normalizer information.
-  // Stores counts for each bigram in dense square matrix.
-  std::vector<std::vector<int64>> bigram_counts_ ABSL_GUARDED_BY(counts_lock_);
-  absl::Mutex counts_lock_;  // protects count information.
+  std::vector<double> utf8_normalizer_ ABSL_GUARDED_BY(counts_lock_);
+  // Stores the counts of the bigrams, with one sparse row per state.
+  std::vector<CountsRow> bigram_rows_ ABSL_GUARDED_BY(counts_lock_);
 };
 
 }  // namespace models
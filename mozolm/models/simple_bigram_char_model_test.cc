@@ -0,0 +1,198 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the simple character bigram model.
+
+#include "mozolm/models/simple_bigram_char_model.h"
+
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "mozolm/stubs/status-matchers.h"
+#include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+#include "mozolm/models/model_storage.pb.h"
+#include "mozolm/utils/file_util.h"
+
+namespace mozolm {
+namespace models {
+namespace {
+
+// Checks that both models return the same scores for all the states.
+void CheckSameScores(SimpleBigramCharModel* model,
+                     SimpleBigramCharModel* other_model) {
+  ASSERT_EQ(model->NumSymbols(), other_model->NumSymbols());
+  for (int state = 0; state < model->NumSymbols(); ++state) {
+    LMScores scores, other_scores;
+    ASSERT_TRUE(model->ExtractLMScores(state, &scores));
+    ASSERT_TRUE(other_model->ExtractLMScores(state, &other_scores));
+    EXPECT_EQ(scores.normalization(), other_scores.normalization());
+    ASSERT_EQ(scores.symbols_size(), other_scores.symbols_size());
+    for (int i = 0; i < scores.symbols_size(); ++i) {
+      EXPECT_EQ(scores.symbols(i), other_scores.symbols(i));
+      EXPECT_EQ(scores.probabilities(i), other_scores.probabilities(i));
+    }
+  }
+}
+
+TEST(SimpleBigramCharModelTest, DefaultModel) {
+  SimpleBigramCharModel model;
+  ASSERT_OK(model.Read(ModelStorage()));
+  ASSERT_EQ(28, model.NumSymbols());  // End-of-string, space and a-z.
+  LMScores scores;
+  ASSERT_TRUE(model.ExtractLMScores(model.NextState(0, 'a'), &scores));
+  EXPECT_EQ(28, scores.normalization());
+  for (const double prob : scores.probabilities()) {
+    EXPECT_DOUBLE_EQ(1.0 / 28, prob);
+  }
+}
+
+TEST(SimpleBigramCharModelTest, BulkUpdateMatchesUpdates) {
+  const std::vector<std::vector<int>> utf8_strings = {
+      {'a', 'b', 'a', 0}, {'b', 'b', ' ', 'c', 0}, {0}};
+  SimpleBigramCharModel bulk_model;
+  ASSERT_OK(bulk_model.Read(ModelStorage()));
+  ASSERT_TRUE(bulk_model.BulkUpdateLMCounts(utf8_strings, 2));
+  SimpleBigramCharModel model;
+  ASSERT_OK(model.Read(ModelStorage()));
+  for (const auto& utf8_syms : utf8_strings) {
+    ASSERT_TRUE(model.UpdateLMCounts(model.start_state(), utf8_syms, 2));
+  }
+  CheckSameScores(&model, &bulk_model);
+}
+
+TEST(SimpleBigramCharModelTest, ReadWriteBinary) {
+  SimpleBigramCharModel model;
+  ASSERT_OK(model.Read(ModelStorage()));
+  ASSERT_TRUE(model.UpdateLMCounts(0, {'a', 'b', 'a', ' '}, 3));
+  const std::string model_file = file::TempFilePath("bigram.bin");
+  ASSERT_OK(model.WriteBinary(model_file));
+
+  SimpleBigramCharModel binary_model;
+  ModelStorage storage;
+  storage.set_model_file(model_file);
+  ASSERT_OK(binary_model.Read(storage));
+  CheckSameScores(&model, &binary_model);
+
+  // The model read from the binary format remains adaptive.
+  ASSERT_TRUE(model.UpdateLMCounts(0, {'z', 'a'}, 2));
+  ASSERT_TRUE(binary_model.UpdateLMCounts(0, {'z', 'a'}, 2));
+  CheckSameScores(&model, &binary_model);
+
+  // The counts that do not fit in 32 bits are stored in 64 bits.
+  ASSERT_TRUE(model.UpdateLMCounts(0, {'q'}, 1LL << 40));
+  ASSERT_OK(model.WriteBinary(model_file));
+  ASSERT_OK(binary_model.Read(storage));
+  CheckSameScores(&model, &binary_model);
+  std::filesystem::remove(model_file);
+}
+
+TEST(SimpleBigramCharModelTest, CheckBadBinary) {
+  const auto model_file_status = file::WriteTempTextFile(
+      "bad_bigram.bin", "MZBIGRAM\x07");
+  ASSERT_OK(model_file_status);
+  SimpleBigramCharModel model;
+  ModelStorage storage;
+  storage.set_model_file(model_file_status.value());
+  EXPECT_FALSE(model.Read(storage).ok());
+  std::filesystem::remove(model_file_status.value());
+}
+
+TEST(SimpleBigramCharModelTest, LargeVocabulary) {
+  // Vocabulary of the end-of-string and of the CJK unified ideographs.
+  constexpr int kFirstIdeograph = 0x4E00;
+  constexpr int kNumIdeographs = 20000;
+  std::string vocab = "0\n";
+  for (int i = 0; i < kNumIdeographs; ++i) {
+    absl::StrAppend(&vocab, kFirstIdeograph + i, "\n");
+  }
+  const auto vocab_file_status = file::WriteTempTextFile("cjk.vocab", vocab);
+  ASSERT_OK(vocab_file_status);
+  SimpleBigramCharModel model;
+  ModelStorage storage;
+  storage.set_vocabulary_file(vocab_file_status.value());
+  ASSERT_OK(model.Read(storage));
+  ASSERT_EQ(kNumIdeographs + 1, model.NumSymbols());
+  const int state = model.NextState(0, kFirstIdeograph);
+  ASSERT_EQ(1, state);
+  ASSERT_TRUE(model.UpdateLMCounts(state, {kFirstIdeograph + 1}, 3));
+
+  LMScores scores;
+  ASSERT_TRUE(model.ExtractLMScores(state, &scores));
+  const double normalization = kNumIdeographs + 1 + 3;
+  EXPECT_EQ(normalization, scores.normalization());
+  ASSERT_EQ(kNumIdeographs + 1, scores.probabilities_size());
+  EXPECT_DOUBLE_EQ(4 / normalization, scores.probabilities(2));
+  EXPECT_DOUBLE_EQ(1 / normalization, scores.probabilities(0));
+  EXPECT_DOUBLE_EQ(1 / normalization, scores.probabilities(kNumIdeographs));
+
+  // The negative log probabilities agree with the scores.
+  std::vector<double> neg_log_probs;
+  double neg_log_normalization;
+  ASSERT_TRUE(model.ExtractNegLogProbs(state, &neg_log_probs,
+                                       &neg_log_normalization));
+  EXPECT_EQ(normalization, neg_log_normalization);
+  ASSERT_EQ(kNumIdeographs + 1, neg_log_probs.size());
+  EXPECT_DOUBLE_EQ(std::log(normalization / 4), neg_log_probs[2]);
+  EXPECT_DOUBLE_EQ(std::log(normalization), neg_log_probs[1]);
+
+  // The other states are left uniform.
+  ASSERT_TRUE(model.ExtractLMScores(0, &scores));
+  EXPECT_EQ(kNumIdeographs + 1, scores.normalization());
+  std::filesystem::remove(vocab_file_status.value());
+}
+
+TEST(SimpleBigramCharModelTest, ReadDenseBinary) {
+  // Binary model in the first version of the format, with a dense matrix of
+  // 32-bit counts over the end-of-string and 'a'.
+  const std::string model_file = file::TempFilePath("dense_bigram.bin");
+  {
+    std::ofstream outfile(model_file, std::ios_base::binary);
+    const uint32 header[] = {1, sizeof(int32), 2};
+    const int32 symbols[] = {0, 'a'};
+    const int32 counts[] = {1, 3, 0, 2};
+    outfile.write("MZBIGRAM", 8);
+    outfile.write(reinterpret_cast<const char*>(header), sizeof(header));
+    outfile.write(reinterpret_cast<const char*>(symbols), sizeof(symbols));
+    outfile.write(reinterpret_cast<const char*>(counts), sizeof(counts));
+  }
+  SimpleBigramCharModel model;
+  ModelStorage storage;
+  storage.set_model_file(model_file);
+  ASSERT_OK(model.Read(storage));
+  LMScores scores;
+  ASSERT_TRUE(model.ExtractLMScores(0, &scores));
+  EXPECT_EQ(4, scores.normalization());
+  EXPECT_DOUBLE_EQ(0.75, scores.probabilities(1));
+  scores.Clear();
+  ASSERT_TRUE(model.ExtractLMScores(model.NextState(0, 'a'), &scores));
+  EXPECT_EQ(3, scores.normalization());
+  EXPECT_DOUBLE_EQ(1.0 / 3, scores.probabilities(0));
+  EXPECT_DOUBLE_EQ(2.0 / 3, scores.probabilities(1));
+
+  // Written back in the sparse format, the model keeps its scores.
+  ASSERT_OK(model.WriteBinary(model_file));
+  SimpleBigramCharModel sparse_model;
+  ASSERT_OK(sparse_model.Read(storage));
+  CheckSameScores(&model, &sparse_model);
+  std::filesystem::remove(model_file);
+}
+
+}  // namespace
+}  // namespace models
+}  // namespace mozolm
@@ -0,0 +1,189 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/models/user_adaptation.h"
+
+#include <algorithm>
+
+#include "absl/strings/str_cat.h"
+#include "mozolm/utils/utf8_util.h"
+
+namespace mozolm {
+namespace models {
+namespace {
+
+// Defaults of the configuration.
+constexpr int kDefaultOrder = 3;
+constexpr double kDefaultPriorWeight = 5.0;
+constexpr int kDefaultMaxUsers = 1000;
+constexpr int kDefaultMaxContextsPerUser = 4096;
+
+// Bytes taken by an entry of the hash maps besides its key and value,
+// approximately.
+constexpr int64 kHashEntryOverheadBytes = 2 * sizeof(void*);
+
+// Returns whether the byte starts a UTF-8 encoded character.
+bool IsLeadingByte(char byte) { return (byte & 0xC0) != 0x80; }
+
+}  // namespace
+
+UserCounts::UserCounts(int order, int max_contexts)
+    : max_context_chars_(std::max(order - 1, 0)),
+      max_contexts_(max_contexts) {}
+
+std::string UserCounts::ContextKey(absl::string_view context) const {
+  size_t start = context.size();
+  int num_chars = 0;
+  while (start > 0 && num_chars < max_context_chars_) {
+    --start;
+    if (IsLeadingByte(context[start])) ++num_chars;
+  }
+  return std::string(context.substr(start));
+}
+
+void UserCounts::Update(absl::string_view context,
+                        const std::vector<int>& utf8_syms, int64 count) {
+  if (count <= 0) return;
+  std::string key = ContextKey(context);
+  absl::MutexLock lock(&counts_lock_);
+  for (const int utf8_sym : utf8_syms) {
+    auto pos = contexts_.find(key);
+    if (pos == contexts_.end() && contexts_.size() < max_contexts_) {
+      pos = contexts_.emplace(key, ContextCounts()).first;
+    }
+    if (pos != contexts_.end()) {
+      pos->second.counts[utf8_sym] += count;
+      pos->second.total += count;
+    }
+    key = ContextKey(absl::StrCat(key, utf8::EncodeUnicodeChar(utf8_sym)));
+  }
+}
+
+void UserCounts::Adapt(absl::string_view context, double prior_weight,
+                       LMScores* scores) const {
+  absl::ReaderMutexLock lock(&counts_lock_);
+  const auto pos = contexts_.find(ContextKey(context));
+  if (pos == contexts_.end()) return;
+  const ContextCounts& context_counts = pos->second;
+  std::vector<int64> counts(scores->symbols_size(), 0);
+  int64 total = 0;
+  for (int i = 0; i < scores->symbols_size(); ++i) {
+    // The end-of-string is either empty or encoded as the codepoint 0.
+    char32 utf8_sym = 0;
+    utf8::DecodeLeadingUnicodeChar(scores->symbols(i), &utf8_sym);
+    const auto count_pos = context_counts.counts.find(utf8_sym);
+    if (count_pos == context_counts.counts.end()) continue;
+    counts[i] = count_pos->second;
+    total += counts[i];
+  }
+  if (total == 0) return;
+  const double denominator = total + prior_weight;
+  for (int i = 0; i < scores->probabilities_size(); ++i) {
+    scores->set_probabilities(
+        i, (counts[i] + prior_weight * scores->probabilities(i)) /
+               denominator);
+  }
+}
+
+int UserCounts::num_contexts() const {
+  absl::ReaderMutexLock lock(&counts_lock_);
+  return contexts_.size();
+}
+
+int64 UserCounts::MemoryBytes() const {
+  absl::ReaderMutexLock lock(&counts_lock_);
+  int64 num_bytes = sizeof(UserCounts);
+  for (const auto& context : contexts_) {
+    num_bytes += sizeof(context) + kHashEntryOverheadBytes +
+                 context.first.capacity() +
+                 context.second.counts.capacity() *
+                     (sizeof(std::pair<int, int64>) +
+                      kHashEntryOverheadBytes);
+  }
+  return num_bytes;
+}
+
+UserAdaptation::UserAdaptation(const UserAdaptationConfig& config)
+    : config_(config) {
+  if (config_.order() <= 0) config_.set_order(kDefaultOrder);
+  if (config_.prior_weight() <= 0.0) {
+    config_.set_prior_weight(kDefaultPriorWeight);
+  }
+  if (config_.max_users() <= 0) config_.set_max_users(kDefaultMaxUsers);
+  if (config_.max_contexts_per_user() <= 0) {
+    config_.set_max_contexts_per_user(kDefaultMaxContextsPerUser);
+  }
+  max_users_ = config_.max_users();
+}
+
+std::shared_ptr<UserCounts> UserAdaptation::GetUser(const std::string& user,
+                                                    bool create) {
+  absl::MutexLock lock(&users_lock_);
+  auto pos = users_.find(user);
+  if (pos != users_.end()) {
+    lru_users_.splice(lru_users_.begin(), lru_users_, pos->second.second);
+    return pos->second.first;
+  }
+  if (!create) return nullptr;
+  if (users_.size() >= max_users_) {
+    users_.erase(lru_users_.back());
+    lru_users_.pop_back();
+  }
+  lru_users_.push_front(user);
+  auto counts = std::make_shared<UserCounts>(config_.order(),
+                                             config_.max_contexts_per_user());
+  users_.emplace(user, std::make_pair(counts, lru_users_.begin()));
+  return counts;
+}
+
+int UserAdaptation::num_users() const {
+  absl::MutexLock lock(&users_lock_);
+  return users_.size();
+}
+
+int64 UserAdaptation::MemoryBytes() const {
+  std::vector<std::shared_ptr<UserCounts>> users;
+  int64 num_bytes = 0;
+  {
+    absl::MutexLock lock(&users_lock_);
+    users.reserve(users_.size());
+    for (const auto& user : users_) {
+      users.push_back(user.second.first);
+      // The user name is both in the list and in the map.
+      num_bytes += 2 * (sizeof(std::string) + user.first.capacity()) +
+                   sizeof(user) + kHashEntryOverheadBytes;
+    }
+  }
+  // The counts are measured without blocking the lookups of the users.
+  for (const auto& counts : users) num_bytes += counts->MemoryBytes();
+  return num_bytes;
+}
+
+void UserAdaptation::SetMemoryLimit(int64 max_bytes) {
+  const int64 num_bytes = MemoryBytes();
+  absl::MutexLock lock(&users_lock_);
+  int64 max_users = config_.max_users();
+  if (max_bytes >= 0 && !users_.empty()) {
+    const int64 user_bytes = std::max<int64>(num_bytes / users_.size(), 1);
+    max_users = std::min(max_users, max_bytes / user_bytes);
+  }
+  max_users_ = std::max<int64>(max_users, 1);
+  while (users_.size() > max_users_) {
+    users_.erase(lru_users_.back());
+    lru_users_.pop_back();
+  }
+}
+
+}  // namespace models
+}  // namespace mozolm
@@ -0,0 +1,141 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Per-user adaptation of the shared models.
+//
+// The counts updated on behalf of a user are kept in a small table of the
+// user, keyed by the preceding characters, rather than in the shared models,
+// which are left unchanged. When scoring for the user, the probabilities
+// returned by the shared models serve as the prior of the user counts:
+//
+//   P_user(c | h) = (n(h, c) + w P(c | h)) / (n(h) + w)
+//
+// where n(h, c) is the count of the user for the symbol c following the last
+// characters h of the context, n(h) the total count following h, and w the
+// prior weight. Once the users are many, the least recently used are
+// evicted.
+
+#ifndef MOZOLM_MOZOLM_MODELS_USER_ADAPTATION_H_
+#define MOZOLM_MOZOLM_MODELS_USER_ADAPTATION_H_
+
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mozolm/stubs/integral_types.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "mozolm/models/lm_scores.pb.h"
+#include "mozolm/models/model_config.pb.h"
+
+namespace mozolm {
+namespace models {
+
+// Counts of the symbols typed by one of the users, keyed by the preceding
+// characters. Thread-safe.
+class UserCounts {
+ public:
+  // Keys the counts by the last order - 1 characters of the context, keeping
+  // the counts following at most max_contexts distinct contexts.
+  UserCounts(int order, int max_contexts);
+  ~UserCounts() = default;
+
+  // Adds the count to each of the symbols, given as codepoints, the first
+  // one following the UTF-8 context and each of the others following the
+  // context extended with the previous symbols.
+  void Update(absl::string_view context, const std::vector<int>& utf8_syms,
+              int64 count) ABSL_LOCKS_EXCLUDED(counts_lock_);
+
+  // Combines the counts following the UTF-8 context with the scores, in full
+  // format, of the shared models. The symbols which are not in the scores are
+  // ignored.
+  void Adapt(absl::string_view context, double prior_weight,
+             LMScores* scores) const ABSL_LOCKS_EXCLUDED(counts_lock_);
+
+  // Number of distinct contexts followed by some counts.
+  int num_contexts() const ABSL_LOCKS_EXCLUDED(counts_lock_);
+
+  // Approximate number of bytes held by the counts.
+  int64 MemoryBytes() const ABSL_LOCKS_EXCLUDED(counts_lock_);
+
+ private:
+  // Counts of the symbols following one of the contexts.
+  struct ContextCounts {
+    absl::flat_hash_map<int, int64> counts;
+    int64 total = 0;
+  };
+
+  // Returns the key of the counts following the UTF-8 context.
+  std::string ContextKey(absl::string_view context) const;
+
+  const int max_context_chars_;
+  const int max_contexts_;
+
+  mutable absl::Mutex counts_lock_;
+  absl::flat_hash_map<std::string, ContextCounts> contexts_
+      ABSL_GUARDED_BY(counts_lock_);
+};
+
+// Counts of all the users, evicting the least recently used users. The
+// configuration defaults are filled in for the unset fields. Thread-safe.
+class UserAdaptation {
+ public:
+  explicit UserAdaptation(const UserAdaptationConfig& config);
+  ~UserAdaptation() = default;
+
+  // Returns the counts of the user, marking the user as recently used. If
+  // the user has no counts, returns null unless create is set, in which case
+  // empty counts are created, possibly evicting the least recently used
+  // user. The returned counts remain valid after an eviction.
+  std::shared_ptr<UserCounts> GetUser(const std::string& user, bool create)
+      ABSL_LOCKS_EXCLUDED(users_lock_);
+
+  // Number of characters of history, plus one, keying the user counts.
+  int order() const { return config_.order(); }
+
+  // Weight of the shared models in the adapted probabilities.
+  double prior_weight() const { return config_.prior_weight(); }
+
+  // Number of users with counts.
+  int num_users() const ABSL_LOCKS_EXCLUDED(users_lock_);
+
+  // Approximate number of bytes held by the counts of all the users.
+  int64 MemoryBytes() const ABSL_LOCKS_EXCLUDED(users_lock_);
+
+  // Lowers the maximum number of users to fit about max_bytes, given the
+  // memory held by the users so far, evicting the least recently used users
+  // over the limit. Restores the configured maximum if max_bytes is negative.
+  // At least one user is kept.
+  void SetMemoryLimit(int64 max_bytes) ABSL_LOCKS_EXCLUDED(users_lock_);
+
+ private:
+  UserAdaptationConfig config_;
+
+  mutable absl::Mutex users_lock_;
+  // Maximum number of users, at most the configured one.
+  int max_users_ ABSL_GUARDED_BY(users_lock_);
+  // Users, the most recently used first.
+  std::list<std::string> lru_users_ ABSL_GUARDED_BY(users_lock_);
+  absl::flat_hash_map<std::string, std::pair<std::shared_ptr<UserCounts>,
+                                             std::list<std::string>::iterator>>
+      users_ ABSL_GUARDED_BY(users_lock_);
+};
+
+}  // namespace models
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_MODELS_USER_ADAPTATION_H_
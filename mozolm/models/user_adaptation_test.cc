@@ -0,0 +1,99 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/models/user_adaptation.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "mozolm/models/lm_scores.pb.h"
+#include "mozolm/models/model_config.pb.h"
+
+namespace mozolm {
+namespace models {
+namespace {
+
+constexpr double kFloatDelta = 1E-6;
+
+// Returns uniform scores over the end-of-string and the letters "abc".
+LMScores UniformScores() {
+  LMScores scores;
+  for (const char* symbol : {"", "a", "b", "c"}) {
+    scores.add_symbols(symbol);
+    scores.add_probabilities(0.25);
+  }
+  return scores;
+}
+
+TEST(UserCountsTest, CheckAdaptedProbabilities) {
+  UserCounts counts(/* order= */2, /* max_contexts= */10);
+  // Counts "ab" twice, then "a" followed by the end-of-string.
+  counts.Update("x", {'a', 'b'}, 2);
+  counts.Update("xa", {0}, 1);
+  EXPECT_EQ(2, counts.num_contexts());
+
+  // The contexts are keyed by their last character: after "a", b was seen
+  // twice and the end-of-string once.
+  LMScores scores = UniformScores();
+  counts.Adapt("za", /* prior_weight= */1.0, &scores);
+  EXPECT_NEAR((1 + 0.25) / 4.0, scores.probabilities(0), kFloatDelta);
+  EXPECT_NEAR(0.25 / 4.0, scores.probabilities(1), kFloatDelta);
+  EXPECT_NEAR((2 + 0.25) / 4.0, scores.probabilities(2), kFloatDelta);
+  EXPECT_NEAR(0.25 / 4.0, scores.probabilities(3), kFloatDelta);
+
+  // The scores are unchanged in the contexts without counts.
+  scores = UniformScores();
+  counts.Adapt("b", /* prior_weight= */1.0, &scores);
+  for (int i = 0; i < scores.probabilities_size(); ++i) {
+    EXPECT_NEAR(0.25, scores.probabilities(i), kFloatDelta);
+  }
+}
+
+TEST(UserCountsTest, CheckMaxContexts) {
+  UserCounts counts(/* order= */3, /* max_contexts= */2);
+  counts.Update("", {'a', 'b', 'c', 'a'}, 1);
+  EXPECT_EQ(2, counts.num_contexts());
+  // The counts in the contexts seen first are kept.
+  LMScores scores = UniformScores();
+  counts.Adapt("a", /* prior_weight= */1.0, &scores);
+  EXPECT_NEAR((1 + 0.25) / 2.0, scores.probabilities(2), kFloatDelta);
+  scores = UniformScores();
+  counts.Adapt("bc", /* prior_weight= */1.0, &scores);
+  EXPECT_NEAR(0.25, scores.probabilities(1), kFloatDelta);
+}
+
+TEST(UserAdaptationTest, CheckEvictsLeastRecentlyUsed) {
+  UserAdaptationConfig config;
+  config.set_max_users(2);
+  UserAdaptation adaptation(config);
+  EXPECT_EQ(3, adaptation.order());
+  EXPECT_EQ(nullptr, adaptation.GetUser("alice", /* create= */false));
+  const std::shared_ptr<UserCounts> alice =
+      adaptation.GetUser("alice", /* create= */true);
+  ASSERT_NE(nullptr, alice);
+  ASSERT_NE(nullptr, adaptation.GetUser("bob", /* create= */true));
+  EXPECT_EQ(alice, adaptation.GetUser("alice", /* create= */false));
+
+  // Bob is now the least recently used user.
+  ASSERT_NE(nullptr, adaptation.GetUser("carol", /* create= */true));
+  EXPECT_EQ(2, adaptation.num_users());
+  EXPECT_EQ(nullptr, adaptation.GetUser("bob", /* create= */false));
+  EXPECT_EQ(alice, adaptation.GetUser("alice", /* create= */false));
+}
+
+}  // namespace
+}  // namespace models
+}  // namespace mozolm
@@ -12,20 +12,30 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-// Portable thread pool implementation.
+// Portable work-stealing thread pool.
 //
-// This is taken from the absl synchronization internals and may not be the most
-// optimal implementation. The reference implementation can be found here:
-//   https://github.com/abseil/abseil-cpp/blob/master/absl/synchronization/internal/thread_pool.h
+// Each worker has its own queue of functions, so that the workers and the
+// callers scheduling the functions do not all contend on a single lock. The
+// functions scheduled by the workers themselves go to their own queue, the
+// others are spread over the queues in turn. The workers run the functions of
+// their own queue in order, and once it is empty steal the oldest functions
+// of the other queues. With a single worker, the functions hence run in the
+// order they were scheduled.
 
 #ifndef MOZOLM_MOZOLM_STUBS_THREAD_POOL_H_
 #define MOZOLM_MOZOLM_STUBS_THREAD_POOL_H_
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstddef>
+#include <deque>
 #include <functional>
-#include <queue>
+#include <future>
+#include <memory>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include "absl/base/thread_annotations.h"
@@ -33,10 +43,45 @@
 
 namespace mozolm {
 
-// A simple thread pool implementation for tests.
 class ThreadPool {
  public:
-  explicit ThreadPool(int num_threads) : num_threads_(num_threads) {
+  // Handle of a batch of scheduled functions, to wait for their completion.
+  class Completion {
+   public:
+    // Blocks until all the functions of the batch have run. Not to be called
+    // from the functions running on the pool, which may be waiting to run.
+    void Wait() const {
+      absl::MutexLock l(&state_->mu);
+      state_->mu.Await(absl::Condition(state_.get(), &State::Done));
+    }
+
+    // Returns whether all the functions of the batch have run.
+    bool done() const {
+      absl::MutexLock l(&state_->mu);
+      return state_->Done();
+    }
+
+   private:
+    friend class ThreadPool;
+
+    struct State {
+      explicit State(int num_pending) : num_pending(num_pending) {}
+      bool Done() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu) {
+        return num_pending == 0;
+      }
+
+      mutable absl::Mutex mu;
+      int num_pending ABSL_GUARDED_BY(mu);
+    };
+
+    explicit Completion(std::shared_ptr<State> state)
+        : state_(std::move(state)) {}
+
+    std::shared_ptr<State> state_;
+  };
+
+  explicit ThreadPool(int num_threads)
+      : num_threads_(num_threads), queues_(std::max(num_threads, 1)) {
     threads_.reserve(num_threads);
   }
 
@@ -45,16 +90,17 @@ class ThreadPool {
 
   void StartWorkers() {
     for (int i = 0; i < num_threads_; ++i) {
-      threads_.push_back(std::thread(&ThreadPool::WorkLoop, this));
+      threads_.push_back(std::thread(&ThreadPool::WorkLoop, this, i));
     }
   }
 
+  // Runs all the scheduled functions, including the ones they schedule, and
+  // then stops the workers.
   ~ThreadPool() {
     {
-      absl::MutexLock l(&mu_);
-      for (size_t i = 0; i < threads_.size(); i++) {
-        queue_.push(nullptr);  // Shutdown signal.
-      }
+      absl::MutexLock l(&sleep_mu_);
+      stopping_ = true;
+      wake_up_.SignalAll();
     }
     for (auto &t : threads_) {
       t.join();
@@ -64,35 +110,211 @@ class ThreadPool {
   // Schedules a function to be run on a ThreadPool thread immediately.
   void Schedule(std::function<void()> func) {
     assert(func != nullptr);
-    absl::MutexLock l(&mu_);
-    queue_.push(std::move(func));
+    // Counted before the function is queued, since a worker may take the
+    // function and uncount it as soon as it is queued.
+    num_pending_.fetch_add(1);
+    {
+      WorkQueue &queue = queues_[NextQueue()];
+      absl::MutexLock l(&queue.mu);
+      queue.funcs.push_back(std::move(func));
+    }
+    WakeUp(1);
+  }
+
+  // Schedules the functions at once, spreading them over the queues of the
+  // workers, and returns the handle of their completion.
+  Completion ScheduleBatch(std::vector<std::function<void()>> funcs) {
+    const int num_funcs = funcs.size();
+    auto state = std::make_shared<Completion::State>(num_funcs);
+    if (num_funcs == 0) return Completion(std::move(state));
+    num_pending_.fetch_add(num_funcs);  // Before queuing, as above.
+    const int num_queues = std::min<int>(queues_.size(), num_funcs);
+    const int first_queue = NextQueue();
+    for (int i = 0; i < num_queues; ++i) {
+      WorkQueue &queue = queues_[(first_queue + i) % queues_.size()];
+      absl::MutexLock l(&queue.mu);
+      for (int j = num_funcs * i / num_queues;
+           j < num_funcs * (i + 1) / num_queues; ++j) {
+        assert(funcs[j] != nullptr);
+        queue.funcs.push_back([state, func = std::move(funcs[j])]() {
+          func();
+          absl::MutexLock lock(&state->mu);
+          --state->num_pending;
+        });
+      }
+    }
+    WakeUp(num_funcs);
+    return Completion(std::move(state));
+  }
+
+  // Schedules the function, returning the future of its result.
+  template <class Func>
+  std::future<typename std::invoke_result<Func>::type> Submit(Func func) {
+    using Result = typename std::invoke_result<Func>::type;
+    auto task = std::make_shared<std::packaged_task<Result()>>(std::move(func));
+    std::future<Result> result = task->get_future();
+    Schedule([task]() { (*task)(); });
+    return result;
   }
 
+  // Runs body(i) for each i in [begin, end) on the workers and the calling
+  // thread, returning once all of them have run. The calling thread takes
+  // part, so that the loop completes even if all the workers are busy, and it
+  // may be called from the functions running on the pool.
+  void ParallelFor(int begin, int end, const std::function<void(int)> &body) {
+    if (begin >= end) return;
+    const int num_helpers = std::min(end - begin - 1, num_threads_);
+    if (num_helpers <= 0) {
+      for (int i = begin; i < end; ++i) body(i);
+      return;
+    }
+    // Blocks of several indices amortize the claims, while leaving enough
+    // blocks for balancing the load over the threads.
+    const int block_size =
+        std::max(1, (end - begin) / (kBlocksPerThread * (num_helpers + 1)));
+    auto loop = std::make_shared<LoopState>(begin, end, block_size, &body);
+    for (int i = 0; i < num_helpers; ++i) {
+      Schedule([loop]() { loop->Run(); });
+    }
+    loop->Run();
+    loop->Wait();
+  }
+
+  // Returns the number of worker threads.
+  int num_threads() const { return num_threads_; }
+
  private:
-  bool WorkAvailable() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
-    return !queue_.empty();
+  // Number of blocks of the parallel loops for each of their threads.
+  static constexpr int kBlocksPerThread = 4;
+
+  // Queue of the functions scheduled on one of the workers.
+  struct WorkQueue {
+    absl::Mutex mu;
+    std::deque<std::function<void()>> funcs ABSL_GUARDED_BY(mu);
+  };
+
+  // Shared state of a parallel loop, whose threads claim the next block of
+  // indices until none is left.
+  class LoopState {
+   public:
+    LoopState(int begin, int end, int block_size,
+              const std::function<void(int)> *body)
+        : end_(end), block_size_(block_size), body_(body), next_(begin),
+          num_left_(end - begin) {}
+
+    void Run() {
+      int block_begin;
+      while ((block_begin = next_.fetch_add(block_size_)) < end_) {
+        const int block_end = std::min(block_begin + block_size_, end_);
+        for (int i = block_begin; i < block_end; ++i) (*body_)(i);
+        absl::MutexLock l(&mu_);
+        num_left_ -= block_end - block_begin;
+      }
+    }
+
+    void Wait() {
+      absl::MutexLock l(&mu_);
+      mu_.Await(absl::Condition(this, &LoopState::Done));
+    }
+
+   private:
+    bool Done() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+      return num_left_ == 0;
+    }
+
+    const int end_;
+    const int block_size_;
+    // Only invoked while the loop is not done, hence remains valid.
+    const std::function<void(int)> *const body_;
+    std::atomic<int> next_;
+    absl::Mutex mu_;
+    int num_left_ ABSL_GUARDED_BY(mu_);
+  };
+
+  // Pool and index of the worker running on the current thread, if any.
+  struct CurrentWorker {
+    const ThreadPool *pool = nullptr;
+    int index = -1;
+  };
+  static CurrentWorker &current_worker() {
+    static thread_local CurrentWorker worker;
+    return worker;
+  }
+
+  // Returns the queue of the next scheduled function: the queue of the
+  // current worker, if any, otherwise the queues in turn.
+  int NextQueue() {
+    const CurrentWorker &worker = current_worker();
+    if (worker.pool == this) return worker.index;
+    return next_queue_.fetch_add(1, std::memory_order_relaxed) %
+           queues_.size();
+  }
+
+  // Wakes up workers for the newly scheduled functions, if any is sleeping.
+  // The sleeping count is read after the pending count is updated, and the
+  // workers update them in the reverse order, so that either the workers see
+  // the new functions or they are signaled.
+  void WakeUp(int num_funcs) {
+    if (num_sleeping_.load() == 0) return;
+    absl::MutexLock l(&sleep_mu_);
+    if (num_funcs == 1) {
+      wake_up_.Signal();
+    } else {
+      wake_up_.SignalAll();
+    }
   }
 
-  void WorkLoop() {
+  // Takes the next function from the own queue of the worker, or steals it
+  // from the other queues. Returns false if all of them are empty.
+  bool TakeWork(int index, std::function<void()> *func) {
+    for (size_t i = 0; i < queues_.size(); ++i) {
+      WorkQueue &queue = queues_[(index + i) % queues_.size()];
+      absl::MutexLock l(&queue.mu);
+      if (!queue.funcs.empty()) {
+        *func = std::move(queue.funcs.front());
+        queue.funcs.pop_front();
+        num_pending_.fetch_sub(1);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool WorkOrStopping() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(sleep_mu_) {
+    return num_pending_.load() > 0 || stopping_;
+  }
+
+  void WorkLoop(int index) {
+    current_worker() = {this, index};
     while (true) {
       std::function<void()> func;
-      {
-        absl::MutexLock l(&mu_);
-        mu_.Await(absl::Condition(this, &ThreadPool::WorkAvailable));
-        func = std::move(queue_.front());
-        queue_.pop();
-      }
-      if (func == nullptr) {  // Shutdown signal.
-        break;
+      if (TakeWork(index, &func)) {
+        func();
+        continue;
       }
-      func();
+      absl::MutexLock l(&sleep_mu_);
+      num_sleeping_.fetch_add(1);
+      while (!WorkOrStopping()) wake_up_.Wait(&sleep_mu_);
+      num_sleeping_.fetch_sub(1);
+      // The functions scheduled by the other running functions are run
+      // before stopping.
+      if (stopping_ && num_pending_.load() == 0) break;
     }
   }
 
   const int num_threads_;
-  absl::Mutex mu_;
-  std::queue<std::function<void()>> queue_ ABSL_GUARDED_BY(mu_);
+  std::vector<WorkQueue> queues_;
   std::vector<std::thread> threads_;
+  std::atomic<int> next_queue_{0};
+
+  // Number of functions in the queues, counted before they are queued and
+  // uncounted once taken, hence never negative, and of the workers sleeping
+  // until there are some.
+  std::atomic<int> num_pending_{0};
+  std::atomic<int> num_sleeping_{0};
+  absl::Mutex sleep_mu_;
+  absl::CondVar wake_up_;
+  bool stopping_ ABSL_GUARDED_BY(sleep_mu_) = false;
 };
 
 }  // namespace mozolm
@@ -14,9 +14,13 @@
 
 #include "mozolm/stubs/thread_pool.h"
 
+#include <atomic>
 #include <chrono>
+#include <functional>
+#include <future>
 #include <memory>
 #include <thread>
+#include <vector>
 
 #include "absl/base/thread_annotations.h"
 #include "absl/synchronization/mutex.h"
@@ -81,5 +85,73 @@ TEST(ThreadPoolTest, CheckFIFO) {
   }
 }
 
+TEST(ThreadPoolTest, CheckNestedSchedule) {
+  std::unique_ptr<ThreadPool> thread_pool(new ThreadPool(4));
+  thread_pool->StartWorkers();
+  SecureInteger count(0);
+  ThreadPool *pool = thread_pool.get();
+  for (int i = 0; i < kNumIterations; ++i) {
+    pool->Schedule([pool, &count]() {
+      // Scheduled on the queue of the worker, and run before the pool stops.
+      pool->Schedule([&count]() { count.Increment(); });
+    });
+  }
+  thread_pool.reset(nullptr);
+  EXPECT_EQ(count.value(), kNumIterations);
+}
+
+TEST(ThreadPoolTest, CheckScheduleBatch) {
+  ThreadPool pool(8);
+  pool.StartWorkers();
+  std::atomic<int> count(0);
+  std::vector<std::function<void()>> funcs;
+  for (int i = 0; i < kNumIterations; ++i) {
+    funcs.push_back([&count]() { ++count; });
+  }
+  const ThreadPool::Completion completion = pool.ScheduleBatch(funcs);
+  completion.Wait();
+  EXPECT_TRUE(completion.done());
+  EXPECT_EQ(count.load(), kNumIterations);
+
+  // Empty batches are done at once.
+  EXPECT_TRUE(pool.ScheduleBatch({}).done());
+}
+
+TEST(ThreadPoolTest, CheckSubmit) {
+  ThreadPool pool(4);
+  pool.StartWorkers();
+  std::vector<std::future<int>> results;
+  for (int i = 0; i < kNumIterations; ++i) {
+    results.push_back(pool.Submit([i]() { return i * i; }));
+  }
+  for (int i = 0; i < kNumIterations; ++i) {
+    EXPECT_EQ(results[i].get(), i * i);
+  }
+}
+
+TEST(ThreadPoolTest, CheckParallelFor) {
+  ThreadPool pool(8);
+  pool.StartWorkers();
+  std::vector<int> counts(kNumIterations, 0);
+  pool.ParallelFor(0, kNumIterations, [&counts](int i) { ++counts[i]; });
+  for (int i = 0; i < kNumIterations; ++i) EXPECT_EQ(counts[i], 1) << i;
+
+  // Nested loops, run by the workers, complete even though all the workers
+  // may be busy with the outer loop.
+  std::atomic<int> count(0);
+  pool.ParallelFor(0, 64, [&pool, &count](int /* i */) {
+    pool.ParallelFor(0, 100, [&count](int /* j */) { ++count; });
+  });
+  EXPECT_EQ(count.load(), 6400);
+
+  // Empty ranges, and pools without workers, which run the loop on the
+  // calling thread.
+  pool.ParallelFor(5, 5, [](int /* i */) { FAIL(); });
+  ThreadPool empty_pool(0);
+  int sum = 0;
+  empty_pool.ParallelFor(0, 10, [&sum](int i) { sum += i; });
+  EXPECT_EQ(sum, 45);
+}
+
 }  // namespace
 }  // namespace mozolm
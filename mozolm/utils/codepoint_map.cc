@@ -0,0 +1,51 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/utils/codepoint_map.h"
+
+#include "mozolm/utils/utf8_util.h"
+
+namespace mozolm {
+namespace utf8 {
+
+void CodepointMap::Clear() {
+  dense_labels_.clear();
+  sparse_labels_.clear();
+}
+
+void CodepointMap::Add(char32 codepoint, int label) {
+  if (codepoint < 0) return;
+  if (codepoint < kNumDenseCodepoints) {
+    if (codepoint >= dense_labels_.size()) {
+      dense_labels_.resize(codepoint + 1, kNoLabel);
+    }
+    dense_labels_[codepoint] = label;
+  } else {
+    sparse_labels_[codepoint] = label;
+  }
+}
+
+bool CodepointMap::AddSymbol(const std::string &symbol, int label) {
+  if (symbol.empty()) return false;
+  char32 codepoint;
+  if (DecodeUnicodeChar(symbol, &codepoint) != symbol.size()) return false;
+
+  // Round trip rules out the invalid encodings, which decode as kBadUTF8Char.
+  if (EncodeUnicodeChar(codepoint) != symbol) return false;
+  Add(codepoint, label);
+  return true;
+}
+
+}  // namespace utf8
+}  // namespace mozolm
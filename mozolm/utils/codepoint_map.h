@@ -0,0 +1,71 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Lookup of symbol labels by Unicode codepoint.
+
+#ifndef MOZOLM_MOZOLM_UTILS_CODEPOINT_MAP_H_
+#define MOZOLM_MOZOLM_UTILS_CODEPOINT_MAP_H_
+
+#include <string>
+#include <vector>
+
+#include "mozolm/stubs/integral_types.h"
+#include "absl/container/flat_hash_map.h"
+
+namespace mozolm {
+namespace utf8 {
+
+// Maps Unicode codepoints to the labels of single-codepoint symbols, avoiding
+// the encoding of the codepoints and the string lookups in the symbol table.
+// The codepoints in the Basic Multilingual Plane are stored in a dense array,
+// sized by the largest such codepoint, the remaining ones in a hash map.
+class CodepointMap {
+ public:
+  // Label returned for the codepoints not in the map.
+  static constexpr int kNoLabel = -1;
+
+  // Number of codepoints in the Basic Multilingual Plane.
+  static constexpr char32 kNumDenseCodepoints = 0x10000;
+
+  CodepointMap() = default;
+
+  // Removes all the codepoints.
+  void Clear();
+
+  // Adds the codepoint with the given label.
+  void Add(char32 codepoint, int label);
+
+  // Adds the symbol with the given label if it consists of a single valid
+  // codepoint. Returns false otherwise.
+  bool AddSymbol(const std::string &symbol, int label);
+
+  // Returns the label for the codepoint, or kNoLabel if not found.
+  int Find(char32 codepoint) const {
+    if (codepoint >= 0 && codepoint < dense_labels_.size()) {
+      return dense_labels_[codepoint];
+    }
+    if (codepoint < kNumDenseCodepoints) return kNoLabel;
+    const auto pos = sparse_labels_.find(codepoint);
+    return pos != sparse_labels_.end() ? pos->second : kNoLabel;
+  }
+
+ private:
+  std::vector<int> dense_labels_;  // Labels indexed by BMP codepoint.
+  absl::flat_hash_map<char32, int> sparse_labels_;  // Labels beyond the BMP.
+};
+
+}  // namespace utf8
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_UTILS_CODEPOINT_MAP_H_
@@ -0,0 +1,55 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/utils/codepoint_map.h"
+
+#include "gtest/gtest.h"
+#include "mozolm/utils/utf8_util.h"
+
+namespace mozolm {
+namespace utf8 {
+namespace {
+
+TEST(CodepointMapTest, CheckEmpty) {
+  const CodepointMap codepoint_map;
+  EXPECT_EQ(CodepointMap::kNoLabel, codepoint_map.Find(-1));
+  EXPECT_EQ(CodepointMap::kNoLabel, codepoint_map.Find(0));
+  EXPECT_EQ(CodepointMap::kNoLabel, codepoint_map.Find('a'));
+  EXPECT_EQ(CodepointMap::kNoLabel, codepoint_map.Find(0x1F600));
+}
+
+TEST(CodepointMapTest, CheckAddSymbol) {
+  CodepointMap codepoint_map;
+  EXPECT_TRUE(codepoint_map.AddSymbol("a", 1));
+  EXPECT_TRUE(codepoint_map.AddSymbol("ბ", 2));    // U+10D1.
+  EXPECT_TRUE(codepoint_map.AddSymbol("😀", 3));  // U+1F600.
+  EXPECT_FALSE(codepoint_map.AddSymbol("", 4));
+  EXPECT_FALSE(codepoint_map.AddSymbol("<epsilon>", 5));
+  EXPECT_FALSE(codepoint_map.AddSymbol("\xFF", 6));
+  EXPECT_EQ(1, codepoint_map.Find('a'));
+  EXPECT_EQ(2, codepoint_map.Find(0x10D1));
+  EXPECT_EQ(3, codepoint_map.Find(0x1F600));
+  EXPECT_EQ(CodepointMap::kNoLabel, codepoint_map.Find('b'));
+  EXPECT_EQ(CodepointMap::kNoLabel, codepoint_map.Find(0xFFFF));
+  EXPECT_EQ(CodepointMap::kNoLabel, codepoint_map.Find(0x1F601));
+  EXPECT_EQ(CodepointMap::kNoLabel, codepoint_map.Find(kBadUTF8Char));
+
+  codepoint_map.Clear();
+  EXPECT_EQ(CodepointMap::kNoLabel, codepoint_map.Find('a'));
+  EXPECT_EQ(CodepointMap::kNoLabel, codepoint_map.Find(0x1F600));
+}
+
+}  // namespace
+}  // namespace utf8
+}  // namespace mozolm
@@ -0,0 +1,129 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/utils/latency_histogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_join.h"
+
+namespace mozolm {
+namespace {
+
+// Growth of the widths of the histogram buckets.
+constexpr double kBucketGrowth = 1.05;
+
+// Number of histogram buckets: the first one for the latencies below one
+// microsecond, the last one for all the latencies above its lower bound.
+constexpr int kNumBuckets = 430;
+
+}  // namespace
+
+LatencyHistogram::LatencyHistogram()
+    : buckets_(new std::atomic<int64>[kNumBuckets]), count_(0), sum_nsec_(0) {
+  for (int i = 0; i < kNumBuckets; ++i) buckets_[i] = 0;
+}
+
+LatencyHistogram::LatencyHistogram(const LatencyHistogram& other)
+    : LatencyHistogram() {
+  Merge(other);
+}
+
+LatencyHistogram& LatencyHistogram::operator=(const LatencyHistogram& other) {
+  if (this == &other) return *this;
+  for (int i = 0; i < kNumBuckets; ++i) buckets_[i] = 0;
+  count_ = 0;
+  sum_nsec_ = 0;
+  Merge(other);
+  return *this;
+}
+
+int LatencyHistogram::Bucket(double latency_usec) {
+  if (latency_usec < 1.0) return 0;
+  const int bucket =
+      1 + static_cast<int>(std::log(latency_usec) / std::log(kBucketGrowth));
+  return std::min(bucket, kNumBuckets - 1);
+}
+
+double LatencyHistogram::BucketStart(int bucket) {
+  return bucket == 0 ? 0.0 : std::pow(kBucketGrowth, bucket - 1);
+}
+
+void LatencyHistogram::Add(absl::Duration latency) {
+  const double latency_usec = absl::ToDoubleMicroseconds(latency);
+  buckets_[Bucket(latency_usec)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_nsec_.fetch_add(absl::ToInt64Nanoseconds(latency),
+                      std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other) {
+  for (int i = 0; i < kNumBuckets; ++i) {
+    buckets_[i].fetch_add(other.buckets_[i].load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+  }
+  count_.fetch_add(other.count(), std::memory_order_relaxed);
+  sum_nsec_.fetch_add(other.sum_nsec_.load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+}
+
+absl::Duration LatencyHistogram::Mean() const {
+  const int64 count = this->count();
+  if (count == 0) return absl::ZeroDuration();
+  return absl::Nanoseconds(
+      static_cast<double>(sum_nsec_.load(std::memory_order_relaxed)) / count);
+}
+
+absl::Duration LatencyHistogram::Percentile(double fraction) const {
+  // Snapshots the buckets first so that the rank is consistent with them
+  // while the latencies keep being recorded.
+  std::vector<int64> buckets(kNumBuckets);
+  int64 count = 0;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    count += buckets[i];
+  }
+  if (count == 0) return absl::ZeroDuration();
+  const double rank = std::min(std::max(fraction, 0.0), 1.0) * count;
+  double cumulative = 0.0;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    if (buckets[i] == 0) continue;
+    if (cumulative + buckets[i] >= rank) {
+      // Interpolates linearly within the bucket.
+      const double start = BucketStart(i);
+      const double width = BucketStart(i + 1) - start;
+      return absl::Microseconds(start +
+                                width * (rank - cumulative) / buckets[i]);
+    }
+    cumulative += buckets[i];
+  }
+  return absl::Microseconds(BucketStart(kNumBuckets));
+}
+
+std::string LatencyHistogram::ToString() const {
+  std::vector<std::string> lines;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    const int64 bucket_count = buckets_[i].load(std::memory_order_relaxed);
+    if (bucket_count == 0) continue;
+    lines.push_back(absl::StrFormat("< %10.3fms: %d",
+                                    BucketStart(i + 1) / 1000.0,
+                                    bucket_count));
+  }
+  return absl::StrJoin(lines, "\n");
+}
+
+}  // namespace mozolm
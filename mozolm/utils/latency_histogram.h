@@ -0,0 +1,89 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Histogram of latencies, shared by the server metrics and the load generator.
+
+#ifndef MOZOLM_MOZOLM_UTILS_LATENCY_HISTOGRAM_H_
+#define MOZOLM_MOZOLM_UTILS_LATENCY_HISTOGRAM_H_
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "mozolm/stubs/integral_types.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+namespace mozolm {
+
+// Histogram of latencies with exponentially growing buckets, each about 5%
+// wider than the previous one, from one microsecond up to about a quarter of
+// an hour. Recording is thread-safe and lock-free; the readers see a possibly
+// slightly stale but consistent enough view of the concurrent recordings.
+class LatencyHistogram {
+ public:
+  LatencyHistogram();
+  LatencyHistogram(const LatencyHistogram& other);
+  LatencyHistogram& operator=(const LatencyHistogram& other);
+
+  // Records a latency.
+  void Add(absl::Duration latency);
+
+  // Adds the latencies recorded by the other histogram.
+  void Merge(const LatencyHistogram& other);
+
+  // Number of recorded latencies.
+  int64 count() const { return count_.load(std::memory_order_relaxed); }
+
+  // Mean of the recorded latencies, zero if none.
+  absl::Duration Mean() const;
+
+  // Returns the latency below which the given fraction of the recorded
+  // latencies falls, interpolated within the bucket, zero if none.
+  absl::Duration Percentile(double fraction) const;
+
+  // Returns the non-empty buckets, one per line, with their upper bounds and
+  // counts.
+  std::string ToString() const;
+
+ private:
+  // Returns the bucket of the latency given in microseconds.
+  static int Bucket(double latency_usec);
+
+  // Returns the lower bound of the bucket in microseconds.
+  static double BucketStart(int bucket);
+
+  std::unique_ptr<std::atomic<int64>[]> buckets_;
+  std::atomic<int64> count_;
+  std::atomic<int64> sum_nsec_;
+};
+
+// Records the time spent in its scope into the histogram.
+class ScopedLatencyTimer {
+ public:
+  explicit ScopedLatencyTimer(LatencyHistogram* histogram)
+      : histogram_(histogram), start_(absl::Now()) {}
+  ~ScopedLatencyTimer() { histogram_->Add(absl::Now() - start_); }
+
+  ScopedLatencyTimer(const ScopedLatencyTimer&) = delete;
+  ScopedLatencyTimer& operator=(const ScopedLatencyTimer&) = delete;
+
+ private:
+  LatencyHistogram* const histogram_;
+  const absl::Time start_;
+};
+
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_UTILS_LATENCY_HISTOGRAM_H_
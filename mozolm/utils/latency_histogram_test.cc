@@ -0,0 +1,69 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/utils/latency_histogram.h"
+
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "absl/time/time.h"
+
+namespace mozolm {
+namespace {
+
+TEST(LatencyHistogramTest, CheckPercentiles) {
+  LatencyHistogram histogram;
+  EXPECT_EQ(absl::ZeroDuration(), histogram.Percentile(0.5));
+  for (int i = 1; i <= 1000; ++i) histogram.Add(absl::Microseconds(i * 10));
+  EXPECT_EQ(1000, histogram.count());
+  EXPECT_NEAR(5005.0, absl::ToDoubleMicroseconds(histogram.Mean()), 1e-6);
+  // Percentiles are within the 5% resolution of the buckets.
+  EXPECT_NEAR(5000.0, absl::ToDoubleMicroseconds(histogram.Percentile(0.5)),
+              250.0);
+  EXPECT_NEAR(9900.0, absl::ToDoubleMicroseconds(histogram.Percentile(0.99)),
+              500.0);
+
+  LatencyHistogram other;
+  other.Add(absl::Seconds(1));
+  histogram.Merge(other);
+  EXPECT_EQ(1001, histogram.count());
+  EXPECT_NEAR(1.0, absl::ToDoubleSeconds(histogram.Percentile(1.0)), 0.05);
+}
+
+TEST(LatencyHistogramTest, CheckConcurrentRecording) {
+  constexpr int kNumThreads = 4;
+  constexpr int kNumLatencies = 10000;
+  LatencyHistogram histogram;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&histogram] {
+      for (int j = 0; j < kNumLatencies; ++j) {
+        histogram.Add(absl::Microseconds(100));
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  EXPECT_EQ(kNumThreads * kNumLatencies, histogram.count());
+  EXPECT_NEAR(100.0, absl::ToDoubleMicroseconds(histogram.Mean()), 1e-6);
+
+  // Copies are independent of the original.
+  LatencyHistogram copy = histogram;
+  histogram.Add(absl::Seconds(1));
+  EXPECT_EQ(kNumThreads * kNumLatencies, copy.count());
+  EXPECT_EQ(kNumThreads * kNumLatencies + 1, histogram.count());
+}
+
+}  // namespace
+}  // namespace mozolm
@@ -0,0 +1,288 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/utils/tracing.h"
+
+#include <algorithm>
+
+#include "absl/random/random.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+
+namespace mozolm {
+namespace {
+
+// Lengths of the fields of the traceparent header: version, trace id, parent
+// span id and flags, separated by dashes.
+constexpr int kVersionLength = 2;
+constexpr int kTraceIdLength = 32;
+constexpr int kSpanIdLength = 16;
+constexpr int kFlagsLength = 2;
+constexpr int kTraceParentLength =
+    kVersionLength + kTraceIdLength + kSpanIdLength + kFlagsLength + 3;
+
+// Flag of the sampled traces.
+constexpr uint32 kSampledFlag = 0x01;
+
+// Trace active on the current thread, null if none, and its innermost open
+// span.
+thread_local Trace* current_trace = nullptr;
+thread_local uint64 current_span_id = 0;
+
+// Bit generator of the current thread, so that the sampling decisions do not
+// contend.
+absl::BitGen& ThreadBitGen() {
+  thread_local absl::BitGen bitgen;
+  return bitgen;
+}
+
+// Returns a random non-zero identifier.
+uint64 NewId() {
+  uint64 id;
+  do {
+    id = absl::Uniform<uint64>(ThreadBitGen());
+  } while (id == 0);
+  return id;
+}
+
+// Parses the lowercase hex digits, as the header requires.
+bool ParseHex(absl::string_view digits, uint64* value) {
+  for (const char c : digits) {
+    if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) return false;
+  }
+  return absl::SimpleHexAtoi(digits, value);
+}
+
+std::string HexId(uint64 id) { return absl::StrFormat("%016x", id); }
+
+}  // namespace
+
+bool ParseTraceParent(absl::string_view value, TraceContext* context) {
+  if (value.size() != kTraceParentLength) return false;
+  const int trace_id_pos = kVersionLength + 1;
+  const int span_id_pos = trace_id_pos + kTraceIdLength + 1;
+  const int flags_pos = span_id_pos + kSpanIdLength + 1;
+  if (value[trace_id_pos - 1] != '-' || value[span_id_pos - 1] != '-' ||
+      value[flags_pos - 1] != '-') {
+    return false;
+  }
+  uint64 version, flags;
+  TraceContext parsed;
+  if (!ParseHex(value.substr(0, kVersionLength), &version) ||
+      version == 0xff ||
+      !ParseHex(value.substr(trace_id_pos, kTraceIdLength / 2),
+                &parsed.trace_id_high) ||
+      !ParseHex(value.substr(trace_id_pos + kTraceIdLength / 2,
+                             kTraceIdLength / 2),
+                &parsed.trace_id_low) ||
+      !ParseHex(value.substr(span_id_pos, kSpanIdLength),
+                &parsed.parent_span_id) ||
+      !ParseHex(value.substr(flags_pos, kFlagsLength), &flags)) {
+    return false;
+  }
+  if ((parsed.trace_id_high == 0 && parsed.trace_id_low == 0) ||
+      parsed.parent_span_id == 0) {
+    return false;
+  }
+  parsed.sampled = (flags & kSampledFlag) != 0;
+  *context = parsed;
+  return true;
+}
+
+std::string FormatTraceParent(const TraceContext& context, uint64 span_id) {
+  return absl::StrFormat("00-%016x%016x-%016x-%02x", context.trace_id_high,
+                         context.trace_id_low, span_id,
+                         context.sampled ? kSampledFlag : 0);
+}
+
+void Trace::AddSpan(SpanRecord span) {
+  absl::MutexLock lock(&lock_);
+  spans_.push_back(std::move(span));
+}
+
+std::vector<SpanRecord> Trace::TakeSpans() {
+  absl::MutexLock lock(&lock_);
+  std::vector<SpanRecord> spans;
+  spans.swap(spans_);
+  return spans;
+}
+
+std::string Trace::TraceIdString() const {
+  return absl::StrCat(HexId(context_.trace_id_high),
+                      HexId(context_.trace_id_low));
+}
+
+absl::StatusOr<std::unique_ptr<FileTraceExporter>> FileTraceExporter::Create(
+    const std::string& file_name, int max_queued_traces) {
+  std::FILE* file = std::fopen(file_name.c_str(), "a");
+  if (file == nullptr) {
+    return absl::PermissionDeniedError(
+        absl::StrCat("Cannot open trace file ", file_name));
+  }
+  return std::unique_ptr<FileTraceExporter>(
+      new FileTraceExporter(file, max_queued_traces));
+}
+
+FileTraceExporter::FileTraceExporter(std::FILE* file, int max_queued_traces)
+    : file_(file), max_queued_traces_(max_queued_traces) {
+  writer_ = std::thread(&FileTraceExporter::RunWriter, this);
+}
+
+FileTraceExporter::~FileTraceExporter() {
+  {
+    absl::MutexLock lock(&lock_);
+    stopping_ = true;
+  }
+  writer_.join();
+  std::fclose(file_);
+}
+
+void FileTraceExporter::Export(std::unique_ptr<Trace> trace) {
+  absl::MutexLock lock(&lock_);
+  if (queue_.size() >= max_queued_traces_) {
+    ++num_dropped_;
+    return;
+  }
+  queue_.push_back(std::move(trace));
+}
+
+int64 FileTraceExporter::num_dropped() const {
+  absl::MutexLock lock(&lock_);
+  return num_dropped_;
+}
+
+std::string FileTraceExporter::FormatTrace(Trace* trace) {
+  // The names of the spans and of their attributes are identifiers, which
+  // need no escaping.
+  std::string line = absl::StrCat("{\"trace_id\":\"", trace->TraceIdString(),
+                                  "\",\"spans\":[");
+  const std::vector<SpanRecord> spans = trace->TakeSpans();
+  for (int i = 0; i < spans.size(); ++i) {
+    const SpanRecord& span = spans[i];
+    absl::StrAppend(&line, i > 0 ? "," : "", "{\"name\":\"", span.name,
+                    "\",\"span_id\":\"", HexId(span.span_id),
+                    "\",\"parent_span_id\":\"", HexId(span.parent_span_id),
+                    "\",\"start_unix_usec\":", absl::ToUnixMicros(span.start),
+                    ",\"duration_usec\":",
+                    absl::ToInt64Microseconds(span.duration));
+    if (!span.attributes.empty()) {
+      line += ",\"attributes\":{";
+      for (int j = 0; j < span.attributes.size(); ++j) {
+        absl::StrAppend(&line, j > 0 ? "," : "", "\"",
+                        span.attributes[j].first,
+                        "\":", span.attributes[j].second);
+      }
+      line += "}";
+    }
+    line += "}";
+  }
+  line += "]}";
+  return line;
+}
+
+void FileTraceExporter::RunWriter() {
+  std::deque<std::unique_ptr<Trace>> traces;
+  while (true) {
+    {
+      absl::MutexLock lock(&lock_);
+      lock_.Await(
+          absl::Condition(this, &FileTraceExporter::QueuedOrStopping));
+      if (queue_.empty()) return;  // Stopping.
+      traces.swap(queue_);
+    }
+    // Formats and writes the traces outside of the lock, so that the request
+    // threads keep queueing meanwhile.
+    for (const auto& trace : traces) {
+      const std::string line = FormatTrace(trace.get());
+      std::fprintf(file_, "%s\n", line.c_str());
+    }
+    std::fflush(file_);
+    traces.clear();
+  }
+}
+
+Tracer::Tracer(double sample_rate, std::unique_ptr<TraceExporter> exporter)
+    : sample_rate_(sample_rate), exporter_(std::move(exporter)) {}
+
+std::unique_ptr<Trace> Tracer::StartTrace(absl::string_view trace_parent) {
+  TraceContext context;
+  const bool propagated =
+      !trace_parent.empty() && ParseTraceParent(trace_parent, &context);
+  if (!(propagated && context.sampled) &&
+      !(sample_rate_ > 0.0 &&
+        absl::Bernoulli(ThreadBitGen(), std::min(sample_rate_, 1.0)))) {
+    return nullptr;
+  }
+  if (!propagated) {
+    context.trace_id_high = NewId();
+    context.trace_id_low = NewId();
+    context.parent_span_id = 0;
+  }
+  context.sampled = true;
+  return std::unique_ptr<Trace>(new Trace(context));
+}
+
+ScopedSpan::ScopedSpan(const char* name) : trace_(current_trace) {
+  if (trace_ == nullptr) return;
+  record_.name = name;
+  record_.span_id = NewId();
+  record_.parent_span_id = current_span_id;
+  record_.start = absl::Now();
+  current_span_id = record_.span_id;
+}
+
+ScopedSpan::~ScopedSpan() {
+  if (trace_ == nullptr) return;
+  record_.duration = absl::Now() - record_.start;
+  current_span_id = record_.parent_span_id;
+  trace_->AddSpan(std::move(record_));
+}
+
+ScopedTraceActivation::ScopedTraceActivation(Trace* trace,
+                                             uint64 parent_span_id)
+    : previous_trace_(current_trace), previous_span_id_(current_span_id) {
+  current_trace = trace;
+  current_span_id = parent_span_id;
+}
+
+ScopedTraceActivation::~ScopedTraceActivation() {
+  current_trace = previous_trace_;
+  current_span_id = previous_span_id_;
+}
+
+Trace* ScopedTraceActivation::CurrentTrace(uint64* span_id) {
+  *span_id = current_span_id;
+  return current_trace;
+}
+
+ScopedRequestTrace::ScopedRequestTrace(Tracer* tracer,
+                                       absl::string_view trace_parent,
+                                       const char* name)
+    : tracer_(tracer) {
+  if (tracer_ == nullptr) return;
+  trace_ = tracer_->StartTrace(trace_parent);
+  if (trace_ == nullptr) return;
+  activation_.emplace(trace_.get(), trace_->context().parent_span_id);
+  span_.emplace(name);
+}
+
+ScopedRequestTrace::~ScopedRequestTrace() {
+  if (trace_ == nullptr) return;
+  span_.reset();
+  activation_.reset();
+  tracer_->EndTrace(std::move(trace_));
+}
+
+}  // namespace mozolm
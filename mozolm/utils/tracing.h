@@ -0,0 +1,249 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Sampled tracing of the individual requests, for explaining the outliers
+// which the aggregate latencies do not.
+//
+// The server starts a trace for a sample of the requests and activates it on
+// the thread handling the request. The code down the call stack, such as the
+// model hub and the models, times its steps with spans of the active trace,
+// without being passed the trace: a span of a thread without an active trace
+// only costs the read of a thread-local pointer. The trace context follows
+// the W3C Trace Context format, so that the traces of the server join those
+// of its callers.
+
+#ifndef MOZOLM_MOZOLM_UTILS_TRACING_H_
+#define MOZOLM_MOZOLM_UTILS_TRACING_H_
+
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "mozolm/stubs/integral_types.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+
+namespace mozolm {
+
+// Name of the gRPC metadata key carrying the trace context.
+constexpr char kTraceParentKey[] = "traceparent";
+
+// Trace context of a request: the identifiers of its trace and of the span of
+// the caller, and whether the caller samples the trace.
+struct TraceContext {
+  uint64 trace_id_high = 0;
+  uint64 trace_id_low = 0;
+  uint64 parent_span_id = 0;  // Zero if the trace starts here.
+  bool sampled = false;
+};
+
+// Parses the value of the traceparent header, "00-<trace id>-<span id>-<flags>"
+// in lowercase hex digits. Returns false if the value is malformed or has
+// all-zero identifiers.
+bool ParseTraceParent(absl::string_view value, TraceContext* context);
+
+// Returns the value of the traceparent header propagating the trace to the
+// callees of the given span.
+std::string FormatTraceParent(const TraceContext& context, uint64 span_id);
+
+// Finished span of a trace.
+struct SpanRecord {
+  const char* name = nullptr;  // Static string.
+  uint64 span_id = 0;
+  uint64 parent_span_id = 0;  // Zero for the root span of the request.
+  absl::Time start;
+  absl::Duration duration;
+  // Values noted by the span, e.g., the number of cache misses.
+  std::vector<std::pair<const char*, int64>> attributes;
+};
+
+// Trace of a request, collecting its spans as they finish. Thread-safe, since
+// the spans of a batch request finish on the pool threads.
+class Trace {
+ public:
+  explicit Trace(const TraceContext& context) : context_(context) {}
+
+  Trace(const Trace&) = delete;
+  Trace& operator=(const Trace&) = delete;
+
+  void AddSpan(SpanRecord span) ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Returns the spans finished so far, in the order they finished.
+  std::vector<SpanRecord> TakeSpans() ABSL_LOCKS_EXCLUDED(lock_);
+
+  const TraceContext& context() const { return context_; }
+
+  // Returns the trace id in hex digits.
+  std::string TraceIdString() const;
+
+ private:
+  const TraceContext context_;
+  absl::Mutex lock_;
+  std::vector<SpanRecord> spans_ ABSL_GUARDED_BY(lock_);
+};
+
+// Exports the finished traces. Needs to be thread-safe, and should return
+// quickly since it is called on the request threads.
+class TraceExporter {
+ public:
+  virtual ~TraceExporter() = default;
+  virtual void Export(std::unique_ptr<Trace> trace) = 0;
+};
+
+// Appends the traces to a file as JSON, one trace per line. The request
+// threads only queue the traces, which are formatted and written by a
+// dedicated thread. The traces exported while the queue is full are dropped.
+class FileTraceExporter : public TraceExporter {
+ public:
+  // Opens the file for appending and starts the writer thread, keeping at
+  // most max_queued_traces traces waiting to be written.
+  static absl::StatusOr<std::unique_ptr<FileTraceExporter>> Create(
+      const std::string& file_name, int max_queued_traces);
+
+  // Writes the queued traces before returning.
+  ~FileTraceExporter() override;
+
+  void Export(std::unique_ptr<Trace> trace) override
+      ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Number of traces dropped because of the queue limit.
+  int64 num_dropped() const ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Formats the trace as a line of JSON, without the end of line.
+  static std::string FormatTrace(Trace* trace);
+
+ private:
+  FileTraceExporter(std::FILE* file, int max_queued_traces);
+
+  // Writes the traces as they are queued, until stopped.
+  void RunWriter() ABSL_LOCKS_EXCLUDED(lock_);
+
+  bool QueuedOrStopping() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_) {
+    return stopping_ || !queue_.empty();
+  }
+
+  std::FILE* const file_;
+  const int max_queued_traces_;
+  mutable absl::Mutex lock_;
+  std::deque<std::unique_ptr<Trace>> queue_ ABSL_GUARDED_BY(lock_);
+  int64 num_dropped_ ABSL_GUARDED_BY(lock_) = 0;
+  bool stopping_ ABSL_GUARDED_BY(lock_) = false;
+  std::thread writer_;
+};
+
+// Decides which requests are traced and exports their traces. Thread-safe.
+class Tracer {
+ public:
+  // Traces the given fraction of the requests, picked at random, as well as
+  // the requests whose callers sample them.
+  Tracer(double sample_rate, std::unique_ptr<TraceExporter> exporter);
+
+  Tracer(const Tracer&) = delete;
+  Tracer& operator=(const Tracer&) = delete;
+
+  // Returns the trace of a new request, given the value of its traceparent
+  // header, empty if none, or null if the request is not traced.
+  std::unique_ptr<Trace> StartTrace(absl::string_view trace_parent);
+
+  void EndTrace(std::unique_ptr<Trace> trace) {
+    exporter_->Export(std::move(trace));
+  }
+
+ private:
+  const double sample_rate_;
+  const std::unique_ptr<TraceExporter> exporter_;
+};
+
+// Span of the trace active on the thread, if any, timing its scope. The spans
+// opened within its scope on the same thread are its children.
+class ScopedSpan {
+ public:
+  explicit ScopedSpan(const char* name);
+  ~ScopedSpan();
+
+  ScopedSpan(const ScopedSpan&) = delete;
+  ScopedSpan& operator=(const ScopedSpan&) = delete;
+
+  // Whether the span is recorded, which is worth checking before computing
+  // costly attributes.
+  bool active() const { return trace_ != nullptr; }
+
+  // Notes the value with the span, if recorded.
+  void AddAttribute(const char* key, int64 value) {
+    if (trace_ != nullptr) record_.attributes.emplace_back(key, value);
+  }
+
+ private:
+  Trace* const trace_;
+  SpanRecord record_;
+};
+
+// Activates the trace on the current thread within its scope, e.g., on the
+// pool threads handling the parts of a batch request. The spans opened in the
+// scope are children of the given span. Nothing is traced if the trace is
+// null.
+class ScopedTraceActivation {
+ public:
+  ScopedTraceActivation(Trace* trace, uint64 parent_span_id);
+  ~ScopedTraceActivation();
+
+  ScopedTraceActivation(const ScopedTraceActivation&) = delete;
+  ScopedTraceActivation& operator=(const ScopedTraceActivation&) = delete;
+
+  // Returns the trace active on the current thread, null if none, and the id
+  // of its innermost open span.
+  static Trace* CurrentTrace(uint64* span_id);
+
+ private:
+  Trace* const previous_trace_;
+  const uint64 previous_span_id_;
+};
+
+// Traces the request within its scope, if the tracer picks it: activates its
+// trace on the thread, opens the root span named after the request, and
+// exports the trace once the scope ends. Nothing is traced if the tracer is
+// null.
+class ScopedRequestTrace {
+ public:
+  ScopedRequestTrace(Tracer* tracer, absl::string_view trace_parent,
+                     const char* name);
+  ~ScopedRequestTrace();
+
+  ScopedRequestTrace(const ScopedRequestTrace&) = delete;
+  ScopedRequestTrace& operator=(const ScopedRequestTrace&) = delete;
+
+  // Notes the value with the root span, if the request is traced.
+  void AddAttribute(const char* key, int64 value) {
+    if (span_) span_->AddAttribute(key, value);
+  }
+
+ private:
+  Tracer* const tracer_;
+  std::unique_ptr<Trace> trace_;
+  absl::optional<ScopedTraceActivation> activation_;
+  absl::optional<ScopedSpan> span_;
+};
+
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_UTILS_TRACING_H_
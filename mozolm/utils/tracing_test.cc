@@ -0,0 +1,211 @@
+// Copyright 2021 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the sampled tracing.
+
+#include "mozolm/utils/tracing.h"
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+
+namespace mozolm {
+namespace {
+
+constexpr char kTraceParent[] =
+    "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01";
+
+// Keeps the exported traces.
+class TestExporter : public TraceExporter {
+ public:
+  void Export(std::unique_ptr<Trace> trace) override {
+    absl::MutexLock lock(&lock_);
+    traces_.push_back(std::move(trace));
+  }
+
+  std::vector<std::unique_ptr<Trace>> TakeTraces() {
+    absl::MutexLock lock(&lock_);
+    return std::move(traces_);
+  }
+
+ private:
+  absl::Mutex lock_;
+  std::vector<std::unique_ptr<Trace>> traces_;
+};
+
+TEST(TracingTest, CheckTraceParent) {
+  TraceContext context;
+  ASSERT_TRUE(ParseTraceParent(kTraceParent, &context));
+  EXPECT_EQ(0x0af7651916cd43ddULL, context.trace_id_high);
+  EXPECT_EQ(0x8448eb211c80319cULL, context.trace_id_low);
+  EXPECT_EQ(0xb7ad6b7169203331ULL, context.parent_span_id);
+  EXPECT_TRUE(context.sampled);
+  EXPECT_EQ(kTraceParent,
+            FormatTraceParent(context, context.parent_span_id));
+
+  // Not sampled by the caller.
+  ASSERT_TRUE(ParseTraceParent(
+      "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-00", &context));
+  EXPECT_FALSE(context.sampled);
+
+  // Malformed values.
+  EXPECT_FALSE(ParseTraceParent("", &context));
+  EXPECT_FALSE(ParseTraceParent(
+      "00-0AF7651916CD43DD8448EB211C80319C-b7ad6b7169203331-01", &context));
+  EXPECT_FALSE(ParseTraceParent(
+      "00-00000000000000000000000000000000-b7ad6b7169203331-01", &context));
+  EXPECT_FALSE(ParseTraceParent(
+      "00-0af7651916cd43dd8448eb211c80319c-0000000000000000-01", &context));
+  EXPECT_FALSE(ParseTraceParent(
+      "00_0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01", &context));
+}
+
+TEST(TracingTest, CheckSampling) {
+  auto exporter = absl::make_unique<TestExporter>();
+  TestExporter* traces = exporter.get();
+  Tracer tracer(/* sample_rate= */0.0, std::move(exporter));
+  EXPECT_EQ(nullptr, tracer.StartTrace(""));
+  EXPECT_EQ(nullptr, tracer.StartTrace(
+      "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-00"));
+
+  // Sampled by the caller, which is the parent of the trace.
+  std::unique_ptr<Trace> trace = tracer.StartTrace(kTraceParent);
+  ASSERT_NE(nullptr, trace);
+  EXPECT_EQ("0af7651916cd43dd8448eb211c80319c", trace->TraceIdString());
+  EXPECT_EQ(0xb7ad6b7169203331ULL, trace->context().parent_span_id);
+  tracer.EndTrace(std::move(trace));
+  EXPECT_EQ(1, traces->TakeTraces().size());
+
+  // All the requests are traced, each with its own trace id.
+  Tracer all_tracer(/* sample_rate= */1.0, absl::make_unique<TestExporter>());
+  std::unique_ptr<Trace> first = all_tracer.StartTrace("");
+  std::unique_ptr<Trace> second = all_tracer.StartTrace("");
+  ASSERT_NE(nullptr, first);
+  ASSERT_NE(nullptr, second);
+  EXPECT_NE(first->TraceIdString(), second->TraceIdString());
+  EXPECT_EQ(0, first->context().parent_span_id);
+}
+
+TEST(TracingTest, CheckSpans) {
+  // Not recorded without an active trace.
+  {
+    ScopedSpan span("Inactive");
+    EXPECT_FALSE(span.active());
+  }
+  auto exporter = absl::make_unique<TestExporter>();
+  TestExporter* traces = exporter.get();
+  Tracer tracer(/* sample_rate= */1.0, std::move(exporter));
+  {
+    ScopedRequestTrace request_trace(&tracer, "", "Request");
+    request_trace.AddAttribute("size", 3);
+    {
+      ScopedSpan child("Child");
+      EXPECT_TRUE(child.active());
+      child.AddAttribute("misses", 2);
+      ScopedSpan grandchild("Grandchild");
+    }
+    ScopedSpan sibling("Sibling");
+  }
+  {
+    ScopedSpan span("Inactive");
+    EXPECT_FALSE(span.active());
+  }
+  std::vector<std::unique_ptr<Trace>> exported = traces->TakeTraces();
+  ASSERT_EQ(1, exported.size());
+  const std::vector<SpanRecord> spans = exported[0]->TakeSpans();
+  ASSERT_EQ(4, spans.size());
+  EXPECT_STREQ("Grandchild", spans[0].name);
+  EXPECT_STREQ("Child", spans[1].name);
+  EXPECT_STREQ("Sibling", spans[2].name);
+  EXPECT_STREQ("Request", spans[3].name);
+  EXPECT_EQ(spans[1].span_id, spans[0].parent_span_id);
+  EXPECT_EQ(spans[3].span_id, spans[1].parent_span_id);
+  EXPECT_EQ(spans[3].span_id, spans[2].parent_span_id);
+  EXPECT_EQ(0, spans[3].parent_span_id);
+  ASSERT_EQ(1, spans[1].attributes.size());
+  EXPECT_STREQ("misses", spans[1].attributes[0].first);
+  EXPECT_EQ(2, spans[1].attributes[0].second);
+  ASSERT_EQ(1, spans[3].attributes.size());
+  EXPECT_EQ(3, spans[3].attributes[0].second);
+}
+
+TEST(TracingTest, CheckActivationOnOtherThreads) {
+  Trace trace(TraceContext{1, 2, 0, true});
+  constexpr uint64 kParentSpanId = 12345;
+  std::thread worker([&trace] {
+    ScopedTraceActivation activation(&trace, kParentSpanId);
+    ScopedSpan span("Worker");
+  });
+  worker.join();
+  const std::vector<SpanRecord> spans = trace.TakeSpans();
+  ASSERT_EQ(1, spans.size());
+  EXPECT_EQ(kParentSpanId, spans[0].parent_span_id);
+
+  // The activation is scoped.
+  uint64 span_id;
+  EXPECT_EQ(nullptr, ScopedTraceActivation::CurrentTrace(&span_id));
+  {
+    ScopedTraceActivation activation(&trace, kParentSpanId);
+    EXPECT_EQ(&trace, ScopedTraceActivation::CurrentTrace(&span_id));
+    EXPECT_EQ(kParentSpanId, span_id);
+  }
+  EXPECT_EQ(nullptr, ScopedTraceActivation::CurrentTrace(&span_id));
+}
+
+TEST(TracingTest, CheckFileExporter) {
+  const std::string file_name =
+      std::string(::testing::TempDir()) + "/tracing_test.json";
+  std::remove(file_name.c_str());
+  {
+    auto exporter_status = FileTraceExporter::Create(file_name, 10);
+    ASSERT_TRUE(exporter_status.ok());
+    Tracer tracer(/* sample_rate= */1.0, std::move(exporter_status.value()));
+    for (int i = 0; i < 3; ++i) {
+      ScopedRequestTrace request_trace(&tracer, kTraceParent, "Request");
+      ScopedSpan span("Child");
+      span.AddAttribute("index", i);
+    }
+  }  // Writes the traces.
+  std::FILE* file = std::fopen(file_name.c_str(), "r");
+  ASSERT_NE(nullptr, file);
+  std::vector<std::string> lines;
+  char buffer[1024];
+  while (std::fgets(buffer, sizeof(buffer), file) != nullptr) {
+    lines.push_back(buffer);
+  }
+  std::fclose(file);
+  ASSERT_EQ(3, lines.size());
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(absl::StartsWith(
+        lines[i], "{\"trace_id\":\"0af7651916cd43dd8448eb211c80319c\","))
+        << lines[i];
+    EXPECT_TRUE(absl::StrContains(lines[i], "\"name\":\"Child\""));
+    EXPECT_TRUE(absl::StrContains(
+        lines[i], "\"parent_span_id\":\"b7ad6b7169203331\""));
+    EXPECT_TRUE(absl::StrContains(
+        lines[i], absl::StrCat("\"attributes\":{\"index\":", i, "}")));
+  }
+}
+
+}  // namespace
+}  // namespace mozolm
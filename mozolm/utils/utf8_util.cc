@@ -14,70 +14,158 @@
 
 #include "mozolm/utils/utf8_util.h"
 
+#include <cstring>
 #include <iterator>
 
-#include "absl/strings/str_split.h"
-#include "utf8/checked.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif  // __SSE2__
 
-using utf8_iterator = ::utf8::iterator<std::string::const_iterator>;
+#include "utf8/checked.h"
 
 namespace mozolm {
 namespace utf8 {
+namespace {
 
-std::vector<std::string> StrSplitByChar(const std::string &input) {
-     if (!::utf8::is_valid(input.begin(), input.end())) {
-       return {};  // Refuse to split invalid UTF8 input.
-     }
-     const int num_codepoints = ::utf8::distance(input.begin(), input.end());
-     std::vector<std::string> result;
-     result.reserve(num_codepoints);
-
-     utf8_iterator pos(input.begin(), input.begin(), input.end());
-     const utf8_iterator pos_end(input.end(), input.begin(), input.end());
-     while (pos != pos_end) {
-       std::string codepoint;
-       ::utf8::append(*pos, std::back_inserter(codepoint));
-       result.push_back(codepoint);
-       ++pos;
-     }
-     return result;
+// Returns the number of codepoints of valid UTF-8 input, i.e., the number of
+// bytes other than the continuation bytes.
+size_t NumCodepoints(absl::string_view input) {
+  size_t num_codepoints = 0;
+  for (const char c : input) {
+    if ((static_cast<unsigned char>(c) & 0xC0) != 0x80) ++num_codepoints;
+  }
+  return num_codepoints;
+}
+
+}  // namespace
+
+std::vector<std::string> StrSplitByChar(absl::string_view input) {
+  if (!IsValidUTF8(input)) {
+    return {};  // Refuse to split invalid UTF8 input.
+  }
+  std::vector<std::string> result;
+  result.reserve(NumCodepoints(input));
+  const Codepoints codepoints(input);
+  for (auto pos = codepoints.begin(); pos != codepoints.end(); ++pos) {
+    result.emplace_back(pos.bytes());
+  }
+  return result;
 }
 
 int DecodeUnicodeChar(const std::string &input, char32 *first_char) {
-     if (input.empty()) {  // Do nothing.
-       *first_char = 0;
-       return 1;
-     }
-     if (!::utf8::is_valid(input.begin(), input.end())) {  // Error.
-       *first_char = kBadUTF8Char;
-       return 1;
-     }
-     utf8_iterator pos(input.begin(), input.begin(), input.end());
-     const utf8_iterator pos_end(input.end(), input.begin(), input.end());
-     if (pos == pos_end) {  // This probably should not happen. Error.
-       *first_char = kBadUTF8Char;
-       return 1;
-     }
-     *first_char = *pos;
-     ++pos;
-     return pos.base() - input.begin();  // Number of bytes.
+  if (input.empty()) {  // Do nothing.
+    *first_char = 0;
+    return 1;
+  }
+  if (!IsValidUTF8(input)) {  // Error.
+    *first_char = kBadUTF8Char;
+    return 1;
+  }
+  return DecodeLeadingUnicodeChar(input, first_char);  // Number of bytes.
+}
+
+size_t AsciiPrefixLength(absl::string_view input) {
+  const char *const begin = input.data();
+  const char *const end = begin + input.size();
+  const char *pos = begin;
+#if defined(__SSE2__)
+  // Checks the sign bits of 16 bytes at once.
+  for (; end - pos >= 16; pos += 16) {
+    const __m128i block =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+    if (_mm_movemask_epi8(block) != 0) break;
+  }
+#endif  // __SSE2__
+  for (; end - pos >= 8; pos += 8) {
+    uint64 block;
+    std::memcpy(&block, pos, sizeof(block));
+    if ((block & 0x8080808080808080ULL) != 0) break;
+  }
+  while (pos < end && static_cast<unsigned char>(*pos) < 0x80) ++pos;
+  return pos - begin;
 }
 
-std::vector<int> StrSplitByCharToUnicode(const std::string &input) {
-  const std::vector<std::string> input_chars = StrSplitByChar(input);
-  std::vector<int> input_codepoints(input_chars.size());
-  for (int i = 0; i < input_chars.size(); ++i) {
-    DecodeSingleUnicodeChar(input_chars[i], &(input_codepoints[i]));
+bool IsValidUTF8(absl::string_view input) {
+  char32 codepoint;
+  while (true) {
+    input.remove_prefix(AsciiPrefixLength(input));
+    if (input.empty()) return true;
+    const int num_bytes = DecodeLeadingUnicodeChar(input, &codepoint);
+    if (num_bytes == 0) return false;
+    input.remove_prefix(num_bytes);
+  }
+}
+
+int DecodeLeadingUnicodeChar(absl::string_view input, char32 *first_char) {
+  if (input.empty()) {
+    *first_char = 0;
+    return 0;
+  }
+  const unsigned char lead = input[0];
+  if (lead < 0x80) {  // ASCII.
+    *first_char = lead;
+    return 1;
+  }
+  int num_bytes;
+  char32 min_value;
+  char32 value;
+  if ((lead & 0xE0) == 0xC0) {
+    num_bytes = 2;
+    min_value = 0x80;
+    value = lead & 0x1F;
+  } else if ((lead & 0xF0) == 0xE0) {
+    num_bytes = 3;
+    min_value = 0x800;
+    value = lead & 0x0F;
+  } else if ((lead & 0xF8) == 0xF0) {
+    num_bytes = 4;
+    min_value = 0x10000;
+    value = lead & 0x07;
+  } else {
+    *first_char = kBadUTF8Char;
+    return 0;
+  }
+  if (input.size() < num_bytes) {
+    *first_char = kBadUTF8Char;
+    return 0;
+  }
+  for (int i = 1; i < num_bytes; ++i) {
+    const unsigned char trail = input[i];
+    if ((trail & 0xC0) != 0x80) {
+      *first_char = kBadUTF8Char;
+      return 0;
+    }
+    value = (value << 6) | (trail & 0x3F);
+  }
+  // Rejects overlong encodings, surrogates and values beyond Unicode.
+  if (value < min_value || value > 0x10FFFF ||
+      (value >= 0xD800 && value <= 0xDFFF)) {
+    *first_char = kBadUTF8Char;
+    return 0;
+  }
+  *first_char = value;
+  return num_bytes;
+}
+
+std::vector<int> StrSplitByCharToUnicode(absl::string_view input) {
+  if (!IsValidUTF8(input)) {
+    return {};  // Refuse to split invalid UTF8 input.
+  }
+  std::vector<int> input_codepoints;
+  input_codepoints.reserve(NumCodepoints(input));
+  // The ASCII prefix, usually the whole input, is copied as is.
+  const size_t ascii_length = AsciiPrefixLength(input);
+  input_codepoints.assign(input.begin(), input.begin() + ascii_length);
+  for (const char32 codepoint : Codepoints(input.substr(ascii_length))) {
+    input_codepoints.push_back(codepoint);
   }
   return input_codepoints;
 }
 
 bool DecodeSingleUnicodeChar(const std::string &input, char32 *utf8_value) {
-  const std::vector<std::string> split_input = StrSplitByChar(input);
-  if (split_input.size() != 1) {
+  if (input.empty() ||
+      DecodeLeadingUnicodeChar(input, utf8_value) != input.size()) {
     *utf8_value = kBadUTF8Char;
-  } else {
-    DecodeUnicodeChar(split_input[0], utf8_value);
   }
   if (*utf8_value == kBadUTF8Char) {
     return false;
@@ -17,10 +17,13 @@
 #ifndef MOZOLM_MOZOLM_UTILS_UTF8_UTIL_H_
 #define MOZOLM_MOZOLM_UTILS_UTF8_UTIL_H_
 
+#include <cstddef>
+#include <iterator>
 #include <string>
 #include <vector>
 
 #include "mozolm/stubs/integral_types.h"
+#include "absl/strings/string_view.h"
 
 namespace mozolm {
 namespace utf8 {
@@ -30,11 +33,18 @@ constexpr char32 kBadUTF8Char = 0xFFFD;
 
 // Splits the provided input into equal-length strings consisting of one
 // Unicode character (codepoint).
-std::vector<std::string> StrSplitByChar(const std::string &input);
+std::vector<std::string> StrSplitByChar(absl::string_view input);
 
 // Splits the provided input into equal-length strings consisting of one
 // Unicode character (codepoint), and returns their Unicode codepoint value.
-std::vector<int> StrSplitByCharToUnicode(const std::string &input);
+std::vector<int> StrSplitByCharToUnicode(absl::string_view input);
+
+// Returns true if the input is valid UTF-8.
+bool IsValidUTF8(absl::string_view input);
+
+// Returns the length of the longest prefix of the input consisting of ASCII
+// characters, scanning the input in blocks of bytes.
+size_t AsciiPrefixLength(absl::string_view input);
 
 // Decodes the first Unicode codepoint value from a UTF-8 string representation
 // of multiple unicode characters. Returns the number of bytes read from the
@@ -42,6 +52,11 @@ std::vector<int> StrSplitByCharToUnicode(const std::string &input);
 // `kBadUTF8Char` in the result `first_char` and returns 1.
 int DecodeUnicodeChar(const std::string &input, char32 *first_char);
 
+// Decodes the first Unicode codepoint of the input in place, without copying
+// it. Returns the number of bytes of the codepoint, or 0 if the input is empty
+// (storing 0) or does not start with valid UTF-8 (storing `kBadUTF8Char`).
+int DecodeLeadingUnicodeChar(absl::string_view input, char32 *first_char);
+
 // Returns true of input string is a single codepoint with valid UTF-8 value,
 // which is stored in utf8_value.
 bool DecodeSingleUnicodeChar(const std::string &input, char32 *utf8_value);
@@ -49,6 +64,90 @@ bool DecodeSingleUnicodeChar(const std::string &input, char32 *utf8_value);
 // Encodes single Unicode codepoint value as UTF-8.
 std::string EncodeUnicodeChar(char32 input);
 
+// Forward iterator over the Unicode codepoints of a UTF-8 string, decoding
+// them in place. Each byte not starting a valid UTF-8 encoding is returned
+// as `kBadUTF8Char`.
+class CodepointIterator {
+ public:
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = char32;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const char32 *;
+  using reference = char32;
+
+  CodepointIterator() = default;
+  CodepointIterator(absl::string_view text, size_t pos)
+      : text_(text), pos_(pos) {
+    Decode();
+  }
+
+  char32 operator*() const { return codepoint_; }
+
+  // Returns the UTF-8 encoding of the current codepoint, viewing the text.
+  absl::string_view bytes() const { return text_.substr(pos_, num_bytes_); }
+
+  // Byte position of the current codepoint in the text.
+  size_t position() const { return pos_; }
+
+  CodepointIterator &operator++() {
+    pos_ += num_bytes_;
+    Decode();
+    return *this;
+  }
+
+  CodepointIterator operator++(int) {
+    CodepointIterator result = *this;
+    ++*this;
+    return result;
+  }
+
+  bool operator==(const CodepointIterator &other) const {
+    return pos_ == other.pos_;
+  }
+  bool operator!=(const CodepointIterator &other) const {
+    return pos_ != other.pos_;
+  }
+
+ private:
+  void Decode() {
+    if (pos_ >= text_.size()) {
+      codepoint_ = 0;
+      num_bytes_ = 0;
+      return;
+    }
+    const unsigned char lead = text_[pos_];
+    if (lead < 0x80) {  // ASCII.
+      codepoint_ = lead;
+      num_bytes_ = 1;
+      return;
+    }
+    num_bytes_ = DecodeLeadingUnicodeChar(text_.substr(pos_), &codepoint_);
+    if (num_bytes_ == 0) num_bytes_ = 1;  // Skips the invalid byte.
+  }
+
+  absl::string_view text_;
+  size_t pos_ = 0;
+  int num_bytes_ = 0;
+  char32 codepoint_ = 0;
+};
+
+// Range of the Unicode codepoints of a UTF-8 string, which must outlive it.
+// For example:
+//
+//   for (const char32 codepoint : utf8::Codepoints(text)) { ... }
+class Codepoints {
+ public:
+  explicit Codepoints(absl::string_view text) : text_(text) {}
+
+  CodepointIterator begin() const { return CodepointIterator(text_, 0); }
+  CodepointIterator end() const {
+    return CodepointIterator(text_, text_.size());
+  }
+
+ private:
+  absl::string_view text_;
+};
+
 }  // namespace utf8
 }  // namespace mozolm
 
@@ -14,6 +14,9 @@
 
 #include "mozolm/utils/utf8_util.h"
 
+#include <string>
+#include <vector>
+
 #include "gmock/gmock.h"
 #include "mozolm/stubs/status-matchers.h"
 #include "protobuf-matchers/protocol-buffer-matchers.h"
@@ -73,6 +76,76 @@ TEST(Utf8UtilTest, CheckDecodeUnicodeChar) {
   EXPECT_EQ(kBadUTF8Char, code);
 }
 
+TEST(Utf8UtilTest, CheckDecodeLeadingUnicodeChar) {
+  char32 code;
+  EXPECT_EQ(1, DecodeLeadingUnicodeChar("zx", &code));
+  EXPECT_EQ(122, code);
+  EXPECT_EQ(3, DecodeLeadingUnicodeChar("ස්", &code));
+  EXPECT_EQ(3523, code);
+  EXPECT_EQ(2, DecodeLeadingUnicodeChar("ܨ", &code));
+  EXPECT_EQ(1832, code);
+  EXPECT_EQ(4, DecodeLeadingUnicodeChar("\xf0\x92\x81\xab", &code));
+  EXPECT_EQ(0x1206B, code);
+  EXPECT_EQ(0, DecodeLeadingUnicodeChar("", &code));
+  EXPECT_EQ(0, code);
+
+  // The view may end in the middle of the string.
+  const std::string text = "Բարեւ";
+  EXPECT_EQ(2, DecodeLeadingUnicodeChar(absl::string_view(text).substr(2, 2),
+                                        &code));
+  EXPECT_EQ(1377, code);
+
+  // Invalid, truncated, overlong and surrogate encodings.
+  EXPECT_EQ(0, DecodeLeadingUnicodeChar("\xfe\xfe\xff\xff", &code));
+  EXPECT_EQ(kBadUTF8Char, code);
+  EXPECT_EQ(0, DecodeLeadingUnicodeChar("\xe0\xb6", &code));
+  EXPECT_EQ(kBadUTF8Char, code);
+  EXPECT_EQ(0, DecodeLeadingUnicodeChar("\xc0\xaf", &code));
+  EXPECT_EQ(kBadUTF8Char, code);
+  EXPECT_EQ(0, DecodeLeadingUnicodeChar("\xed\xa0\x80", &code));
+  EXPECT_EQ(kBadUTF8Char, code);
+}
+
+TEST(Utf8UtilTest, CheckCodepoints) {
+  const std::string text = "aԲ\xfeባ";
+  std::vector<char32> codepoints;
+  std::vector<std::string> chars;
+  const Codepoints range(text);
+  for (auto pos = range.begin(); pos != range.end(); ++pos) {
+    codepoints.push_back(*pos);
+    chars.emplace_back(pos.bytes());
+  }
+  EXPECT_THAT(codepoints, ElementsAre(97, 1330, kBadUTF8Char, 4707));
+  EXPECT_THAT(chars, ElementsAre("a", "Բ", "\xfe", "ባ"));
+  EXPECT_TRUE(Codepoints("").begin() == Codepoints("").end());
+}
+
+TEST(Utf8UtilTest, CheckIsValidUTF8) {
+  EXPECT_TRUE(IsValidUTF8(""));
+  EXPECT_TRUE(IsValidUTF8("abcdefg"));
+  EXPECT_TRUE(IsValidUTF8("მოგესალმებით"));
+  const std::string ascii(40, 'a');
+  EXPECT_TRUE(IsValidUTF8(ascii + "ບ" + ascii));
+  EXPECT_FALSE(IsValidUTF8(ascii + "\xfe" + ascii));
+  EXPECT_FALSE(IsValidUTF8(ascii + "\xe0\xb6"));
+  EXPECT_THAT(StrSplitByChar(ascii + "\xfe"), ElementsAre());
+  EXPECT_THAT(StrSplitByCharToUnicode("ab\xfe"), ElementsAre());
+}
+
+TEST(Utf8UtilTest, CheckAsciiPrefixLength) {
+  EXPECT_EQ(0, AsciiPrefixLength(""));
+  EXPECT_EQ(3, AsciiPrefixLength("abc"));
+  EXPECT_EQ(0, AsciiPrefixLength("ბa"));
+  // Non-ASCII characters at all the positions within and across the blocks.
+  const std::string ascii(40, 'a');
+  for (int i = 0; i <= ascii.size(); ++i) {
+    const std::string text = ascii.substr(0, i) + "ბ" + ascii;
+    EXPECT_EQ(i, AsciiPrefixLength(text));
+    EXPECT_EQ(i + 1 + ascii.size(), StrSplitByCharToUnicode(text).size());
+  }
+  EXPECT_EQ(ascii.size(), AsciiPrefixLength(ascii));
+}
+
 TEST(Utf8UtilTest, CheckEncodeUnicodeChar) {
   EXPECT_EQ("z", EncodeUnicodeChar(122));
   EXPECT_EQ("ܨ", EncodeUnicodeChar(1832));